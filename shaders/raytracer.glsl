@@ -6,7 +6,31 @@
 #define NO_HIT    -1
 #define INVALID   4294967295 // uint max
 
-#define KD_TREE 1
+// leaves store their primitive type in the upper bits of count
+#define PRIMITIVE_SPHERE      0u
+#define PRIMITIVE_TRIANGLE    1u
+#define PRIMITIVE_INSTANCE    2u
+#define PRIMITIVE_TYPE_SHIFT  30u
+#define PRIMITIVE_COUNT_MASK  0x3fffffffu
+
+// layouts of the tree, the values of NodeFormat in renderer.h
+#define NODES_FULL            0u
+#define NODES_QUANTIZED_16    1u
+#define NODES_QUANTIZED_8     2u
+#define NODES_WIDE_4          3u
+
+// layouts of the triangles, the values of TriangleFormat in renderer.h
+#define TRIANGLES_RAW         0u
+#define TRIANGLES_PRECOMPUTED 1u
+
+// how leaves refer to their primitives, the values of LeafFormat in soa.h
+#define LEAVES_INDEXED        0u
+#define LEAVES_SOA            1u
+#define LEAF_WIDTH            8u
+
+// stack entries that move the ray between world and object space
+#define INSTANCE_ENTER        0x80000000u // or'ed with the instance index
+#define INSTANCE_EXIT         0xfffffffeu
 
 struct Sphere {
   vec3 center;
@@ -26,6 +50,56 @@ struct Mesh {
   int material;
 };
 
+struct Instance {
+  mat4 world_to_object;
+  uint geometry;
+  int material; // -1 keeps the triangle materials
+  uint root;    // root node of the geometry tree
+  uint pad;
+};
+
+// four children tested at once, see wide.h
+struct WideNode {
+  vec4 min_x, min_y, min_z;
+  vec4 max_x, max_y, max_z;
+  uvec4 child;
+  uvec4 count;
+};
+
+// pluecker coordinates of the edges and the plane, see TriangleRecord in scene.h
+struct TriangleRecord {
+  vec4 edge[3];   // w holds the normal xyz
+  vec4 moment[3]; // w holds the plane distance, the material and 0
+};
+
+// LEAF_WIDTH spheres of a leaf as structure of arrays, see SphereBlock in soa.h
+struct SphereBlock {
+  float center_x[LEAF_WIDTH];
+  float center_y[LEAF_WIDTH];
+  float center_z[LEAF_WIDTH];
+  float radius[LEAF_WIDTH];
+  int material[LEAF_WIDTH];
+  uint id[LEAF_WIDTH];
+};
+
+// LEAF_WIDTH triangle records of a leaf as structure of arrays, see TriangleBlock in soa.h.
+// component axis of edge k of a lane is at (k * 3 + axis) * LEAF_WIDTH + lane
+struct TriangleBlock {
+  float edge[9u * LEAF_WIDTH];
+  float moment[9u * LEAF_WIDTH];
+  float normal[3u * LEAF_WIDTH];
+  float plane[LEAF_WIDTH];
+  int material[LEAF_WIDTH];
+  uint id[LEAF_WIDTH];
+};
+
+// entry of the alias table over the envmap texels, see Cubemap::AliasEntry in cpu_tracer.h
+struct EnvmapEntry {
+  float threshold;   // the entry itself is taken below it, its alias above
+  uint alias;
+  float probability; // of the texel of the entry
+};
+
 struct Node {
   vec4 min;
   vec4 max;
@@ -35,10 +109,46 @@ struct Node {
   uint count;
 };
 
+// the megakernel traces whole paths, one pixel per invocation. the wavefront path tracer
+// splits every bounce into passes over queues of paths, the renderer compiles this file
+// once per stage with STAGE defined
+#define STAGE_MEGAKERNEL      0
+#define STAGE_GENERATE        1
+#define STAGE_EXTEND          2
+#define STAGE_SHADE           3
+#define STAGE_QUEUES          4
+#define STAGE_TILES           5
+
+#ifndef STAGE
+#define STAGE STAGE_MEGAKERNEL
+#endif
+
+// the extend queue holds the rays of the next intersection pass, followed by one shading
+// queue per material type
+#define QUEUE_EXTEND          0u
+#define QUEUE_SHADE           1u
+#define QUEUE_COUNT           4u
+#define WAVEFRONT_GROUP_SIZE  64u
+
+// adaptive sampling traces the megakernel over the tiles of 8x8 pixels that have not
+// converged yet, a pixel converges once the standard error of its mean luminance drops
+// below u_adaptive_threshold of the luminance, darker pixels than ADAPTIVE_DARK are
+// measured against it instead
+#define TILE_SIZE             8
+#define ADAPTIVE_DARK         0.05
+
+#if STAGE == STAGE_MEGAKERNEL || STAGE == STAGE_TILES
 layout(local_size_x = 8, local_size_y = 8) in;
+#else
+layout(local_size_x = 64) in;
+#endif
 
 layout(rgba32f, binding = 0) uniform image2D image;
 
+// per pixel: frames accumulated, mean luminance of the frames and the sum of their squared
+// deviations from it (welford)
+layout(rgba32f, binding = 1) uniform image2D moments;
+
 layout(std140, binding = 1) readonly buffer sphere_buffer {
   Sphere spheres[];
 };
@@ -59,15 +169,143 @@ layout(std430, binding = 5) readonly buffer kd_tree {
   Node nodes[];
 };
 
+layout(std430, binding = 6) readonly buffer instance_buffer {
+  Instance instances[];
+};
+
+// quantized nodes, see compact.h for the layout
+layout(std430, binding = 7) readonly buffer compact_tree {
+  uint compact[];
+};
+
+layout(std430, binding = 8) readonly buffer wide_tree {
+  WideNode wide[];
+};
+
+layout(std430, binding = 9) readonly buffer triangle_record_buffer {
+  TriangleRecord records[];
+};
+
+// leaf offsets index this list, it maps every reference to its sphere, triangle or instance
+layout(std430, binding = 10) readonly buffer leaf_index_buffer {
+  uint leaf_indices[];
+};
+
+// uniform grid over the spheres, cell c holds leaf_indices[grid_cells[c] .. grid_cells[c + 1])
+layout(std430, binding = 11) readonly buffer grid_buffer {
+  vec4 grid_min;
+  vec4 grid_cell_size;
+  uvec4 grid_resolution;
+  uint grid_cells[];
+};
+
+// copies of the leaf primitives for LEAVES_SOA, leaf offsets index the blocks
+layout(std430, binding = 12) readonly buffer sphere_block_buffer {
+  SphereBlock sphere_blocks[];
+};
+
+layout(std430, binding = 13) readonly buffer triangle_block_buffer {
+  TriangleBlock triangle_blocks[];
+};
+
+// state of every path between the wavefront passes, the path id is the pixel
+struct PathState {
+  vec4 origin;
+  vec4 direction;
+  vec4 throughput;       // w is the pdf of the direction for the light weight, 0 if none
+  vec4 radiance;         // summed over the samples so far
+  vec4 hit;              // normal and distance of the hit the extend pass found
+  uvec4 seed;            // sampler state
+  uvec4 info;            // pixel, sample, bounce, material of the hit
+};
+
+layout(std430, binding = 14) buffer path_buffer {
+  PathState paths[];
+};
+
+// ring of path ids, producers append at tail, a pass reads count items from first.
+// groups are the arguments of glDispatchComputeIndirect
+struct Queue {
+  uint groups_x;
+  uint groups_y;
+  uint groups_z;
+  uint first;
+  uint count;
+  uint tail;
+  uint pad0;
+  uint pad1;
+};
+
+// a queue can hold every path twice, the ones its pass reads and the ones appended meanwhile
+#define QUEUE_CAPACITY        (2u * u_path_count)
+
+layout(std430, binding = 15) buffer queue_buffer {
+  Queue queues[QUEUE_COUNT];
+  uint queue_items[];
+};
+
+// rays traced while u_count_rays is set, bounces and occlusion queries apart, and the
+// samples they were traced for. debug builds define STACK_CHECK and count the entries push
+// dropped because the traversal stack was full
+layout(std430, binding = 16) buffer stats_buffer {
+  uint ray_count;
+  uint shadow_ray_count;
+  uint sample_count;
+  uint stack_overflows;
+};
+
+uniform uint u_path_count;
+uniform uint u_queue_phase;   // QUEUE_EXTEND or QUEUE_SHADE, the queues the next pass reads
+uniform uint u_shade_queue;   // material type of the shade pass
+uniform bool u_count_rays;
+
+// the tiles stage lists the tiles the megakernel traces, as indirect dispatch arguments
+// followed by the tile ids
+layout(std430, binding = 17) buffer tile_buffer {
+  uint tile_groups_x;
+  uint tile_groups_y;
+  uint tile_groups_z;
+  uint tile_pad;
+  uint active_tiles[];
+};
+
+// copies of the emissive spheres, next event estimation samples them directly
+layout(std140, binding = 18) readonly buffer light_buffer {
+  Sphere lights[];
+};
+
+uniform uint u_light_count;
+uniform bool u_use_nee;
+
+// the envmap texels face after face and row after row, picked in proportion to their
+// luminance times their solid angle
+layout(std430, binding = 19) readonly buffer environment_buffer {
+  EnvmapEntry envmap_entries[];
+};
+
+uniform uint u_envmap_size; // width of the faces of environment_buffer, 0 without one
+
+uniform bool u_adaptive;
+uniform float u_adaptive_threshold;
+uniform int u_adaptive_min_frames;
+
 uniform int u_frames;
 uniform uint u_samples;
 uniform uint u_max_bounce;
+uniform bool u_roulette;
+uniform uint u_roulette_depth;
 uniform float u_time;
 uniform vec3 u_background;
 uniform bool u_reset_flag;
 uniform bool u_use_envmap;
 uniform bool u_use_dof;
+uniform bool u_use_bvh;
+uniform bool u_use_grid;
+uniform uint u_node_format;
+uniform uint u_triangle_format;
+uniform uint u_leaf_format;
 uniform int u_random;
+uniform uint u_sampler;
 
 uniform samplerCube u_envmap;
 
@@ -95,7 +333,10 @@ struct HitInfo {
   int material;
 };
 
-#define STACK_SIZE 5
+// the renderer defines it from the depth of the uploaded tree
+#ifndef STACK_SIZE
+#define STACK_SIZE 32
+#endif
 
 struct Stack {
   int top;
@@ -118,6 +359,11 @@ void push(inout Stack s, uint v) {
   if (!is_full(s)) {
     s.items[++s.top] = v;
   }
+#ifdef STACK_CHECK
+  else {
+    atomicAdd(stack_overflows, 1u);
+  }
+#endif
 }
 
 uint pop(inout Stack s) {
@@ -128,14 +374,22 @@ uint pop(inout Stack s) {
   }
 }
 
+// the samplers behind rand(): PCG draws every dimension as white noise, SOBOL takes them
+// from an owen scrambled sobol sequence, shuffled and padded in sets of 4 dimensions
+// (burley 2020, practical hash-based owen scrambling). the camera takes the first set and
+// every bounce the next three, for the direction, the light it samples and the environment.
+// the sample index counts the samples of the pixel
+#define SAMPLER_PCG           0u
+#define SAMPLER_SOBOL         1u
+#define SAMPLE_SET            4u
+#define BOUNCE_DIMENSIONS     12u
+#define NO_SET                0xffffffffu
+
 //RNG from code by Moroz Mykhailo (https://www.shadertoy.com/view/wltcRS)
-//internal RNG state 
+//internal RNG state, the pcg4d state or sample index, dimension, pixel seed and the set of
+//sample_point of sobol
 uvec4 seed;
-
-void init_rand(vec2 p, int frame)
-{
-  seed = uvec4(p, uint(frame), uint(p.x) + uint(p.y) + uint(frame));
-}
+uvec4 sample_point;
 
 void pcg4d(inout uvec4 v)
 {
@@ -145,8 +399,137 @@ void pcg4d(inout uvec4 v)
   v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
 }
 
+uint hash(uint x)
+{
+  uint state = x * 747796405u + 2891336453u;
+  uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+uint hash_combine(uint seed, uint value)
+{
+  return seed ^ (value + (seed << 6) + (seed >> 2));
+}
+
+// the first 4 dimensions of the sobol sequence, 32 direction numbers each (joe and kuo)
+const uint SOBOL_DIRECTIONS[128] = uint[](
+  0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+  0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+  0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+  0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+  0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+  0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+  0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+  0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+  0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+  0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+  0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+  0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+  0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+  0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+  0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+  0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+);
+
+// the 4 dimensions of a point of the sobol sequence
+uvec4 sobol(uint index)
+{
+  uvec4 x = uvec4(0u);
+  for (; index != 0u; index &= index - 1u) {
+    uint bit = uint(findLSB(index));
+    x ^= uvec4(SOBOL_DIRECTIONS[bit], SOBOL_DIRECTIONS[32u + bit], SOBOL_DIRECTIONS[64u + bit], SOBOL_DIRECTIONS[96u + bit]);
+  }
+  return x;
+}
+
+uint nested_uniform_scramble(uint x, uint seed)
+{
+  x = bitfieldReverse(x);
+  x ^= x * 0x3d20adeau;
+  x += seed;
+  x *= (seed >> 16) | 1u;
+  x ^= x * 0x05526c56u;
+  x ^= x * 0x53a22864u;
+  return bitfieldReverse(x);
+}
+
+uint sample_set_seed(uint set, uint pixel_seed)
+{
+  return hash(hash_combine(pixel_seed, set));
+}
+
+// the point of the sample in the set of dimensions, its index shuffled per pixel and set
+uvec4 sobol_set(uint index, uint set, uint pixel_seed)
+{
+  return sobol(nested_uniform_scramble(index, sample_set_seed(set, pixel_seed)));
+}
+
+// a dimension of the point, scrambled per pixel, set and dimension
+float sobol_sample(uint x, uint dimension, uint pixel_seed)
+{
+  uint set_seed = sample_set_seed(dimension / SAMPLE_SET, pixel_seed);
+  x = nested_uniform_scramble(x, hash_combine(set_seed, hash(dimension % SAMPLE_SET)));
+  return float(x >> 8) / 16777216.0;
+}
+
+// first is the index of the first sample this pixel takes, pcg seeds from u_random instead
+void init_rand(ivec2 pixel, uint first)
+{
+  if (u_sampler == SAMPLER_SOBOL) {
+    seed = uvec4(first, 0u, hash(uint(pixel.x) ^ hash(uint(pixel.y))), NO_SET);
+  } else {
+    uint frame = uint(u_random);
+    seed = uvec4(uvec2(pixel), frame, uint(pixel.x) + uint(pixel.y) + frame);
+  }
+}
+
+void next_sample()
+{
+  if (u_sampler == SAMPLER_SOBOL) {
+    seed.x++;
+    seed.w = NO_SET;
+  }
+}
+
+// the dimensions of the camera ray, 0, or of a bounce. sample_point is not part of the
+// path state of the wavefront passes, every pass starts a new set
+void sample_dimensions(uint bounce)
+{
+  if (u_sampler == SAMPLER_SOBOL) {
+    seed.y = BOUNCE_DIMENSIONS * bounce;
+    seed.w = NO_SET;
+  }
+}
+
+// the second set of the dimensions of the current bounce
+void sample_light_dimensions()
+{
+  if (u_sampler == SAMPLER_SOBOL) {
+    seed.y = seed.y - seed.y % BOUNCE_DIMENSIONS + SAMPLE_SET;
+    seed.w = NO_SET;
+  }
+}
+
+// the third set, for the environment
+void sample_environment_dimensions()
+{
+  if (u_sampler == SAMPLER_SOBOL) {
+    seed.y = seed.y - seed.y % BOUNCE_DIMENSIONS + 2u * SAMPLE_SET;
+    seed.w = NO_SET;
+  }
+}
+
 float rand()
 {
+  if (u_sampler == SAMPLER_SOBOL) {
+    uint dimension = seed.y++;
+    if (seed.w != dimension / SAMPLE_SET) {
+      seed.w = dimension / SAMPLE_SET;
+      sample_point = sobol_set(seed.x, seed.w, seed.z);
+    }
+    return sobol_sample(sample_point[dimension % SAMPLE_SET], dimension, seed.z);
+  }
+
   pcg4d(seed); 
   return float(seed.x) / float(0xffffffffu);
 }
@@ -197,6 +580,18 @@ Ray camera_ray(vec2 xy) {
   }
 }
 
+// the camera ray of the next sample of a pixel, jittered over the pixel and the lens
+Ray pixel_ray(ivec2 pixel_coords)
+{
+  vec2 resolution = vec2(imageSize(image));
+  aspect_ratio = resolution.y / resolution.x;
+  frag_coord = vec2(pixel_coords);
+
+  sample_dimensions(0u);
+  vec2 jitter = vec2(rand(), rand());
+  return camera_ray(((frag_coord + jitter) / resolution) * 2.0 - 1.0);
+}
+
 float sphere_intersect(Ray r, Sphere s) {
     vec3 pos = s.center;
     float rad = s.radius;
@@ -255,315 +650,1319 @@ float triangle_intersect(Ray r, vec3 v0, vec3 v1, vec3 v2) {
     return INF;
 }
 
-bool aabb_intersect(Ray ray, vec4 aabb_min, vec4 aabb_max) {
-  float tmin = 0.0, tmax = INF;
+// watertight test against records[i], moment is cross(r.direction, r.origin) of the ray.
+// a ray exactly on an edge counts as inside, the neighbour sees the negated side
+float triangle_record_intersect(Ray r, vec3 moment, uint i) {
+  if (dot(records[i].edge[0].xyz, moment) + dot(records[i].moment[0].xyz, r.direction) < 0.0 ||
+      dot(records[i].edge[1].xyz, moment) + dot(records[i].moment[1].xyz, r.direction) < 0.0 ||
+      dot(records[i].edge[2].xyz, moment) + dot(records[i].moment[2].xyz, r.direction) < 0.0)
+  {
+    return INF;
+  }
 
-  for (int d = 0; d < 3; ++d) {
-    float t1 = (aabb_min[d] - ray.origin[d]) / ray.direction[d];
-    float t2 = (aabb_max[d] - ray.origin[d]) / ray.direction[d];
+  vec3 normal = vec3(records[i].edge[0].w, records[i].edge[1].w, records[i].edge[2].w);
+  return (records[i].moment[0].w - dot(normal, r.origin)) / dot(normal, r.direction);
+}
 
-    tmin = max(tmin, min(t1, t2));
-    tmax = min(tmax, max(t1, t2));
+// distance to triangle i in the uploaded format, INF on a miss
+float triangle_distance(Ray r, vec3 moment, uint i) {
+  if (u_triangle_format == TRIANGLES_PRECOMPUTED) {
+    return triangle_record_intersect(r, moment, i);
   }
+  return triangle_intersect(r, vec3(vertices[i * 3 + 0]), vec3(vertices[i * 3 + 1]), vec3(vertices[i * 3 + 2]));
+}
 
-  return tmin < tmax;
+vec3 triangle_normal(uint i) {
+  if (u_triangle_format == TRIANGLES_PRECOMPUTED) {
+    return vec3(records[i].edge[0].w, records[i].edge[1].w, records[i].edge[2].w);
+  }
+  vec3 v0 = vec3(vertices[i * 3 + 0]);
+  return normalize(cross(vec3(vertices[i * 3 + 1]) - v0, vec3(vertices[i * 3 + 2]) - v0));
 }
 
-int traverse(Ray ray, inout HitInfo hit) {
-  
-  int closest = NO_HIT;
+int triangle_material(uint i) {
+  return int((u_triangle_format == TRIANGLES_PRECOMPUTED) ? records[i].moment[1].w : vertices[i * 3].w);
+}
 
-  int tests = 0;
+// distance at which the ray enters the box, INF if it misses it or enters behind t_max
+float aabb_distance(Ray ray, vec4 aabb_min, vec4 aabb_max, float t_max) {
+  vec3 inv = 1.0 / ray.direction;
+  vec3 t1 = (aabb_min.xyz - ray.origin) * inv;
+  vec3 t2 = (aabb_max.xyz - ray.origin) * inv;
+  vec3 lo = min(t1, t2);
+  vec3 hi = max(t1, t2);
 
-  uint id = 0;
+  float tmin = max(max(lo.x, lo.y), max(lo.z, 0.0));
+  float tmax = min(min(hi.x, hi.y), min(hi.z, t_max));
 
-  Stack s;
-  init(s);
-  push(s, id);
+  return (tmin <= tmax) ? tmin : INF;
+}
 
-  while (!is_empty(s)) {
-    id = pop(s);
-    Node node = nodes[id];
+// set while occluded runs the traversals: the leaves keep only t of the first primitive in
+// range and the traversals end as soon as there is one
+bool occlusion_query = false;
 
-#if 0
-    if (!aabb_intersect(ray, node.min, node.max)) {
-      continue;
-    }
-#endif
+void intersect_spheres(Ray ray, uint offset, uint count, inout HitInfo hit, inout int closest)
+{
+  for (uint i = offset; i < offset + count; i++) {
+    uint p = leaf_indices[i];
+    float t = sphere_intersect(ray, spheres[p]);
 
-    //if (node.left != INVALID) {
-    if (node.left != INVALID) {
-      push(s, node.left);
+    if (EPSILON < t && t < hit.t) {
+      hit.t = t;
+      closest = int(p);
+      if (occlusion_query) {
+        return;
+      }
+      hit.point = ray.origin + ray.direction * t;
+      hit.normal = (hit.point - spheres[p].center) / spheres[p].radius;
+      hit.material = spheres[p].material;
     }
+  }
+}
 
-    //if (node.right != INVALID) {
-    if (node.right != INVALID) {
-      push(s, node.right);
+// moves the normal of a triangle hit to world space and applies the instance material
+void place_hit(inout HitInfo hit, int instance)
+{
+  if (instance != NO_HIT) {
+    hit.normal = normalize(transpose(mat3(instances[instance].world_to_object)) * hit.normal);
+    if (instances[instance].material >= 0) {
+      hit.material = instances[instance].material;
     }
+  }
+}
 
-    if (node.count > 0) {
-      for (uint i = node.offset; i < node.offset + node.count; i++) {
+// the ray is in object space of instance, or in world space if it is NO_HIT
+void intersect_triangles(Ray ray, uint offset, uint count, int instance, inout HitInfo hit, inout int closest)
+{
+  vec3 moment = cross(ray.direction, ray.origin);
 
-        float t = sphere_intersect(ray, spheres[i]);
+  for (uint i = offset; i < offset + count; i++) {
+    uint p = leaf_indices[i];
+    float t = triangle_distance(ray, moment, p);
 
-        if (EPSILON < t && t < hit.t) {
-          hit.t = t;
-          hit.point = ray.origin + ray.direction * t;
-          hit.normal = (hit.point - spheres[i].center) / spheres[i].radius;
-#if 1
-          hit.material = spheres[i].material;
-#else
-          if (node.offset == 0) {
-            hit.material = 0;
-          } else {
-            hit.material = 1;
-          }
-#endif
-          closest = int(i);
-        }
+    if (EPSILON < t && t < hit.t) {
+      hit.t = t;
+      closest = int(p);
+      if (occlusion_query) {
+        return;
       }
+      hit.normal = triangle_normal(p);
+      hit.material = triangle_material(p);
+      place_hit(hit, instance);
     }
   }
-
-  return closest;
 }
 
-int find_closest_mesh(Ray ray, inout HitInfo hit) 
+// intersect_spheres over the blocks of a leaf, lane by lane in the order of the leaf
+void intersect_sphere_blocks(Ray ray, uint offset, uint count, inout HitInfo hit, inout int closest)
 {
-  float max_t = INF;
-  int closest = NO_HIT;
-
-  for (int i = 0; i < meshes.length(); i++) {
-    Mesh mesh = meshes[i];
-    uint offset = mesh.start;
-    uint count = mesh.size;
+  for (uint i = 0u; i < count; i++) {
+    uint b = offset + i / LEAF_WIDTH;
+    uint lane = i % LEAF_WIDTH;
+    vec3 center = vec3(sphere_blocks[b].center_x[lane], sphere_blocks[b].center_y[lane], sphere_blocks[b].center_z[lane]);
+    float t = sphere_intersect(ray, Sphere(center, sphere_blocks[b].radius[lane], sphere_blocks[b].material[lane]));
 
-    for (uint v = offset; v < offset + count; v++) {
-      
-      vec3 v0 = vec3(vertices[v * 3 + 0]);
-      vec3 v1 = vec3(vertices[v * 3 + 1]);
-      vec3 v2 = vec3(vertices[v * 3 + 2]);
-
-      float t = triangle_intersect(ray, v0, v1, v2);
-
-      if (EPSILON < t && t < max_t) {
-        hit.t = t;
-        hit.point = ray.origin + ray.direction * t;
-        hit.normal = normalize(cross(v1 - v0, v2 - v0));
-        hit.material = int(vertices[v * 3].w);
-        max_t = hit.t;
-        closest = i;
+    if (EPSILON < t && t < hit.t) {
+      hit.t = t;
+      closest = int(sphere_blocks[b].id[lane]);
+      if (occlusion_query) {
+        return;
       }
+      hit.point = ray.origin + ray.direction * t;
+      hit.normal = (hit.point - center) / sphere_blocks[b].radius[lane];
+      hit.material = sphere_blocks[b].material[lane];
     }
   }
-
-  return closest;
 }
 
-int find_closest_sphere_range(Ray ray, inout HitInfo hit, int begin, int end)
-{
-  float max_t = INF;
-  int closest = NO_HIT;
+vec3 block_edge(uint b, uint k, uint lane) {
+  uint i = k * 3u * LEAF_WIDTH + lane;
+  return vec3(triangle_blocks[b].edge[i], triangle_blocks[b].edge[i + LEAF_WIDTH], triangle_blocks[b].edge[i + 2u * LEAF_WIDTH]);
+}
 
-  float t;
+vec3 block_moment(uint b, uint k, uint lane) {
+  uint i = k * 3u * LEAF_WIDTH + lane;
+  return vec3(triangle_blocks[b].moment[i], triangle_blocks[b].moment[i + LEAF_WIDTH], triangle_blocks[b].moment[i + 2u * LEAF_WIDTH]);
+}
 
-  for (int i = begin; i < end || i < spheres.length(); i++) 
-  {
-    float t = sphere_intersect(ray, spheres[i]);
+vec3 block_normal(uint b, uint lane) {
+  return vec3(triangle_blocks[b].normal[lane], triangle_blocks[b].normal[lane + LEAF_WIDTH], triangle_blocks[b].normal[lane + 2u * LEAF_WIDTH]);
+}
 
-    if (EPSILON < t && t < max_t) {
-      hit.t = t;
-      hit.point = ray.origin + ray.direction * t;
-      hit.normal = (hit.point - spheres[i].center) / spheres[i].radius;
-      hit.material = spheres[i].material;
- 
-      max_t = hit.t;
-      closest = i;
+// triangle_record_intersect against a lane of a block
+float triangle_block_intersect(Ray r, vec3 moment, uint b, uint lane) {
+  for (uint k = 0u; k < 3u; k++) {
+    if (dot(block_edge(b, k, lane), moment) + dot(block_moment(b, k, lane), r.direction) < 0.0) {
+      return INF;
     }
   }
 
-  return closest;
-
+  vec3 normal = block_normal(b, lane);
+  return (triangle_blocks[b].plane[lane] - dot(normal, r.origin)) / dot(normal, r.direction);
 }
 
-int find_closest_sphere(Ray ray, inout HitInfo hit)
+void intersect_triangle_blocks(Ray ray, uint offset, uint count, int instance, inout HitInfo hit, inout int closest)
 {
-  float max_t = INF;
-  int closest = NO_HIT;
+  vec3 moment = cross(ray.direction, ray.origin);
 
-  float t;
-
-  for (int i = 0; i < spheres.length(); i++) 
-  {
-    float t = sphere_intersect(ray, spheres[i]);
+  for (uint i = 0u; i < count; i++) {
+    uint b = offset + i / LEAF_WIDTH;
+    uint lane = i % LEAF_WIDTH;
+    float t = triangle_block_intersect(ray, moment, b, lane);
 
-    if (EPSILON < t && t < max_t) {
+    if (EPSILON < t && t < hit.t) {
       hit.t = t;
-      hit.point = ray.origin + ray.direction * t;
-      hit.normal = (hit.point - spheres[i].center) / spheres[i].radius;
-      hit.material = spheres[i].material;
- 
-      max_t = hit.t;
-      closest = i;
+      closest = int(triangle_blocks[b].id[lane]);
+      if (occlusion_query) {
+        return;
+      }
+      hit.normal = block_normal(b, lane);
+      hit.material = triangle_blocks[b].material[lane];
+      place_hit(hit, instance);
     }
   }
-
-  return closest;
 }
 
-float fresnel_schlick(float f0, float cos_theta)
+// enters the instances or intersects the primitives of a leaf
+void visit_leaf(inout Stack s, Ray ray, uint type, uint offset, uint count, int instance, inout HitInfo hit, inout int closest)
 {
-  float c = 1 - cos_theta;
-  return  f0 + (1 - f0) * (c*c*c*c*c);
+  if (type == PRIMITIVE_INSTANCE) {
+    for (uint i = offset; i < offset + count; i++) {
+      push(s, INSTANCE_ENTER | leaf_indices[i]);
+    }
+  } else if (type == PRIMITIVE_TRIANGLE) {
+    if (u_leaf_format == LEAVES_SOA) {
+      intersect_triangle_blocks(ray, offset, count, instance, hit, closest);
+    } else {
+      intersect_triangles(ray, offset, count, instance, hit, closest);
+    }
+  } else {
+    if (u_leaf_format == LEAVES_SOA) {
+      intersect_sphere_blocks(ray, offset, count, hit, closest);
+    } else {
+      intersect_spheres(ray, offset, count, hit, closest);
+    }
+  }
 }
 
-vec3 trace_path(Ray ray) 
+// moves the ray between world and object space on the instance markers of the stack,
+// returns false if id is a node
+bool visit_marker(inout Stack s, uint id, Ray world_ray, inout Ray ray, inout int instance)
 {
-  vec3 radiance = vec3(0.0);
-  vec3 throughput = vec3(1.0);
+  if (id == INSTANCE_EXIT) {
+    ray = world_ray;
+    instance = NO_HIT;
+    return true;
+  }
 
-  for (int bounce = 0; bounce < u_max_bounce; bounce++)
-  {
-    HitInfo hit1, hit2;
-    hit1.t = INF;
-    hit2.t = INF;
-    HitInfo hit;
+  if ((id & INSTANCE_ENTER) != 0u) {
+    instance = int(id & ~INSTANCE_ENTER);
+    mat4 world_to_object = instances[instance].world_to_object;
+    ray.origin = vec3(world_to_object * vec4(world_ray.origin, 1.0));
+    ray.direction = mat3(world_to_object) * world_ray.direction;
+    push(s, INSTANCE_EXIT);
+    push(s, instances[instance].root);
+    return true;
+  }
 
-#if (KD_TREE == 1)
-    int i = traverse(ray, hit1);
-#else
-    int i = find_closest_sphere(ray, hit1);
-#endif
+  return false;
+}
 
+// pushes the children that the ray enters before the current hit, the nearer one last
+// so it is visited first
+void push_ordered(inout Stack s, uint a, float ta, uint b, float tb)
+{
+  if (ta < tb) {
+    if (tb < INF) push(s, b);
+    push(s, a);
+  } else {
+    if (ta < INF) push(s, a);
+    if (tb < INF) push(s, b);
+  }
+}
 
-    int j = find_closest_mesh(ray, hit2);
+// closest hit over all spheres, triangles and instances in the tree.
+// object space rays keep an unnormalized direction, so t is the same in both spaces.
+// children are tested before they are pushed, so the nearer child is visited first
+// and subtrees behind the current hit are never entered
+int traverse(Ray world_ray, inout HitInfo hit) {
+  
+  int closest = NO_HIT;
 
-    if (i == NO_HIT && j == NO_HIT) {
-      vec3 background = u_use_envmap ? texture(u_envmap, ray.direction).rgb : u_background;
-      radiance += background * throughput;
-      break;
-    }
+  if (nodes.length() == 0 || aabb_distance(world_ray, nodes[0].min, nodes[0].max, hit.t) == INF) {
+    return closest;
+  }
 
-    hit = (hit1.t < hit2.t) ? hit1 : hit2;
+  Ray ray = world_ray;
+  int instance = NO_HIT;
+  uint id = 0;
 
-    Material material = materials[hit.material];
+  Stack s;
+  init(s);
+  push(s, id);
 
-    vec3 albedo = material.albedo.rgb;
-    vec3 emission = material.emission.rgb;
-    float smoothness = material.albedo.w;
+  while (!is_empty(s) && !(occlusion_query && closest != NO_HIT)) {
+    id = pop(s);
 
-    bool inside = dot(-ray.direction, hit.normal) < 0;
+    if (visit_marker(s, id, world_ray, ray, instance)) {
+      continue;
+    }
 
-    vec3 point = hit.point;
-    vec3 normal = hit.normal;
+    Node node = nodes[id];
 
-    ray.origin = point;
+    if (node.count > 0) {
+      uint type = node.count >> PRIMITIVE_TYPE_SHIFT;
+      uint count = node.count & PRIMITIVE_COUNT_MASK;
+      visit_leaf(s, ray, type, node.offset, count, instance, hit, closest);
+      continue;
+    }
 
-    if (material.type == 0) { // diffuse
+    float tl = INF, tr = INF;
 
-      ray.direction = cosine_weighted(hit.normal);
-      throughput *= albedo; 
+    if (node.left != INVALID) {
+      tl = aabb_distance(ray, nodes[node.left].min, nodes[node.left].max, hit.t);
+    }
 
-    } else if (material.type == 1) { // specular
+    if (node.right != INVALID) {
+      tr = aabb_distance(ray, nodes[node.right].min, nodes[node.right].max, hit.t);
+    }
 
-      vec3 diffuse = cosine_weighted(hit.normal);
-      vec3 specular = reflect(ray.direction, hit.normal);
-      ray.direction = mix(diffuse, specular, smoothness);
+    push_ordered(s, node.left, tl, node.right, tr);
+  }
 
-      throughput *= albedo; 
+  if (closest != NO_HIT) {
+    hit.point = world_ray.origin + world_ray.direction * hit.t;
+  }
 
-    } else if (material.type == 2) { // transparent
+  return closest;
+}
 
-      // points inside the sphere if we are inside
-      vec3 nl = inside ? -hit.normal : hit.normal;
+// closest sphere in the grid, the cells are walked front to back with a 3D-DDA and the
+// walk ends once the closest hit lies inside the current cell
+int traverse_grid(Ray ray, inout HitInfo hit)
+{
+  int closest = NO_HIT;
 
-      float nc = 1;   // air
-      float nt = 1.4; // glass
+  if (grid_cells.length() <= 1) {
+    return closest;
+  }
 
-      float nnt = inside ? nt / nc : nc / nt;
+  ivec3 resolution = ivec3(grid_resolution.xyz);
+  vec3 grid_max = grid_min.xyz + grid_cell_size.xyz * vec3(resolution);
 
-      float cos_theta = dot(ray.direction, nl);
+  vec3 inv = 1.0 / ray.direction;
+  vec3 t1 = (grid_min.xyz - ray.origin) * inv;
+  vec3 t2 = (grid_max - ray.origin) * inv;
+  vec3 lo = min(t1, t2);
+  vec3 hi = max(t1, t2);
 
-      float cos_theta_2_sqr;
+  float tmin = max(max(lo.x, lo.y), max(lo.z, 0.0));
+  float tmax = min(min(hi.x, hi.y), min(hi.z, hit.t));
 
-      // total internal reflection
-      if ((cos_theta_2_sqr = 1 - nnt * nnt * (1 - cos_theta * cos_theta)) < 0) {
-        throughput *= albedo;
-        ray.direction = reflect(ray.direction, hit.normal);
-        break;
-      }
+  if (tmax < tmin) {
+    return closest;
+  }
 
-      vec3 transmission = refract(ray.direction, nl, nnt);
+  vec3 entry = (ray.origin + ray.direction * tmin - grid_min.xyz) / grid_cell_size.xyz;
+  ivec3 cell = clamp(ivec3(floor(entry)), ivec3(0), resolution - 1);
+  ivec3 step;
+  vec3 next, delta;
+
+  for (int axis = 0; axis < 3; axis++) {
+    if (ray.direction[axis] == 0.0) {
+      step[axis] = 0;
+      next[axis] = INF;
+      delta[axis] = INF;
+    } else {
+      step[axis] = (0.0 < ray.direction[axis]) ? 1 : -1;
+      float boundary = grid_min[axis] + float(cell[axis] + max(step[axis], 0)) * grid_cell_size[axis];
+      next[axis] = (boundary - ray.origin[axis]) * inv[axis];
+      delta[axis] = grid_cell_size[axis] * abs(inv[axis]);
+    }
+  }
 
-      float a = nt - nc;
-      float b = nt + nc;
-      float R0 = a * a / (b*b);
+  while (true) {
+    int axis = (next.x < next.y) ? ((next.x < next.z) ? 0 : 2) : ((next.y < next.z) ? 1 : 2);
+    float exit = min(next[axis], tmax);
 
-      float cos_theta_2 = dot(transmission, hit.normal);
+    uint id = uint(cell.x + resolution.x * (cell.y + resolution.y * cell.z));
+    uint offset = grid_cells[id];
+    intersect_spheres(ray, offset, grid_cells[id + 1] - offset, hit, closest);
 
-      float tmp = (inside ? cos_theta_2 : -cos_theta);
+    if (hit.t <= exit || tmax <= next[axis] || (occlusion_query && closest != NO_HIT)) {
+      break;
+    }
 
-      // reflection weight
-      float Re = fresnel_schlick(R0, tmp); 
-  
-      // refraction weight
-      float Tr = 1 - Re; 
+    cell[axis] += step[axis];
+    if (cell[axis] < 0 || resolution[axis] <= cell[axis]) {
+      break;
+    }
+
+    next[axis] += delta[axis];
+  }
+
+  return closest;
+}
+
+uint compact_bits()
+{
+  return (u_node_format == NODES_QUANTIZED_8) ? 8u : 16u;
+}
+
+uint compact_quantized(uint base, uint value)
+{
+  uint bits = compact_bits();
+  uint per_word = 32u / bits;
+  uint word = compact[base + 7u + value / per_word];
+  return bitfieldExtract(word, int(bits * (value % per_word)), int(bits));
+}
+
+// planes of a child box are origin + q * 2^exponent
+void compact_bounds(uint base, uint child, out vec4 lo, out vec4 hi)
+{
+  vec3 origin = uintBitsToFloat(uvec3(compact[base], compact[base + 1u], compact[base + 2u]));
+  uint e = compact[base + 3u];
+  vec3 scale = uintBitsToFloat(uvec3(bitfieldExtract(e, 0, 8), bitfieldExtract(e, 8, 8), bitfieldExtract(e, 16, 8)) << 23u);
+
+  uint first = child * 6u;
+  vec3 qmin = vec3(compact_quantized(base, first), compact_quantized(base, first + 1u), compact_quantized(base, first + 2u));
+  vec3 qmax = vec3(compact_quantized(base, first + 3u), compact_quantized(base, first + 4u), compact_quantized(base, first + 5u));
+
+  lo = vec4(origin + qmin * scale, 0.0);
+  hi = vec4(origin + qmax * scale, 0.0);
+}
+
+// same as traverse over the quantized nodes, leaves are intersected as soon as their box is hit
+int traverse_compact(Ray world_ray, inout HitInfo hit) {
+
+  int closest = NO_HIT;
+
+  if (compact.length() == 0) {
+    return closest;
+  }
+
+  Ray ray = world_ray;
+  int instance = NO_HIT;
+  uint stride = 7u + 12u * compact_bits() / 32u;
+
+  Stack s;
+  init(s);
+  push(s, 0u);
 
-      float P = 0.25 + 0.5 * Re;
-      float RP = Re / P;
-      float TP = Tr / (1 - P);
+  while (!is_empty(s) && !(occlusion_query && closest != NO_HIT)) {
+    uint id = pop(s);
 
-      if (rand() < P) {
-        throughput *= (albedo * RP);
-        ray.direction = reflect(ray.direction, hit.normal);
+    if (visit_marker(s, id, world_ray, ray, instance)) {
+      continue;
+    }
+
+    uint base = id * stride;
+    uint meta = compact[base + 4u];
+
+    uint child[2];
+    float t[2];
+
+    for (uint c = 0u; c < 2u; c++) {
+      child[c] = compact[base + 5u + c];
+      t[c] = INF;
+
+      if (child[c] == INVALID) {
+        continue;
+      }
+
+      vec4 lo, hi;
+      compact_bounds(base, c, lo, hi);
+      float entry = aabb_distance(ray, lo, hi, hit.t);
+      if (entry == INF) {
+        continue;
+      }
+
+      uint leaf = bitfieldExtract(meta, int(16u * c), 16);
+      uint count = leaf & 0x3fffu;
+
+      if (count == 0u) {
+        t[c] = entry;
       } else {
-        throughput *= (albedo * TP);
-        ray.direction = transmission;
+        visit_leaf(s, ray, leaf >> 14u, child[c], count, instance, hit, closest);
       }
     }
 
-    radiance += emission * throughput;
+    push_ordered(s, child[0], t[0], child[1], t[1]);
   }
 
-  return radiance;
+  if (closest != NO_HIT) {
+    hit.point = world_ray.origin + world_ray.direction * hit.t;
+  }
+
+  return closest;
 }
 
-void main() 
+// closest hit over the 4 wide tree, all children of a node share one vec4 slab test.
+// leaves are intersected right away, interior children are pushed far to near and
+// everything behind the current hit is culled
+int traverse_wide(Ray world_ray, inout HitInfo hit) {
+
+  int closest = NO_HIT;
+
+  if (wide.length() == 0) {
+    return closest;
+  }
+
+  Ray ray = world_ray;
+  int instance = NO_HIT;
+
+  Stack s;
+  init(s);
+  push(s, 0u);
+
+  while (!is_empty(s) && !(occlusion_query && closest != NO_HIT)) {
+    uint id = pop(s);
+
+    if (visit_marker(s, id, world_ray, ray, instance)) {
+      continue;
+    }
+
+    WideNode node = wide[id];
+    vec3 inv = 1.0 / ray.direction;
+
+    vec4 ax = (node.min_x - ray.origin.x) * inv.x, bx = (node.max_x - ray.origin.x) * inv.x;
+    vec4 ay = (node.min_y - ray.origin.y) * inv.y, by = (node.max_y - ray.origin.y) * inv.y;
+    vec4 az = (node.min_z - ray.origin.z) * inv.z, bz = (node.max_z - ray.origin.z) * inv.z;
+
+    vec4 tnear = max(max(min(ax, bx), min(ay, by)), max(min(az, bz), vec4(0.0)));
+    vec4 tfar = min(min(max(ax, bx), max(ay, by)), min(max(az, bz), vec4(hit.t)));
+    bvec4 entered = lessThanEqual(tnear, tfar);
+
+    uint near[4];
+    float dist[4];
+    int n = 0;
+
+    for (int c = 0; c < 4; c++) {
+      if (!entered[c] || node.child[c] == INVALID) {
+        continue;
+      }
+
+      if (node.count[c] != 0u) {
+        uint type = node.count[c] >> PRIMITIVE_TYPE_SHIFT;
+        uint count = node.count[c] & PRIMITIVE_COUNT_MASK;
+        visit_leaf(s, ray, type, node.child[c], count, instance, hit, closest);
+        continue;
+      }
+
+      // farthest first, so the nearest child is popped next
+      int j = n++;
+      while (j > 0 && dist[j - 1] < tnear[c]) {
+        near[j] = near[j - 1];
+        dist[j] = dist[j - 1];
+        j--;
+      }
+      near[j] = node.child[c];
+      dist[j] = tnear[c];
+    }
+
+    for (int k = 0; k < n; k++) {
+      push(s, near[k]);
+    }
+  }
+
+  if (closest != NO_HIT) {
+    hit.point = world_ray.origin + world_ray.direction * hit.t;
+  }
+
+  return closest;
+}
+
+int find_closest_mesh(Ray ray, inout HitInfo hit) 
 {
-  ivec2 pixel_coords = ivec2(gl_GlobalInvocationID.xy);
+  float max_t = INF;
+  int closest = NO_HIT;
+  vec3 moment = cross(ray.direction, ray.origin);
 
-  frag_coord = vec2(pixel_coords);
-  vec2 resolution = vec2(imageSize(image));
+  for (int i = 0; i < meshes.length(); i++) {
+    Mesh mesh = meshes[i];
+    uint offset = mesh.start;
+    uint count = mesh.size;
 
-  init_rand(frag_coord, u_random);
+    for (uint v = offset; v < offset + count; v++) {
+      float t = triangle_distance(ray, moment, v);
 
-  aspect_ratio = resolution.y / resolution.x;
+      if (EPSILON < t && t < max_t) {
+        hit.t = t;
+        hit.point = ray.origin + ray.direction * t;
+        hit.normal = triangle_normal(v);
+        hit.material = triangle_material(v);
+        max_t = hit.t;
+        closest = i;
+      }
+    }
+  }
+
+  return closest;
+}
+
+int find_closest_sphere_range(Ray ray, inout HitInfo hit, int begin, int end)
+{
+  float max_t = INF;
+  int closest = NO_HIT;
+
+  float t;
+
+  for (int i = begin; i < end || i < spheres.length(); i++) 
+  {
+    float t = sphere_intersect(ray, spheres[i]);
+
+    if (EPSILON < t && t < max_t) {
+      hit.t = t;
+      hit.point = ray.origin + ray.direction * t;
+      hit.normal = (hit.point - spheres[i].center) / spheres[i].radius;
+      hit.material = spheres[i].material;
+ 
+      max_t = hit.t;
+      closest = i;
+    }
+  }
+
+  return closest;
+
+}
+
+int find_closest_sphere(Ray ray, inout HitInfo hit)
+{
+  float max_t = INF;
+  int closest = NO_HIT;
+
+  float t;
 
-  vec3 previous;
+  for (int i = 0; i < spheres.length(); i++) 
+  {
+    float t = sphere_intersect(ray, spheres[i]);
 
-  if (u_reset_flag) {
-    previous = vec3(0);
+    if (EPSILON < t && t < max_t) {
+      hit.t = t;
+      hit.point = ray.origin + ray.direction * t;
+      hit.normal = (hit.point - spheres[i].center) / spheres[i].radius;
+      hit.material = spheres[i].material;
+ 
+      max_t = hit.t;
+      closest = i;
+    }
+  }
+
+  return closest;
+}
+
+float fresnel_schlick(float f0, float cos_theta)
+{
+  float c = 1 - cos_theta;
+  return  f0 + (1 - f0) * (c*c*c*c*c);
+}
+
+// closest hit over the selected acceleration structure, false if the ray escapes
+bool closest_hit(Ray ray, out HitInfo hit)
+{
+  HitInfo hit1, hit2;
+  hit1.t = INF;
+  hit2.t = INF;
+
+  int i, j;
+
+  if (u_use_bvh) {
+    // the tree only looks for hits in front of the closest grid sphere
+    int k = u_use_grid ? traverse_grid(ray, hit1) : NO_HIT;
+
+    if (u_node_format == NODES_WIDE_4) {
+      i = traverse_wide(ray, hit1);
+    } else if (u_node_format != NODES_FULL) {
+      i = traverse_compact(ray, hit1);
+    } else {
+      i = traverse(ray, hit1);
+    }
+    i = (i != NO_HIT) ? i : k;
+    j = NO_HIT;
   } else {
-    previous = imageLoad(image, pixel_coords).rgb;
+    i = find_closest_sphere(ray, hit1);
+    j = find_closest_mesh(ray, hit2);
   }
-  
-  vec2 xy = (frag_coord / resolution) * 2.0 - 1.0;
 
-  Ray ray = camera_ray(xy);  
+  hit = (hit1.t < hit2.t) ? hit1 : hit2;
+  return i != NO_HIT || j != NO_HIT;
+}
+
+// whether anything lies on the ray in front of t_max, for visibility alone. the search
+// stops at the first primitive in range and never computes a hit point, normal or material
+bool occluded(Ray ray, float t_max)
+{
+  if (!u_use_bvh) {
+    for (int i = 0; i < spheres.length(); i++) {
+      float t = sphere_intersect(ray, spheres[i]);
+      if (EPSILON < t && t < t_max) {
+        return true;
+      }
+    }
+
+    vec3 moment = cross(ray.direction, ray.origin);
+    for (int i = 0; i < meshes.length(); i++) {
+      for (uint v = meshes[i].start; v < meshes[i].start + meshes[i].size; v++) {
+        float t = triangle_distance(ray, moment, v);
+        if (EPSILON < t && t < t_max) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  HitInfo hit;
+  hit.t = t_max;
+  occlusion_query = true;
+
+  int i = u_use_grid ? traverse_grid(ray, hit) : NO_HIT;
+  if (i == NO_HIT) {
+    if (u_node_format == NODES_WIDE_4) {
+      i = traverse_wide(ray, hit);
+    } else if (u_node_format != NODES_FULL) {
+      i = traverse_compact(ray, hit);
+    } else {
+      i = traverse(ray, hit);
+    }
+  }
+
+  occlusion_query = false;
+  return i != NO_HIT;
+}
+
+vec3 background(vec3 direction)
+{
+  return u_use_envmap ? texture(u_envmap, direction).rgb : u_background;
+}
+
+uint light_rays = 0u; // shadow rays traced by this invocation
+
+float power_heuristic(float pdf, float other)
+{
+  return (pdf * pdf) / (pdf * pdf + other * other);
+}
+
+// 1 - cos of the half angle of the cone a sphere covers seen from a point outside of it,
+// written so it keeps its precision for far away lights
+float cone_extent(float distance2, float radius2)
+{
+  float ratio = radius2 / distance2;
+  return ratio / (1.0 + sqrt(1.0 - ratio));
+}
+
+// pdf of the direction from point to a light when it was picked among all of them and
+// sampled uniformly over the cone it covers, 0 from inside of it
+float light_pdf(Sphere light, vec3 point)
+{
+  vec3 to_center = light.center - point;
+  float distance2 = dot(to_center, to_center);
+  float radius2 = light.radius * light.radius;
+  if (distance2 <= radius2 * (1.0 + 1e-3)) {
+    return 0.0;
+  }
+  return 1.0 / (2.0 * PI * cone_extent(distance2, radius2) * float(u_light_count));
+}
+
+// pdf of next event estimation for the light at point, which a bounce from origin hit. 0 if
+// no light lies there, the emission then keeps its full weight
+float hit_light_pdf(vec3 origin, vec3 point)
+{
+  for (uint i = 0u; i < u_light_count; i++) {
+    Sphere light = lights[i];
+    if (abs(distance(point, light.center) - light.radius) <= 1e-3 * light.radius + EPSILON) {
+      return light_pdf(light, origin);
+    }
+  }
+  return 0.0;
+}
+
+// whether bounce is the last ray of a path. its hit samples no lights: the bounce that would
+// take the other share of their weight is never traced, and a path one ray longer than the
+// bounces reach would depend on the weights
+bool last_bounce(uint bounce)
+{
+  return u_max_bounce <= bounce + 1u;
+}
+
+// direct light at a diffuse hit: one light picked uniformly, a direction in the cone it covers
+// and a shadow ray, weighted against a bounce finding the light (power heuristic)
+vec3 sample_light(vec3 point, vec3 normal, vec3 albedo, uint bounce)
+{
+  if (last_bounce(bounce)) {
+    return vec3(0.0);
+  }
+  sample_light_dimensions();
+
+  uint index = min(uint(rand() * float(u_light_count)), u_light_count - 1u);
+  Sphere light = lights[index];
+
+  vec3 to_center = light.center - point;
+  float distance2 = dot(to_center, to_center);
+  float radius2 = light.radius * light.radius;
+
+  float u1 = rand();
+  float u2 = rand();
+
+  // the light the point lies on lights nothing of itself
+  if (distance2 <= radius2 * (1.0 + 1e-3)) {
+    return vec3(0.0);
+  }
+
+  float extent = cone_extent(distance2, radius2);
+  float cos_theta = 1.0 - u1 * extent;
+  float sin_theta = sqrt(max(0.0, 1.0 - cos_theta * cos_theta));
+  float phi = 2.0 * PI * u2;
+
+  vec3 w = to_center / sqrt(distance2);
+  vec3 u = normalize(cross(abs(w.x) > 0.1 ? vec3(0, 1, 0) : vec3(1, 0, 0), w));
+  vec3 v = cross(w, u);
+  vec3 direction = normalize(u * cos(phi) * sin_theta + v * sin(phi) * sin_theta + w * cos_theta);
+
+  float cos_surface = dot(direction, normal);
+  if (cos_surface <= 0.0) {
+    return vec3(0.0);
+  }
+
+  // visible if nothing lies in front of the light
+  Ray shadow = Ray(point, direction);
+  float t_light = sphere_intersect(shadow, light);
+  light_rays++;
+  if (INF <= t_light || occluded(shadow, t_light - EPSILON)) {
+    return vec3(0.0);
+  }
+
+  float pdf = 1.0 / (2.0 * PI * extent * float(u_light_count));
+  float weight = power_heuristic(pdf, cos_surface / PI);
+  return materials[light.material].emission.rgb * albedo * (cos_surface / PI) * weight / pdf;
+}
+
+bool sampling_environment()
+{
+  return u_use_nee && u_use_envmap && 0u < u_envmap_size;
+}
+
+// face of direction and the point s, t in [-1, 1] on it, like the face selection of the cube
+// map table in the OpenGL specification
+uint cube_face(vec3 d, out vec2 st)
+{
+  vec3 a = abs(d);
+  if (a.y <= a.x && a.z <= a.x) {
+    st = vec2(0.0 <= d.x ? -d.z : d.z, -d.y) / a.x;
+    return 0.0 <= d.x ? 0u : 1u;
+  }
+  if (a.z <= a.y) {
+    st = vec2(d.x, 0.0 <= d.y ? d.z : -d.z) / a.y;
+    return 0.0 <= d.y ? 2u : 3u;
+  }
+  st = vec2(0.0 <= d.z ? d.x : -d.x, -d.y) / a.z;
+  return 0.0 <= d.z ? 4u : 5u;
+}
+
+// the inverse of cube_face, not normalized
+vec3 cube_direction(uint face, vec2 st)
+{
+  switch (face) {
+    case 0u: return vec3(1.0, -st.y, -st.x);
+    case 1u: return vec3(-1.0, -st.y, st.x);
+    case 2u: return vec3(st.x, 1.0, st.y);
+    case 3u: return vec3(st.x, -1.0, -st.y);
+    case 4u: return vec3(st.x, -st.y, 1.0);
+    default: return vec3(-st.x, -st.y, -1.0);
+  }
+}
+
+// density over solid angle of the texel at st, its probability over the solid angle it
+// covers, which shrinks with the cube of the distance from the center of the cube
+float texel_pdf(uint entry, vec2 st)
+{
+  float n = float(u_envmap_size);
+  float r2 = 1.0 + dot(st, st);
+  return envmap_entries[entry].probability * 0.25 * n * n * r2 * sqrt(r2);
+}
+
+// pdf of sample_environment for direction
+float environment_pdf(vec3 direction)
+{
+  vec2 st;
+  uint face = cube_face(direction, st);
+  uint n = u_envmap_size;
+  uvec2 texel = uvec2(clamp(ivec2((st + 1.0) * 0.5 * float(n)), ivec2(0), ivec2(n - 1u)));
+  return texel_pdf((face * n + texel.y) * n + texel.x, st);
+}
+
+// direct light of the envmap at a diffuse hit: a texel of the alias table, a point in it and
+// a shadow ray that has to leave the scene, weighted against a bounce missing it
+vec3 sample_environment(vec3 point, vec3 normal, vec3 albedo, uint bounce)
+{
+  if (last_bounce(bounce)) {
+    return vec3(0.0);
+  }
+  sample_environment_dimensions();
+
+  uint n = u_envmap_size;
+  uint count = 6u * n * n;
+  uint entry = min(uint(rand() * float(count)), count - 1u);
+  if (envmap_entries[entry].threshold <= rand()) {
+    entry = envmap_entries[entry].alias;
+  }
+
+  float u = rand();
+  float v = rand();
+
+  uint face = entry / (n * n);
+  uvec2 texel = uvec2(entry % n, entry / n % n);
+  vec2 st = 2.0 * (vec2(texel) + vec2(u, v)) / float(n) - 1.0;
+
+  vec3 direction = normalize(cube_direction(face, st));
+  float pdf = texel_pdf(entry, st);
+
+  float cos_surface = dot(direction, normal);
+  if (cos_surface <= 0.0 || pdf <= 0.0) {
+    return vec3(0.0);
+  }
+
+  light_rays++;
+  if (occluded(Ray(point, direction), INF)) {
+    return vec3(0.0);
+  }
+
+  float weight = power_heuristic(pdf, cos_surface / PI);
+  return background(direction) * albedo * (cos_surface / PI) * weight / pdf;
+}
+
+// background of a ray that left the scene, weighted like the emission of a light if
+// sample_environment could have found it as well
+vec3 escaped(vec3 direction, float pdf)
+{
+  float weight = (0.0 < pdf && sampling_environment()) ? power_heuristic(pdf, environment_pdf(direction)) : 1.0;
+  return background(direction) * weight;
+}
+
+// continues the path at hit in a direction the material of the hit picks and adds its
+// emission, false if the path ends there. pdf is the one of the direction of the ray that
+// found hit if next event estimation could have found its light as well, 0 otherwise, and
+// becomes the one of the new direction. bounce counts the rays of the path before hit
+bool scatter(inout Ray ray, HitInfo hit, uint bounce, inout vec3 throughput, inout vec3 radiance, inout float pdf)
+{
+  Material material = materials[hit.material];
+
+  vec3 albedo = material.albedo.rgb;
+  vec3 emission = material.emission.rgb;
+  float smoothness = material.albedo.w;
+
+  bool inside = dot(-ray.direction, hit.normal) < 0;
+
+  vec3 point = hit.point;
+  vec3 normal = hit.normal;
+
+  // emission the last vertex sampled as a light is shared between both
+  if (emission != vec3(0.0)) {
+    float weight = (0.0 < pdf) ? power_heuristic(pdf, hit_light_pdf(ray.origin, point)) : 1.0;
+    radiance += emission * throughput * weight;
+  }
+
+  ray.origin = point;
+  pdf = 0.0;
+
+  if (material.type == 0) { // diffuse
+
+    bool nee = u_use_nee && (0u < u_light_count || sampling_environment());
+    if (nee && 0u < u_light_count) {
+      radiance += throughput * sample_light(point, normal, albedo, bounce);
+    }
+    if (sampling_environment()) {
+      radiance += throughput * sample_environment(point, normal, albedo, bounce);
+    }
+
+    // back to the first set of the bounce, the light samples moved on from it
+    sample_dimensions(bounce + 1u);
+    ray.direction = cosine_weighted(hit.normal);
+    throughput *= albedo; 
+    pdf = nee ? max(dot(ray.direction, normal), 0.0) / PI : 0.0;
+
+  } else if (material.type == 1) { // specular
+
+    vec3 diffuse = cosine_weighted(hit.normal);
+    vec3 specular = reflect(ray.direction, hit.normal);
+    ray.direction = mix(diffuse, specular, smoothness);
+
+    throughput *= albedo; 
+
+  } else if (material.type == 2) { // transparent
+
+    // points inside the sphere if we are inside
+    vec3 nl = inside ? -hit.normal : hit.normal;
+
+    float nc = 1;   // air
+    float nt = 1.4; // glass
+
+    float nnt = inside ? nt / nc : nc / nt;
+
+    float cos_theta = dot(ray.direction, nl);
+
+    float cos_theta_2_sqr;
+
+    // total internal reflection
+    if ((cos_theta_2_sqr = 1 - nnt * nnt * (1 - cos_theta * cos_theta)) < 0) {
+      throughput *= albedo;
+      ray.direction = reflect(ray.direction, hit.normal);
+      return false;
+    }
+
+    vec3 transmission = refract(ray.direction, nl, nnt);
+
+    float a = nt - nc;
+    float b = nt + nc;
+    float R0 = a * a / (b*b);
+
+    float cos_theta_2 = dot(transmission, hit.normal);
+
+    float tmp = (inside ? cos_theta_2 : -cos_theta);
+
+    // reflection weight
+    float Re = fresnel_schlick(R0, tmp); 
+
+    // refraction weight
+    float Tr = 1 - Re; 
+
+    float P = 0.25 + 0.5 * Re;
+    float RP = Re / P;
+    float TP = Tr / (1 - P);
+
+    if (rand() < P) {
+      throughput *= (albedo * RP);
+      ray.direction = reflect(ray.direction, hit.normal);
+    } else {
+      throughput *= (albedo * TP);
+      ray.direction = transmission;
+    }
+  }
+
+  return true;
+}
+
+float luminance(vec3 color)
+{
+  return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// russian roulette from bounce u_roulette_depth on: the path goes on with the luminance of
+// its throughput as probability and carries the rest of the weight of the ended ones, so
+// the expected radiance stays the same. paths that carry nothing end at once. the number
+// comes after the direction in the dimensions of the bounce
+bool survives(inout vec3 throughput, uint bounce)
+{
+  if (throughput == vec3(0.0)) {
+    return false;
+  }
+
+  if (!u_roulette || bounce + 1u < u_roulette_depth) {
+    return true;
+  }
+
+  float p = min(luminance(throughput), 1.0);
+  if (p <= rand()) {
+    return false;
+  }
+  throughput /= p;
+  return true;
+}
+
+vec3 trace_path(Ray ray) 
+{
+  vec3 radiance = vec3(0.0);
+  vec3 throughput = vec3(1.0);
+  float pdf = 0.0;
+  uint rays = 0u;
+
+  for (int bounce = 0; bounce < u_max_bounce; bounce++)
+  {
+    HitInfo hit;
+    rays++;
+
+    if (!closest_hit(ray, hit)) {
+      radiance += escaped(ray.direction, pdf) * throughput;
+      break;
+    }
+
+    sample_dimensions(uint(bounce) + 1u);
+    if (!scatter(ray, hit, uint(bounce), throughput, radiance, pdf) || !survives(throughput, uint(bounce))) {
+      break;
+    }
+  }
+
+  if (u_count_rays) {
+    atomicAdd(ray_count, rays);
+    atomicAdd(shadow_ray_count, light_rays);
+    atomicAdd(sample_count, 1u);
+    light_rays = 0u;
+  }
+
+  return radiance;
+}
+
+bool pixel_converged(vec4 moment)
+{
+  float frames = moment.x;
+  if (frames < float(u_adaptive_min_frames) || frames < 2.0) {
+    return false;
+  }
+
+  float error = sqrt(moment.z / ((frames - 1.0) * frames));
+  return error <= u_adaptive_threshold * max(moment.y, ADAPTIVE_DARK);
+}
+
+// blends the color of this frame into the accumulated image. pixels count their own
+// frames, adaptive sampling skips the converged ones
+void store_pixel(ivec2 pixel_coords, vec3 color)
+{
+  vec4 moment = u_reset_flag ? vec4(0) : imageLoad(moments, pixel_coords);
+  vec3 previous = u_reset_flag ? vec3(0) : imageLoad(image, pixel_coords).rgb;
+  vec3 color_sum = previous * moment.x;
+  vec3 final_color = (color + color_sum) / (moment.x + 1.0);
+  imageStore(image, pixel_coords, vec4(final_color, 1));
+
+  float value = luminance(color);
+  float delta = value - moment.y;
+  moment.x += 1.0;
+  moment.y += delta / moment.x;
+  moment.z += delta * (value - moment.y);
+  imageStore(moments, pixel_coords, moment);
+}
+
+#if STAGE == STAGE_MEGAKERNEL
+
+void main() 
+{
+  ivec2 pixel_coords = ivec2(gl_GlobalInvocationID.xy);
+
+  // one work group per listed tile
+  if (u_adaptive) {
+    uint tiles_x = uint(imageSize(image).x) / TILE_SIZE;
+    uint tile = active_tiles[gl_WorkGroupID.x];
+    pixel_coords = ivec2(tile % tiles_x, tile / tiles_x) * TILE_SIZE + ivec2(gl_LocalInvocationID.xy);
+
+    // converged pixels of the tile keep their lanes idle
+    if (!u_reset_flag && pixel_converged(imageLoad(moments, pixel_coords))) {
+      return;
+    }
+  }
+
+  // the samples continue the sequence of the frames this pixel accumulated
+  float frames = u_reset_flag ? 0.0 : imageLoad(moments, pixel_coords).x;
+  init_rand(pixel_coords, uint(frames) * u_samples);
 
   vec3 color = vec3(0);
 
   for (int s = 0; s < u_samples; s++)
   {
-    color += trace_path(ray);
+    if (s > 0) {
+      next_sample();
+    }
+    color += trace_path(pixel_ray(pixel_coords));
   }
 
   color /= float(u_samples);
 
-  vec3 color_sum = previous * float(u_frames);
-  vec3 final_color = (color + color_sum) / (u_frames + 1);
-  vec4 pixel = vec4(final_color, 1);
+  store_pixel(pixel_coords, color);
+}
+
+#elif STAGE == STAGE_TILES
+
+shared bool tile_active;
+
+// lists the tiles with a pixel that has not converged, one work group per tile
+void main()
+{
+  if (gl_LocalInvocationIndex == 0u) {
+    tile_active = false;
+  }
+  barrier();
+
+  if (u_reset_flag || !pixel_converged(imageLoad(moments, ivec2(gl_GlobalInvocationID.xy)))) {
+    tile_active = true;
+  }
+  barrier();
 
+  if (gl_LocalInvocationIndex == 0u && tile_active) {
+    uint slot = atomicAdd(tile_groups_x, 1u);
+    active_tiles[slot] = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+  }
+}
+
+#else
 
-  imageStore(image, pixel_coords, pixel);
+// path id of every pixel, row by row
+ivec2 path_pixel(uint id)
+{
+  uint width = uint(imageSize(image).x);
+  return ivec2(id % width, id / width);
+}
+
+void enqueue(uint queue, uint id)
+{
+  uint slot = atomicAdd(queues[queue].tail, 1u);
+  queue_items[queue * QUEUE_CAPACITY + slot % QUEUE_CAPACITY] = id;
 }
+
+// the path id of item i of the current pass over queue
+uint queue_item(uint queue, uint i)
+{
+  return queue_items[queue * QUEUE_CAPACITY + (queues[queue].first + i) % QUEUE_CAPACITY];
+}
+
+// the path ended, it starts the next sample of its pixel at the camera ray again or
+// stores the pixel after the last one. regenerated paths join the next extend pass, so
+// the queues stay full while the samples of other pixels still bounce
+void finish_sample(uint id)
+{
+  paths[id].info.y++;
+  if (u_count_rays) {
+    atomicAdd(sample_count, 1u);
+  }
+
+  if (paths[id].info.y < u_samples) {
+    seed = paths[id].seed;
+    next_sample();
+    Ray ray = pixel_ray(path_pixel(id));
+
+    paths[id].origin = vec4(ray.origin, 0.0);
+    paths[id].direction = vec4(ray.direction, 0.0);
+    paths[id].seed = seed;
+    paths[id].throughput = vec4(1.0, 1.0, 1.0, 0.0);
+    paths[id].info.z = 0u;
+    enqueue(QUEUE_EXTEND, id);
+  } else {
+    store_pixel(path_pixel(id), paths[id].radiance.rgb / float(u_samples));
+  }
+}
+
+void main()
+{
+  uint index = gl_GlobalInvocationID.x;
+
+#if STAGE == STAGE_GENERATE
+
+  // the first camera ray of every pixel, seeded like the megakernel
+  if (u_path_count <= index) {
+    return;
+  }
+
+  uint id = index;
+  ivec2 pixel_coords = path_pixel(id);
+
+  // converged pixels start no path, the wavefront queues compact around them
+  if (u_adaptive && !u_reset_flag && pixel_converged(imageLoad(moments, pixel_coords))) {
+    return;
+  }
+  float frames = u_reset_flag ? 0.0 : imageLoad(moments, pixel_coords).x;
+  init_rand(pixel_coords, uint(frames) * u_samples);
+  Ray ray = pixel_ray(pixel_coords);
+
+  paths[id].origin = vec4(ray.origin, 0.0);
+  paths[id].direction = vec4(ray.direction, 0.0);
+  paths[id].throughput = vec4(1.0, 1.0, 1.0, 0.0);
+  paths[id].radiance = vec4(0.0);
+  paths[id].seed = seed;
+  paths[id].info = uvec4(id, 0u, 0u, 0u);
+
+  if (u_samples == 0u || u_max_bounce == 0u) {
+    store_pixel(pixel_coords, vec3(0.0));
+  } else {
+    enqueue(QUEUE_EXTEND, id);
+  }
+
+#elif STAGE == STAGE_EXTEND
+
+  // closest hit of every queued ray, hits move on to the queue of their material
+  if (queues[QUEUE_EXTEND].count <= index) {
+    return;
+  }
+
+  uint id = queue_item(QUEUE_EXTEND, index);
+  Ray ray = Ray(paths[id].origin.xyz, paths[id].direction.xyz);
+
+  HitInfo hit;
+  if (!closest_hit(ray, hit)) {
+    paths[id].radiance.rgb += escaped(ray.direction, paths[id].throughput.w) * paths[id].throughput.rgb;
+    finish_sample(id);
+    return;
+  }
+
+  paths[id].hit = vec4(hit.normal, hit.t);
+  paths[id].info.w = uint(hit.material);
+  enqueue(QUEUE_SHADE + materials[hit.material].type, id);
+
+#elif STAGE == STAGE_SHADE
+
+  // scatters the paths that hit a material of type u_shade_queue, all invocations of a
+  // pass take the same branch of scatter
+  uint queue = QUEUE_SHADE + u_shade_queue;
+  if (queues[queue].count <= index) {
+    return;
+  }
+
+  uint id = queue_item(queue, index);
+  seed = paths[id].seed;
+
+  Ray ray = Ray(paths[id].origin.xyz, paths[id].direction.xyz);
+
+  HitInfo hit;
+  hit.t = paths[id].hit.w;
+  hit.point = ray.origin + ray.direction * hit.t;
+  hit.normal = paths[id].hit.xyz;
+  hit.material = int(paths[id].info.w);
+
+  vec3 throughput = paths[id].throughput.rgb;
+  vec3 radiance = paths[id].radiance.rgb;
+  float pdf = paths[id].throughput.w;
+  sample_dimensions(paths[id].info.z + 1u);
+  // the shadow ray of next event estimation is traced right here, not queued
+  bool alive = scatter(ray, hit, paths[id].info.z, throughput, radiance, pdf) && survives(throughput, paths[id].info.z);
+
+  if (u_count_rays && 0u < light_rays) {
+    atomicAdd(shadow_ray_count, light_rays);
+  }
+
+  paths[id].origin = vec4(ray.origin, 0.0);
+  paths[id].direction = vec4(ray.direction, 0.0);
+  paths[id].throughput = vec4(throughput, pdf);
+  paths[id].radiance = vec4(radiance, 0.0);
+  paths[id].seed = seed;
+  paths[id].info.z++;
+
+  if (alive && paths[id].info.z < u_max_bounce) {
+    enqueue(QUEUE_EXTEND, id);
+  } else {
+    finish_sample(id);
+  }
+
+#elif STAGE == STAGE_QUEUES
+
+  // a single invocation between the passes: the queues the next pass reads drop the items
+  // of their last pass and take everything appended since, and get their dispatch size
+  if (index != 0u) {
+    return;
+  }
+
+  uint begin = (u_queue_phase == QUEUE_EXTEND) ? QUEUE_EXTEND : QUEUE_SHADE;
+  uint end = (u_queue_phase == QUEUE_EXTEND) ? QUEUE_SHADE : QUEUE_COUNT;
+
+  for (uint q = begin; q < end; q++) {
+    queues[q].first += queues[q].count;
+    queues[q].count = queues[q].tail - queues[q].first;
+    queues[q].groups_x = (queues[q].count + WAVEFRONT_GROUP_SIZE - 1u) / WAVEFRONT_GROUP_SIZE;
+    queues[q].groups_y = 1u;
+    queues[q].groups_z = 1u;
+  }
+
+  if (u_count_rays && u_queue_phase == QUEUE_EXTEND) {
+    ray_count += queues[QUEUE_EXTEND].count;
+  }
+
+#endif
+}
+
+#endif
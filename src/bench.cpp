@@ -0,0 +1,1748 @@
+#include "scene.h"
+#include "kdtree.h"
+#include "bvh.h"
+#include "lbvh.h"
+#include "sbvh.h"
+#include "compact.h"
+#include "wide.h"
+#include "cache.h"
+#include "grid.h"
+#include "cpu_tracer.h"
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <tiny_obj_loader.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+
+// heap usage of the process, tracked through the global allocation functions below
+static std::atomic<size_t> g_allocated{0};
+static std::atomic<size_t> g_peak{0};
+
+// every allocation is prefixed with its size, 16 bytes keep the default alignment
+constexpr size_t HEADER = 16;
+
+void* operator new(size_t size)
+{
+  void* block = std::malloc(size + HEADER);
+  if (!block) throw std::bad_alloc();
+
+  *static_cast<size_t*>(block) = size;
+
+  size_t current = g_allocated += size;
+  size_t peak = g_peak.load();
+  while (current > peak && !g_peak.compare_exchange_weak(peak, current)) {}
+
+  return static_cast<char*>(block) + HEADER;
+}
+
+void operator delete(void* ptr) noexcept
+{
+  if (!ptr) return;
+  void* block = static_cast<char*>(ptr) - HEADER;
+  g_allocated -= *static_cast<size_t*>(block);
+  std::free(block);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+  operator delete(ptr);
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete[](void* ptr) noexcept { operator delete(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { operator delete(ptr); }
+
+struct Measurement
+{
+  double time;     // milliseconds
+  double memory;   // peak heap growth in megabytes
+};
+
+// runs fn once and reports its wall clock time and how far it raised the heap above the starting point
+Measurement measure(const std::function<void()>& fn)
+{
+  size_t baseline = g_allocated.load();
+  g_peak = baseline;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  fn();
+  auto end = std::chrono::high_resolution_clock::now();
+
+  return {
+    std::chrono::duration<double, std::milli>(end - start).count(),
+    static_cast<double>(g_peak.load() - baseline) / (1024.0 * 1024.0),
+  };
+}
+
+std::vector<Sphere> random_spheres(size_t count, uint seed = 0)
+{
+  // constant density, so larger scenes are bigger instead of more crowded
+  float extent = 10.0f * std::cbrt(static_cast<float>(count));
+
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> position(-extent, +extent);
+  std::uniform_real_distribution<float> radius(0.5f, 2.0f);
+
+  std::vector<Sphere> spheres;
+  spheres.reserve(count);
+
+  for (size_t i = 0; i < count; i++)
+    spheres.push_back(Sphere({position(rng), position(rng), position(rng)}, radius(rng)));
+
+  return spheres;
+}
+
+void report(const char* name, const BuildStats& stats, const Measurement& m)
+{
+  printf("%-14s %10u %10u %12u %10.2f %10.1f %10.1f\n", name, stats.primitives, stats.references,
+    stats.nodes, stats.sah_cost, m.time, m.memory);
+}
+
+// builds every tree type over the same scene and reports its cost
+void bench_build(const std::vector<size_t>& sizes)
+{
+  printf("%-14s %10s %10s %12s %10s %10s %10s\n", "builder", "primitives", "references", "nodes", "sah", "time ms", "peak MB");
+
+  for (size_t size : sizes)
+  {
+    auto spheres = random_spheres(size);
+    BuildStats stats;
+
+    Measurement kd = measure([&]() { stats = KdTree<Sphere, 8, 24>(spheres).stats(); });
+    report("kdtree", stats, kd);
+
+    Measurement bvh = measure([&]() { stats = BVH<Sphere>(spheres).stats(); });
+    report("bvh", stats, bvh);
+
+    Measurement sbvh = measure([&]() { stats = SBVH<Sphere>(spheres).stats(); });
+    report("sbvh", stats, sbvh);
+
+    Measurement lbvh30 = measure([&]() { stats = LBVH<Sphere, uint32_t>(spheres).stats(); });
+    report("lbvh 30 bit", stats, lbvh30);
+
+    Measurement lbvh63 = measure([&]() { stats = LBVH<Sphere, uint64_t>(spheres).stats(); });
+    report("lbvh 63 bit", stats, lbvh63);
+
+    LBVHParams params;
+    params.treelet_size = 7;
+    Measurement treelet = measure([&]() { stats = LBVH<Sphere, uint64_t>(spheres, params).stats(); });
+    report("lbvh treelets", stats, treelet);
+  }
+}
+
+template <class T>
+bool identical(const std::vector<T>& a, const std::vector<T>& b)
+{
+  return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+// build time per thread count, and whether the flattened nodes match the single threaded build
+void bench_threads(const std::vector<size_t>& sizes)
+{
+  uint max_threads = thread_count();
+
+  printf("%-8s %10s %8s %10s %8s %10s\n", "builder", "primitives", "threads", "time ms", "speedup", "identical");
+
+  for (size_t size : sizes)
+  {
+    auto spheres = random_spheres(size);
+
+    std::vector<KdNode> kd_reference, bvh_reference;
+    double kd_serial = 0.0, bvh_serial = 0.0;
+
+    for (uint threads = 1; threads <= max_threads; threads *= 2)
+    {
+      KdTree<Sphere, 8, 24> kd(spheres, 0, threads);
+      if (threads == 1) {
+        kd_reference = kd.nodes();
+        kd_serial = kd.stats().build_time;
+      }
+
+      printf("%-8s %10zu %8u %10.1f %8.2f %10s\n", "kdtree", size, threads, kd.stats().build_time,
+        kd_serial / kd.stats().build_time, identical(kd.nodes(), kd_reference) ? "yes" : "NO");
+
+      BVHParams params;
+      params.threads = threads;
+
+      BVH<Sphere> bvh(spheres, params);
+      if (threads == 1) {
+        bvh_reference = bvh.nodes();
+        bvh_serial = bvh.stats().build_time;
+      }
+
+      printf("%-8s %10zu %8u %10.1f %8.2f %10s\n", "bvh", size, threads, bvh.stats().build_time,
+        bvh_serial / bvh.stats().build_time, identical(bvh.nodes(), bvh_reference) ? "yes" : "NO");
+    }
+  }
+}
+
+// moves every sphere a little per frame and compares refitting the first tree against
+// rebuilding it, the sah ratio shows how far the refitted tree degrades
+void bench_refit(const std::vector<size_t>& sizes, uint frames = 30)
+{
+  printf("%-10s %6s %10s %10s %10s %10s %10s\n", "primitives", "frame", "refit ms", "rebuild ms", "refit sah", "build sah", "changed");
+
+  for (size_t size : sizes)
+  {
+    auto spheres = random_spheres(size);
+
+    BVH<Sphere> bvh(spheres);
+    std::vector<KdNode> nodes = bvh.nodes();
+    const std::vector<uint>& indices = bvh.indices();
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> step(-1.0f, 1.0f);
+    std::vector<glm::vec3> velocity(size);
+    for (glm::vec3& v : velocity)
+      v = glm::vec3(step(rng), step(rng), step(rng));
+
+    for (uint frame = 1; frame <= frames; frame++)
+    {
+      for (size_t i = 0; i < size; i++)
+        spheres[i].center += velocity[i];
+
+      std::vector<uint> changed;
+      Measurement refitted = measure([&]() {
+        changed = refit(nodes, [&](const KdNode& node, AABB& box) {
+          for (uint i = node.offset; i < node.offset + leaf_count(node); i++)
+            grow(box, spheres[indices[i]].bounds());
+          return true;
+        });
+      });
+
+      if (frame % 5 != 0 && frame != 1)
+        continue;
+
+      BuildStats rebuilt;
+      Measurement rebuild = measure([&]() { rebuilt = BVH<Sphere>(spheres).stats(); });
+
+      printf("%-10zu %6u %10.2f %10.2f %10.2f %10.2f %10zu\n", size, frame, refitted.time, rebuild.time,
+        sah_cost(nodes), rebuilt.sah_cost, changed.size());
+    }
+  }
+}
+
+// distance to the sphere along the ray like sphere_intersect in the shader, INFINITY on a miss
+float hit_sphere(const Ray& ray, const Sphere& sphere)
+{
+  glm::vec3 op = sphere.center - ray.origin;
+  float b = glm::dot(op, ray.direction);
+  float det = b * b - glm::dot(op, op) + sphere.radius * sphere.radius;
+  if (det < 0.0f)
+    return INFINITY;
+
+  det = std::sqrt(det);
+  if (0.001f < b - det) return b - det;
+  if (0.001f < b + det) return b + det;
+  return INFINITY;
+}
+
+struct Traversal
+{
+  float t = INFINITY;
+  uint visits = 0; // boxes tested
+};
+
+Traversal closest_full(const std::vector<KdNode>& nodes, const std::vector<Sphere>& spheres, const Ray& ray)
+{
+  Traversal result;
+  uint stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (0 < top)
+  {
+    const KdNode& node = nodes[stack[--top]];
+    result.visits++;
+
+    if (!intersect(&ray, &node))
+      continue;
+
+    if (is_leaf(node))
+    {
+      for (uint i = node.offset; i < node.offset + leaf_count(node); i++)
+        result.t = glm::min(result.t, hit_sphere(ray, spheres[i]));
+    }
+    else
+    {
+      stack[top++] = node.left;
+      stack[top++] = node.right;
+    }
+  }
+
+  return result;
+}
+
+template <uint BITS>
+Traversal closest_compact(const std::vector<uint>& words, const std::vector<Sphere>& spheres, const Ray& ray)
+{
+  using Nodes = CompactNodes<BITS>;
+
+  Traversal result;
+  uint stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (0 < top)
+  {
+    const uint* node = words.data() + stack[--top] * Nodes::STRIDE;
+
+    for (uint c = 0; c < 2; c++)
+    {
+      uint child = Nodes::child_id(node, c);
+      if (child == INVALID)
+        continue;
+
+      AABB box = Nodes::child_bounds(node, c);
+      result.visits++;
+
+      if (!intersect(&ray, &box))
+        continue;
+
+      uint count = Nodes::child_count(node, c);
+      if (count == 0)
+        stack[top++] = child;
+
+      for (uint i = child; i < child + count; i++)
+        result.t = glm::min(result.t, hit_sphere(ray, spheres[i]));
+    }
+  }
+
+  return result;
+}
+
+// closest hit traversal over the full and the quantized node layouts. quantized boxes only
+// grow, so they find every hit of the full layout and at times a grazing one its tight
+// boxes lose to rounding
+void bench_nodes(const std::vector<size_t>& sizes, uint ray_count = 1'000'000)
+{
+  printf("%-14s %10s %10s %10s %10s %10s %10s\n", "layout", "primitives", "nodes MB", "rays ms", "Mrays/s", "visits", "hits");
+
+  for (size_t size : sizes)
+  {
+    auto spheres = random_spheres(size);
+    BVH<Sphere> bvh(spheres);
+    const std::vector<KdNode>& nodes = bvh.nodes();
+    const std::vector<Sphere>& leaves = bvh.primitives();
+
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    glm::vec3 extent = glm::vec3(nodes[0].max - nodes[0].min) * 0.5f;
+    glm::vec3 center = centroid(nodes[0]);
+
+    std::vector<Ray> rays(ray_count);
+    for (Ray& ray : rays)
+    {
+      ray.origin = center + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+      ray.direction = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + glm::vec3(1e-6f));
+    }
+
+    std::vector<uint> roots = { 0 };
+    auto words16 = CompactNodes<16>::encode(nodes, roots);
+    auto words8 = CompactNodes<8>::encode(nodes, roots = { 0 });
+
+    auto run = [&](const char* name, size_t bytes, auto&& traverse) {
+      std::atomic<uint64_t> visits{0};
+      std::atomic<uint> hits{0};
+
+      Measurement m = measure([&]() {
+        parallel_chunks(0, ray_count, thread_count(), [&](uint, uint begin, uint end) {
+          uint64_t local = 0;
+          uint local_hits = 0;
+          for (uint i = begin; i < end; i++)
+          {
+            Traversal r = traverse(rays[i]);
+            local += r.visits;
+            local_hits += (r.t < INFINITY) ? 1 : 0;
+          }
+          visits += local;
+          hits += local_hits;
+        });
+      });
+
+      printf("%-14s %10zu %10.1f %10.1f %10.2f %10.1f %10u\n", name, size, bytes / (1024.0 * 1024.0), m.time,
+        ray_count / (m.time * 1000.0), static_cast<double>(visits) / ray_count, hits.load());
+    };
+
+    run("full", nodes.size() * sizeof(KdNode), [&](const Ray& r) { return closest_full(nodes, leaves, r); });
+    run("quantized 16", words16.size() * sizeof(uint), [&](const Ray& r) { return closest_compact<16>(words16, leaves, r); });
+    run("quantized 8", words8.size() * sizeof(uint), [&](const Ray& r) { return closest_compact<8>(words8, leaves, r); });
+  }
+}
+
+// ordered closest hit traversal of the binary tree against its 4 and 8 wide collapses,
+// width 2 is the binary tree in the same layout
+template <uint WIDTH>
+void bench_width(const std::vector<KdNode>& nodes, const std::vector<Sphere>& leaves, const std::vector<Ray>& rays)
+{
+  std::vector<uint> roots = { 0 };
+  WideBVH<WIDTH> wide(nodes, roots);
+
+  std::atomic<uint64_t> visits{0};
+  std::atomic<uint> hits{0};
+
+  Measurement m = measure([&]() {
+    parallel_chunks(0, static_cast<uint>(rays.size()), thread_count(), [&](uint, uint begin, uint end) {
+      uint64_t local_visits = 0;
+      uint local_hits = 0;
+
+      for (uint i = begin; i < end; i++)
+      {
+        float t = INFINITY;
+        local_visits += traverse_closest(wide.nodes(), rays[i], t, [&](uint offset, uint count, PrimitiveType, float& t) {
+          for (uint k = offset; k < offset + count; k++)
+            t = glm::min(t, hit_sphere(rays[i], leaves[k]));
+        });
+        local_hits += (t < INFINITY) ? 1 : 0;
+      }
+
+      visits += local_visits;
+      hits += local_hits;
+    });
+  });
+
+  printf("%-6u %10zu %10zu %10.2f %10.1f %10.2f %10.2f %10u\n", WIDTH, leaves.size(), wide.nodes().size(),
+    wide.occupancy(), wide.nodes().size() * sizeof(WideNode<WIDTH>) / (1024.0 * 1024.0),
+    rays.size() / (m.time * 1000.0), static_cast<double>(visits) / rays.size(), hits.load());
+}
+
+void bench_wide(const std::vector<size_t>& sizes, uint ray_count = 1'000'000)
+{
+  printf("%-6s %10s %10s %10s %10s %10s %10s %10s\n", "width", "primitives", "nodes", "occupancy", "nodes MB", "Mrays/s", "visits", "hits");
+
+  for (size_t size : sizes)
+  {
+    auto spheres = random_spheres(size);
+    BVH<Sphere> bvh(spheres);
+
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    const KdNode& root = bvh.nodes()[0];
+    glm::vec3 extent = glm::vec3(root.max - root.min) * 0.5f;
+
+    std::vector<Ray> rays(ray_count);
+    for (Ray& ray : rays)
+    {
+      ray.origin = centroid(root) + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+      ray.direction = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + glm::vec3(1e-6f));
+    }
+
+    bench_width<2>(bvh.nodes(), bvh.primitives(), rays);
+    bench_width<4>(bvh.nodes(), bvh.primitives(), rays);
+    bench_width<8>(bvh.nodes(), bvh.primitives(), rays);
+  }
+}
+
+// triangles of an obj file in the order Renderer::load_obj returns them
+std::vector<Triangle> load_triangles(const std::string& path)
+{
+  tinyobj::attrib_t attributes;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warning, error;
+
+  if (!tinyobj::LoadObj(&attributes, &shapes, &materials, &warning, &error, path.c_str()))
+  {
+    fprintf(stderr, "tinyobj: %s%s\n", warning.c_str(), error.c_str());
+    return {};
+  }
+
+  std::vector<glm::vec4> vertices;
+  for (const tinyobj::shape_t& shape : shapes)
+  {
+    for (const tinyobj::index_t& idx : shape.mesh.indices)
+    {
+      const float* v = &attributes.vertices[3 * idx.vertex_index];
+      vertices.push_back(glm::vec4(v[0], v[1], v[2], 1.0f));
+    }
+  }
+
+  return to_triangles(vertices);
+}
+
+// triangle_intersect of the shader on the raw vertices
+float hit_triangle(const Ray& ray, const Triangle& triangle)
+{
+  glm::vec3 v0(triangle.v[0]), v1(triangle.v[1]), v2(triangle.v[2]);
+  glm::vec3 center_v = glm::cross(ray.direction, ray.origin);
+
+  glm::vec3 normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+  float q = glm::dot(ray.direction, normal);
+
+  if (glm::dot(v1 - v0, center_v) + glm::dot(glm::cross(v1, v0), ray.direction) > 0.0f &&
+      glm::dot(v2 - v1, center_v) + glm::dot(glm::cross(v2, v1), ray.direction) > 0.0f &&
+      glm::dot(v0 - v2, center_v) + glm::dot(glm::cross(v0, v2), ray.direction) > 0.0f)
+    return -glm::dot(ray.origin - v0, normal) / q;
+
+  return INFINITY;
+}
+
+// triangle_record_intersect of the shader, moment is cross(direction, origin) of the ray
+float hit_record(const Ray& ray, const glm::vec3& moment, const TriangleRecord& record)
+{
+  for (int k = 0; k < 3; k++)
+  {
+    if (glm::dot(glm::vec3(record.edge[k]), moment) + glm::dot(glm::vec3(record.moment[k]), ray.direction) < 0.0f)
+      return INFINITY;
+  }
+
+  return (record.moment[0].w - glm::dot(record.normal(), ray.origin)) / glm::dot(record.normal(), ray.direction);
+}
+
+// raw vertices against precomputed records, every ray is tested against every triangle of
+// the mesh so the time is spent in the intersection alone. edge rays aim at a point on a
+// random edge of the closed mesh, each of them has to hit something, leaks count those
+// that fall through between two triangles
+void bench_triangles(const std::vector<size_t>& sizes)
+{
+  printf("%-14s %-12s %10s %10s %10s %10s %10s\n", "mesh", "layout", "triangles", "bytes", "ns/test", "hits", "leaks");
+
+  for (const char* path : {"assets/models/icosphere.obj", "assets/models/cube.obj"})
+  {
+    std::vector<Triangle> triangles = load_triangles(path);
+    if (triangles.empty())
+      continue;
+
+    std::vector<TriangleRecord> records(triangles.begin(), triangles.end());
+
+    AABB box = empty_aabb();
+    for (const Triangle& triangle : triangles)
+      grow(box, triangle.bounds());
+
+    glm::vec3 center = centroid(box);
+    glm::vec3 extent = glm::vec3(box.max - box.min) * 0.5f;
+    float radius = 4.0f * glm::length(extent);
+
+    for (size_t ray_count : sizes)
+    {
+      std::mt19937 rng(3);
+      std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+      std::uniform_real_distribution<float> along(0.0f, 1.0f);
+      std::uniform_int_distribution<size_t> pick(0, triangles.size() * 3 - 1);
+
+      // facing the point p, for the triangle of edge e and the neighbour sharing it
+      auto faces = [&](size_t e, const glm::vec3& p) {
+        const Triangle& triangle = triangles[e / 3];
+        glm::vec3 a(triangle.v[e % 3]), b(triangle.v[(e + 1) % 3]);
+
+        uint facing = 0;
+        for (const Triangle& other : triangles)
+        {
+          bool shares = false;
+          for (int k = 0; k < 3; k++)
+            shares |= glm::vec3(other.v[k]) == b && glm::vec3(other.v[(k + 1) % 3]) == a;
+
+          glm::vec3 n = glm::cross(glm::vec3(other.v[1] - other.v[0]), glm::vec3(other.v[2] - other.v[0]));
+          if ((&other == &triangle || shares) && 0.0f < glm::dot(n, p - glm::vec3(other.v[0])))
+            facing++;
+        }
+        return facing == 2;
+      };
+
+      // every other ray aims at an edge between two triangles facing it, not at the
+      // silhouette where it would only graze the mesh, the rest at the bounding box
+      std::vector<Ray> rays(ray_count);
+      for (size_t i = 0; i < ray_count; i++)
+      {
+        glm::vec3 origin, target;
+
+        do
+        {
+          origin = center + radius * glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + glm::vec3(1e-6f));
+          target = center + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+
+          if (i % 2 == 1)
+          {
+            size_t e = pick(rng);
+            const Triangle& triangle = triangles[e / 3];
+            glm::vec3 a(triangle.v[e % 3]), b(triangle.v[(e + 1) % 3]);
+            target = a + (b - a) * along(rng);
+
+            if (!faces(e, origin))
+              continue;
+          }
+          break;
+        } while (true);
+
+        rays[i].origin = origin;
+        rays[i].direction = glm::normalize(target - origin);
+      }
+
+      auto run = [&](const char* name, size_t bytes, auto&& closest) {
+        std::atomic<uint> hits{0}, leaks{0};
+
+        Measurement m = measure([&]() {
+          parallel_chunks(0, static_cast<uint>(ray_count), thread_count(), [&](uint, uint begin, uint end) {
+            uint local_hits = 0, local_leaks = 0;
+            for (uint i = begin; i < end; i++)
+            {
+              bool hit = closest(rays[i]) < INFINITY;
+              local_hits += hit ? 1 : 0;
+              local_leaks += (!hit && i % 2 == 1) ? 1 : 0;
+            }
+            hits += local_hits;
+            leaks += local_leaks;
+          });
+        });
+
+        double tests = static_cast<double>(ray_count) * triangles.size();
+        printf("%-14s %-12s %10zu %10zu %10.2f %10u %10u\n", std::strrchr(path, '/') + 1, name, triangles.size(),
+          bytes, m.time * 1e6 * thread_count() / tests, hits.load(), leaks.load());
+      };
+
+      run("raw", sizeof(Triangle), [&](const Ray& ray) {
+        float t = INFINITY;
+        for (const Triangle& triangle : triangles)
+        {
+          float d = hit_triangle(ray, triangle);
+          if (0.001f < d && d < t) t = d;
+        }
+        return t;
+      });
+
+      run("precomputed", sizeof(TriangleRecord), [&](const Ray& ray) {
+        float t = INFINITY;
+        glm::vec3 moment = glm::cross(ray.direction, ray.origin);
+        for (const TriangleRecord& record : records)
+        {
+          float d = hit_record(ray, moment, record);
+          if (0.001f < d && d < t) t = d;
+        }
+        return t;
+      });
+    }
+  }
+}
+
+// closest hit of the ray through a tree whose leaves hold primitive indices,
+// distance(ray, index) intersects a primitive
+template <class Distance>
+void trace(const std::vector<KdNode>& nodes, const std::vector<uint>& indices, const Ray& ray, Distance&& distance,
+  float& t, uint& visits, uint& tests)
+{
+  visits += traverse_closest(nodes, ray, t, [&](uint offset, uint count, PrimitiveType, float& tmax) {
+    for (uint i = offset; i < offset + count; i++)
+    {
+      float d = distance(ray, indices[i]);
+      if (0.001f < d && d < tmax) tmax = d;
+    }
+    tests += count;
+  });
+}
+
+// binned sah against spatial splits on a room of a few huge primitives around many small
+// ones, like setup_scene_01, with rays starting inside the room
+template <class Bounded, class Distance>
+void bench_room(const char* name, const std::vector<Bounded>& primitives, float room, uint ray_count, Distance&& distance)
+{
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+  std::vector<Ray> rays(ray_count);
+  for (Ray& ray : rays)
+  {
+    ray.origin = 0.9f * room * glm::vec3(unit(rng), unit(rng), unit(rng));
+    ray.direction = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + glm::vec3(1e-6f));
+  }
+
+  auto run = [&](const char* builder, const std::vector<KdNode>& nodes, const std::vector<uint>& indices, const BuildStats& stats) {
+    std::atomic<uint64_t> visits{0}, tests{0};
+    std::atomic<uint> hits{0};
+
+    Measurement m = measure([&]() {
+      parallel_chunks(0, ray_count, thread_count(), [&](uint, uint begin, uint end) {
+        uint local_visits = 0, local_tests = 0, local_hits = 0;
+        for (uint i = begin; i < end; i++)
+        {
+          float t = INFINITY;
+          trace(nodes, indices, rays[i], distance, t, local_visits, local_tests);
+          local_hits += (t < INFINITY) ? 1 : 0;
+        }
+        visits += local_visits;
+        tests += local_tests;
+        hits += local_hits;
+      });
+    });
+
+    printf("%-10s %-6s %10u %10u %10.2f %10.1f %10.2f %10.1f %10.1f %10u\n", name, builder, stats.primitives, stats.references,
+      stats.sah_cost, stats.build_time, ray_count / (m.time * 1000.0), static_cast<double>(visits) / ray_count,
+      static_cast<double>(tests) / ray_count, hits.load());
+  };
+
+  BVH<Bounded> bvh(primitives);
+  run("bvh", bvh.nodes(), bvh.indices(), bvh.stats());
+
+  SBVH<Bounded> sbvh(primitives);
+  run("sbvh", sbvh.nodes(), sbvh.indices(), sbvh.stats());
+}
+
+void bench_spatial(const std::vector<size_t>& sizes, uint ray_count = 1'000'000)
+{
+  printf("%-10s %-6s %10s %10s %10s %10s %10s %10s %10s %10s\n", "scene", "tree", "primitives", "references", "sah", "build ms",
+    "Mrays/s", "visits", "tests", "hits");
+
+  const float room = 16.0f, wall = 10000.0f;
+
+  for (size_t size : sizes)
+  {
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> inside(-room, room);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    // six wall spheres touching the room, like the cornell box of setup_scene_01
+    std::vector<Sphere> spheres;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      for (float side : {-1.0f, 1.0f})
+      {
+        glm::vec3 center(0.0f);
+        center[axis] = side * (room + wall);
+        spheres.push_back(Sphere(center, wall));
+      }
+    }
+    for (size_t i = 0; i < size; i++)
+      spheres.push_back(Sphere({inside(rng), inside(rng), inside(rng)}, 0.2f));
+
+    bench_room("spheres", spheres, room, ray_count, [&](const Ray& ray, uint i) { return hit_sphere(ray, spheres[i]); });
+
+    // the same room out of twelve triangles, two per wall, around small triangles
+    std::vector<glm::vec4> vertices;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      int u = (axis + 1) % 3, v = (axis + 2) % 3;
+      for (float side : {-1.0f, 1.0f})
+      {
+        glm::vec4 corner[4];
+        for (int c = 0; c < 4; c++)
+        {
+          corner[c] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+          corner[c][axis] = side * room;
+          corner[c][u] = (c == 1 || c == 2) ? room : -room;
+          corner[c][v] = (c < 2) ? -room : room;
+        }
+        // wound to face the inside, the test is one sided
+        glm::vec3 inward(0.0f);
+        inward[axis] = side;
+        Triangle probe = {{corner[0], corner[1], corner[2]}};
+        if (hit_record({glm::vec3(0.0f), inward}, glm::vec3(0.0f), TriangleRecord(probe)) == INFINITY)
+          std::swap(corner[1], corner[3]);
+        vertices.insert(vertices.end(), {corner[0], corner[1], corner[2], corner[0], corner[2], corner[3]});
+      }
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+      glm::vec3 p(inside(rng), inside(rng), inside(rng));
+      for (int k = 0; k < 3; k++)
+        vertices.push_back(glm::vec4(p + 0.3f * glm::vec3(unit(rng), unit(rng), unit(rng)), 1.0f));
+    }
+
+    std::vector<Triangle> triangles = to_triangles(vertices);
+    std::vector<TriangleRecord> records(triangles.begin(), triangles.end());
+
+    bench_room("triangles", triangles, room, ray_count, [&](const Ray& ray, uint i) {
+      return hit_record(ray, glm::cross(ray.direction, ray.origin), records[i]);
+    });
+  }
+}
+
+// time to build a tree against hashing its input and loading it back from the cache
+void bench_cache(const std::vector<size_t>& sizes)
+{
+  BuildCache cache((std::filesystem::temp_directory_path() / "pathtracer-bench-cache").string());
+
+  printf("%-10s %10s %10s %10s %10s %10s %8s %8s\n", "primitives", "MB", "build ms", "hash ms", "store ms", "load ms",
+    "match", "stale");
+
+  for (size_t size : sizes)
+  {
+    auto spheres = random_spheres(size);
+
+    std::vector<KdNode> nodes;
+    std::vector<uint> indices;
+    Measurement build = measure([&]() {
+      BVH<Sphere> bvh(spheres);
+      nodes = bvh.nodes();
+      indices = bvh.indices();
+    });
+
+    uint64_t key = 0;
+    Measurement hash = measure([&]() { key = hash_span(std::span(spheres)); });
+    Measurement store = measure([&]() { (void)cache.store(key, {as_section(nodes), as_section(indices)}); });
+
+    bool match = false;
+    Measurement load = measure([&]() {
+      if (auto entry = cache.load(key, 2))
+      {
+        std::vector<KdNode> loaded = entry->copy<KdNode>(0);
+        match = valid_tree(loaded, entry->section<uint>(1).size(), PRIMITIVE_SPHERE) && identical(loaded, nodes) &&
+          identical(entry->copy<uint>(1), indices);
+      }
+    });
+
+    // any change to the input moves it to another key
+    spheres[size / 2].radius *= 2.0f;
+    bool stale = !cache.load(hash_span(std::span(spheres)), 2).has_value();
+
+    double megabytes = (nodes.size() * sizeof(KdNode) + indices.size() * sizeof(uint)) / (1024.0 * 1024.0);
+    printf("%-10zu %10.1f %10.1f %10.2f %10.2f %10.2f %8s %8s\n", size, megabytes, build.time, hash.time, store.time,
+      load.time, match ? "yes" : "no", stale ? "yes" : "no");
+
+    std::error_code error;
+    std::filesystem::remove(cache.path(key), error);
+  }
+}
+
+// the uniform grid against the sah bvh on sphere scenes from uniform to clustered: the
+// lattice of setup_scene_03 grown to size spheres, a random cloud like random_spheres and
+// the orbiting ring of setup_scene_05. rays start anywhere inside the scene bounds.
+// differ counts rays whose closest hit is not the one of the bvh, grazing hits far away
+// that rounding puts just outside the box of their sphere, which only the grid tests
+void bench_grid(const std::vector<size_t>& sizes, uint ray_count = 1'000'000)
+{
+  printf("%-8s %-5s %10s %10s %10s %10s %10s %10s\n", "scene", "accel", "primitives", "references", "build ms",
+    "Mrays/s", "hits", "differ");
+
+  for (size_t size : sizes)
+  {
+    std::mt19937 rng(6);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    std::vector<std::pair<const char*, std::vector<Sphere>>> scenes;
+
+    std::vector<Sphere> lattice;
+    int n = static_cast<int>(std::ceil(std::cbrt(static_cast<double>(size))));
+    for (int i = 0; i < n * n * n && lattice.size() < size; i++)
+      lattice.push_back(Sphere(2.5f * glm::vec3(i % n, (i / n) % n, i / (n * n)), 1.0f));
+    scenes.emplace_back("lattice", lattice);
+
+    scenes.emplace_back("cloud", random_spheres(size));
+
+    std::vector<Sphere> orbits;
+    float ring = 10.0f * std::cbrt(static_cast<float>(size));
+    for (size_t i = 0; i < size; i++)
+    {
+      float angle = 2.0f * static_cast<float>(M_PI) * unit(rng), radius = ring * (0.25f + unit(rng));
+      orbits.push_back(Sphere({std::cos(angle) * radius, (unit(rng) - 0.5f) * ring, std::sin(angle) * radius}, 0.5f));
+    }
+    scenes.emplace_back("orbits", orbits);
+
+    for (const auto& [name, spheres] : scenes)
+    {
+      AABB bounds = empty_aabb();
+      for (const Sphere& sphere : spheres)
+        grow(bounds, sphere.bounds());
+
+      std::vector<Ray> rays(ray_count);
+      for (Ray& ray : rays)
+      {
+        glm::vec3 f(unit(rng), unit(rng), unit(rng));
+        ray.origin = glm::mix(glm::vec3(bounds.min), glm::vec3(bounds.max), f);
+        ray.direction = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) - 0.5f + glm::vec3(1e-6f));
+      }
+
+      std::vector<float> reference(ray_count);
+
+      auto run = [&](const char* accel, uint references, double build, auto&& closest) {
+        std::atomic<uint> hits{0}, differ{0};
+
+        Measurement m = measure([&]() {
+          parallel_chunks(0, ray_count, thread_count(), [&](uint, uint begin, uint end) {
+            uint local_hits = 0, local_differ = 0;
+            for (uint i = begin; i < end; i++)
+            {
+              float t = closest(rays[i]);
+              local_hits += (t < INFINITY) ? 1 : 0;
+              if (accel[0] == 'b') reference[i] = t;
+              else local_differ += (t != reference[i]) ? 1 : 0;
+            }
+            hits += local_hits;
+            differ += local_differ;
+          });
+        });
+
+        printf("%-8s %-5s %10zu %10u %10.1f %10.2f %10u %10u\n", name, accel, spheres.size(), references, build,
+          ray_count / (m.time * 1000.0), hits.load(), differ.load());
+      };
+
+      auto distance = [&](const Ray& ray, uint i) { return hit_sphere(ray, spheres[i]); };
+
+      BVH<Sphere> bvh(spheres);
+      run("bvh", bvh.stats().references, bvh.stats().build_time, [&](const Ray& ray) {
+        float t = INFINITY;
+        uint visits = 0, tests = 0;
+        trace(bvh.nodes(), bvh.indices(), ray, distance, t, visits, tests);
+        return t;
+      });
+
+      Grid<Sphere> grid(spheres);
+      run("grid", grid.stats().references, grid.stats().build_time, [&](const Ray& ray) {
+        float t = INFINITY;
+        grid.traverse(ray, t, [&](uint i) { return distance(ray, i); });
+        return t;
+      });
+    }
+  }
+}
+
+// a floor and a field of lit spheres of every material in front of the default camera at z = -35
+CpuScene sphere_field(size_t size)
+{
+  std::mt19937 rng(16);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  CpuScene scene;
+  scene.materials = {
+    Material(glm::vec3(0.8f)),
+    Material(glm::vec3(0.9f, 0.6f, 0.3f), glm::vec3(0.0f), 0.8f, SPECULAR),
+    Material(glm::vec3(1.0f), glm::vec3(0.0f), 0.0f, TRANSMISSIVE),
+    Material(glm::vec3(1.0f), glm::vec3(4.0f)),
+  };
+
+  scene.spheres.push_back(Sphere(glm::vec3(0.0f, -1010.0f, 0.0f), 1000.0f, 0));
+  float extent = 4.0f * std::sqrt(static_cast<float>(size));
+  for (size_t i = 0; i < size; i++)
+  {
+    glm::vec3 center(extent * (unit(rng) - 0.5f), -10.0f + 10.0f * unit(rng), extent * unit(rng));
+    scene.spheres.push_back(Sphere(center, 0.5f + unit(rng), static_cast<int>(rng() % 4)));
+  }
+
+  scene.lights = emissive_spheres(scene.spheres, scene.materials);
+  return scene;
+}
+
+// renders a lit sphere scene on the cpu tracer with growing thread counts, and compares the
+// mean radiance of the tree, grid and brute force paths. They trace with the same random
+// numbers, so the means only differ where the accelerations report another closest hit
+void bench_cpu(const std::vector<size_t>& sizes, int width = 256, int height = 192, int frames = 4)
+{
+  printf("%-10s %-6s %8s %10s %10s %8s %12s\n", "primitives", "accel", "threads", "time ms", "Mpaths/s", "speedup",
+    "mean");
+
+  for (size_t size : sizes)
+  {
+    CpuScene scene = sphere_field(size);
+    BVH<Sphere> bvh(scene.spheres);
+    Grid<Sphere> grid(scene.spheres);
+
+    Camera camera(glm::vec3(0.0f, 0.0f, -35.0f), 33.0f);
+    TraceSettings settings;
+    settings.background = glm::vec3(0.52f, 0.80f, 0.92f);
+    settings.use_dof = false;
+
+    auto render = [&](const char* accel, uint threads) {
+      CpuTracer tracer(width, height, threads);
+      tracer.set_scene(scene);
+
+      Measurement m = measure([&]() {
+        for (int frame = 0; frame < frames; frame++)
+        {
+          settings.frames = frame;
+          settings.random = frame;
+          settings.reset = frame == 0;
+          tracer.render(camera, settings);
+        }
+      });
+
+      double mean = 0.0;
+      for (const glm::vec4& pixel : tracer.image())
+        mean += (pixel.x + pixel.y + pixel.z) / 3.0;
+      mean /= tracer.image().size();
+
+      double paths = static_cast<double>(width) * height * settings.samples * frames;
+      printf("%-10zu %-6s %8u %10.1f %10.2f", size, accel, tracer.threads(), m.time, paths / (m.time * 1000.0));
+      return std::pair(m.time, mean);
+    };
+
+    settings.use_bvh = true;
+    scene.nodes = bvh.nodes();
+    scene.leaf_indices = bvh.indices();
+
+    double serial = 0.0;
+    for (uint threads = 1; threads <= thread_count(); threads *= 2)
+    {
+      auto [time, mean] = render("bvh", threads);
+      serial = (threads == 1) ? time : serial;
+      printf(" %8.2f %12.6f\n", serial / time, mean);
+    }
+
+    // the grid alone, laid out as grid_buffer with its cells indexing leaf_indices
+    glm::vec3 min = glm::vec3(grid.bounds().min), cell = grid.cell_size();
+    glm::uvec3 resolution = grid.resolution();
+    scene.grid = {
+      std::bit_cast<uint>(min.x), std::bit_cast<uint>(min.y), std::bit_cast<uint>(min.z), 0U,
+      std::bit_cast<uint>(cell.x), std::bit_cast<uint>(cell.y), std::bit_cast<uint>(cell.z), 0U,
+      resolution.x, resolution.y, resolution.z, 0U,
+    };
+    scene.grid.insert(scene.grid.end(), grid.cells().begin(), grid.cells().end());
+    scene.leaf_indices = grid.indices();
+    scene.nodes.clear();
+    settings.use_grid = true;
+
+    auto [grid_time, grid_mean] = render("grid", 0);
+    printf(" %8s %12.6f\n", "", grid_mean);
+
+    settings.use_bvh = settings.use_grid = false;
+    auto [brute_time, brute_mean] = render("brute", 0);
+    printf(" %8s %12.6f\n", "", brute_mean);
+  }
+}
+
+// the sphere field with a wall of triangles behind it, both in one tree like the upload
+// of Renderer::update_tree
+CpuScene sphere_wall(size_t size, const BVHParams& params = {})
+{
+  CpuScene scene = sphere_field(size);
+
+  // a wall of quads, two triangles each, with the material in w like Renderer::set_meshes
+  float extent = 4.0f * std::sqrt(static_cast<float>(size));
+  int quads = static_cast<int>(std::sqrt(static_cast<float>(size))) + 1;
+  float side = 2.0f * extent / quads;
+  for (int y = 0; y < quads; y++)
+  {
+    for (int x = 0; x < quads; x++)
+    {
+      glm::vec4 a(-extent + x * side, -10.0f + y * side, extent + 5.0f, static_cast<float>((x + y) % 2));
+      glm::vec4 b = a + glm::vec4(side, 0.0f, 0.0f, 0.0f), c = a + glm::vec4(0.0f, side, 0.0f, 0.0f);
+      glm::vec4 d = a + glm::vec4(side, side, 0.0f, 0.0f);
+      Triangle lower, upper;
+      lower.v[0] = a; lower.v[1] = c; lower.v[2] = b;
+      upper.v[0] = b; upper.v[1] = c; upper.v[2] = d;
+      scene.triangles.push_back(lower);
+      scene.triangles.push_back(upper);
+    }
+  }
+
+  // one tree per primitive type joined under a root, the layout of Renderer::update_tree
+  BVH<Sphere> spheres(scene.spheres, params);
+  BVH<Triangle> triangles(scene.triangles, params);
+
+  std::vector<KdNode> sphere_nodes = spheres.nodes(), triangle_nodes;
+  tag_leaves(sphere_nodes, PRIMITIVE_SPHERE);
+  scene.leaf_indices = spheres.indices();
+  (void)append(triangle_nodes, triangles.nodes(), static_cast<uint>(scene.leaf_indices.size()));
+  tag_leaves(triangle_nodes, PRIMITIVE_TRIANGLE);
+  scene.leaf_indices.insert(scene.leaf_indices.end(), triangles.indices().begin(), triangles.indices().end());
+  scene.nodes = merge(sphere_nodes, triangle_nodes);
+  return scene;
+}
+
+// the camera rays traced one by one against packets of every simd level this cpu runs, on
+// the sphere field with a wall of triangles behind it. camera frames stop at the first hit,
+// path frames add the bounces that are always traced one by one. differ counts pixels whose
+// color is not the one of single rays
+void bench_packets(const std::vector<size_t>& sizes, int width = 512, int height = 384, int frames = 4)
+{
+  printf("%-10s %-6s %-7s %5s %10s %10s %8s %8s\n", "primitives", "frames", "simd", "lanes", "time ms", "Mrays/s",
+    "speedup", "differ");
+
+  for (size_t size : sizes)
+  {
+    CpuScene scene = sphere_wall(size);
+
+    Camera camera(glm::vec3(0.0f, 0.0f, -35.0f), 33.0f);
+
+    for (uint bounces : {1U, 5U})
+    {
+      TraceSettings settings;
+      settings.background = glm::vec3(0.52f, 0.80f, 0.92f);
+      settings.use_dof = false;
+      settings.use_bvh = true;
+      settings.max_bounce = bounces;
+
+      std::vector<glm::vec4> reference;
+      double serial = 0.0;
+
+      for (uint level = 0; level <= static_cast<uint>(detect_simd()); level++)
+      {
+        CpuTracer tracer(width, height);
+        tracer.set_scene(scene);
+        tracer.set_simd(static_cast<SimdLevel>(level));
+
+        Measurement m = measure([&]() {
+          for (int frame = 0; frame < frames; frame++)
+          {
+            settings.frames = frame;
+            settings.random = frame;
+            settings.reset = frame == 0;
+            tracer.render(camera, settings);
+          }
+        });
+
+        if (level == 0)
+        {
+          reference = tracer.image();
+          serial = m.time;
+        }
+
+        uint differ = 0;
+        for (size_t i = 0; i < reference.size(); i++)
+          differ += (tracer.image()[i] != reference[i]) ? 1 : 0;
+
+        double rays = static_cast<double>(width) * height * frames;
+        printf("%-10zu %-6s %-7s %5u %10.1f %10.2f %8.2f %8u\n", size, (bounces == 1) ? "camera" : "paths",
+          simd_name(tracer.simd()), packet_lanes(tracer.simd()), m.time, rays / (m.time * 1000.0), serial / m.time, differ);
+      }
+    }
+  }
+}
+
+// single rays through indexed leaves against the same leaves copied into structure of
+// arrays blocks, once with the default leaves and once with a cheaper intersection cost
+// for the builder, which makes larger leaves that fill the blocks. differ counts pixels
+// whose color is not the one of the indexed leaves
+void bench_leaves(const std::vector<size_t>& sizes, int width = 512, int height = 384, int frames = 4)
+{
+  printf("%-10s %-8s %-8s %8s %10s %10s %8s %8s\n", "primitives", "leaf cost", "leaves", "lanes", "time ms", "Mpaths/s",
+    "speedup", "differ");
+
+  for (size_t size : sizes)
+  {
+    for (float cost : {1.0f, 0.25f})
+    {
+      BVHParams params;
+      params.intersection_cost = cost;
+      CpuScene scene = sphere_wall(size, params);
+
+      Camera camera(glm::vec3(0.0f, 0.0f, -35.0f), 33.0f);
+      TraceSettings settings;
+      settings.background = glm::vec3(0.52f, 0.80f, 0.92f);
+      settings.use_dof = false;
+      settings.use_bvh = true;
+
+      std::vector<glm::vec4> reference;
+      double indexed = 0.0;
+
+      for (LeafFormat format : {LeafFormat::INDEXED, LeafFormat::SOA})
+      {
+        scene.leaf_format = format;
+        CpuTracer tracer(width, height);
+        tracer.set_scene(scene);
+        tracer.set_simd(SimdLevel::SCALAR);
+
+        Measurement m = measure([&]() {
+          for (int frame = 0; frame < frames; frame++)
+          {
+            settings.frames = frame;
+            settings.random = frame;
+            settings.reset = frame == 0;
+            tracer.render(camera, settings);
+          }
+        });
+
+        if (format == LeafFormat::INDEXED)
+        {
+          reference = tracer.image();
+          indexed = m.time;
+        }
+
+        uint differ = 0;
+        for (size_t i = 0; i < reference.size(); i++)
+          differ += (tracer.image()[i] != reference[i]) ? 1 : 0;
+
+        // lanes is the share of block lanes holding a primitive
+        std::vector<TriangleRecord> records(scene.triangles.begin(), scene.triangles.end());
+        float lanes = SoaLeaves(scene.nodes, scene.leaf_indices, scene.spheres, records).occupancy();
+        double paths = static_cast<double>(width) * height * frames;
+        printf("%-10zu %-8.2f %-8s %8.2f %10.1f %10.2f %8.2f %8u\n", size, cost,
+          (format == LeafFormat::SOA) ? "soa" : "indexed", lanes, m.time, paths / (m.time * 1000.0), indexed / m.time,
+          differ);
+      }
+    }
+  }
+}
+
+// root of the mean squared error of the luminance of image against reference, relative to
+// the luminance of each pixel, with pixels darker than 0.05 measured against 0.05 like the
+// convergence test of adaptive sampling
+double relative_error(const std::vector<glm::vec4>& image, const std::vector<glm::vec4>& reference)
+{
+  auto luminance = [](const glm::vec4& c) { return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z; };
+
+  double error = 0.0;
+  for (size_t i = 0; i < image.size(); i++)
+  {
+    double expected = luminance(reference[i]);
+    double difference = (luminance(image[i]) - expected) / std::max(expected, 0.05);
+    error += difference * difference;
+  }
+  return std::sqrt(error / image.size());
+}
+
+// scene with a sah bvh over its spheres
+CpuScene with_tree(CpuScene scene)
+{
+  BVH<Sphere> bvh(scene.spheres);
+  scene.nodes = bvh.nodes();
+  scene.leaf_indices = bvh.indices();
+  return scene;
+}
+
+// the camera and settings the convergence benches start from, the default view under a plain sky
+Camera bench_camera()
+{
+  return Camera(glm::vec3(0.0f, 0.0f, -35.0f), 33.0f);
+}
+
+TraceSettings bench_settings()
+{
+  TraceSettings settings;
+  settings.background = glm::vec3(0.52f, 0.80f, 0.92f);
+  settings.use_dof = false;
+  settings.use_bvh = true;
+  return settings;
+}
+
+// a run of frames from sample 0, after every frame the time of the frames so far, the error,
+// the stats summed so far and the share of the tiles the frame traced. times only count the
+// frames and not the error checks
+struct Convergence
+{
+  std::vector<double> time;
+  std::vector<double> error;
+  std::vector<FrameStats> stats;
+  std::vector<float> tiles;
+
+  // the first frame at most as far off as target, or the number of frames if none was
+  size_t reached(double target) const
+  {
+    return std::find_if(error.begin(), error.end(), [&](double e) { return e <= target; }) - error.begin();
+  }
+};
+
+// renders frames of settings from sample 0 with the random numbers first_random and up, the
+// error is measured against reference if there is one
+Convergence converge(CpuTracer& tracer, const Camera& camera, TraceSettings settings, int frames,
+  const std::vector<glm::vec4>& reference = {}, int first_random = 0)
+{
+  Convergence run;
+  FrameStats total;
+
+  for (int frame = 0; frame < frames; frame++)
+  {
+    settings.frames = frame;
+    settings.random = first_random + frame;
+    settings.reset = frame == 0;
+    double time = measure([&]() { tracer.render(camera, settings); }).time;
+
+    total.samples += tracer.stats().samples;
+    total.rays += tracer.stats().rays;
+    total.shadow_rays += tracer.stats().shadow_rays;
+
+    run.time.push_back(time + (frame ? run.time.back() : 0.0));
+    run.error.push_back(reference.empty() ? 0.0 : relative_error(tracer.image(), reference));
+    run.stats.push_back(total);
+    run.tiles.push_back(static_cast<float>(tracer.active_tiles()) / tracer.tile_count());
+  }
+  return run;
+}
+
+// a long render of settings to measure runs of up to runs frames against. the runs start at
+// sample 0, the reference continues after them with other random numbers
+std::vector<glm::vec4> reference_image(CpuTracer& tracer, const Camera& camera, const TraceSettings& settings,
+  int frames, int runs)
+{
+  converge(tracer, camera, settings, frames, {}, runs);
+  return tracer.image();
+}
+
+// the frames the benches print, powers of two from first on
+bool reported(int frame, int first = 4)
+{
+  return first <= frame + 1 && ((frame + 1) & frame) == 0;
+}
+
+// the time baseline took to get as close as run after frame, and how many times longer that is
+void print_speedup(const Convergence& baseline, const Convergence& run, int frame)
+{
+  size_t reached = baseline.reached(run.error[frame]);
+  if (reached < baseline.time.size())
+    printf(" %10.1f %8.2f\n", baseline.time[reached], baseline.time[reached] / run.time[frame]);
+  else
+    printf(" %10s %8s\n", "-", "-");
+}
+
+// renders the sphere field uniformly and with adaptive sampling, and compares the time either
+// takes to an error. at a few frame counts the error of the adaptive image is measured
+// against a long uniform reference render, uniform is the time uniform frames took to get
+// as close. tiles is the share of the tiles the last adaptive frame traced
+void bench_adaptive(const std::vector<size_t>& sizes, int width = 128, int height = 96, int reference_frames = 1024,
+  int max_frames = 512)
+{
+  printf("%-10s %-9s %8s %8s %10s %10s %10s %8s\n", "primitives", "threshold", "frames", "tiles", "time ms", "error",
+    "uniform ms", "speedup");
+
+  for (size_t size : sizes)
+  {
+    CpuTracer tracer(width, height);
+    tracer.set_scene(with_tree(sphere_field(size)));
+    Camera camera = bench_camera();
+    TraceSettings settings = bench_settings();
+
+    std::vector<glm::vec4> reference = reference_image(tracer, camera, settings, reference_frames, max_frames);
+    Convergence uniform = converge(tracer, camera, settings, max_frames, reference);
+
+    for (float threshold : {0.1f, 0.05f, 0.03f})
+    {
+      TraceSettings adaptive = settings;
+      adaptive.adaptive = true;
+      adaptive.adaptive_threshold = threshold;
+      Convergence run = converge(tracer, camera, adaptive, max_frames, reference);
+
+      for (int frame = 0; frame < max_frames; frame++)
+      {
+        if (!reported(frame, 32))
+          continue;
+
+        printf("%-10zu %-9.3f %8d %8.2f %10.1f %10.5f", size, threshold, frame + 1, run.tiles[frame], run.time[frame],
+          run.error[frame]);
+        print_speedup(uniform, run, frame);
+      }
+    }
+  }
+}
+
+// renders the sphere field with white noise and with the sobol sampler, and compares their
+// error against a long reference render at a few frame counts of one sample each. pcg
+// frames is how many frames the white noise took to get as close as sobol
+void bench_sampler(const std::vector<size_t>& sizes, int width = 128, int height = 96, int reference_frames = 1024,
+  int max_frames = 256)
+{
+  printf("%-10s %-4s %8s %10s %10s %10s %10s %10s\n", "primitives", "dof", "frames", "pcg", "sobol", "pcg frames",
+    "pcg ms", "sobol ms");
+
+  for (size_t size : sizes)
+  {
+    for (bool dof : {false, true})
+    {
+      CpuTracer tracer(width, height);
+      tracer.set_scene(with_tree(sphere_field(size)));
+      Camera camera = bench_camera();
+      camera.aperture = 0.5f;
+      camera.focal_length = 40.0f;
+      TraceSettings settings = bench_settings();
+      settings.use_dof = dof;
+
+      TraceSettings pcg = settings;
+      pcg.sampler = SamplerType::PCG;
+      TraceSettings sobol = settings;
+      sobol.sampler = SamplerType::SOBOL;
+
+      std::vector<glm::vec4> reference = reference_image(tracer, camera, pcg, reference_frames, max_frames);
+      Convergence white = converge(tracer, camera, pcg, max_frames, reference);
+      Convergence run = converge(tracer, camera, sobol, max_frames, reference);
+
+      for (int frame = 0; frame < max_frames; frame++)
+      {
+        if (!reported(frame, 1))
+          continue;
+
+        size_t reached = white.reached(run.error[frame]);
+        printf("%-10zu %-4s %8d %10.5f %10.5f", size, dof ? "on" : "off", frame + 1, white.error[frame], run.error[frame]);
+        if (reached < white.error.size())
+          printf(" %10d", static_cast<int>(reached) + 1);
+        else
+          printf(" %10s", "-");
+        printf(" %10.1f %10.1f\n", white.time[frame], run.time[frame]);
+      }
+    }
+  }
+}
+
+// a floor and spheres of every material lit by a single small lamp, in the dark
+CpuScene lamp_room(size_t size)
+{
+  std::mt19937 rng(23);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  CpuScene scene;
+  scene.materials = {
+    Material(glm::vec3(0.8f)),
+    Material(glm::vec3(0.9f, 0.6f, 0.3f), glm::vec3(0.0f), 0.8f, SPECULAR),
+    Material(glm::vec3(1.0f), glm::vec3(0.0f), 0.0f, TRANSMISSIVE),
+    Material(glm::vec3(1.0f), glm::vec3(30.0f)),
+  };
+
+  scene.spheres.push_back(Sphere(glm::vec3(0.0f, -1010.0f, 0.0f), 1000.0f, 0));
+  scene.spheres.push_back(Sphere(glm::vec3(0.0f, 12.0f, 10.0f), 3.0f, 3));
+  float extent = 4.0f * std::sqrt(static_cast<float>(size));
+  for (size_t i = 0; i < size; i++)
+  {
+    glm::vec3 center(extent * (unit(rng) - 0.5f), -10.0f + 2.0f * unit(rng), extent * unit(rng));
+    scene.spheres.push_back(Sphere(center, 0.5f + unit(rng), static_cast<int>(rng() % 3)));
+  }
+
+  scene.lights = emissive_spheres(scene.spheres, scene.materials);
+  return scene;
+}
+
+// renders the sphere field and a room with one lamp with and without next event estimation,
+// and compares the time either takes to an error against a long reference render with it.
+// paths is the time the frames without light sampling took to get as close
+void bench_nee(const std::vector<size_t>& sizes, int width = 128, int height = 96, int reference_frames = 1024,
+  int max_frames = 256)
+{
+  printf("%-6s %-10s %8s %10s %10s %10s %10s %8s\n", "scene", "primitives", "frames", "paths", "nee", "nee ms",
+    "paths ms", "speedup");
+
+  for (size_t size : sizes)
+  {
+    for (bool room : {false, true})
+    {
+      CpuTracer tracer(width, height);
+      tracer.set_scene(with_tree(room ? lamp_room(size) : sphere_field(size)));
+      Camera camera = bench_camera();
+      TraceSettings settings = bench_settings();
+      if (room)
+        settings.background = glm::vec3(0.0f);
+
+      TraceSettings paths = settings;
+      paths.use_nee = false;
+
+      std::vector<glm::vec4> reference = reference_image(tracer, camera, settings, reference_frames, max_frames);
+      Convergence baseline = converge(tracer, camera, paths, max_frames, reference);
+      Convergence run = converge(tracer, camera, settings, max_frames, reference);
+
+      for (int frame = 0; frame < max_frames; frame++)
+      {
+        if (!reported(frame))
+          continue;
+
+        printf("%-6s %-10zu %8d %10.5f %10.5f %10.1f", room ? "room" : "field", size, frame + 1, baseline.error[frame],
+          run.error[frame], run.time[frame]);
+        print_speedup(baseline, run, frame);
+      }
+    }
+  }
+}
+
+// a pile of large dark diffuse and glossy spheres on a floor under the sky, paths that enter
+// it bounce between the spheres and lose most of their throughput before they get out
+CpuScene sphere_pile(size_t size)
+{
+  std::mt19937 rng(31);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+  CpuScene scene;
+  scene.materials = {
+    Material(glm::vec3(0.8f)),
+    Material(glm::vec3(0.3f)),
+    Material(glm::vec3(0.35f, 0.3f, 0.25f), glm::vec3(0.0f), 0.6f, SPECULAR),
+  };
+
+  scene.spheres.push_back(Sphere(glm::vec3(0.0f, -1010.0f, 0.0f), 1000.0f, 0));
+  float extent = 2.0f * std::cbrt(static_cast<float>(size));
+  for (size_t i = 0; i < size; i++)
+  {
+    glm::vec3 center(extent * (unit(rng) - 0.5f), -10.0f + extent * unit(rng), extent * unit(rng));
+    scene.spheres.push_back(Sphere(center, 1.0f + 1.5f * unit(rng), 1 + static_cast<int>(rng() % 2)));
+  }
+
+  return scene;
+}
+
+// renders the sphere field and the sphere pile with up to 20 bounces, with paths that run
+// until they escape against paths ended by russian roulette, and compares the time either
+// takes to an error against a long reference render. length is the average number of
+// closest hits per path, rays the closest hits and shadow rays traced per second
+void bench_roulette(const std::vector<size_t>& sizes, int width = 128, int height = 96, int reference_frames = 512,
+  int max_frames = 128)
+{
+  printf("%-6s %-10s %8s %8s %8s %8s %8s %8s %10s %8s\n", "scene", "primitives", "frames", "length", "rays",
+    "error", "length", "rays", "full ms", "speedup");
+
+  // millions of closest hits and shadow rays per second over the frames so far
+  auto rate = [](const Convergence& run, int frame) {
+    return (run.stats[frame].rays + run.stats[frame].shadow_rays) / (run.time[frame] * 1000.0);
+  };
+
+  for (size_t size : sizes)
+  {
+    for (bool pile : {false, true})
+    {
+      CpuTracer tracer(width, height);
+      tracer.set_scene(with_tree(pile ? sphere_pile(size) : sphere_field(size)));
+      Camera camera = bench_camera();
+      TraceSettings settings = bench_settings();
+      settings.max_bounce = 20;
+
+      TraceSettings full = settings;
+      full.roulette = false;
+
+      std::vector<glm::vec4> reference = reference_image(tracer, camera, settings, reference_frames, max_frames);
+      Convergence baseline = converge(tracer, camera, full, max_frames, reference);
+      Convergence run = converge(tracer, camera, settings, max_frames, reference);
+
+      int last = max_frames - 1;
+      for (int frame = 0; frame < max_frames; frame++)
+      {
+        if (!reported(frame))
+          continue;
+
+        printf("%-6s %-10zu %8d %8.2f %8.2f %8.5f %8.2f %8.2f", pile ? "pile" : "field", size, frame + 1,
+          baseline.stats[last].path_length(), rate(baseline, last), run.error[frame], run.stats[frame].path_length(),
+          rate(run, frame));
+        print_speedup(baseline, run, frame);
+      }
+    }
+  }
+}
+
+// a sky that brightens towards the zenith over a dark ground, with a sun disc of the given
+// radiance. 1 is as bright as the png faces get, the sky is then mostly smooth
+Cubemap sun_sky(int size, float sun)
+{
+  const glm::vec3 sun_direction = glm::normalize(glm::vec3(0.5f, 0.7f, -0.5f));
+
+  Cubemap sky;
+  for (int f = 0; f < 6; f++)
+  {
+    Cubemap::Face& face = sky.faces[f];
+    face.width = face.height = size;
+    face.texels.resize(static_cast<size_t>(size) * size);
+
+    for (int y = 0; y < size; y++)
+    {
+      for (int x = 0; x < size; x++)
+      {
+        glm::vec3 d = glm::normalize(Cubemap::direction(f, (2.0f * x + 1.0f) / size - 1.0f, (2.0f * y + 1.0f) / size - 1.0f));
+        glm::vec3 color = (d.y < 0.0f) ? glm::vec3(0.2f, 0.18f, 0.15f)
+                                       : glm::mix(glm::vec3(0.8f, 0.85f, 0.9f), glm::vec3(0.25f, 0.45f, 0.85f), d.y);
+        if (0.9994f < glm::dot(d, sun_direction))
+          color = glm::vec3(sun, sun * 0.95f, sun * 0.85f);
+        face.texels[y * size + x] = color;
+      }
+    }
+  }
+  return sky;
+}
+
+// renders the sphere pile under a sky with a dim and a bright sun, with paths that find the
+// sky only by bouncing into it against paths that sample its alias table at every diffuse
+// hit, and compares the time either takes to an error against a long reference render.
+// build is the time the table takes for the six faces
+void bench_envmap(const std::vector<size_t>& sizes, int width = 128, int height = 96, int reference_frames = 1024,
+  int max_frames = 256, int face_size = 128)
+{
+  printf("%-6s %-10s %8s %8s %10s %10s %10s %10s %8s\n", "sun", "primitives", "build ms", "frames", "paths",
+    "sampled", "sampled ms", "paths ms", "speedup");
+
+  for (size_t size : sizes)
+  {
+    for (float sun : {1.0f, 500.0f})
+    {
+      Cubemap sky = sun_sky(face_size, sun);
+      double build = measure([&]() { sky.build_distribution(); }).time;
+
+      CpuTracer tracer(width, height);
+      tracer.set_scene(with_tree(sphere_pile(size)));
+      tracer.set_envmap(sky);
+      Camera camera = bench_camera();
+      TraceSettings settings = bench_settings();
+      settings.use_envmap = true;
+
+      TraceSettings paths = settings;
+      paths.use_nee = false;
+
+      std::vector<glm::vec4> reference = reference_image(tracer, camera, settings, reference_frames, max_frames);
+      Convergence baseline = converge(tracer, camera, paths, max_frames, reference);
+      Convergence run = converge(tracer, camera, settings, max_frames, reference);
+
+      for (int frame = 0; frame < max_frames; frame++)
+      {
+        if (!reported(frame))
+          continue;
+
+        printf("%-6g %-10zu %8.1f %8d %10.5f %10.5f %10.1f", sun, size, build, frame + 1, baseline.error[frame],
+          run.error[frame], run.time[frame]);
+        print_speedup(baseline, run, frame);
+      }
+    }
+  }
+}
+
+// traces the sphere field under the sky with the sobol sampler and checks that the direction
+// and the roulette number of every bounce come from the first set of that bounce, with and
+// without sampling the lights and the sky. roulette starts at the first bounce so every
+// bounce draws it. false if any draw came from another set
+bool bench_sets(const std::vector<size_t>& sizes, int width = 64, int height = 48)
+{
+  printf("%-10s %-8s %-8s %10s %10s\n", "primitives", "lights", "envmap", "draws", "misplaced");
+
+  bool passed = true;
+  for (size_t size : sizes)
+  {
+    CpuTracer tracer(width, height);
+    tracer.set_scene(with_tree(sphere_field(size)));
+    Cubemap sky = sun_sky(32, 500.0f);
+    sky.build_distribution();
+    tracer.set_envmap(sky);
+
+    for (bool nee : {false, true})
+    {
+      for (bool envmap : {false, true})
+      {
+        Camera camera(glm::vec3(0.0f, 0.0f, -35.0f), 33.0f);
+        TraceSettings settings;
+        settings.use_bvh = true;
+        settings.use_nee = nee;
+        settings.use_envmap = envmap;
+        settings.sampler = SamplerType::SOBOL;
+        settings.max_bounce = 20;
+        settings.roulette_depth = 1;
+        settings.samples = 4;
+
+        size_t draws = 0, misplaced = 0;
+        for (int y = 0; y < height; y++)
+        {
+          for (int x = 0; x < width; x++)
+          {
+            for (const glm::uvec2& set : tracer.sample_sets(camera, settings, x, y))
+            {
+              draws++;
+              misplaced += set.x != set.y;
+            }
+          }
+        }
+
+        printf("%-10zu %-8s %-8s %10zu %10zu\n", size, nee ? "on" : "off", envmap ? "on" : "off", draws, misplaced);
+        passed = passed && misplaced == 0;
+      }
+    }
+  }
+  return passed;
+}
+
+// shadow rays from points between the spheres of the sphere wall to its lights, answered
+// by closest hits against the occlusion query that stops at the first primitive in range,
+// through the tree with both leaf formats and without it. blocked is the share of occluded
+// rays, differ counts the rays the two disagree on
+void bench_occlusion(const std::vector<size_t>& sizes, uint ray_count = 1'000'000)
+{
+  printf("%-10s %-7s %-8s %8s %10s %10s %10s %10s %8s %8s\n", "primitives", "search", "leaves", "blocked",
+    "closest ms", "any ms", "closest", "any", "speedup", "differ");
+
+  for (size_t size : sizes)
+  {
+    CpuScene scene = sphere_wall(size);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    float extent = 4.0f * std::sqrt(static_cast<float>(size));
+
+    std::vector<Ray> rays;
+    std::vector<float> t_max;
+    while (rays.size() < ray_count)
+    {
+      glm::vec3 origin(extent * (unit(rng) - 0.5f), -10.0f + 10.0f * unit(rng), extent * unit(rng));
+      const Sphere& light = scene.lights[rng() % scene.lights.size()];
+      glm::vec3 to_center = light.center - origin;
+      float distance = glm::length(to_center);
+      if (distance <= light.radius)
+        continue;
+
+      // the margin covers the precision of the sphere test far from the light, which can
+      // place the light itself in front of an exact t_max
+      rays.push_back({origin, to_center / distance});
+      t_max.push_back(distance - light.radius - 0.005f - 1e-4f * distance);
+    }
+
+    for (bool bvh : {true, false})
+    {
+      // the brute force search tests every primitive for every ray
+      if (!bvh && 10'000 < size)
+        continue;
+
+      for (LeafFormat format : {LeafFormat::INDEXED, LeafFormat::SOA})
+      {
+        if (!bvh && format == LeafFormat::SOA)
+          continue;
+
+        scene.leaf_format = format;
+        scene.meshes = {Mesh(0, static_cast<uint>(scene.triangles.size()))};
+        CpuTracer tracer(64, 64);
+        tracer.set_scene(scene);
+
+        TraceSettings settings;
+        settings.use_bvh = bvh;
+
+        std::vector<uint8_t> closest, any;
+        Measurement mc = measure([&]() { closest = tracer.occluded(rays, t_max, settings, false); });
+        Measurement ma = measure([&]() { any = tracer.occluded(rays, t_max, settings); });
+
+        size_t blocked = 0, differ = 0;
+        for (size_t i = 0; i < rays.size(); i++)
+        {
+          blocked += any[i];
+          differ += (any[i] != closest[i]) ? 1 : 0;
+        }
+
+        printf("%-10zu %-7s %-8s %8.2f %10.1f %10.1f %10.2f %10.2f %8.2f %8zu\n", size, bvh ? "tree" : "brute",
+          (format == LeafFormat::SOA) ? "soa" : "indexed", static_cast<double>(blocked) / rays.size(), mc.time, ma.time,
+          rays.size() / (mc.time * 1000.0), rays.size() / (ma.time * 1000.0), mc.time / ma.time, differ);
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  std::string name = (1 < argc) ? argv[1] : "build";
+
+  std::vector<size_t> sizes;
+  for (int i = 2; i < argc; i++)
+    sizes.push_back(std::stoull(argv[i]));
+
+  if (name == "build") {
+    bench_build(sizes.empty() ? std::vector<size_t>{1'000'000, 10'000'000} : sizes);
+  } else if (name == "threads") {
+    bench_threads(sizes.empty() ? std::vector<size_t>{1'000'000} : sizes);
+  } else if (name == "refit") {
+    bench_refit(sizes.empty() ? std::vector<size_t>{1'000'000} : sizes);
+  } else if (name == "nodes") {
+    bench_nodes(sizes.empty() ? std::vector<size_t>{1'000'000} : sizes);
+  } else if (name == "wide") {
+    bench_wide(sizes.empty() ? std::vector<size_t>{1'000'000} : sizes);
+  } else if (name == "spatial") {
+    bench_spatial(sizes.empty() ? std::vector<size_t>{100'000} : sizes);
+  } else if (name == "triangles") {
+    bench_triangles(sizes.empty() ? std::vector<size_t>{1'000'000} : sizes);
+  } else if (name == "grid") {
+    bench_grid(sizes.empty() ? std::vector<size_t>{100'000, 1'000'000} : sizes);
+  } else if (name == "cache") {
+    bench_cache(sizes.empty() ? std::vector<size_t>{1'000'000} : sizes);
+  } else if (name == "cpu") {
+    bench_cpu(sizes.empty() ? std::vector<size_t>{1'000} : sizes);
+  } else if (name == "packets") {
+    bench_packets(sizes.empty() ? std::vector<size_t>{1'000, 100'000} : sizes);
+  } else if (name == "leaves") {
+    bench_leaves(sizes.empty() ? std::vector<size_t>{1'000, 100'000} : sizes);
+  } else if (name == "adaptive") {
+    bench_adaptive(sizes.empty() ? std::vector<size_t>{1'000} : sizes);
+  } else if (name == "sampler") {
+    bench_sampler(sizes.empty() ? std::vector<size_t>{1'000} : sizes);
+  } else if (name == "roulette") {
+    bench_roulette(sizes.empty() ? std::vector<size_t>{300} : sizes);
+  } else if (name == "occlusion") {
+    bench_occlusion(sizes.empty() ? std::vector<size_t>{1'000, 100'000} : sizes);
+  } else if (name == "nee") {
+    bench_nee(sizes.empty() ? std::vector<size_t>{100} : sizes);
+  } else if (name == "envmap") {
+    bench_envmap(sizes.empty() ? std::vector<size_t>{100} : sizes);
+  } else if (name == "sets") {
+    return bench_sets(sizes.empty() ? std::vector<size_t>{100} : sizes) ? 0 : 1;
+  } else {
+    fprintf(stderr, "usage: %s [build|threads|refit|nodes|wide|triangles|spatial|grid|cache|cpu|packets|leaves|adaptive|sampler|nee|occlusion|roulette|envmap|sets] [primitive or ray counts...]\n", argv[0]);
+    return 1;
+  }
+
+  return 0;
+}
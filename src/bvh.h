@@ -0,0 +1,341 @@
+#pragma once
+
+#include "kdtree.h"
+#include "parallel.h"
+
+struct BVHParams
+{
+  uint bins = 16;                  // split candidates per axis are bins - 1
+  uint max_leaf_size = 8;          // larger ranges are always split
+  float traversal_cost = 1.0f;     // cost of visiting an interior node
+  float intersection_cost = 1.0f;  // cost of testing one primitive
+  uint threads = 0;                // 0 uses every hardware thread
+  uint task_cutoff = 4096;         // smaller subtrees are built on the calling thread
+  uint parallel_threshold = 65536; // larger ranges compute bounds and bins in parallel
+};
+
+// Bounding volume hierarchy built with the binned surface area heuristic
+// (Wald 2007, "On fast Construction of SAH-based Bounding Volume Hierarchies").
+// Produces the same flattened KdNode layout as KdTree, leaves index into primitives().
+// Subtrees are built as parallel tasks and appended in sequential order, bounds and bins
+// near the root are reduced over thread chunks, so the output does not depend on the
+// number of threads.
+template <class Bounded>
+class BVH
+{
+public:
+  static constexpr uint MAX_BINS = 64;
+
+  BVH(const std::vector<Bounded> &primitives, const BVHParams &params = {})
+    : m_params(params)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    m_params.bins = glm::clamp(m_params.bins, 2U, MAX_BINS);
+    m_params.max_leaf_size = glm::max(m_params.max_leaf_size, 1U);
+    m_params.threads = thread_count(m_params.threads);
+    m_task_depth = task_depth(m_params.threads);
+
+    uint count = static_cast<uint>(primitives.size());
+
+    m_boxes.resize(count);
+    m_centroids.resize(count);
+    m_indices.resize(count);
+
+    parallel_chunks(0, count, m_params.threads, [&](uint, uint begin, uint end) {
+      for (uint i = begin; i < end; i++)
+      {
+        m_boxes[i] = primitives[i].bounds();
+        m_centroids[i] = centroid(m_boxes[i]);
+        m_indices[i] = i;
+      }
+    });
+
+    if (0 < count)
+    {
+      m_nodes.reserve(2 * count - 1);
+      (void)construct(m_nodes, 0, count, 0);
+
+      m_primitives.assign(count, primitives[0]);
+      parallel_chunks(0, count, m_params.threads, [&](uint, uint begin, uint end) {
+        for (uint i = begin; i < end; i++)
+          m_primitives[i] = primitives[m_indices[i]];
+      });
+    }
+
+    std::vector<AABB>().swap(m_boxes);
+    std::vector<glm::vec3>().swap(m_centroids);
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    m_stats.build_time = std::chrono::duration<double, std::milli>(end - start).count();
+    m_stats.sah_cost = sah_cost(m_nodes, m_params.traversal_cost, m_params.intersection_cost);
+    m_stats.primitives = count;
+    m_stats.references = count;
+    m_stats.nodes = static_cast<uint>(m_nodes.size());
+    m_stats.leaves = static_cast<uint>(std::count_if(m_nodes.begin(), m_nodes.end(), is_leaf));
+    m_stats.depth = tree_depth(m_nodes);
+  }
+
+  const std::vector<KdNode> &nodes() const { return m_nodes; }
+  const std::vector<Bounded> &primitives() const { return m_primitives; }
+  const std::vector<uint> &indices() const { return m_indices; }
+  const BuildStats &stats() const { return m_stats; }
+
+private:
+  struct Bin
+  {
+    AABB bounds = empty_aabb();
+    uint count = 0;
+  };
+
+  // bins of all three axes, filled in a single pass over the primitives
+  struct Bins
+  {
+    Bin bin[3][MAX_BINS];
+  };
+
+  struct Split
+  {
+    int axis = -1;
+    uint bin = 0;
+    float cost = std::numeric_limits<float>::max();
+  };
+
+  BVHParams m_params;
+  BuildStats m_stats;
+  uint m_task_depth = 0;
+  std::vector<KdNode> m_nodes;
+  std::vector<Bounded> m_primitives;
+  std::vector<uint> m_indices; // input index of every entry in m_primitives
+
+  // scratch data, only alive during construction
+  std::vector<AABB> m_boxes;
+  std::vector<glm::vec3> m_centroids;
+
+  // threads available to a range at this depth, if it is large enough to be worth splitting
+  uint workers(uint count, uint depth) const
+  {
+    if (count < m_params.parallel_threshold || depth >= 31)
+      return 1;
+    return glm::max(1U, m_params.threads >> depth);
+  }
+
+  uint bin_index(const glm::vec3 &c, int axis, const AABB &centroid_bounds, float scale) const
+  {
+    uint bin = static_cast<uint>((c[axis] - centroid_bounds.min[axis]) * scale);
+    return glm::min(bin, m_params.bins - 1);
+  }
+
+  void compute_bounds(uint begin, uint end, AABB &bounds, AABB &centroid_bounds) const
+  {
+    bounds = empty_aabb();
+    centroid_bounds = empty_aabb();
+
+    for (uint i = begin; i < end; i++)
+    {
+      grow(bounds, m_boxes[m_indices[i]]);
+      grow(centroid_bounds, m_centroids[m_indices[i]]);
+    }
+  }
+
+  void compute_bins(uint begin, uint end, const AABB &centroid_bounds, const glm::vec3 &scale, Bins &bins) const
+  {
+    for (uint i = begin; i < end; i++)
+    {
+      uint id = m_indices[i];
+
+      for (int axis = 0; axis < 3; axis++)
+      {
+        if (scale[axis] <= 0.0f)
+          continue;
+
+        Bin &b = bins.bin[axis][bin_index(m_centroids[id], axis, centroid_bounds, scale[axis])];
+        b.count++;
+        grow(b.bounds, m_boxes[id]);
+      }
+    }
+  }
+
+  Split find_split(uint begin, uint end, uint threads, const AABB &bounds, const AABB &centroid_bounds) const
+  {
+    Split best;
+
+    float area = surface_area(bounds);
+    float inv_area = 0.0f < area ? 1.0f / area : 0.0f;
+    const uint bins = m_params.bins;
+
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+      scale[axis] = (0.0f < extent) ? static_cast<float>(bins) / extent : 0.0f;
+    }
+
+    Bins total;
+
+    if (1 < threads)
+    {
+      std::vector<Bins> partial(threads);
+      parallel_chunks(begin, end, threads, [&](uint chunk, uint b, uint e) {
+        compute_bins(b, e, centroid_bounds, scale, partial[chunk]);
+      });
+
+      for (const Bins &p : partial)
+      {
+        for (int axis = 0; axis < 3; axis++)
+        {
+          for (uint k = 0; k < bins; k++)
+          {
+            total.bin[axis][k].count += p.bin[axis][k].count;
+            grow(total.bin[axis][k].bounds, p.bin[axis][k].bounds);
+          }
+        }
+      }
+    }
+    else
+    {
+      compute_bins(begin, end, centroid_bounds, scale, total);
+    }
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      if (scale[axis] <= 0.0f)
+        continue;
+
+      const Bin *bin = total.bin[axis];
+
+      // sweep from the right, then evaluate every plane while sweeping from the left
+      float right_area[MAX_BINS];
+      uint right_count[MAX_BINS];
+
+      AABB acc = empty_aabb();
+      uint n = 0;
+
+      for (uint k = bins - 1; k > 0; k--)
+      {
+        grow(acc, bin[k].bounds);
+        n += bin[k].count;
+        right_area[k] = surface_area(acc);
+        right_count[k] = n;
+      }
+
+      acc = empty_aabb();
+      n = 0;
+
+      for (uint k = 0; k < bins - 1; k++)
+      {
+        grow(acc, bin[k].bounds);
+        n += bin[k].count;
+
+        if (n == 0 || right_count[k + 1] == 0)
+          continue;
+
+        float cost = m_params.traversal_cost + m_params.intersection_cost * inv_area *
+          (surface_area(acc) * n + right_area[k + 1] * right_count[k + 1]);
+
+        if (cost < best.cost)
+        {
+          best.axis = axis;
+          best.bin = k + 1;
+          best.cost = cost;
+        }
+      }
+    }
+
+    return best;
+  }
+
+  uint construct(std::vector<KdNode> &out, uint begin, uint end, uint depth)
+  {
+    uint count = end - begin;
+    uint threads = workers(count, depth);
+
+    AABB bounds, centroid_bounds;
+
+    if (1 < threads)
+    {
+      std::vector<AABB> partial_bounds(threads), partial_centroids(threads);
+      parallel_chunks(begin, end, threads, [&](uint chunk, uint b, uint e) {
+        compute_bounds(b, e, partial_bounds[chunk], partial_centroids[chunk]);
+      });
+
+      bounds = empty_aabb();
+      centroid_bounds = empty_aabb();
+      for (uint i = 0; i < threads; i++)
+      {
+        grow(bounds, partial_bounds[i]);
+        grow(centroid_bounds, partial_centroids[i]);
+      }
+    }
+    else
+    {
+      compute_bounds(begin, end, bounds, centroid_bounds);
+    }
+
+    uint node_id = static_cast<uint>(out.size());
+
+    KdNode node;
+    node.min = bounds.min;
+    node.max = bounds.max;
+    out.push_back(node);
+
+    Split split = find_split(begin, end, threads, bounds, centroid_bounds);
+    float leaf_cost = m_params.intersection_cost * count;
+
+    if (count == 1 || (count <= m_params.max_leaf_size && leaf_cost <= split.cost))
+    {
+      out[node_id].offset = begin;
+      out[node_id].count = count;
+      return node_id;
+    }
+
+    uint mid = begin;
+
+    if (0 <= split.axis)
+    {
+      float extent = centroid_bounds.max[split.axis] - centroid_bounds.min[split.axis];
+      float scale = static_cast<float>(m_params.bins) / extent;
+
+      auto it = std::partition(m_indices.begin() + begin, m_indices.begin() + end, [&](uint id) {
+        return bin_index(m_centroids[id], split.axis, centroid_bounds, scale) < split.bin;
+      });
+      mid = static_cast<uint>(it - m_indices.begin());
+    }
+
+    if (mid == begin || mid == end)
+    {
+      // no usable plane (e.g. coincident centroids), fall back to a median split
+      glm::vec3 extent = glm::vec3(centroid_bounds.max - centroid_bounds.min);
+      int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+
+      mid = begin + count / 2;
+      std::nth_element(m_indices.begin() + begin, m_indices.begin() + mid, m_indices.begin() + end,
+        [&](uint a, uint b) { return m_centroids[a][axis] < m_centroids[b][axis]; });
+    }
+
+    uint left, right;
+
+    if (m_params.task_cutoff <= count && depth < m_task_depth)
+    {
+      // leaf offsets are positions in m_indices and stay valid, only node ids are shifted
+      std::vector<KdNode> left_nodes, right_nodes;
+
+      std::thread worker([&]() { (void)construct(right_nodes, mid, end, depth + 1); });
+      (void)construct(left_nodes, begin, mid, depth + 1);
+      worker.join();
+
+      left = append(out, left_nodes);
+      right = append(out, right_nodes);
+    }
+    else
+    {
+      left = construct(out, begin, mid, depth + 1);
+      right = construct(out, mid, end, depth + 1);
+    }
+
+    out[node_id].left = left;
+    out[node_id].right = right;
+    return node_id;
+  }
+};
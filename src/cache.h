@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+using uint = unsigned int;
+
+// 64 bit hash of a byte range, eight bytes per step so hashing a large vertex buffer
+// stays far below the cost of building a tree over it
+inline uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0)
+{
+  const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+  const auto *bytes = static_cast<const unsigned char *>(data);
+
+  auto mix = [](uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+  };
+
+  uint64_t h = seed ^ (size * prime);
+  size_t i = 0;
+
+  for (; i + 8 <= size; i += 8)
+  {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    h = (h ^ mix(word * prime)) * prime;
+  }
+
+  // empty inputs may come with a null data, which memcpy must not see even for no bytes
+  uint64_t tail = 0;
+  if (i < size)
+    std::memcpy(&tail, bytes + i, size - i);
+  h = (h ^ mix(tail * prime)) * prime;
+
+  return mix(h);
+}
+
+template <class T, size_t N>
+uint64_t hash_span(std::span<T, N> values, uint64_t seed = 0)
+{
+  return hash_bytes(values.data(), values.size_bytes(), seed);
+}
+
+// Read only memory mapping of a whole file, bytes() is empty if it could not be mapped
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string &path)
+  {
+#if defined(_WIN32)
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+      return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+      return;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping)
+      return;
+
+    m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    m_size = m_data ? static_cast<size_t>(size.QuadPart) : 0;
+#else
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd < 0)
+      return;
+
+    struct stat info;
+    if (fstat(m_fd, &info) != 0 || info.st_size == 0)
+      return;
+
+    void *data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (data == MAP_FAILED)
+      return;
+
+    m_data = data;
+    m_size = static_cast<size_t>(info.st_size);
+#endif
+  }
+
+  ~MappedFile()
+  {
+#if defined(_WIN32)
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+    if (m_data) munmap(m_data, m_size);
+    if (0 <= m_fd) close(m_fd);
+#endif
+  }
+
+  MappedFile(MappedFile &&other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr)), m_size(std::exchange(other.m_size, 0))
+#if defined(_WIN32)
+    , m_file(std::exchange(other.m_file, INVALID_HANDLE_VALUE)), m_mapping(std::exchange(other.m_mapping, nullptr))
+#else
+    , m_fd(std::exchange(other.m_fd, -1))
+#endif
+  {
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile &operator=(MappedFile &&) = delete;
+
+  std::span<const std::byte> bytes() const { return {static_cast<const std::byte *>(m_data), m_size}; }
+
+private:
+  void *m_data = nullptr;
+  size_t m_size = 0;
+#if defined(_WIN32)
+  HANDLE m_file = INVALID_HANDLE_VALUE;
+  HANDLE m_mapping = nullptr;
+#else
+  int m_fd = -1;
+#endif
+};
+
+// Directory of build results, one binary file per key. A file is a header followed by
+// its sections, each padded to 16 bytes so they can be read in place from the mapping:
+//
+//   magic, version, section count, key, then offset and size in bytes of every section
+//
+// Keys hash the input and every setting the result depends on, so a changed input simply
+// misses and is rebuilt under its new key. Files that do not match the key, the version
+// or their own section table are treated as a miss and overwritten on the next store().
+class BuildCache
+{
+public:
+  static constexpr uint32_t MAGIC = 0x48435450; // "PTCH"
+  static constexpr uint32_t VERSION = 1;
+  static constexpr uint32_t MAX_SECTIONS = 4;
+
+  // the sections of a hit, they point into the mapping and live as long as the entry
+  class Entry
+  {
+  public:
+    explicit Entry(const std::string &path) : m_file(path) {}
+
+    template <class T>
+    std::span<const T> section(uint i) const
+    {
+      return {reinterpret_cast<const T *>(m_sections[i].data()), m_sections[i].size() / sizeof(T)};
+    }
+
+    template <class T>
+    std::vector<T> copy(uint i) const
+    {
+      std::span<const T> values = section<T>(i);
+      return {values.begin(), values.end()};
+    }
+
+  private:
+    friend class BuildCache;
+    MappedFile m_file;
+    std::vector<std::span<const std::byte>> m_sections;
+  };
+
+  // an empty directory disables the cache
+  explicit BuildCache(std::string directory = "") : m_directory(std::move(directory)) {}
+
+  bool enabled() const { return !m_directory.empty(); }
+  const std::string &directory() const { return m_directory; }
+
+  // the entry stored under key, if any, with exactly sections sections
+  std::optional<Entry> load(uint64_t key, uint sections) const
+  {
+    if (!enabled())
+      return std::nullopt;
+
+    std::optional<Entry> entry(std::in_place, path(key));
+    std::span<const std::byte> bytes = entry->m_file.bytes();
+
+    Header header;
+    if (bytes.size() < sizeof(Header))
+      return std::nullopt;
+
+    std::memcpy(&header, bytes.data(), sizeof(Header));
+    if (header.magic != MAGIC || header.version != VERSION || header.key != key || header.sections != sections)
+      return std::nullopt;
+
+    for (uint i = 0; i < sections; i++)
+    {
+      const Section &s = header.table[i];
+      if (s.offset % 16 != 0 || bytes.size() < s.offset || bytes.size() - s.offset < s.size)
+        return std::nullopt;
+
+      entry->m_sections.push_back(bytes.subspan(s.offset, s.size));
+    }
+
+    return entry;
+  }
+
+  // writes the sections under key, through a temporary file so a concurrent or
+  // interrupted run never sees a partial entry. returns false if it could not be written
+  bool store(uint64_t key, std::initializer_list<std::span<const std::byte>> sections) const
+  {
+    if (!enabled() || MAX_SECTIONS < sections.size())
+      return false;
+
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+
+    Header header;
+    header.key = key;
+    header.sections = static_cast<uint32_t>(sections.size());
+
+    uint64_t offset = padded(sizeof(Header));
+    uint i = 0;
+    for (std::span<const std::byte> bytes : sections)
+    {
+      header.table[i++] = {offset, bytes.size()};
+      offset = padded(offset + bytes.size());
+    }
+
+    // named after the process, so concurrent runs storing the same key write apart
+    std::string target = path(key);
+    std::string temporary = target + "." + std::to_string(process_id()) + ".tmp";
+
+    {
+      std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+      if (!out)
+        return false;
+
+      const char zeros[16] = {};
+      out.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+      out.write(zeros, padded(sizeof(Header)) - sizeof(Header));
+
+      for (std::span<const std::byte> bytes : sections)
+      {
+        out.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        out.write(zeros, padded(bytes.size()) - bytes.size());
+      }
+
+      if (!out)
+        return false;
+    }
+
+    std::filesystem::rename(temporary, target, error);
+    if (error)
+    {
+      std::filesystem::remove(temporary, error);
+      return false;
+    }
+
+    return true;
+  }
+
+  std::string path(uint64_t key) const
+  {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+    return (std::filesystem::path(m_directory) / name).string();
+  }
+
+private:
+  struct Section
+  {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+  };
+
+  struct Header
+  {
+    uint32_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t sections = 0;
+    uint32_t pad = 0;
+    uint64_t key = 0;
+    Section table[MAX_SECTIONS];
+  };
+
+  std::string m_directory;
+
+  static uint64_t padded(uint64_t size) { return (size + 15) & ~uint64_t(15); }
+
+  static unsigned long process_id()
+  {
+#if defined(_WIN32)
+    return GetCurrentProcessId();
+#else
+    return static_cast<unsigned long>(getpid());
+#endif
+  }
+};
+
+template <class T>
+std::span<const std::byte> as_section(const std::vector<T> &values)
+{
+  return std::as_bytes(std::span(values));
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+#include "kdtree.h"
+
+#include <bit>
+#include <cmath>
+
+// Compact encoding of a flattened tree for the gpu. Every stored node holds the boxes of
+// its two children, quantized to BITS per plane on a power of two grid over the node's
+// own box, so leaves live in their parent's child slot and only interior nodes are stored.
+// A node is a run of STRIDE uints:
+//
+//   0..2   origin xyz, float bits
+//   3      grid exponents xyz, 8 bits each, biased by 127
+//   4      leaf count | type << 14 of child 0 in the low, child 1 in the high 16 bits,
+//          0 marks an interior child
+//   5..6   child 0 and 1, node id or leaf offset, INVALID for an empty child
+//   7..    quantized min xyz, max xyz of child 0 then child 1, 32 / BITS values per uint
+//
+// decoded planes are origin + q * 2^exponent and always enclose the original box.
+template <uint BITS>
+struct CompactNodes
+{
+  static_assert(BITS == 8 || BITS == 16);
+
+  static constexpr uint QMAX = (1U << BITS) - 1;
+  static constexpr uint PER_WORD = 32 / BITS;
+  static constexpr uint HEADER = 7;
+  static constexpr uint STRIDE = HEADER + 12 / PER_WORD;
+  static constexpr uint MAX_COUNT = (1U << 14) - 1;
+
+  // rewrites roots, ids into nodes, to the matching compact node ids.
+  // roots[0] becomes node 0 as long as it is the first root
+  static std::vector<uint> encode(const std::vector<KdNode> &nodes, std::vector<uint> &roots)
+  {
+    std::vector<uint> words;
+    words.reserve(nodes.size() / 2 * STRIDE + STRIDE);
+
+    for (uint &root : roots)
+    {
+      if (root < nodes.size())
+        root = emit(nodes, words, reference(nodes, root));
+    }
+
+    return words;
+  }
+
+  static uint count(const std::vector<uint> &words)
+  {
+    return static_cast<uint>(words.size()) / STRIDE;
+  }
+
+  static AABB child_bounds(const uint *node, uint child)
+  {
+    glm::vec3 origin(std::bit_cast<float>(node[0]), std::bit_cast<float>(node[1]), std::bit_cast<float>(node[2]));
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++)
+      scale[axis] = std::bit_cast<float>(((node[3] >> (8 * axis)) & 0xff) << 23);
+
+    glm::vec3 lo, hi;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      lo[axis] = origin[axis] + static_cast<float>(quantized(node, child * 6 + axis)) * scale[axis];
+      hi[axis] = origin[axis] + static_cast<float>(quantized(node, child * 6 + 3 + axis)) * scale[axis];
+    }
+
+    return {glm::vec4(lo, 0.0f), glm::vec4(hi, 0.0f)};
+  }
+
+  static uint child_id(const uint *node, uint child) { return node[5 + child]; }
+  static uint child_count(const uint *node, uint child) { return (node[4] >> (16 * child)) & MAX_COUNT; }
+  static uint child_type(const uint *node, uint child) { return (node[4] >> (16 * child + 14)) & 3U; }
+
+private:
+  // a child slot, either an interior node of the source tree or a primitive range
+  struct Ref
+  {
+    AABB box = empty_aabb();
+    uint node = INVALID;
+    uint offset = 0, count = 0, type = 0;
+  };
+
+  static Ref reference(const std::vector<KdNode> &nodes, uint id)
+  {
+    Ref ref;
+    ref.box = nodes[id];
+
+    if (is_leaf(nodes[id]))
+    {
+      ref.offset = nodes[id].offset;
+      ref.count = leaf_count(nodes[id]);
+      ref.type = leaf_type(nodes[id]);
+    }
+    else
+    {
+      ref.node = id;
+    }
+
+    return ref;
+  }
+
+  static bool is_range(const Ref &ref) { return ref.node == INVALID; }
+
+  static uint quantized(const uint *node, uint value)
+  {
+    return (node[HEADER + value / PER_WORD] >> (BITS * (value % PER_WORD))) & QMAX;
+  }
+
+  static uint emit(const std::vector<KdNode> &nodes, std::vector<uint> &words, const Ref &ref)
+  {
+    uint id = count(words);
+    words.resize(words.size() + STRIDE, 0U);
+
+    Ref child[2];
+
+    if (!is_range(ref))
+    {
+      const KdNode &node = nodes[ref.node];
+      if (node.left != INVALID) child[0] = reference(nodes, node.left);
+      if (node.right != INVALID) child[1] = reference(nodes, node.right);
+    }
+    else if (MAX_COUNT < ref.count)
+    {
+      // too many primitives for one slot, halve the range under the same box
+      child[0] = child[1] = ref;
+      child[0].count = ref.count / 2;
+      child[1].offset = ref.offset + child[0].count;
+      child[1].count = ref.count - child[0].count;
+    }
+    else
+    {
+      // a tree that is a single leaf
+      child[0] = ref;
+    }
+
+    uint word[2] = {INVALID, INVALID};
+    uint meta = 0;
+
+    for (uint c = 0; c < 2; c++)
+    {
+      if (!is_range(child[c]) || MAX_COUNT < child[c].count)
+      {
+        word[c] = emit(nodes, words, child[c]);
+      }
+      else if (0 < child[c].count)
+      {
+        word[c] = child[c].offset;
+        meta |= (child[c].count | (child[c].type << 14)) << (16 * c);
+      }
+      else
+      {
+        child[c].box = empty_aabb();
+      }
+    }
+
+    uint *out = words.data() + id * STRIDE;
+    quantize(child, out);
+    out[4] = meta;
+    out[5] = word[0];
+    out[6] = word[1];
+    return id;
+  }
+
+  // writes the grid of the node and the child boxes snapped outwards to it
+  static void quantize(const Ref (&child)[2], uint *out)
+  {
+    AABB frame = empty_aabb();
+    for (uint c = 0; c < 2; c++)
+    {
+      if (child[c].box.min.x <= child[c].box.max.x)
+        grow(frame, child[c].box);
+    }
+
+    if (frame.max.x < frame.min.x)
+      frame = {glm::vec4(0.0f), glm::vec4(0.0f)};
+
+    uint exponents = 0;
+    float origin[3], scale[3];
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      origin[axis] = frame.min[axis];
+      float extent = frame.max[axis] - frame.min[axis];
+
+      int e = -126;
+      if (0.0f < extent)
+        e = glm::max(e, static_cast<int>(std::ceil(std::log2(extent / QMAX))));
+
+      while (e < 127 && origin[axis] + QMAX * std::ldexp(1.0f, e) < frame.max[axis])
+        e++;
+
+      scale[axis] = std::ldexp(1.0f, e);
+      exponents |= static_cast<uint>(e + 127) << (8 * axis);
+      out[axis] = std::bit_cast<uint>(origin[axis]);
+    }
+
+    out[3] = exponents;
+
+    for (uint c = 0; c < 2; c++)
+    {
+      if (child[c].box.max.x < child[c].box.min.x)
+        continue;
+
+      for (int axis = 0; axis < 3; axis++)
+      {
+        auto snap = [&](float v, bool up) {
+          float q = std::floor((v - origin[axis]) / scale[axis]);
+          if (up) q = std::ceil((v - origin[axis]) / scale[axis]);
+
+          uint i = static_cast<uint>(glm::clamp(q, 0.0f, static_cast<float>(QMAX)));
+
+          // the decoder rounds like this, step until the plane encloses v
+          while (!up && 0 < i && v < origin[axis] + i * scale[axis]) i--;
+          while (up && i < QMAX && origin[axis] + i * scale[axis] < v) i++;
+          return i;
+        };
+
+        store(out, c * 6 + axis, snap(child[c].box.min[axis], false));
+        store(out, c * 6 + 3 + axis, snap(child[c].box.max[axis], true));
+      }
+    }
+  }
+
+  static void store(uint *node, uint value, uint q)
+  {
+    node[HEADER + value / PER_WORD] |= q << (BITS * (value % PER_WORD));
+  }
+};
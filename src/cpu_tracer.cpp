@@ -0,0 +1,1435 @@
+#include "cpu_tracer.h"
+
+#include <bit>
+#include <cmath>
+
+namespace
+{
+  // the defines of raytracer.glsl
+  constexpr float PI = 3.14159265359f;
+  constexpr float EPSILON = 0.005f;
+  constexpr float INF = 1e5f;
+  constexpr int NO_HIT = -1;
+
+  constexpr uint INSTANCE_ENTER = 0x80000000u;
+  constexpr uint INSTANCE_EXIT = 0xfffffffeu;
+
+  constexpr uint SAMPLE_SET = 4;
+  constexpr uint BOUNCE_DIMENSIONS = 12;
+  constexpr uint NO_SET = 0xffffffffu;
+
+  uint32_t hash(uint32_t x)
+  {
+    uint32_t state = x * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+  }
+
+  uint32_t hash_combine(uint32_t seed, uint32_t value)
+  {
+    return seed ^ (value + (seed << 6) + (seed >> 2));
+  }
+
+  uint32_t reverse_bits(uint32_t x)
+  {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  // SOBOL_DIRECTIONS of the shader, built from the primitive polynomials and initial direction
+  // numbers of joe and kuo for the dimensions after the first, which reverses the bits
+  constexpr std::array<uint32_t, 4 * 32> sobol_directions()
+  {
+    constexpr uint degree[3] = {1, 2, 3}, coefficients[3] = {0, 1, 1};
+    constexpr uint initial[3][3] = {{1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+
+    std::array<uint32_t, 4 * 32> directions = {};
+    for (uint bit = 0; bit < 32; bit++)
+      directions[bit] = 1u << (31 - bit);
+
+    for (uint d = 0; d < 3; d++)
+    {
+      uint32_t *v = &directions[(d + 1) * 32];
+      uint s = degree[d];
+      for (uint i = 0; i < s; i++)
+        v[i] = initial[d][i] << (31 - i);
+      for (uint i = s; i < 32; i++)
+      {
+        v[i] = v[i - s] ^ (v[i - s] >> s);
+        for (uint k = 1; k < s; k++)
+          v[i] ^= ((coefficients[d] >> (s - 1 - k)) & 1u) * v[i - k];
+      }
+    }
+    return directions;
+  }
+
+  constexpr std::array<uint32_t, 4 * 32> SOBOL_DIRECTIONS = sobol_directions();
+
+  // the 4 dimensions of a point of the sobol sequence
+  std::array<uint32_t, 4> sobol(uint32_t index)
+  {
+    std::array<uint32_t, 4> x = {};
+    for (; index != 0; index &= index - 1)
+    {
+      uint bit = static_cast<uint>(std::countr_zero(index));
+      for (uint d = 0; d < 4; d++)
+        x[d] ^= SOBOL_DIRECTIONS[d * 32 + bit];
+    }
+    return x;
+  }
+
+  uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+  {
+    x = reverse_bits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1u;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverse_bits(x);
+  }
+
+  uint32_t sample_set_seed(uint set, uint32_t pixel_seed)
+  {
+    return hash(hash_combine(pixel_seed, set));
+  }
+
+  // the point of the sample in the set of dimensions, its index shuffled per pixel and set
+  std::array<uint32_t, 4> sobol_set(uint32_t index, uint set, uint32_t pixel_seed)
+  {
+    return sobol(nested_uniform_scramble(index, sample_set_seed(set, pixel_seed)));
+  }
+
+  // a dimension of the point, scrambled per pixel, set and dimension
+  float sobol_sample(uint32_t x, uint dimension, uint32_t pixel_seed)
+  {
+    uint32_t set_seed = sample_set_seed(dimension / SAMPLE_SET, pixel_seed);
+    x = nested_uniform_scramble(x, hash_combine(set_seed, hash(dimension % SAMPLE_SET)));
+    return static_cast<float>(x >> 8) / 16777216.0f;
+  }
+
+  // the sampler of the shader: pcg4d seeded per pixel and frame, or the sample index,
+  // dimension, pixel seed and the set of the cached point of the sobol sequence
+  struct Random
+  {
+    uint32_t seed[4] = {};
+    SamplerType type = SamplerType::PCG;
+    std::array<uint32_t, 4> point = {};
+
+    Random() = default;
+    Random(SamplerType type_, uint x, uint y, uint first, int frame) : type(type_)
+    {
+      if (type == SamplerType::SOBOL)
+      {
+        seed[0] = first;
+        seed[2] = hash(x ^ hash(y));
+        seed[3] = NO_SET;
+        return;
+      }
+
+      seed[0] = x;
+      seed[1] = y;
+      seed[2] = static_cast<uint32_t>(frame);
+      seed[3] = x + y + static_cast<uint32_t>(frame);
+    }
+
+    void next_sample()
+    {
+      if (type == SamplerType::SOBOL)
+      {
+        seed[0]++;
+        seed[3] = NO_SET;
+      }
+    }
+
+    // the dimensions of the camera ray, 0, or of a bounce
+    void sample_dimensions(uint bounce)
+    {
+      if (type == SamplerType::SOBOL)
+      {
+        seed[1] = BOUNCE_DIMENSIONS * bounce;
+        seed[3] = NO_SET;
+      }
+    }
+
+    // the second set of the dimensions of the current bounce
+    void sample_light_dimensions()
+    {
+      if (type == SamplerType::SOBOL)
+      {
+        seed[1] = seed[1] - seed[1] % BOUNCE_DIMENSIONS + SAMPLE_SET;
+        seed[3] = NO_SET;
+      }
+    }
+
+    // the third set, for the environment
+    void sample_environment_dimensions()
+    {
+      if (type == SamplerType::SOBOL)
+      {
+        seed[1] = seed[1] - seed[1] % BOUNCE_DIMENSIONS + 2 * SAMPLE_SET;
+        seed[3] = NO_SET;
+      }
+    }
+
+    // the set of the next dimension of sobol
+    uint set() const { return seed[1] / SAMPLE_SET; }
+
+    float next()
+    {
+      if (type == SamplerType::SOBOL)
+      {
+        uint dimension = seed[1]++;
+        if (seed[3] != dimension / SAMPLE_SET)
+        {
+          seed[3] = dimension / SAMPLE_SET;
+          point = sobol_set(seed[0], seed[3], seed[2]);
+        }
+        return sobol_sample(point[dimension % SAMPLE_SET], dimension, seed[2]);
+      }
+
+      uint32_t *v = seed;
+      for (int i = 0; i < 4; i++)
+        v[i] = v[i] * 1664525u + 1013904223u;
+
+      v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+      for (int i = 0; i < 4; i++)
+        v[i] ^= v[i] >> 16u;
+      v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+
+      return static_cast<float>(v[0]) / static_cast<float>(0xffffffffu);
+    }
+  };
+
+  struct HitInfo
+  {
+    float t = INF;
+    glm::vec3 point = glm::vec3(0.0f);
+    glm::vec3 normal = glm::vec3(0.0f);
+    int material = 0;
+  };
+
+  float aabb_distance(const Ray &ray, const AABB &box, float t_max)
+  {
+    glm::vec3 inv = 1.0f / ray.direction;
+    glm::vec3 t1 = (glm::vec3(box.min) - ray.origin) * inv;
+    glm::vec3 t2 = (glm::vec3(box.max) - ray.origin) * inv;
+    glm::vec3 lo = glm::min(t1, t2);
+    glm::vec3 hi = glm::max(t1, t2);
+
+    float tmin = glm::max(glm::max(lo.x, lo.y), glm::max(lo.z, 0.0f));
+    float tmax = glm::min(glm::min(hi.x, hi.y), glm::min(hi.z, t_max));
+
+    return (tmin <= tmax) ? tmin : INF;
+  }
+
+  float sphere_intersect(const Ray &r, const Sphere &s)
+  {
+    glm::vec3 op = s.center - r.origin;
+    float eps = 0.001f;
+    float b = glm::dot(op, r.direction);
+    float det = b * b - glm::dot(op, op) + s.radius * s.radius;
+    if (det < 0.0f)
+      return INF;
+
+    det = std::sqrt(det);
+    float t1 = b - det;
+    if (t1 > eps)
+      return t1;
+
+    float t2 = b + det;
+    if (t2 > eps)
+      return t2;
+
+    return INF;
+  }
+
+  float triangle_intersect(const Ray &r, const glm::vec3 &moment, const TriangleRecord &record)
+  {
+    for (int k = 0; k < 3; k++)
+    {
+      if (glm::dot(glm::vec3(record.edge[k]), moment) + glm::dot(glm::vec3(record.moment[k]), r.direction) < 0.0f)
+        return INF;
+    }
+
+    glm::vec3 normal = record.normal();
+    return (record.moment[0].w - glm::dot(normal, r.origin)) / glm::dot(normal, r.direction);
+  }
+
+  float power_heuristic(float pdf, float other)
+  {
+    return (pdf * pdf) / (pdf * pdf + other * other);
+  }
+
+  // 1 - cos of the half angle of the cone a sphere covers seen from outside of it
+  float cone_extent(float distance2, float radius2)
+  {
+    float ratio = radius2 / distance2;
+    return ratio / (1.0f + std::sqrt(1.0f - ratio));
+  }
+
+  float luminance(const glm::vec3 &color)
+  {
+    return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+  }
+
+  float fresnel_schlick(float f0, float cos_theta)
+  {
+    float c = 1 - cos_theta;
+    return f0 + (1 - f0) * (c * c * c * c * c);
+  }
+
+  // the functions of raytracer.glsl for one frame, a pixel at a time
+  struct PathTracer
+  {
+    const CpuScene &scene;
+    const std::vector<TriangleRecord> &records;
+    const SoaLeaves &leaves; // used instead of the indexed leaves for LeafFormat::SOA
+    const Cubemap &envmap;
+    const Camera &camera;
+    const TraceSettings &settings;
+    float aspect_ratio;
+    std::vector<glm::uvec2> *sets = nullptr; // for sample_sets, the first set of every bounce and the set it draws from
+
+    // the direction and the roulette number of a bounce come from its first set
+    void note_set(uint bounce, const Random &random) const
+    {
+      if (sets && random.type == SamplerType::SOBOL)
+        sets->push_back({BOUNCE_DIMENSIONS * (bounce + 1) / SAMPLE_SET, random.set()});
+    }
+
+    glm::vec3 random_in_sphere(Random &random) const
+    {
+      float z = random.next() * 2.0f - 1.0f;
+      float a = random.next() * 2.0f * PI;
+      float r = std::sqrt(1.0f - z * z);
+      return {r * std::cos(a), r * std::sin(a), z};
+    }
+
+    glm::vec3 cosine_weighted(const glm::vec3 &normal, Random &random) const
+    {
+      return glm::normalize(normal + random_in_sphere(random));
+    }
+
+    Ray camera_ray(const glm::vec2 &xy, Random &random) const
+    {
+      float half_width = std::tan(glm::radians(camera.fov) / 2);
+      float half_height = half_width * aspect_ratio;
+
+      glm::vec3 target = camera.position + camera.forward;
+      glm::vec3 view_point = target + (camera.right * 2.0f * half_width * xy.x) + (camera.up * 2.0f * half_height * xy.y);
+      glm::vec3 direction = glm::normalize(view_point - camera.position);
+
+      if (!settings.use_dof)
+        return {camera.position, direction};
+
+      glm::vec3 origin = camera.position + random_in_sphere(random) * camera.aperture;
+      glm::vec3 focal_point = camera.position + direction * camera.focal_length;
+      return {origin, glm::normalize(focal_point - origin)};
+    }
+
+    // the camera ray of the next sample of a pixel, jittered over the pixel and the lens
+    Ray pixel_ray(const glm::ivec2 &pixel, const glm::vec2 &resolution, Random &random) const
+    {
+      random.sample_dimensions(0);
+      glm::vec2 jitter;
+      jitter.x = random.next();
+      jitter.y = random.next();
+      return camera_ray(((glm::vec2(pixel) + jitter) / resolution) * 2.0f - 1.0f, random);
+    }
+
+    // OCCLUSION keeps only t of the first primitive in range, for occluded
+    template <bool OCCLUSION = false>
+    void intersect_spheres(const Ray &ray, uint offset, uint count, HitInfo &hit, int &closest) const
+    {
+      for (uint i = offset; i < offset + count; i++)
+      {
+        uint p = scene.leaf_indices[i];
+        const Sphere &sphere = scene.spheres[p];
+        float t = sphere_intersect(ray, sphere);
+
+        if (EPSILON < t && t < hit.t)
+        {
+          hit.t = t;
+          closest = static_cast<int>(p);
+          if constexpr (OCCLUSION)
+            return;
+          hit.point = ray.origin + ray.direction * t;
+          hit.normal = (hit.point - sphere.center) / sphere.radius;
+          hit.material = sphere.material;
+        }
+      }
+    }
+
+    // the ray is in object space of instance, or in world space if it is NO_HIT
+    template <bool OCCLUSION = false>
+    void intersect_triangles(const Ray &ray, uint offset, uint count, int instance, HitInfo &hit, int &closest) const
+    {
+      glm::vec3 moment = glm::cross(ray.direction, ray.origin);
+
+      for (uint i = offset; i < offset + count; i++)
+      {
+        uint p = scene.leaf_indices[i];
+        float t = triangle_intersect(ray, moment, records[p]);
+
+        if (EPSILON < t && t < hit.t)
+        {
+          hit.t = t;
+          closest = static_cast<int>(p);
+          if constexpr (OCCLUSION)
+            return;
+          hit.normal = records[p].normal();
+          hit.material = static_cast<int>(records[p].moment[1].w);
+          place(hit, instance);
+        }
+      }
+    }
+
+    // moves the normal of a triangle hit to world space and applies the instance material
+    void place(HitInfo &hit, int instance) const
+    {
+      if (instance == NO_HIT)
+        return;
+
+      const Instance &placed = scene.instances[instance];
+      hit.normal = glm::normalize(glm::transpose(glm::mat3(placed.world_to_object)) * hit.normal);
+      if (placed.material >= 0)
+        hit.material = placed.material;
+    }
+
+    // intersect_spheres over the blocks of a leaf, every block is tested in one pass and
+    // its lanes are then taken in order like the indexed leaf
+    template <bool OCCLUSION = false>
+    void intersect_sphere_blocks(const Ray &ray, uint offset, uint count, HitInfo &hit, int &closest) const
+    {
+      alignas(32) float t[LEAF_WIDTH];
+
+      for (uint first = 0; first < count; first += LEAF_WIDTH)
+      {
+        const SphereBlock &block = leaves.spheres()[offset + first / LEAF_WIDTH];
+        intersect_block(block, ray, t);
+
+        for (uint lane = 0; lane < glm::min(count - first, LEAF_WIDTH); lane++)
+        {
+          if (EPSILON < t[lane] && t[lane] < hit.t)
+          {
+            hit.t = t[lane];
+            closest = static_cast<int>(block.id[lane]);
+            if constexpr (OCCLUSION)
+              return;
+            glm::vec3 center(block.center_x[lane], block.center_y[lane], block.center_z[lane]);
+            hit.point = ray.origin + ray.direction * t[lane];
+            hit.normal = (hit.point - center) / block.radius[lane];
+            hit.material = block.material[lane];
+          }
+        }
+      }
+    }
+
+    template <bool OCCLUSION = false>
+    void intersect_triangle_blocks(const Ray &ray, uint offset, uint count, int instance, HitInfo &hit, int &closest) const
+    {
+      glm::vec3 moment = glm::cross(ray.direction, ray.origin);
+      alignas(32) float t[LEAF_WIDTH];
+
+      for (uint first = 0; first < count; first += LEAF_WIDTH)
+      {
+        const TriangleBlock &block = leaves.triangles()[offset + first / LEAF_WIDTH];
+        intersect_block(block, ray, moment, t);
+
+        for (uint lane = 0; lane < glm::min(count - first, LEAF_WIDTH); lane++)
+        {
+          if (EPSILON < t[lane] && t[lane] < hit.t)
+          {
+            hit.t = t[lane];
+            closest = static_cast<int>(block.id[lane]);
+            if constexpr (OCCLUSION)
+              return;
+            hit.normal = glm::vec3(block.normal[0][lane], block.normal[1][lane], block.normal[2][lane]);
+            hit.material = block.material[lane];
+            place(hit, instance);
+          }
+        }
+      }
+    }
+
+    // closest hit over the tree, instance markers on the stack move the ray between
+    // world and object space the same way as in the shader. OCCLUSION ends at the first hit
+    template <bool OCCLUSION = false>
+    int traverse(const Ray &world_ray, HitInfo &hit) const
+    {
+      int closest = NO_HIT;
+      bool soa = scene.leaf_format == LeafFormat::SOA;
+      const std::vector<KdNode> &nodes = soa ? leaves.nodes() : scene.nodes;
+
+      if (nodes.empty() || aabb_distance(world_ray, nodes[0], hit.t) == INF)
+        return closest;
+
+      Ray ray = world_ray;
+      int instance = NO_HIT;
+
+      TraversalStack<uint> stack;
+      stack.push(0);
+
+      auto push_ordered = [&](uint a, float ta, uint b, float tb) {
+        if (ta < tb)
+        {
+          if (tb < INF) stack.push(b);
+          stack.push(a);
+        }
+        else
+        {
+          if (ta < INF) stack.push(a);
+          if (tb < INF) stack.push(b);
+        }
+      };
+
+      while (!stack.empty() && !(OCCLUSION && closest != NO_HIT))
+      {
+        uint id = stack.pop();
+
+        if (id == INSTANCE_EXIT)
+        {
+          ray = world_ray;
+          instance = NO_HIT;
+          continue;
+        }
+
+        if (id & INSTANCE_ENTER)
+        {
+          instance = static_cast<int>(id & ~INSTANCE_ENTER);
+          const glm::mat4 &world_to_object = scene.instances[instance].world_to_object;
+          ray.origin = glm::vec3(world_to_object * glm::vec4(world_ray.origin, 1.0f));
+          ray.direction = glm::mat3(world_to_object) * world_ray.direction;
+          stack.push(INSTANCE_EXIT);
+          stack.push(scene.instances[instance].root);
+          continue;
+        }
+
+        const KdNode &node = nodes[id];
+
+        if (node.count > 0)
+        {
+          uint offset = node.offset, count = leaf_count(node);
+          PrimitiveType type = leaf_type(node);
+
+          if (type == PRIMITIVE_INSTANCE)
+          {
+            for (uint i = offset; i < offset + count; i++)
+              stack.push(INSTANCE_ENTER | scene.leaf_indices[i]);
+          }
+          else if (type == PRIMITIVE_TRIANGLE)
+          {
+            if (soa)
+              intersect_triangle_blocks<OCCLUSION>(ray, offset, count, instance, hit, closest);
+            else
+              intersect_triangles<OCCLUSION>(ray, offset, count, instance, hit, closest);
+          }
+          else
+          {
+            if (soa)
+              intersect_sphere_blocks<OCCLUSION>(ray, offset, count, hit, closest);
+            else
+              intersect_spheres<OCCLUSION>(ray, offset, count, hit, closest);
+          }
+          continue;
+        }
+
+        float tl = (node.left != INVALID) ? aabb_distance(ray, nodes[node.left], hit.t) : INF;
+        float tr = (node.right != INVALID) ? aabb_distance(ray, nodes[node.right], hit.t) : INF;
+        push_ordered(node.left, tl, node.right, tr);
+      }
+
+      if (closest != NO_HIT)
+        hit.point = world_ray.origin + world_ray.direction * hit.t;
+
+      return closest;
+    }
+
+    // closest sphere in the grid, walked with the same 3D-DDA as traverse_grid
+    template <bool OCCLUSION = false>
+    int traverse_grid(const Ray &ray, HitInfo &hit) const
+    {
+      int closest = NO_HIT;
+      const std::vector<uint> &grid = scene.grid;
+
+      if (grid.size() <= 13)
+        return closest;
+
+      auto word = [&](uint i) { return std::bit_cast<float>(grid[i]); };
+      glm::vec3 grid_min(word(0), word(1), word(2));
+      glm::vec3 cell_size(word(4), word(5), word(6));
+      glm::ivec3 resolution(grid[8], grid[9], grid[10]);
+      const uint *cells = grid.data() + 12;
+
+      glm::vec3 grid_max = grid_min + cell_size * glm::vec3(resolution);
+
+      glm::vec3 inv = 1.0f / ray.direction;
+      glm::vec3 t1 = (grid_min - ray.origin) * inv;
+      glm::vec3 t2 = (grid_max - ray.origin) * inv;
+      glm::vec3 lo = glm::min(t1, t2);
+      glm::vec3 hi = glm::max(t1, t2);
+
+      float tmin = glm::max(glm::max(lo.x, lo.y), glm::max(lo.z, 0.0f));
+      float tmax = glm::min(glm::min(hi.x, hi.y), glm::min(hi.z, hit.t));
+
+      if (tmax < tmin)
+        return closest;
+
+      glm::vec3 entry = (ray.origin + ray.direction * tmin - grid_min) / cell_size;
+      glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor(entry)), glm::ivec3(0), resolution - 1);
+      glm::ivec3 step;
+      glm::vec3 next, delta;
+
+      for (int axis = 0; axis < 3; axis++)
+      {
+        if (ray.direction[axis] == 0.0f)
+        {
+          step[axis] = 0;
+          next[axis] = delta[axis] = INF;
+          continue;
+        }
+
+        step[axis] = (0.0f < ray.direction[axis]) ? 1 : -1;
+        float boundary = grid_min[axis] + static_cast<float>(cell[axis] + glm::max(step[axis], 0)) * cell_size[axis];
+        next[axis] = (boundary - ray.origin[axis]) * inv[axis];
+        delta[axis] = cell_size[axis] * glm::abs(inv[axis]);
+      }
+
+      while (true)
+      {
+        int axis = (next.x < next.y) ? ((next.x < next.z) ? 0 : 2) : ((next.y < next.z) ? 1 : 2);
+        float exit = glm::min(next[axis], tmax);
+
+        uint id = static_cast<uint>(cell.x + resolution.x * (cell.y + resolution.y * cell.z));
+        intersect_spheres<OCCLUSION>(ray, cells[id], cells[id + 1] - cells[id], hit, closest);
+
+        if (hit.t <= exit || tmax <= next[axis] || (OCCLUSION && closest != NO_HIT))
+          break;
+
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || resolution[axis] <= cell[axis])
+          break;
+
+        next[axis] += delta[axis];
+      }
+
+      return closest;
+    }
+
+    int find_closest_mesh(const Ray &ray, HitInfo &hit) const
+    {
+      float max_t = INF;
+      int closest = NO_HIT;
+      glm::vec3 moment = glm::cross(ray.direction, ray.origin);
+
+      for (uint i = 0; i < scene.meshes.size(); i++)
+      {
+        const Mesh &mesh = scene.meshes[i];
+        uint end = glm::min(mesh.start + mesh.size, static_cast<uint>(records.size()));
+
+        for (uint v = mesh.start; v < end; v++)
+        {
+          float t = triangle_intersect(ray, moment, records[v]);
+
+          if (EPSILON < t && t < max_t)
+          {
+            hit.t = t;
+            hit.point = ray.origin + ray.direction * t;
+            hit.normal = records[v].normal();
+            hit.material = static_cast<int>(records[v].moment[1].w);
+            max_t = hit.t;
+            closest = static_cast<int>(i);
+          }
+        }
+      }
+
+      return closest;
+    }
+
+    int find_closest_sphere(const Ray &ray, HitInfo &hit) const
+    {
+      float max_t = INF;
+      int closest = NO_HIT;
+
+      for (uint i = 0; i < scene.spheres.size(); i++)
+      {
+        const Sphere &sphere = scene.spheres[i];
+        float t = sphere_intersect(ray, sphere);
+
+        if (EPSILON < t && t < max_t)
+        {
+          hit.t = t;
+          hit.point = ray.origin + ray.direction * t;
+          hit.normal = (hit.point - sphere.center) / sphere.radius;
+          hit.material = sphere.material;
+          max_t = hit.t;
+          closest = static_cast<int>(i);
+        }
+      }
+
+      return closest;
+    }
+
+    // the closest hit of the first part of the shader's trace_path, false on a miss
+    bool closest_hit(const Ray &ray, HitInfo &hit) const
+    {
+      HitInfo hit1, hit2;
+      int i, j;
+
+      if (settings.use_bvh)
+      {
+        // the tree only looks for hits in front of the closest grid sphere
+        int k = settings.use_grid ? traverse_grid(ray, hit1) : NO_HIT;
+        i = traverse(ray, hit1);
+        i = (i != NO_HIT) ? i : k;
+        j = NO_HIT;
+      }
+      else
+      {
+        i = find_closest_sphere(ray, hit1);
+        j = find_closest_mesh(ray, hit2);
+      }
+
+      hit = (hit1.t < hit2.t) ? hit1 : hit2;
+      return i != NO_HIT || j != NO_HIT;
+    }
+
+    // occluded of the shader: whether anything lies on the ray in front of t_max, without
+    // a hit point, normal or material
+    bool occluded(const Ray &ray, float t_max) const
+    {
+      if (!settings.use_bvh)
+      {
+        for (const Sphere &sphere : scene.spheres)
+        {
+          float t = sphere_intersect(ray, sphere);
+          if (EPSILON < t && t < t_max)
+            return true;
+        }
+
+        glm::vec3 moment = glm::cross(ray.direction, ray.origin);
+        for (const Mesh &mesh : scene.meshes)
+        {
+          uint end = glm::min(mesh.start + mesh.size, static_cast<uint>(records.size()));
+          for (uint v = mesh.start; v < end; v++)
+          {
+            float t = triangle_intersect(ray, moment, records[v]);
+            if (EPSILON < t && t < t_max)
+              return true;
+          }
+        }
+        return false;
+      }
+
+      HitInfo hit;
+      hit.t = t_max;
+      if (settings.use_grid && traverse_grid<true>(ray, hit) != NO_HIT)
+        return true;
+      return traverse<true>(ray, hit) != NO_HIT;
+    }
+
+    // the hit of a packet lane as traverse reports it
+    HitInfo packet_hit(const Ray &ray, const PacketHit &result) const
+    {
+      HitInfo hit;
+      if (result.primitive == INVALID)
+        return hit;
+
+      hit.t = result.t;
+      hit.point = ray.origin + ray.direction * result.t;
+
+      if (result.type == PRIMITIVE_TRIANGLE)
+      {
+        hit.normal = records[result.primitive].normal();
+        hit.material = static_cast<int>(records[result.primitive].moment[1].w);
+      }
+      else
+      {
+        const Sphere &sphere = scene.spheres[result.primitive];
+        hit.normal = (hit.point - sphere.center) / sphere.radius;
+        hit.material = sphere.material;
+      }
+      return hit;
+    }
+
+    // 0 from inside of the light, where sample_light finds nothing
+    float light_pdf(const Sphere &light, const glm::vec3 &point) const
+    {
+      glm::vec3 to_center = light.center - point;
+      float distance2 = glm::dot(to_center, to_center);
+      float radius2 = light.radius * light.radius;
+      if (distance2 <= radius2 * (1.0f + 1e-3f))
+        return 0.0f;
+      return 1.0f / (2.0f * PI * cone_extent(distance2, radius2) * static_cast<float>(scene.lights.size()));
+    }
+
+    // pdf of next event estimation for the light at point, which a bounce from origin hit
+    float hit_light_pdf(const glm::vec3 &origin, const glm::vec3 &point) const
+    {
+      for (const Sphere &light : scene.lights)
+      {
+        if (std::abs(glm::distance(point, light.center) - light.radius) <= 1e-3f * light.radius + EPSILON)
+          return light_pdf(light, origin);
+      }
+      return 0.0f;
+    }
+
+    // last_bounce of the shader, the hit of the last ray samples no lights
+    bool last_bounce(uint bounce) const
+    {
+      return settings.max_bounce <= bounce + 1;
+    }
+
+    // sample_light of the shader: direct light at a diffuse hit, weighted against the bounce
+    glm::vec3 sample_light(const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &albedo, uint bounce,
+      Random &random, FrameStats &stats) const
+    {
+      if (last_bounce(bounce))
+        return glm::vec3(0.0f);
+      random.sample_light_dimensions();
+
+      uint count = static_cast<uint>(scene.lights.size());
+      uint index = glm::min(static_cast<uint>(random.next() * static_cast<float>(count)), count - 1);
+      const Sphere &light = scene.lights[index];
+
+      glm::vec3 to_center = light.center - point;
+      float distance2 = glm::dot(to_center, to_center);
+      float radius2 = light.radius * light.radius;
+
+      float u1 = random.next();
+      float u2 = random.next();
+
+      if (distance2 <= radius2 * (1.0f + 1e-3f))
+        return glm::vec3(0.0f);
+
+      float extent = cone_extent(distance2, radius2);
+      float cos_theta = 1.0f - u1 * extent;
+      float sin_theta = std::sqrt(glm::max(0.0f, 1.0f - cos_theta * cos_theta));
+      float phi = 2.0f * PI * u2;
+
+      glm::vec3 w = to_center / std::sqrt(distance2);
+      glm::vec3 u = glm::normalize(glm::cross(std::abs(w.x) > 0.1f ? glm::vec3(0, 1, 0) : glm::vec3(1, 0, 0), w));
+      glm::vec3 v = glm::cross(w, u);
+      glm::vec3 direction = glm::normalize(u * std::cos(phi) * sin_theta + v * std::sin(phi) * sin_theta + w * cos_theta);
+
+      float cos_surface = glm::dot(direction, normal);
+      if (cos_surface <= 0.0f)
+        return glm::vec3(0.0f);
+
+      Ray shadow{point, direction};
+      float t_light = sphere_intersect(shadow, light);
+      stats.shadow_rays++;
+      if (INF <= t_light || occluded(shadow, t_light - EPSILON))
+        return glm::vec3(0.0f);
+
+      float pdf = 1.0f / (2.0f * PI * extent * static_cast<float>(count));
+      float weight = power_heuristic(pdf, cos_surface / PI);
+      return scene.materials[light.material].emission * albedo * (cos_surface / PI) * weight / pdf;
+    }
+
+    bool sample_environment() const
+    {
+      return settings.use_nee && settings.use_envmap && !envmap.distribution.empty();
+    }
+
+    // sample_environment of the shader: a direction of the alias table and a shadow ray that
+    // has to escape the scene, weighted against a bounce missing it
+    glm::vec3 sample_environment(const glm::vec3 &point, const glm::vec3 &normal, const glm::vec3 &albedo,
+      uint bounce, Random &random, FrameStats &stats) const
+    {
+      if (last_bounce(bounce))
+        return glm::vec3(0.0f);
+      random.sample_environment_dimensions();
+
+      glm::vec4 u;
+      u.x = random.next();
+      u.y = random.next();
+      u.z = random.next();
+      u.w = random.next();
+
+      float pdf;
+      glm::vec3 direction = envmap.sample_direction(u, pdf);
+
+      float cos_surface = glm::dot(direction, normal);
+      if (cos_surface <= 0.0f || pdf <= 0.0f)
+        return glm::vec3(0.0f);
+
+      stats.shadow_rays++;
+      if (occluded(Ray{point, direction}, INF))
+        return glm::vec3(0.0f);
+
+      float weight = power_heuristic(pdf, cos_surface / PI);
+      return envmap.sample(direction) * albedo * (cos_surface / PI) * weight / pdf;
+    }
+
+    // survives of the shader, russian roulette on the luminance of the throughput
+    bool survives(glm::vec3 &throughput, uint bounce, Random &random) const
+    {
+      if (throughput == glm::vec3(0.0f))
+        return false;
+
+      if (!settings.roulette || bounce + 1 < settings.roulette_depth)
+        return true;
+
+      float p = glm::min(luminance(throughput), 1.0f);
+      note_set(bounce, random);
+      if (p <= random.next())
+        return false;
+      throughput /= p;
+      return true;
+    }
+
+    // primary is the hit of the camera ray if a packet traced it already
+    glm::vec3 trace_path(Ray ray, Random &random, FrameStats &stats, const HitInfo *primary = nullptr) const
+    {
+      stats.samples++;
+
+      glm::vec3 radiance(0.0f);
+      glm::vec3 throughput(1.0f);
+      float pdf = 0.0f; // of the last bounce if the light it finds could also be sampled
+
+      for (uint bounce = 0; bounce < settings.max_bounce; bounce++)
+      {
+        HitInfo hit;
+        bool found;
+        stats.rays++;
+
+        if (bounce == 0 && primary)
+        {
+          hit = *primary;
+          found = hit.t < INF;
+        }
+        else
+        {
+          found = closest_hit(ray, hit);
+        }
+
+        if (!found)
+        {
+          glm::vec3 background = settings.use_envmap ? envmap.sample(ray.direction) : settings.background;
+          float weight = (0.0f < pdf && sample_environment()) ? power_heuristic(pdf, envmap.pdf(ray.direction)) : 1.0f;
+          radiance += background * throughput * weight;
+          break;
+        }
+
+        // the shader reads whatever lies behind the buffer, a path ends here instead
+        if (hit.material < 0 || scene.materials.size() <= static_cast<size_t>(hit.material))
+          break;
+
+        random.sample_dimensions(bounce + 1);
+        const Material &material = scene.materials[hit.material];
+        glm::vec3 albedo = glm::vec3(material.albedo);
+        float smoothness = material.albedo.w;
+
+        bool inside = glm::dot(-ray.direction, hit.normal) < 0;
+
+        if (material.emission != glm::vec3(0.0f))
+        {
+          float weight = (0.0f < pdf) ? power_heuristic(pdf, hit_light_pdf(ray.origin, hit.point)) : 1.0f;
+          radiance += material.emission * throughput * weight;
+        }
+
+        ray.origin = hit.point;
+        pdf = 0.0f;
+
+        if (material.type == DIFFUSE)
+        {
+          bool nee = settings.use_nee && (!scene.lights.empty() || sample_environment());
+          if (nee && !scene.lights.empty())
+            radiance += throughput * sample_light(hit.point, hit.normal, albedo, bounce, random, stats);
+          if (sample_environment())
+            radiance += throughput * sample_environment(hit.point, hit.normal, albedo, bounce, random, stats);
+
+          // back to the first set of the bounce, the light samples moved on from it
+          random.sample_dimensions(bounce + 1);
+          note_set(bounce, random);
+          ray.direction = cosine_weighted(hit.normal, random);
+          throughput *= albedo;
+          pdf = nee ? glm::max(glm::dot(ray.direction, hit.normal), 0.0f) / PI : 0.0f;
+        }
+        else if (material.type == SPECULAR)
+        {
+          note_set(bounce, random);
+          glm::vec3 diffuse = cosine_weighted(hit.normal, random);
+          glm::vec3 specular = glm::reflect(ray.direction, hit.normal);
+          ray.direction = glm::mix(diffuse, specular, smoothness);
+          throughput *= albedo;
+        }
+        else if (material.type == TRANSMISSIVE)
+        {
+          glm::vec3 nl = inside ? -hit.normal : hit.normal;
+
+          float nc = 1.0f;
+          float nt = 1.4f;
+          float nnt = inside ? nt / nc : nc / nt;
+          float cos_theta = glm::dot(ray.direction, nl);
+
+          // total internal reflection ends the path like in the shader
+          if (1 - nnt * nnt * (1 - cos_theta * cos_theta) < 0)
+          {
+            throughput *= albedo;
+            ray.direction = glm::reflect(ray.direction, hit.normal);
+            break;
+          }
+
+          glm::vec3 transmission = glm::refract(ray.direction, nl, nnt);
+
+          float a = nt - nc;
+          float b = nt + nc;
+          float R0 = a * a / (b * b);
+
+          float cos_theta_2 = glm::dot(transmission, hit.normal);
+          float Re = fresnel_schlick(R0, inside ? cos_theta_2 : -cos_theta);
+          float Tr = 1 - Re;
+
+          float P = 0.25f + 0.5f * Re;
+
+          note_set(bounce, random);
+          if (random.next() < P)
+          {
+            throughput *= albedo * (Re / P);
+            ray.direction = glm::reflect(ray.direction, hit.normal);
+          }
+          else
+          {
+            throughput *= albedo * (Tr / (1 - P));
+            ray.direction = transmission;
+          }
+        }
+
+        if (!survives(throughput, bounce, random))
+          break;
+      }
+
+      return radiance;
+    }
+  };
+
+  // ADAPTIVE_DARK of the shader, darker pixels are measured against it
+  constexpr float ADAPTIVE_DARK = 0.05f;
+
+  bool pixel_converged(const glm::vec4 &moment, const TraceSettings &settings)
+  {
+    float frames = moment.x;
+    if (frames < static_cast<float>(settings.adaptive_min_frames) || frames < 2.0f)
+      return false;
+
+    float error = std::sqrt(moment.z / ((frames - 1.0f) * frames));
+    return error <= settings.adaptive_threshold * glm::max(moment.y, ADAPTIVE_DARK);
+  }
+
+  // blends the color of a frame into the pixel and the luminance moments, every pixel counts
+  // its own frames
+  void store_pixel(glm::vec4 &pixel, glm::vec4 &moment, const glm::vec3 &color, bool reset)
+  {
+    if (reset)
+      moment = glm::vec4(0.0f);
+
+    glm::vec3 previous = reset ? glm::vec3(0.0f) : glm::vec3(pixel);
+    pixel = glm::vec4((color + previous * moment.x) / (moment.x + 1.0f), 1.0f);
+
+    float value = luminance(color);
+    float delta = value - moment.y;
+    moment.x += 1.0f;
+    moment.y += delta / moment.x;
+    moment.z += delta * (value - moment.y);
+  }
+
+  // face selection and coordinates of the cube map table in the OpenGL specification, s and t
+  // of the point on the face in [-1, 1]
+  int cube_face(const glm::vec3 &d, float &s, float &t)
+  {
+    glm::vec3 a = glm::abs(d);
+    int face;
+    float sc, tc, ma;
+
+    if (a.y <= a.x && a.z <= a.x)
+    {
+      face = (0.0f <= d.x) ? 0 : 1;
+      sc = (0.0f <= d.x) ? -d.z : d.z;
+      tc = -d.y;
+      ma = a.x;
+    }
+    else if (a.z <= a.y)
+    {
+      face = (0.0f <= d.y) ? 2 : 3;
+      sc = d.x;
+      tc = (0.0f <= d.y) ? d.z : -d.z;
+      ma = a.y;
+    }
+    else
+    {
+      face = (0.0f <= d.z) ? 4 : 5;
+      sc = (0.0f <= d.z) ? d.x : -d.x;
+      tc = -d.y;
+      ma = a.z;
+    }
+
+    s = (ma == 0.0f) ? 0.0f : sc / ma;
+    t = (ma == 0.0f) ? 0.0f : tc / ma;
+    return face;
+  }
+}
+
+bool Cubemap::empty() const
+{
+  for (const Face &face : faces)
+  {
+    if (face.texels.empty())
+      return true;
+  }
+  return false;
+}
+
+glm::vec3 Cubemap::direction(int face, float s, float t)
+{
+  switch (face)
+  {
+  case 0: return {1.0f, -t, -s};
+  case 1: return {-1.0f, -t, s};
+  case 2: return {s, 1.0f, t};
+  case 3: return {s, -1.0f, -t};
+  case 4: return {s, -t, 1.0f};
+  default: return {-s, -t, -1.0f};
+  }
+}
+
+glm::vec3 Cubemap::sample(const glm::vec3 &d) const
+{
+  float s, t;
+  int face = cube_face(d, s, t);
+
+  const Face &f = faces[face];
+  if (f.texels.empty() || d == glm::vec3(0.0f))
+    return glm::vec3(0.0f);
+
+  float u = (s + 1.0f) * 0.5f * f.width - 0.5f;
+  float v = (t + 1.0f) * 0.5f * f.height - 0.5f;
+
+  int x0 = static_cast<int>(std::floor(u)), y0 = static_cast<int>(std::floor(v));
+  float fx = u - x0, fy = v - y0;
+
+  auto texel = [&](int x, int y) {
+    x = glm::clamp(x, 0, f.width - 1);
+    y = glm::clamp(y, 0, f.height - 1);
+    return f.texels[y * f.width + x];
+  };
+
+  glm::vec3 bottom = glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx);
+  glm::vec3 top = glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx);
+  return glm::mix(bottom, top, fy);
+}
+
+// alias table of vose (1991) over the texels, the solid angle of a texel is its area on the
+// face over the cube of its distance from the center
+void Cubemap::build_distribution()
+{
+  distribution.clear();
+
+  int n = faces[0].width;
+  for (const Face &face : faces)
+  {
+    if (face.width != n || face.height != n || face.texels.size() != static_cast<size_t>(n) * n)
+      return;
+  }
+  if (n == 0)
+    return;
+
+  size_t count = 6 * static_cast<size_t>(n) * n;
+  std::vector<double> weights(count);
+  double total = 0.0;
+
+  for (int f = 0; f < 6; f++)
+  {
+    for (int y = 0; y < n; y++)
+    {
+      for (int x = 0; x < n; x++)
+      {
+        float s = (2.0f * x + 1.0f) / n - 1.0f;
+        float t = (2.0f * y + 1.0f) / n - 1.0f;
+        float r2 = 1.0f + s * s + t * t;
+        size_t i = (static_cast<size_t>(f) * n + y) * n + x;
+        weights[i] = glm::max(luminance(faces[f].texels[y * n + x]), 0.0f) / (r2 * std::sqrt(r2));
+        total += weights[i];
+      }
+    }
+  }
+  if (total <= 0.0)
+    return;
+
+  distribution.resize(count);
+  std::vector<double> scaled(count);
+  std::vector<uint> small, large;
+
+  for (size_t i = 0; i < count; i++)
+  {
+    distribution[i] = {1.0f, static_cast<uint>(i), static_cast<float>(weights[i] / total)};
+    scaled[i] = weights[i] / total * static_cast<double>(count);
+    (scaled[i] < 1.0 ? small : large).push_back(static_cast<uint>(i));
+  }
+
+  while (!small.empty() && !large.empty())
+  {
+    uint less = small.back();
+    small.pop_back();
+    uint more = large.back();
+
+    distribution[less].threshold = static_cast<float>(scaled[less]);
+    distribution[less].alias = more;
+
+    scaled[more] -= 1.0 - scaled[less];
+    if (scaled[more] < 1.0)
+    {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+  // whatever is left is 1 up to rounding and keeps its own entry
+}
+
+glm::vec3 Cubemap::sample_direction(const glm::vec4 &u, float &pdf) const
+{
+  int n = size();
+  uint count = static_cast<uint>(distribution.size());
+  uint i = glm::min(static_cast<uint>(u.x * static_cast<float>(count)), count - 1);
+  if (distribution[i].threshold <= u.y)
+    i = distribution[i].alias;
+
+  int face = static_cast<int>(i / (n * n));
+  int x = static_cast<int>(i % n);
+  int y = static_cast<int>(i / n % n);
+
+  float s = 2.0f * (x + u.z) / n - 1.0f;
+  float t = 2.0f * (y + u.w) / n - 1.0f;
+  float r2 = 1.0f + s * s + t * t;
+
+  pdf = distribution[i].probability * 0.25f * n * n * r2 * std::sqrt(r2);
+  return direction(face, s, t) / std::sqrt(r2);
+}
+
+float Cubemap::pdf(const glm::vec3 &d) const
+{
+  if (distribution.empty())
+    return 0.0f;
+
+  float s, t;
+  int face = cube_face(d, s, t);
+
+  int n = size();
+  int x = glm::clamp(static_cast<int>((s + 1.0f) * 0.5f * n), 0, n - 1);
+  int y = glm::clamp(static_cast<int>((t + 1.0f) * 0.5f * n), 0, n - 1);
+  float r2 = 1.0f + s * s + t * t;
+
+  return distribution[(static_cast<size_t>(face) * n + y) * n + x].probability * 0.25f * n * n * r2 * std::sqrt(r2);
+}
+
+CpuTracer::CpuTracer(int width, int height, uint threads)
+  : m_width(width), m_height(height), m_image(static_cast<size_t>(width) * height, glm::vec4(0.0f)),
+    m_moments(m_image.size(), glm::vec4(0.0f)), m_pool(threads)
+{
+}
+
+void CpuTracer::set_scene(CpuScene scene)
+{
+  m_scene = std::move(scene);
+
+  m_records.clear();
+  m_records.reserve(m_scene.triangles.size());
+  for (const Triangle &triangle : m_scene.triangles)
+    m_records.emplace_back(triangle);
+
+  m_leaves = SoaLeaves();
+  if (m_scene.leaf_format == LeafFormat::SOA)
+    m_leaves = SoaLeaves(m_scene.nodes, m_scene.leaf_indices, m_scene.spheres, m_records);
+}
+
+void CpuTracer::set_envmap(Cubemap envmap)
+{
+  m_envmap = std::move(envmap);
+}
+
+void CpuTracer::set_simd(SimdLevel level)
+{
+  bool supported = level <= detect_simd() && packet_tracer(level);
+  m_simd = supported ? level : SimdLevel::SCALAR;
+}
+
+void CpuTracer::resize(int width, int height)
+{
+  m_width = width;
+  m_height = height;
+  m_image.assign(static_cast<size_t>(width) * height, glm::vec4(0.0f));
+  m_moments.assign(m_image.size(), glm::vec4(0.0f));
+}
+
+uint CpuTracer::tile_count() const
+{
+  return static_cast<uint>(((m_width + TILE_SIZE - 1) / TILE_SIZE) * ((m_height + TILE_SIZE - 1) / TILE_SIZE));
+}
+
+void CpuTracer::render(const Camera &camera, const TraceSettings &settings)
+{
+  TraceSettings frame = settings;
+  frame.use_envmap = settings.use_envmap && !m_envmap.empty();
+
+  PathTracer tracer{m_scene, m_records, m_leaves, m_envmap, camera, frame, static_cast<float>(m_height) / m_width};
+
+  int tiles_x = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+  int tiles_y = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+  glm::vec2 resolution(m_width, m_height);
+
+  // packets only cover the spheres and triangles of the tree, the grid, the brute force
+  // search and instances need single rays
+  PacketTracer trace_packet = packet_tracer(m_simd);
+  if (!frame.use_bvh || frame.use_grid || !m_scene.instances.empty())
+    trace_packet = nullptr;
+
+  PacketScene packet_scene{m_scene.nodes.data(), static_cast<uint>(m_scene.nodes.size()), m_scene.leaf_indices.data(),
+    m_scene.spheres.data(), m_records.data()};
+
+  uint lanes = trace_packet ? packet_lanes(m_simd) : 1;
+  int packet_width = (8 <= lanes) ? 4 : (lanes == 4) ? 2 : 1;
+  int packet_height = static_cast<int>(lanes) / packet_width;
+
+  // the tiles stage of the shader, tiles with a pixel that has not converged
+  std::vector<uint> tiles;
+  for (uint tile = 0; tile < static_cast<uint>(tiles_x * tiles_y); tile++)
+  {
+    int x0 = static_cast<int>(tile) % tiles_x * TILE_SIZE;
+    int y0 = static_cast<int>(tile) / tiles_x * TILE_SIZE;
+    bool active = !frame.adaptive || frame.reset;
+
+    for (int y = y0; !active && y < glm::min(y0 + TILE_SIZE, m_height); y++)
+      for (int x = x0; !active && x < glm::min(x0 + TILE_SIZE, m_width); x++)
+        active = !pixel_converged(m_moments[static_cast<size_t>(y) * m_width + x], frame);
+
+    if (active)
+      tiles.push_back(tile);
+  }
+  m_active_tiles = static_cast<uint>(tiles.size());
+
+  // every worker counts its own rays, summed once the frame is done
+  std::vector<FrameStats> stats(m_pool.size());
+
+  m_pool.run(m_active_tiles, [&](uint index, uint worker) {
+    uint tile = tiles[index];
+    int x0 = static_cast<int>(tile) % tiles_x * TILE_SIZE;
+    int y0 = static_cast<int>(tile) / tiles_x * TILE_SIZE;
+
+    for (int py = y0; py < glm::min(y0 + TILE_SIZE, m_height); py += packet_height)
+    {
+      for (int px = x0; px < glm::min(x0 + TILE_SIZE, m_width); px += packet_width)
+      {
+        // the camera rays of the first sample of the packet, each pixel keeps its random
+        // numbers for its paths and continues the samples of the frames it accumulated
+        Ray rays[16];
+        Random randoms[16] = {};
+        glm::ivec2 pixels[16];
+        uint count = 0;
+
+        for (int y = py; y < glm::min(py + packet_height, m_height); y++)
+        {
+          for (int x = px; x < glm::min(px + packet_width, m_width); x++)
+          {
+            float frames = frame.reset ? 0.0f : m_moments[static_cast<size_t>(y) * m_width + x].x;
+            uint first = static_cast<uint>(frames) * frame.samples;
+            randoms[count] = Random(frame.sampler, static_cast<uint>(x), static_cast<uint>(y), first, frame.random);
+            pixels[count] = glm::ivec2(x, y);
+            rays[count] = tracer.pixel_ray(pixels[count], resolution, randoms[count]);
+            count++;
+          }
+        }
+
+        PacketHit results[16];
+        HitInfo primary[16];
+        bool traced = trace_packet && trace_packet(packet_scene, rays, count, results);
+
+        for (uint k = 0; traced && k < count; k++)
+          primary[k] = tracer.packet_hit(rays[k], results[k]);
+
+        for (uint k = 0; k < count; k++)
+        {
+          size_t index = static_cast<size_t>(pixels[k].y) * m_width + pixels[k].x;
+          if (frame.adaptive && !frame.reset && pixel_converged(m_moments[index], frame))
+            continue;
+
+          glm::vec3 color(0.0f);
+          for (uint s = 0; s < frame.samples; s++)
+          {
+            if (s == 0)
+            {
+              color += tracer.trace_path(rays[k], randoms[k], stats[worker], traced ? &primary[k] : nullptr);
+              continue;
+            }
+
+            randoms[k].next_sample();
+            color += tracer.trace_path(tracer.pixel_ray(pixels[k], resolution, randoms[k]), randoms[k], stats[worker]);
+          }
+          color /= static_cast<float>(frame.samples);
+
+          store_pixel(m_image[index], m_moments[index], color, frame.reset);
+        }
+      }
+    }
+  });
+
+  m_stats = FrameStats();
+  for (const FrameStats &worker : stats)
+  {
+    m_stats.samples += worker.samples;
+    m_stats.rays += worker.rays;
+    m_stats.shadow_rays += worker.shadow_rays;
+  }
+}
+
+std::vector<glm::uvec2> CpuTracer::sample_sets(const Camera &camera, const TraceSettings &settings, int x, int y)
+{
+  TraceSettings frame = settings;
+  frame.use_envmap = settings.use_envmap && !m_envmap.empty();
+
+  std::vector<glm::uvec2> sets;
+  PathTracer tracer{m_scene, m_records, m_leaves, m_envmap, camera, frame, static_cast<float>(m_height) / m_width, &sets};
+
+  FrameStats stats;
+  Random random(frame.sampler, static_cast<uint>(x), static_cast<uint>(y), static_cast<uint>(frame.frames) * frame.samples,
+    frame.random);
+  for (uint s = 0; s < frame.samples; s++)
+  {
+    if (0 < s)
+      random.next_sample();
+    tracer.trace_path(tracer.pixel_ray(glm::ivec2(x, y), glm::vec2(m_width, m_height), random), random, stats);
+  }
+  return sets;
+}
+
+std::vector<uint8_t> CpuTracer::occluded(const std::vector<Ray> &rays, const std::vector<float> &t_max,
+  const TraceSettings &settings, bool any_hit)
+{
+  // the rays carry everything, the camera is never asked for one
+  Camera camera(glm::vec3(0.0f), 45.0f);
+  PathTracer tracer{m_scene, m_records, m_leaves, m_envmap, camera, settings, static_cast<float>(m_height) / m_width};
+
+  constexpr uint BATCH = 1024;
+  std::vector<uint8_t> result(rays.size());
+
+  m_pool.run(static_cast<uint>((rays.size() + BATCH - 1) / BATCH), [&](uint batch, uint) {
+    size_t end = glm::min(static_cast<size_t>(batch + 1) * BATCH, rays.size());
+    for (size_t i = static_cast<size_t>(batch) * BATCH; i < end; i++)
+    {
+      if (any_hit)
+      {
+        result[i] = tracer.occluded(rays[i], t_max[i]);
+        continue;
+      }
+
+      HitInfo hit;
+      result[i] = tracer.closest_hit(rays[i], hit) && hit.t < t_max[i];
+    }
+  });
+
+  return result;
+}
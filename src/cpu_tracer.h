@@ -0,0 +1,178 @@
+#pragma once
+
+#include "kdtree.h"
+#include "packet.h"
+#include "parallel.h"
+#include "scene.h"
+#include "soa.h"
+
+#include <array>
+#include <memory>
+#include <vector>
+
+// Cubemap as the render shader samples it: faces in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
+// rows as they were uploaded, filtered linearly and clamped to the edges of each face
+struct Cubemap
+{
+  struct Face
+  {
+    int width = 0;
+    int height = 0;
+    std::vector<glm::vec3> texels;
+  };
+
+  // an entry of the alias table, uploaded as EnvmapEntry of the render shader
+  struct AliasEntry
+  {
+    float threshold;   // the entry itself is taken below it, its alias above
+    uint alias;
+    float probability; // of the texel of the entry
+  };
+
+  std::array<Face, 6> faces;
+
+  // alias table over the texels of all faces, face after face and row after row, each with a
+  // probability proportional to its luminance times the solid angle it covers. empty unless
+  // build_distribution found square faces of one size that are not all black
+  std::vector<AliasEntry> distribution;
+
+  bool empty() const;
+  glm::vec3 sample(const glm::vec3 &direction) const;
+
+  void build_distribution();
+
+  // size of the faces the distribution was built for
+  int size() const { return faces[0].width; }
+
+  // direction of the point s, t in [-1, 1] on a face, the inverse of the face selection
+  static glm::vec3 direction(int face, float s, float t);
+
+  // direction of a texel picked by u.x from the table and u.y against its threshold, placed
+  // in the texel by u.z and u.w, and its density over solid angle
+  glm::vec3 sample_direction(const glm::vec4 &u, float &pdf) const;
+  float pdf(const glm::vec3 &direction) const;
+};
+
+static_assert(sizeof(Cubemap::AliasEntry) == 3 * sizeof(float));
+
+// the buffers the renderer uploads, in the layout raytracer.glsl reads them
+struct CpuScene
+{
+  std::vector<Sphere> spheres;
+  std::vector<Sphere> lights;       // emissive_spheres of spheres, the light_buffer
+  std::vector<Material> materials;
+  std::vector<Mesh> meshes;
+  std::vector<Triangle> triangles;  // the vertex buffer, meshes and leaves index it
+  std::vector<KdNode> nodes;        // full nodes, instance roots are ids into them
+  std::vector<Instance> instances;
+  std::vector<uint> leaf_indices;
+  std::vector<uint> grid;           // grid_buffer: min, cell size, resolution, then the cell offsets
+  LeafFormat leaf_format = LeafFormat::INDEXED; // the tracer copies the leaves into blocks for SOA
+};
+
+// how the render shader draws its random numbers, SAMPLER_PCG and SAMPLER_SOBOL
+enum class SamplerType : uint
+{
+  PCG,   // white noise in every dimension
+  SOBOL, // owen scrambled sobol sequence, per pixel
+};
+
+// the uniforms of the render shader
+struct TraceSettings
+{
+  int frames = 0;   // frames accumulated so far
+  uint samples = 1;
+  uint max_bounce = 5;
+  bool roulette = true;             // end paths by russian roulette once they are roulette_depth bounces long
+  uint roulette_depth = 5;
+  int random = 0;   // seeds the per pixel random numbers of PCG
+  SamplerType sampler = SamplerType::SOBOL;
+  glm::vec3 background = glm::vec3(0.0f);
+  bool reset = false;
+  bool use_envmap = true;
+  bool use_dof = true;
+  bool use_bvh = false;
+  bool use_grid = false;
+  bool use_nee = true;              // sample the lights and the envmap at diffuse hits
+  bool adaptive = false;            // skip the tiles whose pixels all converged
+  float adaptive_threshold = 0.02f; // standard error of the mean luminance relative to it
+  int adaptive_min_frames = 16;     // frames before a pixel can converge
+};
+
+// what the last frame traced, like stats_buffer of the shader
+struct FrameStats
+{
+  uint64_t samples = 0;
+  uint64_t rays = 0;        // closest hits of the paths, the camera rays included
+  uint64_t shadow_rays = 0; // occlusion queries of light sampling
+
+  float path_length() const { return samples ? static_cast<float>(rays) / samples : 0.0f; }
+};
+
+// Path tracer on the cpu that computes what the render shader does, function by function,
+// over the same buffers, so a frame of either converges to the same image. The image is
+// split into tiles that a pool of threads renders, busy threads steal tiles from the ends
+// of the others' shares. Rows are stored bottom up like the texture the shader writes.
+//
+// With adaptive sampling every pixel keeps the moments of the luminance of its frames, tiles
+// whose pixels all converged are skipped until the next reset.
+//
+// The camera rays of neighbouring pixels are traced as one packet of the widest simd level
+// the cpu supports, 2x2, 4x2 or 4x4 pixels. The bounces after the first scatter the rays in
+// all directions, they are traced one at a time.
+class CpuTracer
+{
+public:
+  CpuTracer(int width, int height, uint threads = 0);
+
+  void set_scene(CpuScene scene);
+  void set_envmap(Cubemap envmap);
+  void resize(int width, int height);
+
+  // packets of the camera rays, SCALAR traces every ray on its own. levels the cpu or the
+  // build does not support fall back to SCALAR
+  void set_simd(SimdLevel level);
+  SimdLevel simd() const { return m_simd; }
+
+  // accumulates one frame into the image, like a dispatch of the render shader
+  void render(const Camera &camera, const TraceSettings &settings);
+
+  // whether anything lies on each ray in front of its t_max, like the shadow rays of light
+  // sampling, in batches over the threads. any_hit false answers every ray with its closest
+  // hit instead, which is what the occlusion query saves
+  std::vector<uint8_t> occluded(const std::vector<Ray> &rays, const std::vector<float> &t_max,
+    const TraceSettings &settings, bool any_hit = true);
+
+  // traces the samples of one frame of pixel x, y and lists for every direction and roulette
+  // number of a bounce the first sobol set of the bounce and the set it was drawn from, which
+  // differ if the light and environment samples leak into the sets of other bounces
+  std::vector<glm::uvec2> sample_sets(const Camera &camera, const TraceSettings &settings, int x, int y);
+
+  const std::vector<glm::vec4> &image() const { return m_image; }
+  int width() const { return m_width; }
+  int height() const { return m_height; }
+  uint threads() const { return m_pool.size(); }
+
+  const FrameStats &stats() const { return m_stats; }
+
+  // tiles traced by the last frame, out of all of them
+  uint active_tiles() const { return m_active_tiles; }
+  uint tile_count() const;
+
+  static constexpr int TILE_SIZE = 16;
+
+private:
+  int m_width, m_height;
+  std::vector<glm::vec4> m_image;
+  std::vector<glm::vec4> m_moments; // frames, mean luminance and squared deviations, like moments in the shader
+  uint m_active_tiles = 0;
+  FrameStats m_stats;
+
+  CpuScene m_scene;
+  std::vector<TriangleRecord> m_records;
+  SoaLeaves m_leaves;
+  Cubemap m_envmap;
+  SimdLevel m_simd = detect_simd();
+
+  TaskPool m_pool;
+};
@@ -77,7 +77,7 @@ namespace gfx
       template <typename T>
       void buffer_sub_data(size_t offset, const std::span<T> &data)
       {
-        GL_CALL(glBufferSubData(offset, data.size_bytes(), data.data()));
+        GL_CALL(glBufferSubData(target, offset, data.size_bytes(), data.data()));
       }
 
       void bind_buffer_range(GLuint index, size_t offset, size_t size)
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "kdtree.h"
+#include "parallel.h"
+
+#include <chrono>
+#include <cmath>
+
+struct GridParams
+{
+  float density = 2.0f;        // cells per primitive, the resolution follows from it
+  uint max_resolution = 256;   // cells per axis
+  uint threads = 0;            // 0 uses every hardware thread
+};
+
+struct GridStats
+{
+  double build_time = 0.0; // milliseconds
+  glm::uvec3 resolution = glm::uvec3(0);
+  uint primitives = 0;
+  uint references = 0; // primitives stored in cells, once per overlapped cell
+  uint cells = 0;
+  uint empty = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const GridStats &obj)
+{
+  os << "GridStats { primitives = " << obj.primitives << ", references = " << obj.references
+     << ", resolution = " << obj.resolution.x << " x " << obj.resolution.y << " x " << obj.resolution.z
+     << ", empty = " << obj.empty << " / " << obj.cells << ", time = " << obj.build_time << " ms }";
+  return os;
+}
+
+// Uniform grid over the bounds of the primitives, for scenes close to uniformly distributed
+// where it builds in linear time and skips empty space as fast as a tree. The resolution
+// makes cubic cells with about density cells per primitive (Cleary and Wyvill 1988). Cells
+// are stored compressed: cell c holds indices()[cells()[c] .. cells()[c + 1]), input
+// indices of every primitive whose box overlaps it. Rays walk the cells front to back
+// with a 3D-DDA (Amanatides and Woo 1987), the same as the GLSL traverse_grid.
+template <class Bounded>
+class Grid
+{
+public:
+  Grid(const std::vector<Bounded> &primitives, const GridParams &params = {})
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    uint count = static_cast<uint>(primitives.size());
+    uint threads = thread_count(params.threads);
+
+    std::vector<AABB> boxes(count);
+    parallel_chunks(0, count, threads, [&](uint, uint begin, uint end) {
+      for (uint i = begin; i < end; i++)
+        boxes[i] = primitives[i].bounds();
+    });
+
+    m_bounds = empty_aabb();
+    for (const AABB &box : boxes)
+      grow(m_bounds, box);
+
+    resolve(count, params);
+
+    // the (cell, primitive) pairs are emitted per chunk and scattered in chunk order, so
+    // the cells list their primitives in input order for any number of threads
+    std::vector<std::vector<glm::uvec2>> pairs(glm::max(1U, glm::min(threads, count)));
+
+    parallel_chunks(0, count, threads, [&](uint chunk, uint begin, uint end) {
+      for (uint i = begin; i < end; i++)
+      {
+        glm::uvec3 lo = cell_of(glm::vec3(boxes[i].min)), hi = cell_of(glm::vec3(boxes[i].max));
+
+        for (uint z = lo.z; z <= hi.z; z++)
+          for (uint y = lo.y; y <= hi.y; y++)
+            for (uint x = lo.x; x <= hi.x; x++)
+              pairs[chunk].push_back({cell_id({x, y, z}), i});
+      }
+    });
+
+    uint cells = m_resolution.x * m_resolution.y * m_resolution.z;
+    m_cells.assign(cells + 1, 0);
+
+    for (const auto &chunk : pairs)
+      for (const glm::uvec2 &pair : chunk)
+        m_cells[pair.x + 1]++;
+
+    for (uint c = 0; c < cells; c++)
+      m_cells[c + 1] += m_cells[c];
+
+    m_indices.resize(m_cells[cells]);
+    std::vector<uint> cursor(m_cells.begin(), m_cells.end() - 1);
+
+    for (const auto &chunk : pairs)
+      for (const glm::uvec2 &pair : chunk)
+        m_indices[cursor[pair.x]++] = pair.y;
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    m_stats.build_time = std::chrono::duration<double, std::milli>(end - start).count();
+    m_stats.resolution = m_resolution;
+    m_stats.primitives = count;
+    m_stats.references = static_cast<uint>(m_indices.size());
+    m_stats.cells = cells;
+    for (uint c = 0; c < cells; c++)
+      m_stats.empty += (m_cells[c] == m_cells[c + 1]) ? 1 : 0;
+  }
+
+  const AABB &bounds() const { return m_bounds; }
+  const glm::uvec3 &resolution() const { return m_resolution; }
+  glm::vec3 cell_size() const { return m_cell_size; }
+  const std::vector<uint> &cells() const { return m_cells; }
+  const std::vector<uint> &indices() const { return m_indices; }
+  const GridStats &stats() const { return m_stats; }
+
+  // walks the cells the ray passes before tmax, front to back. visit(offset, count, exit)
+  // gets the index range of a cell and the distance the ray leaves it at, and returns
+  // true to stop. Returns the number of cells visited
+  template <class Visit>
+  uint march(const Ray &ray, float tmax, Visit &&visit) const
+  {
+    if (m_cells.size() <= 1)
+      return 0;
+
+    float t0 = 0.0f, t1 = tmax;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float inv = 1.0f / ray.direction[axis];
+      float a = (m_bounds.min[axis] - ray.origin[axis]) * inv;
+      float b = (m_bounds.max[axis] - ray.origin[axis]) * inv;
+      t0 = glm::max(t0, glm::min(a, b));
+      t1 = glm::min(t1, glm::max(a, b));
+    }
+
+    if (t1 < t0)
+      return 0;
+
+    glm::ivec3 cell = glm::ivec3(cell_of(ray.origin + ray.direction * t0));
+    glm::ivec3 step, last = glm::ivec3(m_resolution) - 1;
+    glm::vec3 next, delta;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      if (ray.direction[axis] == 0.0f)
+      {
+        step[axis] = 0;
+        next[axis] = delta[axis] = INFINITY;
+        continue;
+      }
+
+      step[axis] = (0.0f < ray.direction[axis]) ? 1 : -1;
+      float boundary = m_bounds.min[axis] + (cell[axis] + (0 < step[axis] ? 1 : 0)) * m_cell_size[axis];
+      next[axis] = (boundary - ray.origin[axis]) / ray.direction[axis];
+      delta[axis] = m_cell_size[axis] / glm::abs(ray.direction[axis]);
+    }
+
+    uint visits = 0;
+
+    while (true)
+    {
+      int axis = (next.x < next.y) ? ((next.x < next.z) ? 0 : 2) : ((next.y < next.z) ? 1 : 2);
+      float exit = glm::min(next[axis], t1);
+
+      uint id = cell_id(glm::uvec3(cell));
+      visits++;
+
+      if (visit(m_cells[id], m_cells[id + 1] - m_cells[id], exit) || t1 <= next[axis])
+        break;
+
+      cell[axis] += step[axis];
+      if (cell[axis] < 0 || last[axis] < cell[axis])
+        break;
+
+      next[axis] += delta[axis];
+    }
+
+    return visits;
+  }
+
+  // closest hit along the ray like KdTree::traverse, distance(index) returns the hit
+  // distance of an input primitive or infinity. A hit only ends the walk once it lies in
+  // the current cell, primitives overlapping later cells may still be closer
+  template <class Distance>
+  uint traverse(const Ray &ray, float &t, Distance &&distance) const
+  {
+    uint closest = INVALID;
+
+    march(ray, t, [&](uint offset, uint count, float exit) {
+      for (uint i = offset; i < offset + count; i++)
+      {
+        float d = distance(m_indices[i]);
+        if (d < t)
+        {
+          t = d;
+          closest = m_indices[i];
+        }
+      }
+      return t <= exit;
+    });
+
+    return closest;
+  }
+
+private:
+  AABB m_bounds;
+  glm::uvec3 m_resolution = glm::uvec3(1);
+  glm::vec3 m_cell_size = glm::vec3(1.0f);
+  std::vector<uint> m_cells;
+  std::vector<uint> m_indices;
+  GridStats m_stats;
+
+  // cubic cells, as many as density times the primitive count fit the bounds
+  void resolve(uint count, const GridParams &params)
+  {
+    if (count == 0)
+    {
+      m_bounds = {glm::vec4(0.0f), glm::vec4(0.0f)};
+      m_resolution = glm::uvec3(0);
+      return;
+    }
+
+    glm::vec3 extent = glm::vec3(m_bounds.max - m_bounds.min);
+    float largest = glm::max(extent.x, glm::max(extent.y, extent.z));
+
+    // flat or point like scenes still get a non zero volume
+    extent = glm::max(extent, glm::vec3(glm::max(largest, 1e-6f) * 1e-3f));
+    m_bounds.max = m_bounds.min + glm::vec4(extent, 0.0f);
+
+    float volume = extent.x * extent.y * extent.z;
+    float per_length = std::cbrt(params.density * count / volume);
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float cells = std::ceil(extent[axis] * per_length);
+      m_resolution[axis] = static_cast<uint>(glm::clamp(cells, 1.0f, static_cast<float>(glm::max(params.max_resolution, 1U))));
+      m_cell_size[axis] = extent[axis] / m_resolution[axis];
+    }
+  }
+
+  glm::uvec3 cell_of(const glm::vec3 &p) const
+  {
+    glm::vec3 cell = glm::floor((p - glm::vec3(m_bounds.min)) / m_cell_size);
+    return glm::uvec3(glm::clamp(cell, glm::vec3(0.0f), glm::vec3(m_resolution) - 1.0f));
+  }
+
+  uint cell_id(const glm::uvec3 &cell) const
+  {
+    return cell.x + m_resolution.x * (cell.y + m_resolution.y * cell.z);
+  }
+};
@@ -8,8 +8,12 @@
 #include <ostream>
 #include <iostream>
 #include <algorithm>
+#include <numeric>
+#include <chrono>
 #include <cstdio>
-#include <stack>
+#include <thread>
+
+#include "parallel.h"
 
 using uint = unsigned int;
 
@@ -53,6 +57,66 @@ inline bool intersect(const Ray *ray, const AABB *box)
   return tmin < tmax;
 }
 
+// distance at which the ray enters the box, infinity if it misses it or enters behind tmax
+inline float entry_distance(const Ray &ray, const AABB &box, float tmax)
+{
+  float tmin = 0.0f;
+
+  for (int d = 0; d < 3; ++d) {
+    float inv = 1.0f / ray.direction[d];
+    float t1 = (box.min[d] - ray.origin[d]) * inv;
+    float t2 = (box.max[d] - ray.origin[d]) * inv;
+
+    tmin = glm::max(tmin, glm::min(t1, t2));
+    tmax = glm::min(tmax, glm::max(t1, t2));
+  }
+
+  return (tmin <= tmax) ? tmin : std::numeric_limits<float>::infinity();
+}
+
+inline AABB empty_aabb()
+{
+  return { glm::vec4(+std::numeric_limits<float>::max()), glm::vec4(-std::numeric_limits<float>::max()) };
+}
+
+inline void grow(AABB &a, const AABB &b)
+{
+  a.min = glm::min(a.min, b.min);
+  a.max = glm::max(a.max, b.max);
+}
+
+inline void grow(AABB &a, const glm::vec3 &p)
+{
+  a.min = glm::min(a.min, glm::vec4(p, 0.0f));
+  a.max = glm::max(a.max, glm::vec4(p, 0.0f));
+}
+
+inline glm::vec3 centroid(const AABB &a)
+{
+  return glm::vec3(a.min + a.max) * 0.5f;
+}
+
+// empty or inverted boxes have zero area
+inline float surface_area(const AABB &a)
+{
+  glm::vec3 d = glm::max(glm::vec3(a.max - a.min), glm::vec3(0.0f));
+  return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// box around the eight transformed corners of a
+inline AABB transform_bounds(const AABB &a, const glm::mat4 &m)
+{
+  AABB result = empty_aabb();
+
+  for (int i = 0; i < 8; i++)
+  {
+    glm::vec4 corner((i & 1) ? a.max.x : a.min.x, (i & 2) ? a.max.y : a.min.y, (i & 4) ? a.max.z : a.min.z, 1.0f);
+    grow(result, glm::vec3(m * corner));
+  }
+
+  return result;
+}
+
 inline std::ostream &operator<<(std::ostream &os, const AABB &obj)
 {
   os << "AABB { min = " << obj.min << ", max = " << obj.max << " }";
@@ -68,162 +132,542 @@ struct KdNode : public AABB
   uint count = 0;
 };
 
-inline std::ostream &operator<<(std::ostream &os, const KdNode &obj)
+inline bool is_leaf(const KdNode &node)
+{
+  return node.left == INVALID && node.right == INVALID;
+}
+
+// leaves store the type of their primitives in the upper bits of KdNode::count,
+// untagged leaves refer to spheres
+enum PrimitiveType : uint
+{
+  PRIMITIVE_SPHERE   = 0,
+  PRIMITIVE_TRIANGLE = 1,
+  PRIMITIVE_INSTANCE = 2, // offset is an instance, whose geometry has its own tree
+};
+
+constexpr uint PRIMITIVE_TYPE_SHIFT = 30;
+constexpr uint PRIMITIVE_COUNT_MASK = (1U << PRIMITIVE_TYPE_SHIFT) - 1;
+
+inline uint leaf_count(const KdNode &node)
+{
+  return node.count & PRIMITIVE_COUNT_MASK;
+}
+
+inline PrimitiveType leaf_type(const KdNode &node)
+{
+  return static_cast<PrimitiveType>(node.count >> PRIMITIVE_TYPE_SHIFT);
+}
+
+inline void tag_leaves(std::vector<KdNode> &nodes, PrimitiveType type)
+{
+  for (KdNode &node : nodes)
+  {
+    if (is_leaf(node))
+      node.count = leaf_count(node) | (static_cast<uint>(type) << PRIMITIVE_TYPE_SHIFT);
+  }
+}
+
+// whether every child comes after its parent and lies in nodes, and every leaf holds
+// primitives of type in the first reference_count references, for trees read back from a
+// file. the builders put parents first, a child id at or before its parent would send the
+// traversals around in a loop
+inline bool valid_tree(const std::vector<KdNode> &nodes, size_t reference_count, PrimitiveType type)
+{
+  for (size_t id = 0; id < nodes.size(); id++)
+  {
+    const KdNode &node = nodes[id];
+    if (node.left != INVALID && (node.left <= id || nodes.size() <= node.left))
+      return false;
+    if (node.right != INVALID && (node.right <= id || nodes.size() <= node.right))
+      return false;
+    if (is_leaf(node) && leaf_type(node) != type)
+      return false;
+    if (is_leaf(node) && reference_count < static_cast<size_t>(node.offset) + leaf_count(node))
+      return false;
+  }
+  return true;
+}
+
+// appends a flattened subtree, shifting its node ids and leaf offsets,
+// returns the new id of the subtree root
+inline uint append(std::vector<KdNode> &nodes, const std::vector<KdNode> &subtree, uint primitive_offset = 0)
+{
+  uint base = static_cast<uint>(nodes.size());
+
+  for (KdNode node : subtree)
+  {
+    if (node.left != INVALID) node.left += base;
+    if (node.right != INVALID) node.right += base;
+    if (is_leaf(node)) node.offset += primitive_offset;
+    nodes.push_back(node);
+  }
+
+  return base;
+}
+
+// joins two flattened trees under a new root node
+inline std::vector<KdNode> merge(const std::vector<KdNode> &a, const std::vector<KdNode> &b)
+{
+  if (a.empty()) return b;
+  if (b.empty()) return a;
+
+  std::vector<KdNode> nodes;
+  nodes.reserve(1 + a.size() + b.size());
+
+  AABB bounds = a[0];
+  grow(bounds, b[0]);
+
+  KdNode root;
+  root.min = bounds.min;
+  root.max = bounds.max;
+  nodes.push_back(root);
+
+  nodes[0].left = append(nodes, a);
+  nodes[0].right = append(nodes, b);
+  return nodes;
+}
+
+// rewrites a flattened tree in depth first order, leaves keep their primitive ranges
+inline std::vector<KdNode> depth_first_order(const std::vector<KdNode> &nodes, uint root = 0)
+{
+  std::vector<KdNode> result;
+  if (nodes.empty())
+    return result;
+
+  result.reserve(nodes.size());
+
+  // old id, new id of the parent and which of its children this is
+  struct Entry
+  {
+    uint id;
+    uint parent;
+    bool right;
+  };
+
+  std::vector<Entry> stack = {{root, INVALID, false}};
+
+  while (!stack.empty())
+  {
+    Entry entry = stack.back();
+    stack.pop_back();
+
+    uint id = static_cast<uint>(result.size());
+    result.push_back(nodes[entry.id]);
+
+    if (entry.parent != INVALID)
+      (entry.right ? result[entry.parent].right : result[entry.parent].left) = id;
+
+    // right first, so the left child directly follows its parent
+    const KdNode &node = nodes[entry.id];
+    if (node.right != INVALID) stack.push_back({node.right, id, true});
+    if (node.left != INVALID) stack.push_back({node.left, id, false});
+  }
+
+  return result;
+}
+
+// number of edges on the longest path from the root to a leaf
+inline uint tree_depth(const std::vector<KdNode> &nodes)
+{
+  if (nodes.empty())
+    return 0;
+
+  uint depth = 0;
+  std::vector<std::pair<uint, uint>> stack = {{0U, 0U}};
+
+  while (!stack.empty())
+  {
+    auto [id, level] = stack.back();
+    stack.pop_back();
+
+    const KdNode &node = nodes[id];
+    depth = std::max(depth, level);
+
+    if (node.left != INVALID) stack.push_back({node.left, level + 1});
+    if (node.right != INVALID) stack.push_back({node.right, level + 1});
+  }
+
+  return depth;
+}
+
+struct BuildStats
+{
+  double build_time = 0.0; // milliseconds
+  float sah_cost = 0.0f;
+  uint primitives = 0;
+  uint references = 0; // primitives stored in leaves, including duplicates
+  uint nodes = 0;
+  uint leaves = 0;
+  uint depth = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const BuildStats &obj)
 {
-  os << "Node { l = " << obj.left << ", r = " << obj.right << ", o = " << obj.offset << ", c = " << obj.count << " }";
+  os << "BuildStats { primitives = " << obj.primitives << ", references = " << obj.references
+     << ", nodes = " << obj.nodes << ", leaves = " << obj.leaves << ", depth = " << obj.depth
+     << ", sah = " << obj.sah_cost << ", time = " << obj.build_time << " ms }";
   return os;
 }
 
-template <class Bounded, uint NODE_SIZE = 8, uint MAX_DEPTH = 5>
-class KdTree
+// surface area heuristic cost of a flattened tree, relative to its root
+inline float sah_cost(const std::vector<KdNode> &nodes, float traversal_cost = 1.0f, float intersection_cost = 1.0f)
+{
+  if (nodes.empty())
+    return 0.0f;
+
+  float root_area = surface_area(nodes[0]);
+  if (root_area <= 0.0f)
+    return intersection_cost * leaf_count(nodes[0]);
+
+  float cost = 0.0f;
+
+  for (const KdNode &node : nodes)
+  {
+    float p = surface_area(node) / root_area;
+
+    if (is_leaf(node))
+      cost += p * intersection_cost * leaf_count(node);
+    else
+      cost += p * traversal_cost;
+  }
+
+  return cost;
+}
+
+// Stack of pending nodes of a traversal. It is local to the traversal, so a leaf callback
+// can start another one. The first N entries live in the stack frame, deeper trees spill
+// to the heap instead of overflowing.
+template <class T, uint N = 64>
+class TraversalStack
 {
 public:
-  KdTree(const std::vector<Bounded> primitives)
+  bool empty() const { return m_size == 0; }
+
+  void push(const T &entry)
+  {
+    if (m_size < N)
+      m_entries[m_size] = entry;
+    else
+      m_spill.push_back(entry);
+    m_size++;
+  }
+
+  T pop()
   {
-    (void)construct(primitives, bounds(primitives), 0);
+    m_size--;
+    if (m_size < N)
+      return m_entries[m_size];
+
+    T entry = m_spill.back();
+    m_spill.pop_back();
+    return entry;
   }
 
-  uint construct(std::vector<Bounded> primitives, const AABB &bounds, uint depth = 0)
+private:
+  T m_entries[N];
+  std::vector<T> m_spill;
+  uint m_size = 0;
+};
+
+// Closest hit traversal of a flattened tree. Both children are tested before they are
+// pushed, the nearer one is visited first and subtrees the ray enters behind the current
+// hit distance t are skipped. leaf(offset, count, type, t) intersects the primitives of a
+// leaf and lowers t on a hit. Returns the number of nodes visited.
+template <class Leaf>
+uint traverse_closest(const std::vector<KdNode> &nodes, const Ray &ray, float &t, Leaf &&leaf, uint root = 0)
+{
+  if (nodes.size() <= root || entry_distance(ray, nodes[root], t) == std::numeric_limits<float>::infinity())
+    return 0;
+
+  struct Entry
   {
-    if (primitives.size() <= NODE_SIZE || depth >= MAX_DEPTH)
+    uint id;
+    float tnear;
+  };
+
+  // at most one pending sibling per level
+  TraversalStack<Entry> stack;
+  stack.push({root, 0.0f});
+
+  uint visits = 0;
+
+  while (!stack.empty())
+  {
+    auto [id, tnear] = stack.pop();
+
+    // t may have shrunk since the node was pushed
+    if (t < tnear)
+      continue;
+
+    const KdNode &node = nodes[id];
+    visits++;
+
+    if (is_leaf(node))
     {
-      uint offset = m_primitives.size();
-      uint node_id = m_nodes.size();
-      uint count = primitives.size();
-      //assert(0 < count);
-
-      m_primitives.insert(m_primitives.end(), primitives.begin(), primitives.end());
-
-      KdNode node;
-      node.min = bounds.min;
-      node.max = bounds.max;
-      node.left = INVALID;
-      node.right = INVALID;
-      node.offset = offset;
-      node.count = count;
-      m_nodes.push_back(node);
-      std::cout << "ID = " << node_id << ", " << node << std::endl;
-      return node_id;
+      leaf(node.offset, leaf_count(node), leaf_type(node), t);
+      continue;
+    }
+
+    float inf = std::numeric_limits<float>::infinity();
+    float tl = (node.left != INVALID) ? entry_distance(ray, nodes[node.left], t) : inf;
+    float tr = (node.right != INVALID) ? entry_distance(ray, nodes[node.right], t) : inf;
+
+    // far child first, so the near one is popped next
+    if (tr < tl)
+    {
+      if (tl < inf) stack.push({node.left, tl});
+      stack.push({node.right, tr});
     }
     else
     {
-      KdNode node;
-      node.min = bounds.min;
-      node.max = bounds.max;
-      node.offset = 0;
-      node.count = 0;
+      if (tr < inf) stack.push({node.right, tr});
+      if (tl < inf) stack.push({node.left, tl});
+    }
+  }
 
-      uint node_id = m_nodes.size();
-      m_nodes.push_back({});
+  return visits;
+}
 
-      int axis = depth % 3;
-      AABB left_aabb, right_aabb;
+// Recomputes the bounds of a flattened tree bottom-up after its primitives moved, the
+// topology stays as it is. Children must have larger ids than their parents, which holds
+// for every builder and for merge(). leaf_bounds(node, box) returns false for leaves whose
+// bounds are kept. Returns the ids of the nodes whose bounds changed in ascending order.
+template <class LeafBounds>
+std::vector<uint> refit(std::vector<KdNode> &nodes, LeafBounds &&leaf_bounds)
+{
+  std::vector<uint> changed;
 
-      left_aabb = bounds;
-      right_aabb = bounds;
+  for (uint i = static_cast<uint>(nodes.size()); i-- > 0;)
+  {
+    KdNode &node = nodes[i];
+    AABB box = empty_aabb();
 
-#if 0
-      float boundary = bounds.min[axis] + (bounds.max[axis] - bounds.min[axis]) / 2.0f;
-#else
-      auto compare = [&axis](const Bounded &a, const Bounded &b) { 
-        return a.bounds().min[axis] < b.bounds().min[axis]; 
-      };
+    if (is_leaf(node))
+    {
+      if (!leaf_bounds(static_cast<const KdNode &>(node), box))
+        continue;
+    }
+    else
+    {
+      if (node.left != INVALID) grow(box, nodes[node.left]);
+      if (node.right != INVALID) grow(box, nodes[node.right]);
+    }
 
-      std::sort(primitives.begin(), primitives.end(), compare);
-      float boundary = primitives[primitives.size() / 2].bounds().min[axis];
-#endif
-      left_aabb.max[axis] = boundary - 0.001f;
-      right_aabb.min[axis] = boundary;
+    if (box.min != node.min || box.max != node.max)
+    {
+      node.min = box.min;
+      node.max = box.max;
+      changed.push_back(i);
+    }
+  }
 
-      std::vector<Bounded> left, right;
+  std::reverse(changed.begin(), changed.end());
+  return changed;
+}
 
-      for (auto primitive : primitives)
-      {
-        AABB aabb = primitive.bounds();
-
-        if (intersect(&left_aabb, &aabb) && intersect(&right_aabb, &aabb)) {
-          printf("insert both\n");
-          left.push_back(primitive);
-          right.push_back(primitive);
-        } else if (intersect(&left_aabb, &aabb)) {
-          printf("insert left\n");
-          left.push_back(primitive);
-        } else if (intersect(&right_aabb, &aabb)) {
-          printf("insert right\n");
-          right.push_back(primitive);
-        }
-      }
+// Median split kd-tree, primitives straddling a split plane are referenced from both
+// children. Leaves index indices(), the input index of every reference, so a duplicate
+// costs one uint instead of a copy of the primitive. Construction partitions a single
+// index array in place, verbosity 1 prints a summary and verbosity 2 prints every node.
+// Subtrees above a size cutoff are built as parallel tasks, the node order is the same
+// for any number of threads.
+template <class Bounded, uint NODE_SIZE = 8, uint MAX_DEPTH = 5>
+class KdTree
+{
+public:
+  // subtrees with fewer primitives are built on the calling thread
+  static constexpr uint TASK_CUTOFF = 4096;
 
-      if (left.size() > 0) {
-        node.left = construct(left, left_aabb, depth + 1);
-      } else {
-        node.left = INVALID;
-      }
+  KdTree(const std::vector<Bounded> &primitives, uint verbosity = 0, uint threads = 0)
+    : m_input(&primitives), m_verbosity(verbosity), m_task_depth(task_depth(thread_count(threads)))
+  {
+    auto start = std::chrono::high_resolution_clock::now();
 
-      if (right.size() > 0) {
-        node.right = construct(right, right_aabb, depth + 1);
-      } else {
-        node.right = INVALID;
-      }
+    uint count = static_cast<uint>(primitives.size());
 
-      m_nodes[node_id] = node;
-      std::cout << "ID = " << node_id << ", " << node << std::endl;
-      return node_id;
+    std::vector<uint> indices(count);
+    std::iota(indices.begin(), indices.end(), 0U);
+
+    // a full tree of MAX_DEPTH levels, but no more than one leaf per NODE_SIZE primitives
+    size_t max_nodes = (size_t(1) << glm::min(MAX_DEPTH + 1, 31U)) - 1;
+
+    Subtree tree;
+    tree.nodes.reserve(glm::min(max_nodes, 4 * (size_t(count) / NODE_SIZE + 1)));
+    tree.references.reserve(count);
+
+    (void)construct(tree, indices, 0, count, bounds(primitives), 0);
+
+    m_nodes = std::move(tree.nodes);
+    m_indices = std::move(tree.references);
+    m_input = nullptr;
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    m_stats.build_time = std::chrono::duration<double, std::milli>(end - start).count();
+    m_stats.sah_cost = sah_cost(m_nodes);
+    m_stats.primitives = count;
+    m_stats.references = static_cast<uint>(m_indices.size());
+    m_stats.nodes = static_cast<uint>(m_nodes.size());
+    m_stats.leaves = static_cast<uint>(std::count_if(m_nodes.begin(), m_nodes.end(), is_leaf));
+    m_stats.depth = tree_depth(m_nodes);
+
+    if (1 < m_verbosity)
+    {
+      for (uint id = 0; id < m_nodes.size(); id++)
+        std::cout << "ID = " << id << ", " << m_nodes[id] << std::endl;
     }
+
+    if (0 < m_verbosity)
+      std::cout << "kdtree: " << m_stats << std::endl;
   }
 
-  static AABB bounds(const std::vector<Bounded> primitives)
+  static AABB bounds(const std::vector<Bounded> &primitives)
   {
-    AABB total;
-    total.min = glm::vec4(+1e5f);
-    total.max = glm::vec4(-1e5f);
+    AABB total = empty_aabb();
 
     for (auto &primitive : primitives)
-    {
-      AABB aabb = primitive.bounds();
-      total.min = glm::min(aabb.min, total.min);
-      total.max = glm::max(aabb.max, total.max);
-    }
+      grow(total, primitive.bounds());
+
     return total;
   }
 
-  std::vector<KdNode> nodes() { return m_nodes; }
-  std::vector<Bounded> primitives() { return m_primitives; }
+  const std::vector<KdNode> &nodes() const { return m_nodes; }
+  const std::vector<uint> &indices() const { return m_indices; }
+  const BuildStats &stats() const { return m_stats; }
+
+  // closest hit along the ray, distance(index) returns the hit distance of an input
+  // primitive or infinity. t limits the search and receives the closest distance, the
+  // result is the input index of the closest primitive or INVALID on a miss
+  template <class Distance>
+  uint traverse(const Ray &ray, float &t, Distance &&distance) const
+  {
+    uint closest = INVALID;
+
+    traverse_closest(m_nodes, ray, t, [&](uint offset, uint count, PrimitiveType, float &tmax) {
+      for (uint i = offset; i < offset + count; i++)
+      {
+        float d = distance(m_indices[i]);
+        if (d < tmax)
+        {
+          tmax = d;
+          closest = m_indices[i];
+        }
+      }
+    });
+
+    return closest;
+  }
+
+private:
+  enum Side { LEFT, BOTH, RIGHT, NEITHER };
 
-  // non-recursive kd-tree traversal
-  std::vector<Bounded> traverse(const Ray& ray) const {
+  // nodes and leaf references of a subtree, with ids and offsets local to it
+  struct Subtree
+  {
+    std::vector<KdNode> nodes;
+    std::vector<uint> references;
+    std::vector<uint> scratch;
+  };
+
+  const std::vector<Bounded> *m_input = nullptr;
+  uint m_verbosity = 0;
+  uint m_task_depth = 0;
+  BuildStats m_stats;
+  std::vector<KdNode> m_nodes;
+  std::vector<uint> m_indices;
 
-    uint id = 0; 
+  AABB bounds_of(uint id) const { return (*m_input)[id].bounds(); }
 
-    std::stack<uint> stack;
-    stack.push(id);
+  uint partition(std::vector<uint> &indices, uint begin, uint end, Side side, const AABB &left_aabb, const AABB &right_aabb) const
+  {
+    auto it = std::partition(indices.begin() + begin, indices.begin() + end, [&](uint id) {
+      AABB aabb = bounds_of(id);
+      bool left = intersect(&left_aabb, &aabb);
+      bool right = intersect(&right_aabb, &aabb);
+      return side == (left && right ? BOTH : (left ? LEFT : (right ? RIGHT : NEITHER)));
+    });
+    return static_cast<uint>(it - indices.begin());
+  }
+
+  uint construct(Subtree &out, std::vector<uint> &indices, uint begin, uint end, const AABB &bounds, uint depth) const
+  {
+    uint node_id = static_cast<uint>(out.nodes.size());
+    uint count = end - begin;
 
-    std::vector<Bounded> result;
+    KdNode node;
+    node.min = bounds.min;
+    node.max = bounds.max;
+    out.nodes.push_back(node);
 
-    while (!stack.empty()) 
+    if (count <= NODE_SIZE || depth >= MAX_DEPTH)
     {
-      id = stack.pop();
+      node.offset = static_cast<uint>(out.references.size());
+      node.count = count;
+      out.references.insert(out.references.end(), indices.begin() + begin, indices.begin() + end);
+
+      out.nodes[node_id] = node;
+      return node_id;
+    }
 
-      KdNode node = m_nodes[id];
+    int axis = depth % 3;
 
-      if (!intersect(&ray, &node))
-        continue;
+    auto first = indices.begin() + begin;
+    auto median = first + count / 2;
 
-      if (node.left != INVALID)  
-        stack.push(node.left);
-      
-      if (node.right != INVALID) 
-        stack.push(node.right);
+    std::nth_element(first, median, indices.begin() + end, [&](uint a, uint b) {
+      return bounds_of(a).min[axis] < bounds_of(b).min[axis];
+    });
 
-      if (0 < node.count) {
-        result.insert(result.end(), m_primitives.begin() + node.offset, m_primitives.begin() + node.offset + node.count);
-      }
+    float boundary = bounds_of(*median).min[axis];
+
+    AABB left_aabb = bounds, right_aabb = bounds;
+    left_aabb.max[axis] = boundary - 0.001f;
+    right_aabb.min[axis] = boundary;
+
+    // [begin, both) left only, [both, right) straddling, [right, last) right only
+    uint both = partition(indices, begin, end, LEFT, left_aabb, right_aabb);
+    uint right = partition(indices, both, end, BOTH, left_aabb, right_aabb);
+    uint last = partition(indices, right, end, RIGHT, left_aabb, right_aabb);
+
+    if (TASK_CUTOFF <= count && depth < m_task_depth && begin < right && both < last)
+    {
+      // the right subtree gets its own copy of the indices it needs and is built in parallel,
+      // both are appended in the same order the sequential build would emit them
+      Subtree left_tree, right_tree;
+      std::vector<uint> right_indices(indices.begin() + both, indices.begin() + last);
+
+      std::thread worker([&]() {
+        (void)construct(right_tree, right_indices, 0, last - both, right_aabb, depth + 1);
+      });
+      (void)construct(left_tree, indices, begin, right, left_aabb, depth + 1);
+      worker.join();
+
+      uint offset = static_cast<uint>(out.references.size());
+      out.references.insert(out.references.end(), left_tree.references.begin(), left_tree.references.end());
+      node.left = append(out.nodes, left_tree.nodes, offset);
+
+      offset = static_cast<uint>(out.references.size());
+      out.references.insert(out.references.end(), right_tree.references.begin(), right_tree.references.end());
+      node.right = append(out.nodes, right_tree.nodes, offset);
+
+      out.nodes[node_id] = node;
+      return node_id;
     }
 
-    return result;
-  }
+    // straddling primitives go to both children, but the left subtree may reorder them
+    size_t saved = out.scratch.size();
+    out.scratch.insert(out.scratch.end(), indices.begin() + both, indices.begin() + right);
 
-private:
-  std::vector<KdNode> m_nodes;
-  std::vector<Bounded> m_primitives;
+    node.left = (begin < right) ? construct(out, indices, begin, right, left_aabb, depth + 1) : INVALID;
+
+    // the left subtree has copied its references into leaves, so its range can be reused
+    std::copy(out.scratch.begin() + saved, out.scratch.end(), indices.begin() + both);
+    out.scratch.resize(saved);
+
+    node.right = (both < last) ? construct(out, indices, both, last, right_aabb, depth + 1) : INVALID;
+
+    out.nodes[node_id] = node;
+    return node_id;
+  }
 };
@@ -0,0 +1,511 @@
+#pragma once
+
+#include "kdtree.h"
+#include "parallel.h"
+
+#include <array>
+#include <bit>
+#include <cstdint>
+
+struct LBVHParams
+{
+  uint max_leaf_size = 4;          // subtrees over at most this many primitives become leaves
+  uint threads = 0;                // 0 uses every hardware thread
+  uint task_cutoff = 4096;         // smaller subtrees are emitted on the calling thread
+  uint treelet_size = 0;           // leaves per restructured treelet, 0 disables the pass
+  float traversal_cost = 1.0f;
+  float intersection_cost = 1.0f;
+};
+
+// 10 bits per axis in a 30 bit code
+inline uint32_t morton_code(const glm::uvec3 &q, uint32_t)
+{
+  auto expand = [](uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+  };
+  return (expand(q.x) << 2) | (expand(q.y) << 1) | expand(q.z);
+}
+
+// 21 bits per axis in a 63 bit code
+inline uint64_t morton_code(const glm::uvec3 &q, uint64_t)
+{
+  auto expand = [](uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+  };
+  return (expand(q.x) << 2) | (expand(q.y) << 1) | expand(q.z);
+}
+
+// Stable least significant digit radix sort of keys and their values, 8 bits per pass.
+// Every chunk histograms and scatters its own contiguous range, so the result is the same
+// for any number of threads.
+template <class Key>
+void radix_sort(std::vector<Key> &keys, std::vector<uint> &values, uint threads)
+{
+  constexpr uint RADIX = 256;
+  constexpr uint PASSES = sizeof(Key);
+
+  uint count = static_cast<uint>(keys.size());
+  threads = glm::max(1U, glm::min(threads, count / 4096 + 1));
+
+  std::vector<Key> keys_tmp(count);
+  std::vector<uint> values_tmp(count);
+  std::vector<std::array<uint, RADIX>> offsets(threads);
+
+  for (uint pass = 0; pass < PASSES; pass++)
+  {
+    uint shift = pass * 8;
+
+    parallel_chunks(0, count, threads, [&](uint chunk, uint begin, uint end) {
+      offsets[chunk].fill(0);
+      for (uint i = begin; i < end; i++)
+        offsets[chunk][(keys[i] >> shift) & 0xff]++;
+    });
+
+    // skip passes where every key has the same digit
+    bool trivial = false;
+    for (uint digit = 0; digit < RADIX && !trivial; digit++)
+    {
+      uint total = 0;
+      for (uint chunk = 0; chunk < threads; chunk++)
+        total += offsets[chunk][digit];
+      trivial = (total == count);
+    }
+
+    if (trivial)
+      continue;
+
+    uint sum = 0;
+    for (uint digit = 0; digit < RADIX; digit++)
+    {
+      for (uint chunk = 0; chunk < threads; chunk++)
+      {
+        uint n = offsets[chunk][digit];
+        offsets[chunk][digit] = sum;
+        sum += n;
+      }
+    }
+
+    parallel_chunks(0, count, threads, [&](uint chunk, uint begin, uint end) {
+      for (uint i = begin; i < end; i++)
+      {
+        uint dst = offsets[chunk][(keys[i] >> shift) & 0xff]++;
+        keys_tmp[dst] = keys[i];
+        values_tmp[dst] = values[i];
+      }
+    });
+
+    keys.swap(keys_tmp);
+    values.swap(values_tmp);
+  }
+}
+
+// Linear bounding volume hierarchy (Karras 2012, "Maximizing Parallelism in the Construction
+// of BVHs, Octrees, and k-d Trees"). Primitives are sorted along a Morton curve over their
+// centroids, every internal node is found independently from the sorted codes, and the tree
+// is emitted in the same flattened KdNode layout as KdTree and BVH. Code is uint32_t for
+// 30 bit or uint64_t for 63 bit Morton codes. An optional treelet restructuring pass
+// (Karras and Aila 2013) improves the SAH cost afterwards.
+template <class Bounded, class Code = uint64_t>
+class LBVH
+{
+public:
+  static constexpr uint AXIS_BITS = (sizeof(Code) == 4) ? 10 : 21;
+  static constexpr uint MAX_TREELET = 8;
+
+  LBVH(const std::vector<Bounded> &primitives, const LBVHParams &params = {})
+    : m_params(params)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    m_params.max_leaf_size = glm::max(m_params.max_leaf_size, 1U);
+    m_params.threads = thread_count(m_params.threads);
+    m_params.treelet_size = glm::min(m_params.treelet_size, MAX_TREELET);
+
+    uint count = static_cast<uint>(primitives.size());
+    uint threads = m_params.threads;
+
+    m_boxes.resize(count);
+    std::vector<AABB> partial(threads, empty_aabb());
+
+    parallel_chunks(0, count, threads, [&](uint chunk, uint begin, uint end) {
+      for (uint i = begin; i < end; i++)
+      {
+        m_boxes[i] = primitives[i].bounds();
+        grow(partial[chunk], centroid(m_boxes[i]));
+      }
+    });
+
+    AABB centroid_bounds = empty_aabb();
+    for (const AABB &p : partial)
+      grow(centroid_bounds, p);
+
+    // morton codes of the centroids, quantized inside the centroid bounds
+    std::vector<Code> codes(count);
+    m_order.resize(count);
+
+    glm::vec3 origin = glm::vec3(centroid_bounds.min);
+    glm::vec3 extent = glm::vec3(centroid_bounds.max - centroid_bounds.min);
+    float cells = static_cast<float>((1U << AXIS_BITS) - 1);
+
+    parallel_chunks(0, count, threads, [&](uint, uint begin, uint end) {
+      for (uint i = begin; i < end; i++)
+      {
+        glm::vec3 c = centroid(m_boxes[i]) - origin;
+        glm::uvec3 q;
+        for (int axis = 0; axis < 3; axis++)
+          q[axis] = (0.0f < extent[axis]) ? static_cast<uint>(c[axis] / extent[axis] * cells) : 0U;
+
+        codes[i] = morton_code(q, Code());
+        m_order[i] = i;
+      }
+    });
+
+    radix_sort(codes, m_order, threads);
+
+    if (0 < count)
+    {
+      emit_hierarchy(codes);
+
+      m_nodes.reserve(2 * (count / m_params.max_leaf_size) + 1);
+      (void)emit(m_nodes, 0, count == 1, 0);
+
+      if (3 <= m_params.treelet_size)
+        restructure();
+
+      m_primitives.assign(count, primitives[0]);
+      parallel_chunks(0, count, threads, [&](uint, uint begin, uint end) {
+        for (uint i = begin; i < end; i++)
+          m_primitives[i] = primitives[m_order[i]];
+      });
+    }
+
+    std::vector<AABB>().swap(m_boxes);
+    std::vector<uint>().swap(m_first);
+    std::vector<uint>().swap(m_last);
+    std::vector<uint>().swap(m_split);
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    m_stats.build_time = std::chrono::duration<double, std::milli>(end - start).count();
+    m_stats.sah_cost = sah_cost(m_nodes, m_params.traversal_cost, m_params.intersection_cost);
+    m_stats.primitives = count;
+    m_stats.references = count;
+    m_stats.nodes = static_cast<uint>(m_nodes.size());
+    m_stats.leaves = static_cast<uint>(std::count_if(m_nodes.begin(), m_nodes.end(), is_leaf));
+    m_stats.depth = tree_depth(m_nodes);
+  }
+
+  const std::vector<KdNode> &nodes() const { return m_nodes; }
+  const std::vector<Bounded> &primitives() const { return m_primitives; }
+  const std::vector<uint> &indices() const { return m_order; }
+  const BuildStats &stats() const { return m_stats; }
+
+private:
+  LBVHParams m_params;
+  BuildStats m_stats;
+  std::vector<KdNode> m_nodes;
+  std::vector<Bounded> m_primitives;
+  std::vector<uint> m_order;              // sorted position -> primitive index
+
+  // scratch data, only alive during construction
+  std::vector<AABB> m_boxes;
+  std::vector<uint> m_first, m_last;      // primitive range of each internal node
+  std::vector<uint> m_split;              // last primitive of the left child
+
+  // length of the common prefix of two sorted keys, ties broken by position
+  static int delta(const std::vector<Code> &codes, int64_t i, int64_t j)
+  {
+    if (j < 0 || j >= static_cast<int64_t>(codes.size()))
+      return -1;
+
+    Code a = codes[i], b = codes[j];
+    if (a != b)
+      return std::countl_zero(static_cast<Code>(a ^ b));
+
+    return static_cast<int>(8 * sizeof(Code)) + std::countl_zero(static_cast<uint32_t>(i ^ j));
+  }
+
+  // internal node i of the radix tree, independent of every other node
+  void emit_hierarchy(const std::vector<Code> &codes)
+  {
+    uint internal = static_cast<uint>(codes.size()) - 1;
+
+    m_first.resize(internal);
+    m_last.resize(internal);
+    m_split.resize(internal);
+
+    parallel_chunks(0, internal, m_params.threads, [&](uint, uint begin, uint end) {
+      for (int64_t i = begin; i < end; i++)
+      {
+        int d = (delta(codes, i, i + 1) - delta(codes, i, i - 1)) < 0 ? -1 : 1;
+        int delta_min = delta(codes, i, i - d);
+
+        // upper bound for the length of the range, then binary search for the other end
+        int64_t l_max = 2;
+        while (delta(codes, i, i + l_max * d) > delta_min)
+          l_max *= 2;
+
+        int64_t l = 0;
+        for (int64_t t = l_max / 2; t >= 1; t /= 2)
+        {
+          if (delta(codes, i, i + (l + t) * d) > delta_min)
+            l += t;
+        }
+
+        int64_t j = i + l * d;
+        int delta_node = delta(codes, i, j);
+
+        // binary search for the split position
+        int64_t s = 0;
+        int64_t t = l;
+        do
+        {
+          t = (t + 1) / 2;
+          if (delta(codes, i, i + (s + t) * d) > delta_node)
+            s += t;
+        } while (t > 1);
+
+        m_first[i] = static_cast<uint>(glm::min(i, j));
+        m_last[i] = static_cast<uint>(glm::max(i, j));
+        m_split[i] = static_cast<uint>(i + s * d + glm::min(d, 0));
+      }
+    });
+  }
+
+  // flattens the radix tree below internal node (or leaf) id, collapsing small ranges into leaves
+  uint emit(std::vector<KdNode> &out, uint id, bool leaf, uint depth) const
+  {
+    uint first = leaf ? id : m_first[id];
+    uint last = leaf ? id : m_last[id];
+    uint count = last - first + 1;
+
+    uint node_id = static_cast<uint>(out.size());
+    out.push_back({});
+
+    if (leaf || count <= m_params.max_leaf_size)
+    {
+      AABB bounds = empty_aabb();
+      for (uint i = first; i <= last; i++)
+        grow(bounds, m_boxes[m_order[i]]);
+
+      out[node_id].min = bounds.min;
+      out[node_id].max = bounds.max;
+      out[node_id].offset = first;
+      out[node_id].count = count;
+      return node_id;
+    }
+
+    uint split = m_split[id];
+    bool left_leaf = (split == first);
+    bool right_leaf = (split + 1 == last);
+
+    uint left, right;
+
+    if (m_params.task_cutoff <= count && depth < task_depth(m_params.threads))
+    {
+      std::vector<KdNode> left_nodes, right_nodes;
+
+      std::thread worker([&]() { (void)emit(right_nodes, split + 1, right_leaf, depth + 1); });
+      (void)emit(left_nodes, split, left_leaf, depth + 1);
+      worker.join();
+
+      left = append(out, left_nodes);
+      right = append(out, right_nodes);
+    }
+    else
+    {
+      left = emit(out, split, left_leaf, depth + 1);
+      right = emit(out, split + 1, right_leaf, depth + 1);
+    }
+
+    AABB bounds = out[left];
+    grow(bounds, out[right]);
+
+    out[node_id].min = bounds.min;
+    out[node_id].max = bounds.max;
+    out[node_id].left = left;
+    out[node_id].right = right;
+    return node_id;
+  }
+
+  // SAH cost of every subtree, not normalized by the root area
+  float subtree_cost(uint id, std::vector<float> &cost) const
+  {
+    const KdNode &node = m_nodes[id];
+
+    if (is_leaf(node))
+      return cost[id] = m_params.intersection_cost * surface_area(node) * leaf_count(node);
+
+    float left = subtree_cost(node.left, cost);
+    float right = subtree_cost(node.right, cost);
+    return cost[id] = m_params.traversal_cost * surface_area(node) + left + right;
+  }
+
+  void restructure()
+  {
+    std::vector<float> cost(m_nodes.size());
+    (void)subtree_cost(0, cost);
+
+    restructure(0, cost, 0);
+
+    // treelets reuse node ids in a different topology, restore the depth first layout
+    m_nodes = depth_first_order(m_nodes);
+  }
+
+  // bottom up, subtrees are disjoint and handled in parallel near the root
+  void restructure(uint id, std::vector<float> &cost, uint depth)
+  {
+    const KdNode &node = m_nodes[id];
+    if (is_leaf(node))
+      return;
+
+    if (depth < task_depth(m_params.threads))
+    {
+      std::thread worker([&, right = node.right]() { restructure(right, cost, depth + 1); });
+      restructure(node.left, cost, depth + 1);
+      worker.join();
+    }
+    else
+    {
+      restructure(node.left, cost, depth + 1);
+      restructure(node.right, cost, depth + 1);
+    }
+
+    optimize_treelet(id, cost);
+  }
+
+  // finds the SAH optimal topology over the treelet leaves below root by dynamic programming
+  // over all subsets, then rewires the treelet's internal nodes accordingly
+  void optimize_treelet(uint root, std::vector<float> &cost)
+  {
+    uint leaves[MAX_TREELET];
+    uint internals[MAX_TREELET];
+    uint leaf_count = 0, internal_count = 0;
+
+    leaves[leaf_count++] = m_nodes[root].left;
+    leaves[leaf_count++] = m_nodes[root].right;
+    internals[internal_count++] = root;
+
+    // grow the treelet by expanding the leaf with the largest surface area
+    while (leaf_count < m_params.treelet_size)
+    {
+      int best = -1;
+      float best_area = -1.0f;
+
+      for (uint i = 0; i < leaf_count; i++)
+      {
+        const KdNode &node = m_nodes[leaves[i]];
+        float area = surface_area(node);
+        if (!is_leaf(node) && best_area < area)
+        {
+          best = static_cast<int>(i);
+          best_area = area;
+        }
+      }
+
+      if (best < 0)
+        break;
+
+      uint expanded = leaves[best];
+      internals[internal_count++] = expanded;
+      leaves[best] = m_nodes[expanded].left;
+      leaves[leaf_count++] = m_nodes[expanded].right;
+    }
+
+    if (leaf_count < 3)
+      return;
+
+    uint subsets = 1U << leaf_count;
+
+    AABB bounds[1U << MAX_TREELET];
+    float best_cost[1U << MAX_TREELET];
+    uint best_partition[1U << MAX_TREELET];
+
+    for (uint s = 1; s < subsets; s++)
+    {
+      bounds[s] = empty_aabb();
+      for (uint i = 0; i < leaf_count; i++)
+      {
+        if (s & (1U << i))
+          grow(bounds[s], m_nodes[leaves[i]]);
+      }
+    }
+
+    for (uint i = 0; i < leaf_count; i++)
+      best_cost[1U << i] = cost[leaves[i]];
+
+    // subsets in increasing order, so every proper subset is solved first
+    for (uint s = 1; s < subsets; s++)
+    {
+      if (std::has_single_bit(s))
+        continue;
+
+      float best = std::numeric_limits<float>::max();
+      uint partition = 0;
+
+      // partitions containing the lowest bit of s, each split is visited once
+      uint low = s & (~s + 1);
+      for (uint p = (s - 1) & s; p; p = (p - 1) & s)
+      {
+        if (!(p & low))
+          continue;
+
+        float c = best_cost[p] + best_cost[s ^ p];
+        if (c < best)
+        {
+          best = c;
+          partition = p;
+        }
+      }
+
+      // no cost compared, all NaN or inf, split off the lowest leaf instead
+      if (partition == 0)
+      {
+        partition = low;
+        best = best_cost[low] + best_cost[s ^ low];
+      }
+
+      best_cost[s] = m_params.traversal_cost * surface_area(bounds[s]) + best;
+      best_partition[s] = partition;
+    }
+
+    // keeps the treelet if its cost is NaN as well
+    if (!(best_cost[subsets - 1] < cost[root]))
+      return;
+
+    uint next = 0;
+
+    auto rebuild = [&](auto &&self, uint s) -> uint {
+      // partitions are never empty, the first leaf stands in for the compiler
+      if (s == 0)
+        return leaves[0];
+      if (std::has_single_bit(s))
+        return leaves[std::countr_zero(s)];
+
+      uint id = internals[next++];
+      uint p = best_partition[s];
+
+      uint left = self(self, p);
+      uint right = self(self, s ^ p);
+
+      m_nodes[id].min = bounds[s].min;
+      m_nodes[id].max = bounds[s].max;
+      m_nodes[id].left = left;
+      m_nodes[id].right = right;
+      cost[id] = best_cost[s];
+      return id;
+    };
+
+    (void)rebuild(rebuild, subsets - 1);
+  }
+};
@@ -19,8 +19,7 @@ void setup_envmap(Renderer& renderer)
     "assets/cubemap/back.png ",
   };
 
-  auto envmap = std::make_unique<CubemapTexture>(faces);
-  renderer.set_envmap(std::move(envmap));
+  renderer.set_envmap(faces);
 }
 
 float random(float min = 0, float max = 1)
@@ -60,7 +59,10 @@ void setup_scene_01(Renderer& renderer)
 #endif
   };
 
-  renderer.set_spheres(spheres);
+  // spheres and meshes share one tree on the gpu, spatial splits keep the huge
+  // wall spheres from inflating every box around the small ones
+  renderer.set_tree_builder(TreeBuilder::SBVH);
+  renderer.set_kdtree(spheres);
 
   // setup material 
   const std::vector<Material> materials = {
@@ -83,36 +85,16 @@ void setup_scene_01(Renderer& renderer)
 
 #if (CORNELL_BOX)
 
-  std::vector<glm::vec4> obj = Renderer::load_obj("assets/models/cube.obj");
-
-  //std::vector<glm::vec4> all;
+  // meshes stay in object space, the instance transform places them
+  uint cube = renderer.add_geometry(Renderer::load_obj("assets/models/cube.obj"));
 
   glm::mat4 matrix = Renderer::transform(glm::vec3(-6.0f, -room_size.y + sr, 0.0f), glm::vec3(sr), glm::quat(glm::vec3(0.0f, M_PI / 4, 0.0f)));
-  for (glm::vec4& vertex : obj) vertex = matrix * vertex;
-
-  renderer.set_vertices(obj);
-
-  const std::vector<Mesh> meshes = {
-    Mesh(0, obj.size() / 3, 0),
-  };
-
-  renderer.set_meshes(meshes);
+  renderer.set_instances({ Instance(cube, matrix, 0) });
 #else
-  std::vector<glm::vec4> obj = Renderer::load_obj("assets/models/icosphere.obj");
+  uint icosphere = renderer.add_geometry(Renderer::load_obj("assets/models/icosphere.obj"));
 
   glm::mat4 matrix = Renderer::transform(glm::vec3(6.0f, -room_size.y + sr, 0.0f), glm::vec3(sr));
-  for (glm::vec4& vertex : obj) {
-    vertex = matrix * vertex;
-    vertex.w = 6; // mesh material
-  }
-
-  renderer.set_vertices(obj);
-
-  const std::vector<Mesh> meshes = {
-    Mesh(0, obj.size() / 3, 6),
-  };
-
-  renderer.set_meshes(meshes);
+  renderer.set_instances({ Instance(icosphere, matrix, 6) });
 #endif
 }
 
@@ -145,7 +127,7 @@ void setup_scene_02(Renderer& renderer)
   }
 #endif
 
-  KdTree<Sphere, 8, 3> tree(spheres);
+  KdTree<Sphere, 8, 3> tree(spheres, 1);
 
   std::vector<glm::vec4> mesh = Renderer::load_obj("assets/models/icosphere.obj");
   glm::mat4 matrix = Renderer::transform(glm::vec3(30.0f, 0.0f, 0.0f), glm::vec3(1.0f));
@@ -158,16 +140,12 @@ void setup_scene_02(Renderer& renderer)
   //KdTree<Triangle> triangle_tree(triangles);
 
   auto nodes = tree.nodes();
-  auto primitives = tree.primitives();
 
 
-  //for (auto& p : primitives) std::cout << p << std::endl;
-  for (auto& n : nodes) std::cout << n << std::endl;
-  
-  printf("original: %zd, primitives: %zd\n", spheres.size(), primitives.size());
+  printf("original: %zd, references: %zd\n", spheres.size(), tree.indices().size());
 
-  renderer.set_nodes(nodes);
-  renderer.set_spheres(primitives);
+  renderer.set_spheres(spheres);
+  renderer.set_nodes(nodes, tree.indices());
 
   setup_envmap(renderer);
 }
@@ -196,12 +174,85 @@ void setup_scene_03(Renderer& renderer)
   }
 
 #if 1
-  renderer.set_spheres(spheres);
-#else
+  // evenly spaced, a uniform grid fits them better than a tree
+  renderer.set_tree_builder(TreeBuilder::GRID);
   renderer.set_kdtree(spheres);
+#else
+  renderer.set_spheres(spheres);
 #endif
 }
 
+// a thousand copies of one mesh, the triangles and their tree are stored once
+void setup_scene_04(Renderer& renderer)
+{
+  setup_envmap(renderer);
+
+  const std::vector<Material> materials = {
+    /* 0 */ Material(gfx::rgb(0xAAAAAA)),
+    /* 1 */ Material(gfx::rgb(0xBC0000)),
+    /* 2 */ Material(gfx::rgb(0xAAAAAA), gfx::rgb(0x0), 1.0f, MaterialType::SPECULAR),
+    /* 3 */ Material(gfx::rgb(0xFF5733), gfx::rgb(0x0), 0.0f, MaterialType::TRANSMISSIVE),
+  };
+
+  renderer.set_materials(materials);
+
+  uint icosphere = renderer.add_geometry(Renderer::load_obj("assets/models/icosphere.obj"));
+
+  std::vector<Instance> instances;
+
+  float spacing = 3.0f;
+  int n = 10;
+
+  for (int x = 0; x < n; x++) {
+    for (int y = 0; y < n; y++) {
+      for (int z = 0; z < n; z++) {
+        glm::vec3 position = (glm::vec3(x, y, z) - (n - 1) * 0.5f) * spacing;
+        glm::quat rotation = glm::quat(random(glm::vec3(0.0f), glm::vec3(2.0f * M_PI)));
+        glm::mat4 matrix = Renderer::transform(position, glm::vec3(random(0.5f, 1.0f)), rotation);
+        instances.push_back(Instance(icosphere, matrix, static_cast<int>(rand() % materials.size())));
+      }
+    }
+  }
+
+  renderer.set_instances(instances);
+}
+
+// spheres orbiting the origin, the tree is refitted every frame instead of rebuilt
+void setup_scene_05(Renderer& renderer)
+{
+  setup_envmap(renderer);
+
+  const std::vector<Material> materials = {
+    /* 0 */ Material(gfx::rgb(0xAAAAAA)),
+    /* 1 */ Material(gfx::rgb(0xAAAAAA), gfx::rgb(0x0), 1.0f, MaterialType::SPECULAR),
+  };
+
+  renderer.set_materials(materials);
+
+  std::vector<Sphere> spheres;
+  std::vector<glm::vec3> orbits; // radius, height and speed of every sphere
+
+  for (int i = 0; i < 1000; i++) {
+    orbits.push_back(glm::vec3(random(5.0f, 20.0f), random(-10.0f, 10.0f), random(0.1f, 1.0f)));
+    spheres.push_back(Sphere(glm::vec3(0.0f), 0.5f, i % 2));
+  }
+
+  auto move = [orbits](std::vector<Sphere>& spheres, float time) {
+    for (size_t i = 0; i < spheres.size(); i++) {
+      float angle = orbits[i].z * time + static_cast<float>(i);
+      spheres[i].center = glm::vec3(std::cos(angle) * orbits[i].x, orbits[i].y, std::sin(angle) * orbits[i].x);
+    }
+  };
+
+  move(spheres, 0.0f);
+  renderer.set_kdtree(spheres);
+
+  renderer.set_animation([spheres, move](Renderer& renderer, float time) mutable {
+    move(spheres, time);
+    renderer.update_spheres(spheres);
+  });
+}
+
 int main()
 {
   srand(0);
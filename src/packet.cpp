@@ -0,0 +1,73 @@
+#include "packet.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <immintrin.h>
+#  include <intrin.h>
+#endif
+
+// defined in packet_sse.cpp, packet_avx2.cpp and packet_avx512.cpp, each compiled for its
+// instruction set. they return false when the compiler did not target it
+bool trace_packet_sse(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits);
+bool trace_packet_avx2(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits);
+bool trace_packet_avx512(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits);
+
+bool packet_sse_compiled();
+bool packet_avx2_compiled();
+bool packet_avx512_compiled();
+
+// the cpu has to support the instructions and the operating system has to save the wider
+// registers on context switches, gcc and clang check both
+SimdLevel detect_simd()
+{
+  SimdLevel level = SimdLevel::SCALAR;
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) level = SimdLevel::SSE;
+  if (__builtin_cpu_supports("avx2")) level = SimdLevel::AVX2;
+  if (__builtin_cpu_supports("avx512f")) level = SimdLevel::AVX512;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  int info[4];
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+  __cpuidex(info, 7, 0);
+  bool avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+  bool avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+
+  if (sse2) level = SimdLevel::SSE;
+  if (avx2) level = SimdLevel::AVX2;
+  if (avx512) level = SimdLevel::AVX512;
+#endif
+
+  // a build without the flags of a level falls back to the next narrower one
+  if (level == SimdLevel::AVX512 && !packet_avx512_compiled()) level = SimdLevel::AVX2;
+  if (level == SimdLevel::AVX2 && !packet_avx2_compiled()) level = SimdLevel::SSE;
+  if (level == SimdLevel::SSE && !packet_sse_compiled()) level = SimdLevel::SCALAR;
+
+  return level;
+}
+
+const char *simd_name(SimdLevel level)
+{
+  switch (level)
+  {
+  case SimdLevel::SSE: return "sse";
+  case SimdLevel::AVX2: return "avx2";
+  case SimdLevel::AVX512: return "avx512";
+  default: return "scalar";
+  }
+}
+
+PacketTracer packet_tracer(SimdLevel level)
+{
+  switch (level)
+  {
+  case SimdLevel::SSE: return packet_sse_compiled() ? trace_packet_sse : nullptr;
+  case SimdLevel::AVX2: return packet_avx2_compiled() ? trace_packet_avx2 : nullptr;
+  case SimdLevel::AVX512: return packet_avx512_compiled() ? trace_packet_avx512 : nullptr;
+  default: return nullptr;
+  }
+}
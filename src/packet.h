@@ -0,0 +1,53 @@
+#pragma once
+
+#include "kdtree.h"
+#include "scene.h"
+
+// instruction sets the packet tracer is compiled for, the width of a packet follows from it
+enum class SimdLevel : uint
+{
+  SCALAR, // one ray at a time
+  SSE,    // 4 rays
+  AVX2,   // 8 rays
+  AVX512, // 16 rays
+};
+
+// the widest level this cpu and operating system support
+SimdLevel detect_simd();
+
+const char *simd_name(SimdLevel level);
+
+inline uint packet_lanes(SimdLevel level)
+{
+  return level == SimdLevel::SCALAR ? 1U : 2U << static_cast<uint>(level);
+}
+
+// the buffers a packet is traced through, the leaves index spheres and records through
+// leaf_indices like the full nodes of the render shader
+struct PacketScene
+{
+  const KdNode *nodes = nullptr;
+  uint node_count = 0;
+  const uint *leaf_indices = nullptr;
+  const Sphere *spheres = nullptr;
+  const TriangleRecord *records = nullptr;
+};
+
+// closest hit of a ray, primitive is INVALID and t is 1e5 (INF of the shader) on a miss
+struct PacketHit
+{
+  float t;
+  uint primitive;
+  PrimitiveType type;
+};
+
+// Traces up to packet_lanes(level) rays at once through the tree: every node is tested
+// against the whole packet, first conservatively against the interval bounds of all its
+// rays (frustum culling) and then ray by ray in one slab test, and the rays that reach a
+// leaf are intersected with its primitives together. Hits match the single ray traversal
+// of the shader. Returns false if the packet could not be traced, for trees with instance
+// leaves or deeper than the packet stack, the caller then traces the rays one by one.
+using PacketTracer = bool (*)(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits);
+
+// the tracer of level, or nullptr for SCALAR and levels this build does not support
+PacketTracer packet_tracer(SimdLevel level);
@@ -0,0 +1,21 @@
+// packets of 8 rays, built with -mavx2 (/arch:AVX2 with msvc), see CMakeLists.txt
+#include "packet_kernel.h"
+
+bool packet_avx2_compiled()
+{
+#if defined(__AVX2__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool trace_packet_avx2(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits)
+{
+#if defined(__AVX2__)
+  return trace_packet<Float8>(scene, rays, count, hits);
+#else
+  (void)scene, (void)rays, (void)count, (void)hits;
+  return false;
+#endif
+}
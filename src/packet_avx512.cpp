@@ -0,0 +1,21 @@
+// packets of 16 rays, built with -mavx512f (/arch:AVX512 with msvc), see CMakeLists.txt
+#include "packet_kernel.h"
+
+bool packet_avx512_compiled()
+{
+#if defined(__AVX512F__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool trace_packet_avx512(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits)
+{
+#if defined(__AVX512F__)
+  return trace_packet<Float16>(scene, rays, count, hits);
+#else
+  (void)scene, (void)rays, (void)count, (void)hits;
+  return false;
+#endif
+}
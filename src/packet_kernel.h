@@ -0,0 +1,390 @@
+#pragma once
+
+// The packet traversal behind packet_tracer(), included by packet_sse.cpp, packet_avx2.cpp
+// and packet_avx512.cpp which are compiled with the flags of their instruction set. All of
+// it has internal linkage and it calls no inline functions of other headers, so the linker
+// can never pick a copy built for a wider instruction set for code that runs everywhere.
+
+#include "packet.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#  include <immintrin.h>
+#endif
+
+namespace
+{
+  // the defines of raytracer.glsl
+  constexpr float PACKET_EPSILON = 0.005f;
+  constexpr float PACKET_INF = 1e5f;
+  constexpr float SPHERE_EPSILON = 0.001f;
+
+  constexpr uint PACKET_STACK_SIZE = 128;
+
+  alignas(64) constexpr float LANE_INDEX[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+  inline float scalar_min(float a, float b) { return (b < a) ? b : a; }
+  inline float scalar_max(float a, float b) { return (a < b) ? b : a; }
+
+  // components through a pointer instead of glm's operator[], see above
+  inline float component(const glm::vec3 &v, int axis) { return (&v.x)[axis]; }
+  inline float component(const glm::vec4 &v, int axis) { return (&v.x)[axis]; }
+
+#if defined(__SSE2__) || defined(_M_X64)
+  struct Mask4 { __m128 v; };
+
+  struct Float4
+  {
+    static constexpr uint N = 4;
+    using Mask = Mask4;
+    __m128 v;
+
+    static Float4 splat(float x) { return {_mm_set1_ps(x)}; }
+    static Float4 load(const float *p) { return {_mm_load_ps(p)}; }
+    void store(float *p) const { _mm_store_ps(p, v); }
+  };
+
+  inline Float4 operator+(Float4 a, Float4 b) { return {_mm_add_ps(a.v, b.v)}; }
+  inline Float4 operator-(Float4 a, Float4 b) { return {_mm_sub_ps(a.v, b.v)}; }
+  inline Float4 operator*(Float4 a, Float4 b) { return {_mm_mul_ps(a.v, b.v)}; }
+  inline Float4 operator/(Float4 a, Float4 b) { return {_mm_div_ps(a.v, b.v)}; }
+  inline Float4 min(Float4 a, Float4 b) { return {_mm_min_ps(a.v, b.v)}; }
+  inline Float4 max(Float4 a, Float4 b) { return {_mm_max_ps(a.v, b.v)}; }
+  inline Float4 sqrt(Float4 a) { return {_mm_sqrt_ps(a.v)}; }
+  inline Mask4 operator<(Float4 a, Float4 b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+  inline Mask4 operator<=(Float4 a, Float4 b) { return {_mm_cmple_ps(a.v, b.v)}; }
+  inline Mask4 operator&(Mask4 a, Mask4 b) { return {_mm_and_ps(a.v, b.v)}; }
+  inline uint bits(Mask4 m) { return static_cast<uint>(_mm_movemask_ps(m.v)); }
+  inline Float4 select(Mask4 m, Float4 a, Float4 b) { return {_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))}; }
+#endif
+
+#if defined(__AVX2__)
+  struct Mask8 { __m256 v; };
+
+  struct Float8
+  {
+    static constexpr uint N = 8;
+    using Mask = Mask8;
+    __m256 v;
+
+    static Float8 splat(float x) { return {_mm256_set1_ps(x)}; }
+    static Float8 load(const float *p) { return {_mm256_load_ps(p)}; }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+  };
+
+  inline Float8 operator+(Float8 a, Float8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+  inline Float8 operator-(Float8 a, Float8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+  inline Float8 operator*(Float8 a, Float8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+  inline Float8 operator/(Float8 a, Float8 b) { return {_mm256_div_ps(a.v, b.v)}; }
+  inline Float8 min(Float8 a, Float8 b) { return {_mm256_min_ps(a.v, b.v)}; }
+  inline Float8 max(Float8 a, Float8 b) { return {_mm256_max_ps(a.v, b.v)}; }
+  inline Float8 sqrt(Float8 a) { return {_mm256_sqrt_ps(a.v)}; }
+  inline Mask8 operator<(Float8 a, Float8 b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+  inline Mask8 operator<=(Float8 a, Float8 b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+  inline Mask8 operator&(Mask8 a, Mask8 b) { return {_mm256_and_ps(a.v, b.v)}; }
+  inline uint bits(Mask8 m) { return static_cast<uint>(_mm256_movemask_ps(m.v)); }
+  inline Float8 select(Mask8 m, Float8 a, Float8 b) { return {_mm256_blendv_ps(b.v, a.v, m.v)}; }
+#endif
+
+#if defined(__AVX512F__)
+  struct Mask16 { __mmask16 k; };
+
+  struct Float16
+  {
+    static constexpr uint N = 16;
+    using Mask = Mask16;
+    __m512 v;
+
+    static Float16 splat(float x) { return {_mm512_set1_ps(x)}; }
+    static Float16 load(const float *p) { return {_mm512_load_ps(p)}; }
+    void store(float *p) const { _mm512_store_ps(p, v); }
+  };
+
+  inline Float16 operator+(Float16 a, Float16 b) { return {_mm512_add_ps(a.v, b.v)}; }
+  inline Float16 operator-(Float16 a, Float16 b) { return {_mm512_sub_ps(a.v, b.v)}; }
+  inline Float16 operator*(Float16 a, Float16 b) { return {_mm512_mul_ps(a.v, b.v)}; }
+  inline Float16 operator/(Float16 a, Float16 b) { return {_mm512_div_ps(a.v, b.v)}; }
+  inline Float16 min(Float16 a, Float16 b) { return {_mm512_min_ps(a.v, b.v)}; }
+  inline Float16 max(Float16 a, Float16 b) { return {_mm512_max_ps(a.v, b.v)}; }
+  inline Float16 sqrt(Float16 a) { return {_mm512_sqrt_ps(a.v)}; }
+  inline Mask16 operator<(Float16 a, Float16 b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ)}; }
+  inline Mask16 operator<=(Float16 a, Float16 b) { return {_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ)}; }
+  inline Mask16 operator&(Mask16 a, Mask16 b) { return {static_cast<__mmask16>(a.k & b.k)}; }
+  inline uint bits(Mask16 m) { return static_cast<uint>(m.k); }
+  inline Float16 select(Mask16 m, Float16 a, Float16 b) { return {_mm512_mask_blend_ps(m.k, b.v, a.v)}; }
+#endif
+
+  // the rays of a packet in lanes, with the interval bounds of their origins and inverse
+  // directions. The bounds only hold for axes where no direction changes sign, frustum
+  // culling is skipped otherwise
+  template <class F>
+  struct Packet
+  {
+    F origin[3], direction[3], inv[3], moment[3];
+    typename F::Mask active;
+
+    bool bounded = true;
+    float origin_lo[3], origin_hi[3], inv_lo[3], inv_hi[3];
+    float mean_direction[3];
+  };
+
+  template <class F>
+  Packet<F> make_packet(const Ray *rays, uint count)
+  {
+    constexpr uint N = F::N;
+    alignas(64) float lanes[12][N];
+
+    for (uint l = 0; l < N; l++)
+    {
+      // idle lanes repeat the last ray, so they do not widen the bounds
+      const Ray &ray = rays[(l < count) ? l : count - 1];
+
+      for (int axis = 0; axis < 3; axis++)
+      {
+        lanes[axis][l] = component(ray.origin, axis);
+        lanes[3 + axis][l] = component(ray.direction, axis);
+        lanes[6 + axis][l] = 1.0f / component(ray.direction, axis);
+      }
+
+      // cross(direction, origin), the moment of the ray for the triangle records
+      lanes[9][l] = ray.direction.y * ray.origin.z - ray.direction.z * ray.origin.y;
+      lanes[10][l] = ray.direction.z * ray.origin.x - ray.direction.x * ray.origin.z;
+      lanes[11][l] = ray.direction.x * ray.origin.y - ray.direction.y * ray.origin.x;
+    }
+
+    Packet<F> packet;
+    packet.active = F::load(LANE_INDEX) < F::splat(static_cast<float>(count));
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      packet.origin[axis] = F::load(lanes[axis]);
+      packet.direction[axis] = F::load(lanes[3 + axis]);
+      packet.inv[axis] = F::load(lanes[6 + axis]);
+      packet.moment[axis] = F::load(lanes[9 + axis]);
+
+      packet.origin_lo[axis] = packet.origin_hi[axis] = lanes[axis][0];
+      packet.inv_lo[axis] = packet.inv_hi[axis] = lanes[6 + axis][0];
+      packet.mean_direction[axis] = 0.0f;
+
+      for (uint l = 0; l < N; l++)
+      {
+        packet.origin_lo[axis] = scalar_min(packet.origin_lo[axis], lanes[axis][l]);
+        packet.origin_hi[axis] = scalar_max(packet.origin_hi[axis], lanes[axis][l]);
+        packet.inv_lo[axis] = scalar_min(packet.inv_lo[axis], lanes[6 + axis][l]);
+        packet.inv_hi[axis] = scalar_max(packet.inv_hi[axis], lanes[6 + axis][l]);
+        packet.mean_direction[axis] += lanes[3 + axis][l];
+      }
+
+      // a zero or sign changing direction makes the inverse unbounded
+      bool same_sign = (0.0f < packet.inv_lo[axis]) == (0.0f < packet.inv_hi[axis]);
+      bool finite = -1e30f < packet.inv_lo[axis] && packet.inv_hi[axis] < 1e30f;
+      packet.bounded = packet.bounded && same_sign && finite;
+    }
+
+    return packet;
+  }
+
+  // true if no ray of the packet can enter the box before tmax: the slab distances of every
+  // ray lie in the products of the origin and inverse direction intervals
+  template <class F>
+  bool frustum_misses(const Packet<F> &packet, const AABB &box, float tmax)
+  {
+    float entry = 0.0f, exit = tmax;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float lo = 0.0f, hi = 0.0f;
+
+      for (int side = 0; side < 2; side++)
+      {
+        float plane = component(side ? box.max : box.min, axis);
+        float a = (plane - packet.origin_hi[axis]) * packet.inv_lo[axis];
+        float b = (plane - packet.origin_hi[axis]) * packet.inv_hi[axis];
+        float c = (plane - packet.origin_lo[axis]) * packet.inv_lo[axis];
+        float d = (plane - packet.origin_lo[axis]) * packet.inv_hi[axis];
+
+        float plane_lo = scalar_min(scalar_min(a, b), scalar_min(c, d));
+        float plane_hi = scalar_max(scalar_max(a, b), scalar_max(c, d));
+
+        lo = side ? scalar_min(lo, plane_lo) : plane_lo;
+        hi = side ? scalar_max(hi, plane_hi) : plane_hi;
+      }
+
+      entry = scalar_max(entry, lo);
+      exit = scalar_min(exit, hi);
+    }
+
+    return exit < entry;
+  }
+
+  // aabb_distance of the shader for every lane, the lanes that enter the box before t
+  template <class F>
+  typename F::Mask enters(const Packet<F> &packet, const AABB &box, F t)
+  {
+    F lo = F::splat(0.0f), hi = t;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      F a = (F::splat(component(box.min, axis)) - packet.origin[axis]) * packet.inv[axis];
+      F b = (F::splat(component(box.max, axis)) - packet.origin[axis]) * packet.inv[axis];
+      lo = max(lo, min(a, b));
+      hi = min(hi, max(a, b));
+    }
+
+    return lo <= hi;
+  }
+
+  // sphere_intersect of the shader for every lane
+  template <class F>
+  F sphere_distance(const Packet<F> &packet, const Sphere &sphere)
+  {
+    F op[3];
+    for (int axis = 0; axis < 3; axis++)
+      op[axis] = F::splat(component(sphere.center, axis)) - packet.origin[axis];
+
+    F b = op[0] * packet.direction[0] + op[1] * packet.direction[1] + op[2] * packet.direction[2];
+    F det = b * b - (op[0] * op[0] + op[1] * op[1] + op[2] * op[2]) + F::splat(sphere.radius * sphere.radius);
+
+    typename F::Mask real = F::splat(0.0f) <= det;
+    det = sqrt(max(det, F::splat(0.0f)));
+
+    F eps = F::splat(SPHERE_EPSILON), inf = F::splat(PACKET_INF);
+    F t1 = b - det, t2 = b + det;
+    F t = select(eps < t1, t1, select(eps < t2, t2, inf));
+    return select(real, t, inf);
+  }
+
+  // triangle_record_intersect of the shader for every lane
+  template <class F>
+  F triangle_distance(const Packet<F> &packet, const TriangleRecord &record)
+  {
+    typename F::Mask inside = F::splat(0.0f) <= F::splat(0.0f);
+
+    for (int k = 0; k < 3; k++)
+    {
+      F side = (F::splat(record.edge[k].x) * packet.moment[0] + F::splat(record.edge[k].y) * packet.moment[1] +
+                F::splat(record.edge[k].z) * packet.moment[2]) +
+               (F::splat(record.moment[k].x) * packet.direction[0] + F::splat(record.moment[k].y) * packet.direction[1] +
+                F::splat(record.moment[k].z) * packet.direction[2]);
+      inside = inside & (F::splat(0.0f) <= side);
+    }
+
+    F normal[3] = {F::splat(record.edge[0].w), F::splat(record.edge[1].w), F::splat(record.edge[2].w)};
+    F distance = F::splat(record.moment[0].w) -
+                 (normal[0] * packet.origin[0] + normal[1] * packet.origin[1] + normal[2] * packet.origin[2]);
+    F t = distance / (normal[0] * packet.direction[0] + normal[1] * packet.direction[1] + normal[2] * packet.direction[2]);
+
+    return select(inside, t, F::splat(PACKET_INF));
+  }
+
+  template <class F>
+  bool trace_packet(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits)
+  {
+    constexpr uint N = F::N;
+    if (count == 0 || N < count)
+      return false;
+
+    Packet<F> packet = make_packet<F>(rays, count);
+
+    F t = F::splat(PACKET_INF);
+    float t_max = PACKET_INF; // largest t of the packet, for frustum culling
+    uint primitive[N];
+    PrimitiveType type[N];
+
+    for (uint l = 0; l < N; l++)
+    {
+      primitive[l] = INVALID;
+      type[l] = PRIMITIVE_SPHERE;
+    }
+
+    uint stack[PACKET_STACK_SIZE];
+    uint top = 0;
+
+    if (0 < scene.node_count)
+      stack[top++] = 0;
+
+    while (0 < top)
+    {
+      const KdNode &node = scene.nodes[stack[--top]];
+
+      if (packet.bounded && frustum_misses(packet, node, t_max))
+        continue;
+
+      typename F::Mask mask = enters(packet, node, t) & packet.active;
+      if (bits(mask) == 0)
+        continue;
+
+      if (0 < node.count)
+      {
+        PrimitiveType leaf = static_cast<PrimitiveType>(node.count >> PRIMITIVE_TYPE_SHIFT);
+        uint leaf_count = node.count & PRIMITIVE_COUNT_MASK;
+
+        // instances move every ray into another space, they are left to single rays
+        if (leaf == PRIMITIVE_INSTANCE)
+          return false;
+
+        bool closer_hit = false;
+
+        for (uint i = node.offset; i < node.offset + leaf_count; i++)
+        {
+          uint p = scene.leaf_indices[i];
+          F candidate = (leaf == PRIMITIVE_TRIANGLE) ? triangle_distance(packet, scene.records[p])
+                                                     : sphere_distance(packet, scene.spheres[p]);
+
+          typename F::Mask closer = (F::splat(PACKET_EPSILON) < candidate) & (candidate < t) & mask;
+          uint lanes = bits(closer);
+          if (lanes == 0)
+            continue;
+
+          t = select(closer, candidate, t);
+          closer_hit = true;
+
+          for (uint l = 0; l < N; l++)
+          {
+            if (lanes & (1U << l))
+            {
+              primitive[l] = p;
+              type[l] = leaf;
+            }
+          }
+        }
+
+        if (closer_hit)
+        {
+          alignas(64) float lanes[N];
+          t.store(lanes);
+          t_max = 0.0f;
+          for (uint l = 0; l < count; l++)
+            t_max = scalar_max(t_max, lanes[l]);
+        }
+        continue;
+      }
+
+      if (PACKET_STACK_SIZE < top + 2)
+        return false;
+
+      // the child on the side the packet comes from is visited first
+      float towards = 0.0f;
+      if (node.left != INVALID && node.right != INVALID)
+      {
+        const KdNode &left = scene.nodes[node.left], &right = scene.nodes[node.right];
+        for (int axis = 0; axis < 3; axis++)
+          towards += (component(right.min, axis) + component(right.max, axis) - component(left.min, axis) -
+                      component(left.max, axis)) * packet.mean_direction[axis];
+      }
+
+      uint near = (0.0f <= towards) ? node.left : node.right;
+      uint far = (0.0f <= towards) ? node.right : node.left;
+
+      if (far != INVALID) stack[top++] = far;
+      if (near != INVALID) stack[top++] = near;
+    }
+
+    alignas(64) float distance[N];
+    t.store(distance);
+
+    for (uint l = 0; l < count; l++)
+      hits[l] = {(primitive[l] != INVALID) ? distance[l] : PACKET_INF, primitive[l], type[l]};
+
+    return true;
+  }
+}
@@ -0,0 +1,21 @@
+// packets of 4 rays, built with nothing beyond the x86-64 baseline, see CMakeLists.txt
+#include "packet_kernel.h"
+
+bool packet_sse_compiled()
+{
+#if defined(__SSE2__) || defined(_M_X64)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool trace_packet_sse(const PacketScene &scene, const Ray *rays, uint count, PacketHit *hits)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+  return trace_packet<Float4>(scene, rays, count, hits);
+#else
+  (void)scene, (void)rays, (void)count, (void)hits;
+  return false;
+#endif
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using uint = unsigned int;
+
+// 0 means one thread per hardware core
+inline uint thread_count(uint requested = 0)
+{
+  if (0 < requested)
+    return requested;
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+// levels of recursion that spawn tasks, so every thread gets about two subtrees
+inline uint task_depth(uint threads)
+{
+  uint depth = 0;
+  while ((1U << depth) < threads) depth++;
+  return (1 < threads) ? depth + 1 : 0;
+}
+
+// Splits [begin, end) into equal contiguous chunks and calls fn(chunk, chunk_begin, chunk_end)
+// for each of them on its own thread. Chunk boundaries only depend on the range and the
+// number of chunks, so reductions over the chunks in order are deterministic.
+template <class Fn>
+void parallel_chunks(uint begin, uint end, uint chunks, Fn &&fn)
+{
+  uint count = end - begin;
+  chunks = std::max(1U, std::min(chunks, count));
+
+  auto chunk_begin = [&](uint c) { return begin + static_cast<uint>((uint64_t(count) * c) / chunks); };
+
+  std::vector<std::thread> workers;
+  workers.reserve(chunks - 1);
+
+  for (uint c = 1; c < chunks; c++)
+    workers.emplace_back([&fn, c, b = chunk_begin(c), e = chunk_begin(c + 1)]() { fn(c, b, e); });
+
+  fn(0, chunk_begin(0), chunk_begin(1));
+
+  for (auto &worker : workers)
+    worker.join();
+}
+
+// Persistent workers for batches of independent tasks of uneven cost. Every worker starts
+// on its own contiguous share of the batch, taking tasks from the front, and once it runs
+// dry steals from the back of the others, so a worker stuck with expensive tasks gets
+// help while the cheap ones finish. The calling thread works as worker 0.
+class TaskPool
+{
+public:
+  explicit TaskPool(uint threads = 0) : m_queues(thread_count(threads))
+  {
+    for (uint w = 1; w < size(); w++)
+      m_workers.emplace_back([this, w]() { work(w); });
+  }
+
+  ~TaskPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (auto &worker : m_workers)
+      worker.join();
+  }
+
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+
+  uint size() const { return static_cast<uint>(m_queues.size()); }
+
+  // calls task(index, worker) for every index in [0, count), returns once all are done
+  void run(uint count, std::function<void(uint, uint)> task)
+  {
+    if (count == 0)
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_task = std::move(task);
+      m_remaining = count;
+
+      for (uint w = 0; w < size(); w++)
+      {
+        Queue &queue = m_queues[w];
+        std::lock_guard<std::mutex> queue_lock(queue.mutex);
+        queue.begin = static_cast<uint>((uint64_t(count) * w) / size());
+        queue.end = static_cast<uint>((uint64_t(count) * (w + 1)) / size());
+      }
+
+      m_batch++;
+    }
+    m_wake.notify_all();
+
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]() { return m_remaining == 0; });
+    m_task = nullptr;
+  }
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    uint begin = 0, end = 0;
+  };
+
+  std::vector<Queue> m_queues;
+  std::vector<std::thread> m_workers;
+  std::function<void(uint, uint)> m_task;
+  std::atomic<uint> m_remaining{0};
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake, m_done;
+  uint64_t m_batch = 0;
+  bool m_stop = false;
+
+  void work(uint w)
+  {
+    uint64_t seen = 0;
+
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&]() { return m_stop || m_batch != seen; });
+        if (m_stop)
+          return;
+        seen = m_batch;
+      }
+
+      drain(w);
+    }
+  }
+
+  void drain(uint w)
+  {
+    uint task;
+
+    while (take(w, task))
+    {
+      m_task(task, w);
+
+      if (--m_remaining == 0)
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done.notify_all();
+      }
+    }
+  }
+
+  // the front of the own queue, then the back of the next non empty one
+  bool take(uint w, uint &task)
+  {
+    {
+      Queue &own = m_queues[w];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (own.begin < own.end)
+      {
+        task = own.begin++;
+        return true;
+      }
+    }
+
+    for (uint i = 1; i < size(); i++)
+    {
+      Queue &victim = m_queues[(w + i) % size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (victim.begin < victim.end)
+      {
+        task = --victim.end;
+        return true;
+      }
+    }
+
+    return false;
+  }
+};
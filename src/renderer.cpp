@@ -1,13 +1,22 @@
 #include "renderer.h"
 #include "gfx/gfx.h"
 #include "kdtree.h"
+#include "bvh.h"
+#include "lbvh.h"
+#include "sbvh.h"
+#include "grid.h"
+#include "compact.h"
+#include "wide.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
+#include <bit>
 #include <span>
+#include <numeric>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
 
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -18,13 +27,54 @@ const std::string raytracer_shader = R"(
 #include "raytracer.glsl"
 )";
 
+// values of STAGE and the queue layout in raytracer.glsl
+enum WavefrontStage : uint {
+  STAGE_GENERATE = 1,
+  STAGE_EXTEND   = 2,
+  STAGE_SHADE    = 3,
+  STAGE_QUEUES   = 4,
+  STAGE_TILES    = 5,
+};
+
+constexpr uint QUEUE_EXTEND = 0;
+constexpr uint QUEUE_SHADE = 1; // one queue per material type follows
+constexpr uint QUEUE_COUNT = 4;
+constexpr uint QUEUE_SIZE = 8 * sizeof(uint);
+constexpr uint WAVEFRONT_GROUP_SIZE = 64;
+constexpr size_t PATH_STATE_SIZE = 7 * sizeof(glm::vec4);
+
+// the tiles of adaptive sampling are the 8x8 work groups of the megakernel
+constexpr int TILE_SIZE = 8;
+
+// defines have to follow the #version line
+static std::string with_define(const std::string& source, const std::string& name, uint value)
+{
+  size_t line = source.find('\n', source.find("#version"));
+  if (line == std::string::npos) {
+    return source;
+  }
+  return source.substr(0, line + 1) + "#define " + name + " " + std::to_string(value) + "\n" + source.substr(line + 1);
+}
+
+// the render shader with a traversal stack of stack_size entries, debug builds count the
+// entries a full stack drops
+static std::string traversal_source(uint stack_size)
+{
+  std::string source = with_define(ShaderProgram::from_file("shaders/raytracer.glsl"), "STACK_SIZE", stack_size);
+#ifndef NDEBUG
+  source = with_define(source, "STACK_CHECK", 1);
+#endif
+  return source;
+}
+
 Renderer::Renderer(int width, int height) 
   : Window(width, height, "Pathtracer")
   , m_screen_shader(std::make_unique<ShaderProgram>(
       ShaderProgram::from_file("shaders/screen.vert"), 
       ShaderProgram::from_file("shaders/screen.frag")))
-  , m_render_shader(std::make_unique<ShaderProgram>(ShaderProgram::from_file("shaders/raytracer.glsl")))
+  , m_render_shader(std::make_unique<ShaderProgram>(traversal_source(32)))
   , m_texture(std::make_unique<Texture>())
+  , m_moments(std::make_unique<Texture>())
   , m_screen_quad_vao(std::make_unique<VertexArrayObject>())
   , m_screen_quad_vbo(std::make_unique<VertexBuffer>())
   , m_spheres(std::make_unique<ShaderStorageBuffer>())
@@ -32,6 +82,20 @@ Renderer::Renderer(int width, int height)
   , m_vertices(std::make_unique<ShaderStorageBuffer>())
   , m_meshes(std::make_unique<ShaderStorageBuffer>())
   , m_kdtree(std::make_unique<ShaderStorageBuffer>())
+  , m_instances(std::make_unique<ShaderStorageBuffer>())
+  , m_compact_nodes(std::make_unique<ShaderStorageBuffer>())
+  , m_wide_nodes(std::make_unique<ShaderStorageBuffer>())
+  , m_triangle_records(std::make_unique<ShaderStorageBuffer>())
+  , m_leaf_indices(std::make_unique<ShaderStorageBuffer>())
+  , m_grid(std::make_unique<ShaderStorageBuffer>())
+  , m_sphere_blocks(std::make_unique<ShaderStorageBuffer>())
+  , m_triangle_blocks(std::make_unique<ShaderStorageBuffer>())
+  , m_lights(std::make_unique<ShaderStorageBuffer>())
+  , m_environment(std::make_unique<ShaderStorageBuffer>())
+  , m_paths(std::make_unique<ShaderStorageBuffer>())
+  , m_queues(std::make_unique<ShaderStorageBuffer>())
+  , m_ray_count(std::make_unique<ShaderStorageBuffer>())
+  , m_tiles(std::make_unique<ShaderStorageBuffer>())
   , m_camera(glm::vec3(0.0f, 0.0f, -35.0f), 33.0f)
 {
   // setup screen quad
@@ -61,10 +125,34 @@ Renderer::Renderer(int width, int height)
   m_texture->set_parameter(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
   m_texture->set_parameter(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_width, m_height, 0, GL_RGBA, GL_FLOAT, NULL);
+
+  m_moments->bind();
+  m_moments->set_parameter(GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  m_moments->set_parameter(GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, m_width, m_height, 0, GL_RGBA, GL_FLOAT, NULL);
+
+  // indirect dispatch arguments followed by one id per tile
+  const std::vector<uint> tiles((m_width / TILE_SIZE) * (m_height / TILE_SIZE) + 4, 0);
+  m_tiles->bind();
+  m_tiles->buffer_data(std::span(tiles), GL_DYNAMIC_COPY);
+
+  const std::vector<uint> zero = { 0, 0, 0, 0 };
+  m_ray_count->bind();
+  m_ray_count->buffer_data(std::span(zero), GL_DYNAMIC_READ);
+  glGenQueries(1, &m_ray_query);
+
+  upload_environment();
 }
 
 void Renderer::render(float dt)
 {
+  if (m_animation) {
+    m_animation_time += dt;
+    m_animation(*this, m_animation_time);
+  }
+
+  update_tree();
+
   ImGuiWindowFlags window_flags = 0;
 
   ImGui::SetNextWindowPos(ImVec2(10, 10));
@@ -72,12 +160,48 @@ void Renderer::render(float dt)
   ImGui::Begin("Options", nullptr, window_flags);
   ImGui::Text("FPS: %.2f", 1.0f / dt);
   ImGui::Text("Time: %.2f", m_time);
+  read_ray_count();
+  if (!m_use_cpu) ImGui::Text("Mrays/s: %.2f", m_rays_per_second / 1e6);
+  if (!m_use_cpu && m_use_nee) ImGui::Text("Shadow Mrays/s: %.2f", m_shadow_rays_per_second / 1e6);
+  if (m_use_cpu && m_cpu) m_path_length = m_cpu->stats().path_length();
+  ImGui::Text("Path length: %.2f", m_path_length);
+  ImGui::Checkbox("Adaptive Sampling", &m_adaptive);
+  if (m_adaptive) {
+    ImGui::SliderFloat("Noise Threshold", &m_adaptive_threshold, 0.001f, 0.2f, "%.3f", ImGuiSliderFlags_Logarithmic);
+    ImGui::SliderInt("Min Frames", &m_adaptive_min_frames, 2, 256);
+    if (m_use_cpu && m_cpu) m_active_tiles = static_cast<float>(m_cpu->active_tiles()) / m_cpu->tile_count();
+    if (m_use_cpu || m_path_scheduling == PathScheduling::MEGAKERNEL) ImGui::Text("Active tiles: %.1f%%", 100.0f * m_active_tiles);
+  }
   ImGui::Checkbox("Use Envmap", &m_use_envmap);
   ImGui::Checkbox("Use DOF", &m_use_dof);
+  ImGui::Checkbox("Sample Lights", &m_use_nee);
+  if (ImGui::Checkbox("Render on CPU", &m_use_cpu)) reset_buffer();
   ImGui::SliderInt("Bounces", &m_bounces, 1, 20);
+  ImGui::Checkbox("Russian Roulette", &m_roulette);
+  if (m_roulette) ImGui::SliderInt("Roulette Depth", &m_roulette_depth, 1, 20);
   ImGui::SliderFloat("Aperture", &m_camera.aperture, 0.001f, 1.0f);
   ImGui::SliderFloat("Focal Length", &m_camera.focal_length, 0.001f, 50.0f);
   ImGui::SliderFloat("FOV", &m_camera.fov, 0.001f, 90.0f);
+  int node_format = static_cast<int>(m_node_format);
+  if (ImGui::Combo("Nodes", &node_format, "full\0quantized 16 bit\0quantized 8 bit\0wide 4\0")) {
+    set_node_format(static_cast<NodeFormat>(node_format));
+  }
+  int triangle_format = static_cast<int>(m_triangle_format);
+  if (ImGui::Combo("Triangles", &triangle_format, "raw\0precomputed\0")) {
+    set_triangle_format(static_cast<TriangleFormat>(triangle_format));
+  }
+  int leaf_format = static_cast<int>(m_leaf_format);
+  if (ImGui::Combo("Leaves", &leaf_format, "indexed\0structure of arrays\0")) {
+    set_leaf_format(static_cast<LeafFormat>(leaf_format));
+  }
+  int path_scheduling = static_cast<int>(m_path_scheduling);
+  if (ImGui::Combo("Paths", &path_scheduling, "megakernel\0wavefront\0")) {
+    set_path_scheduling(static_cast<PathScheduling>(path_scheduling));
+  }
+  int sampler = static_cast<int>(m_sampler);
+  if (ImGui::Combo("Sampler", &sampler, "pcg\0sobol\0")) {
+    set_sampler(static_cast<SamplerType>(sampler));
+  }
   if (ImGui::Button("Reset Buffer")) reset_buffer();
   if (ImGui::Button("Save Image")) save_to_file();
   ImGui::End();
@@ -91,47 +215,68 @@ void Renderer::render(float dt)
   m_meshes->bind_buffer_base(3);
   m_vertices->bind_buffer_base(4);
   m_kdtree->bind_buffer_base(5);
+  m_instances->bind_buffer_base(6);
+  m_compact_nodes->bind_buffer_base(7);
+  m_wide_nodes->bind_buffer_base(8);
+  m_triangle_records->bind_buffer_base(9);
+  m_leaf_indices->bind_buffer_base(10);
+  m_grid->bind_buffer_base(11);
+  m_sphere_blocks->bind_buffer_base(12);
+  m_triangle_blocks->bind_buffer_base(13);
+  m_paths->bind_buffer_base(14);
+  m_queues->bind_buffer_base(15);
+  m_ray_count->bind_buffer_base(16);
+  m_tiles->bind_buffer_base(17);
+  m_lights->bind_buffer_base(18);
+  m_environment->bind_buffer_base(19);
   
-
-  m_render_shader->bind();
-  m_render_shader->set_uniform("u_time", m_time);
-  m_render_shader->set_uniform("u_frames", m_frames);
-  m_render_shader->set_uniform("u_samples", m_samples);
-  m_render_shader->set_uniform("u_max_bounce", static_cast<unsigned int>(m_bounces));
-  m_render_shader->set_uniform("u_background", m_background);
-  m_render_shader->set_uniform("u_random", rand());
-
-  if (m_envmap) {
-    m_envmap->bind(3);
-    m_screen_shader->set_uniform("u_envmap", 3);
-    m_render_shader->set_uniform("u_use_envmap", m_use_envmap);
-  } else {
-    m_render_shader->set_uniform("u_use_envmap", false);
+  TraceSettings settings = trace_settings();
+  bool wavefront = !m_use_cpu && m_path_scheduling == PathScheduling::WAVEFRONT;
+  bool count_rays = !m_use_cpu && !m_ray_query_pending;
+
+  if (wavefront) {
+    prepare_wavefront();
+    for (const auto& stage : m_wavefront_shaders) {
+      set_uniforms(*stage, settings, count_rays);
+    }
   }
+  set_uniforms(*m_render_shader, settings, count_rays);
 
-  m_render_shader->set_uniform("u_use_dof", m_use_dof);
-  m_render_shader->set_uniform("u_use_bvh", m_use_bvh);
-
-  m_render_shader->set_uniform("u_camera_position", m_camera.position);
-  m_render_shader->set_uniform("u_camera_fov", glm::radians(m_camera.fov));
-  m_render_shader->set_uniform("u_camera_aperture", m_camera.aperture);
-  m_render_shader->set_uniform("u_camera_focal_length", m_camera.focal_length);
-  m_render_shader->set_uniform("u_camera_forward", m_camera.forward);
-  m_render_shader->set_uniform("u_camera_right", m_camera.right);
-  m_render_shader->set_uniform("u_camera_up", m_camera.up);
-
-  m_render_shader->set_uniform("u_reset_flag", m_reset);
   if (m_reset) {
     m_reset = false;
     m_time = m_frames = 0;
   } 
 
-  glBindImageTexture(0, m_texture->id(), 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+  if (m_use_cpu) {
+    render_cpu(settings);
+  } else {
+    glBindImageTexture(0, m_texture->id(), 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    glBindImageTexture(1, m_moments->id(), 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+
+    if (count_rays) {
+      const std::vector<uint> zero = { 0, 0, 0, 0 };
+      m_ray_count->bind();
+      m_ray_count->buffer_sub_data(0, std::span(zero));
+      glBeginQuery(GL_TIME_ELAPSED, m_ray_query);
+    }
+
+    if (wavefront) {
+      render_wavefront();
+    } else if (m_adaptive) {
+      render_adaptive(settings);
+    } else {
+      // dispatch compute shaders
+      int work_group_size = 8;
+      m_render_shader->bind();
+      glDispatchCompute(m_width / work_group_size, m_height / work_group_size, 1);
+    }
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
 
-  // dispatch compute shaders
-  int work_group_size = 8;
-  glDispatchCompute(m_width / work_group_size, m_height / work_group_size, 1);
-  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    if (count_rays) {
+      glEndQuery(GL_TIME_ELAPSED);
+      m_ray_query_pending = true;
+    }
+  }
 
   m_texture->bind(0);
 
@@ -148,16 +293,300 @@ void Renderer::render(float dt)
   }
 }
 
+// the uniforms of the render shader and of every wavefront stage
+void Renderer::set_uniforms(const ShaderProgram& program, const TraceSettings& settings, bool count_rays) const
+{
+  program.bind();
+  program.set_uniform("u_time", m_time);
+  program.set_uniform("u_samples", settings.samples);
+  program.set_uniform("u_max_bounce", settings.max_bounce);
+  program.set_uniform("u_roulette", settings.roulette);
+  program.set_uniform("u_roulette_depth", settings.roulette_depth);
+  program.set_uniform("u_background", settings.background);
+  program.set_uniform("u_random", settings.random);
+  program.set_uniform("u_sampler", static_cast<unsigned int>(settings.sampler));
+
+  if (m_envmap) {
+    m_envmap->bind(3);
+    m_screen_shader->set_uniform("u_envmap", 3);
+    program.set_uniform("u_use_envmap", m_use_envmap);
+  } else {
+    program.set_uniform("u_use_envmap", false);
+  }
+
+  program.set_uniform("u_use_dof", settings.use_dof);
+  program.set_uniform("u_use_bvh", settings.use_bvh);
+  program.set_uniform("u_use_grid", settings.use_grid);
+  program.set_uniform("u_use_nee", settings.use_nee);
+  program.set_uniform("u_light_count", static_cast<unsigned int>(m_light_data.size()));
+  program.set_uniform("u_envmap_size", static_cast<unsigned int>(m_envmap_data.distribution.empty() ? 0 : m_envmap_data.size()));
+  program.set_uniform("u_node_format", static_cast<unsigned int>(m_node_format));
+  program.set_uniform("u_triangle_format", static_cast<unsigned int>(m_triangle_format));
+  program.set_uniform("u_leaf_format", static_cast<unsigned int>(m_leaf_format));
+
+  program.set_uniform("u_camera_position", m_camera.position);
+  program.set_uniform("u_camera_fov", glm::radians(m_camera.fov));
+  program.set_uniform("u_camera_aperture", m_camera.aperture);
+  program.set_uniform("u_camera_focal_length", m_camera.focal_length);
+  program.set_uniform("u_camera_forward", m_camera.forward);
+  program.set_uniform("u_camera_right", m_camera.right);
+  program.set_uniform("u_camera_up", m_camera.up);
+
+  program.set_uniform("u_reset_flag", settings.reset);
+  program.set_uniform("u_path_count", m_path_count);
+  program.set_uniform("u_count_rays", count_rays);
+  program.set_uniform("u_adaptive", settings.adaptive);
+  program.set_uniform("u_adaptive_threshold", settings.adaptive_threshold);
+  program.set_uniform("u_adaptive_min_frames", settings.adaptive_min_frames);
+}
+
+// compiles the wavefront stages on first use and sizes the path and queue buffers for one
+// path per pixel. a queue can hold every path twice, see queue_buffer in raytracer.glsl
+void Renderer::prepare_wavefront()
+{
+  if (!m_wavefront_shaders[0]) {
+    std::string source = traversal_source(m_stack_size);
+    for (uint i = 0; i < m_wavefront_shaders.size(); i++) {
+      m_wavefront_shaders[i] = std::make_unique<ShaderProgram>(with_define(source, "STAGE", STAGE_GENERATE + i));
+    }
+  }
+
+  uint paths = static_cast<uint>(m_width * m_height);
+  if (paths == m_path_count) {
+    return;
+  }
+
+  m_path_count = paths;
+  m_paths->bind();
+  glBufferData(GL_SHADER_STORAGE_BUFFER, paths * PATH_STATE_SIZE, nullptr, GL_DYNAMIC_COPY);
+  m_queues->bind();
+  glBufferData(GL_SHADER_STORAGE_BUFFER, QUEUE_COUNT * (QUEUE_SIZE + 2 * paths * sizeof(uint)), nullptr, GL_DYNAMIC_COPY);
+}
+
+// One frame of the wavefront path tracer. Every pixel starts a path, each iteration then
+// intersects the queued rays and shades the hits one material type at a time, and paths
+// that end start the next sample of their pixel in the same slot. A pixel takes at most
+// samples * bounces iterations. The queues stage sizes every pass on the gpu from the queue
+// counters, so the cpu never waits and passes over empty queues cost next to nothing.
+void Renderer::render_wavefront()
+{
+  const ShaderProgram& generate = *m_wavefront_shaders[STAGE_GENERATE - STAGE_GENERATE];
+  const ShaderProgram& extend = *m_wavefront_shaders[STAGE_EXTEND - STAGE_GENERATE];
+  const ShaderProgram& shade = *m_wavefront_shaders[STAGE_SHADE - STAGE_GENERATE];
+  const ShaderProgram& queues = *m_wavefront_shaders[STAGE_QUEUES - STAGE_GENERATE];
+
+  GLbitfield barrier = GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT;
+
+  const std::vector<uint> empty(QUEUE_COUNT * QUEUE_SIZE / sizeof(uint), 0);
+  m_queues->bind();
+  m_queues->buffer_sub_data(0, std::span(empty));
+
+  generate.bind();
+  glDispatchCompute((m_path_count + WAVEFRONT_GROUP_SIZE - 1) / WAVEFRONT_GROUP_SIZE, 1, 1);
+  glMemoryBarrier(barrier);
+
+  auto update_queues = [&](uint phase) {
+    queues.bind();
+    queues.set_uniform("u_queue_phase", phase);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(barrier);
+  };
+
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_queues->id());
+
+  uint iterations = m_samples * static_cast<uint>(m_bounces);
+  for (uint i = 0; i < iterations; i++) {
+    update_queues(QUEUE_EXTEND);
+    extend.bind();
+    glDispatchComputeIndirect(QUEUE_EXTEND * QUEUE_SIZE);
+    glMemoryBarrier(barrier);
+
+    // the material passes shade disjoint paths, they only meet in the atomics of the queues
+    update_queues(QUEUE_SHADE);
+    shade.bind();
+    for (uint type = 0; type < QUEUE_COUNT - QUEUE_SHADE; type++) {
+      shade.set_uniform("u_shade_queue", type);
+      glDispatchComputeIndirect((QUEUE_SHADE + type) * QUEUE_SIZE);
+    }
+    glMemoryBarrier(barrier);
+  }
+
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+// takes the measured frame once the gpu finished it, without waiting for it
+void Renderer::read_ray_count()
+{
+  if (!m_ray_query_pending) {
+    return;
+  }
+
+  GLint available = 0;
+  glGetQueryObjectiv(m_ray_query, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available) {
+    return;
+  }
+
+  GLuint64 nanoseconds = 0;
+  glGetQueryObjectui64v(m_ray_query, GL_QUERY_RESULT, &nanoseconds);
+
+  uint rays[4] = {};
+  m_ray_count->bind();
+  glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(rays), rays);
+
+  m_rays_per_second = (0 < nanoseconds) ? rays[0] / (nanoseconds * 1e-9) : 0.0;
+  m_shadow_rays_per_second = (0 < nanoseconds) ? rays[1] / (nanoseconds * 1e-9) : 0.0;
+  m_path_length = (0 < rays[2]) ? static_cast<float>(rays[0]) / rays[2] : 0.0f;
+  m_ray_query_pending = false;
+
+  // only debug builds count them, once per stack size is enough
+  if (0 < rays[3] && !m_stack_overflow_reported) {
+    std::cerr << "traversal stack of " << m_stack_size << " overflowed " << rays[3] << " times, subtrees were skipped" << std::endl;
+    m_stack_overflow_reported = true;
+  }
+
+  if (m_adaptive) {
+    uint active = 0;
+    m_tiles->bind();
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(uint), &active);
+    m_active_tiles = static_cast<float>(active) / ((m_width / TILE_SIZE) * (m_height / TILE_SIZE));
+  }
+}
+
+// lists the tiles that have not converged on the gpu and dispatches the megakernel over
+// them, converged tiles cost nothing but their check
+void Renderer::render_adaptive(const TraceSettings& settings)
+{
+  if (!m_tiles_shader) {
+    m_tiles_shader = std::make_unique<ShaderProgram>(
+      with_define(ShaderProgram::from_file("shaders/raytracer.glsl"), "STAGE", STAGE_TILES));
+  }
+
+  set_uniforms(*m_tiles_shader, settings, false);
+
+  const std::vector<uint> arguments = { 0, 1, 1, 0 };
+  m_tiles->bind();
+  m_tiles->buffer_sub_data(0, std::span(arguments));
+
+  glDispatchCompute(m_width / TILE_SIZE, m_height / TILE_SIZE, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+  m_render_shader->bind();
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, m_tiles->id());
+  glDispatchComputeIndirect(0);
+  glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+// the uniforms of the next frame, read before render() clears the reset flag
+TraceSettings Renderer::trace_settings() const
+{
+  TraceSettings settings;
+  settings.frames = m_frames;
+  settings.samples = m_samples;
+  settings.max_bounce = static_cast<uint>(m_bounces);
+  settings.roulette = m_roulette;
+  settings.roulette_depth = static_cast<uint>(m_roulette_depth);
+  settings.random = rand();
+  settings.background = m_background;
+  settings.reset = m_reset;
+  settings.use_envmap = m_envmap && m_use_envmap;
+  settings.use_dof = m_use_dof;
+  settings.use_bvh = m_use_bvh;
+  settings.use_grid = m_use_bvh && !m_grid_cells.empty();
+  settings.use_nee = m_use_nee;
+  settings.sampler = m_sampler;
+  settings.adaptive = m_adaptive;
+  settings.adaptive_threshold = m_adaptive_threshold;
+  settings.adaptive_min_frames = m_adaptive_min_frames;
+  return settings;
+}
+
+// the buffers as the render shader sees them, except for the instance roots which stay
+// ids of the full nodes whatever format was uploaded
+CpuScene Renderer::cpu_scene() const
+{
+  CpuScene scene;
+  scene.spheres = m_sphere_data;
+  scene.lights = m_light_data;
+  scene.materials = m_material_data;
+  scene.meshes = m_mesh_data;
+  scene.triangles = m_triangles;
+  scene.nodes = m_nodes;
+  scene.leaf_indices = m_leaf_index_data;
+  scene.grid = m_grid_data;
+  scene.leaf_format = m_leaf_format;
+
+  scene.instances = m_instance_data;
+  for (Instance& instance : scene.instances) {
+    instance.root = (instance.geometry < m_geometry_roots.size()) ? m_geometry_roots[instance.geometry] : INVALID;
+  }
+  return scene;
+}
+
+// traces the frame on the cpu and uploads the accumulated image into the render texture,
+// both store their rows bottom up
+void Renderer::render_cpu(const TraceSettings& settings)
+{
+  if (!m_cpu) {
+    m_cpu = std::make_unique<CpuTracer>(m_width, m_height);
+    m_cpu->set_envmap(m_envmap_data);
+    m_cpu_dirty = true;
+  }
+
+  if (m_cpu_dirty) {
+    m_cpu->set_scene(cpu_scene());
+    m_cpu_dirty = false;
+  }
+
+  m_cpu->render(m_camera, settings);
+
+  m_texture->bind();
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_width, m_height, GL_RGBA, GL_FLOAT, m_cpu->image().data());
+}
+
 void Renderer::set_spheres(const std::vector<Sphere>& spheres)
 {
+  m_sphere_data = spheres;
+  m_spheres_dirty = true;
+  m_spheres_moving = false;
+  m_cpu_dirty = true;
   m_spheres->bind();
   m_spheres->buffer_data(std::span(spheres));
+  upload_lights();
 }
 
 void Renderer::set_materials(const std::vector<Material>& materials)
 {
+  m_material_data = materials;
+  m_cpu_dirty = true;
   m_materials->bind();
   m_materials->buffer_data(std::span(materials));
+  upload_lights();
+}
+
+// the shader indexes the light buffer only below u_light_count, an empty list still
+// uploads one sphere so the buffer is never bound without storage
+void Renderer::upload_lights()
+{
+  m_light_data = emissive_spheres(m_sphere_data, m_material_data);
+
+  std::vector<Sphere> lights = m_light_data;
+  if (lights.empty()) {
+    lights.emplace_back(glm::vec3(0.0f), 0.0f);
+  }
+  m_lights->bind();
+  m_lights->buffer_data(std::span(lights));
+}
+
+// like the light buffer, one entry stands in for a missing table, u_envmap_size is 0 then
+void Renderer::upload_environment()
+{
+  std::vector<Cubemap::AliasEntry> entries = m_envmap_data.distribution;
+  if (entries.empty()) {
+    entries.push_back({ 1.0f, 0, 0.0f });
+  }
+  m_environment->bind();
+  m_environment->buffer_data(std::span(entries));
 }
 
 void Renderer::set_envmap(std::unique_ptr<CubemapTexture> envmap)
@@ -171,48 +600,633 @@ void Renderer::set_envmap(std::unique_ptr<CubemapTexture> envmap)
   m_envmap->set_parameter(GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 }
 
+void Renderer::set_envmap(const std::array<std::string, 6>& faces)
+{
+  // texels as the gpu filters them, normalized bytes with missing channels left at 0
+  m_envmap_data = Cubemap();
+
+  for (int i = 0; i < 6; i++) {
+    std::optional<Image> image = Image::open(faces[i]);
+    if (!image) {
+      m_envmap_data = Cubemap();
+      break;
+    }
+
+    Cubemap::Face& face = m_envmap_data.faces[i];
+    face.width = image->width();
+    face.height = image->height();
+    face.texels.assign(static_cast<size_t>(face.width) * face.height, glm::vec3(0.0f));
+
+    int channels = image->channels();
+    for (size_t t = 0; t < face.texels.size(); t++) {
+      for (int c = 0; c < glm::min(channels, 3); c++) {
+        face.texels[t][c] = image->data()[t * channels + c] / 255.0f;
+      }
+    }
+  }
+
+  m_envmap_data.build_distribution();
+  upload_environment();
+
+  if (m_cpu) {
+    m_cpu->set_envmap(m_envmap_data);
+  }
+  set_envmap(std::make_unique<CubemapTexture>(faces));
+}
+
 void Renderer::set_vertices(const std::vector<glm::vec4>& vertices)
 {
-  auto triangles = to_triangles(vertices);
-  m_vertices->bind();
-  m_vertices->buffer_data(std::span(triangles));
+  m_triangle_data = to_triangles(vertices);
+  m_triangles_dirty = true;
+  m_triangles = m_triangle_data;
+  upload_triangles();
 }
 
 void Renderer::set_meshes(const std::vector<Mesh>& meshes)
 {
+  // the tree does not know about meshes, so every triangle carries its material in w
+  for (const Mesh& mesh : meshes) {
+    uint end = glm::min(mesh.start + mesh.size, static_cast<uint>(m_triangle_data.size()));
+    for (uint i = mesh.start; i < end; i++) {
+      for (glm::vec4& vertex : m_triangle_data[i].v) {
+        vertex.w = static_cast<float>(mesh.material);
+      }
+    }
+  }
+
+  m_triangles_dirty = true;
+  m_triangles = m_triangle_data;
+  upload_triangles();
+
+  m_mesh_data = meshes;
   m_meshes->bind();
   m_meshes->buffer_data(std::span(meshes));
 }
 
-void Renderer::set_nodes(const std::vector<KdNode>& nodes)
+void Renderer::set_nodes(const std::vector<KdNode>& nodes, const std::vector<uint>& indices)
 {
-  m_kdtree->bind();
-  m_kdtree->buffer_data(std::span(nodes));
+  m_spheres_dirty = m_triangles_dirty = false;
+  m_use_bvh = true;
+
+  // without indices the leaves index the sphere buffer as it was given
+  m_leaf_index_data = indices;
+  if (indices.empty()) {
+    m_leaf_index_data.resize(m_sphere_data.size());
+    std::iota(m_leaf_index_data.begin(), m_leaf_index_data.end(), 0U);
+  }
+
+  m_leaf_indices->bind();
+  m_leaf_indices->buffer_data(std::span(m_leaf_index_data));
+
+  m_nodes = nodes;
+  m_geometry_roots.clear();
+  m_instance_data.clear();
+  m_grid_cells.clear();
+  upload_nodes();
+
+  m_build_cost = sah_cost(m_nodes);
+}
+
+// uploads the elements at the ascending ids, nearby ids are joined into one range
+// since a few larger uploads are cheaper than many small ones
+template <class T>
+static void upload_ranges(ShaderStorageBuffer& buffer, const std::vector<T>& data, const std::vector<uint>& ids, uint max_gap = 64)
+{
+  buffer.bind();
+
+  for (size_t i = 0; i < ids.size();) {
+    size_t j = i + 1;
+    while (j < ids.size() && ids[j] - ids[j - 1] <= max_gap) j++;
+
+    uint begin = ids[i], end = ids[j - 1] + 1;
+    buffer.buffer_sub_data(begin * sizeof(T), std::span(data).subspan(begin, end - begin));
+    i = j;
+  }
+}
+
+void Renderer::update_spheres(const std::vector<Sphere>& spheres)
+{
+  // the grid is rebuilt in linear time, there are no boxes to refit
+  bool refittable = m_use_bvh && !m_spheres_dirty && !m_nodes.empty() && spheres.size() == m_sphere_data.size() &&
+    m_tree_builder != TreeBuilder::GRID;
+
+  if (!refittable) {
+    set_spheres(spheres);
+    m_spheres_moving = true;
+    return;
+  }
+
+  std::vector<uint> moved;
+  for (uint i = 0; i < spheres.size(); i++) {
+    const Sphere& sphere = spheres[i];
+    Sphere& old = m_sphere_data[i];
+
+    if (sphere.center != old.center || sphere.radius != old.radius || sphere.material != old.material) {
+      old = sphere;
+      moved.push_back(i);
+    }
+  }
+
+  if (moved.empty()) {
+    return;
+  }
+  m_spheres_moving = true;
+
+  std::vector<uint> changed = refit(m_nodes, [&](const KdNode& node, AABB& box) {
+    if (leaf_type(node) != PRIMITIVE_SPHERE) return false;
+
+    for (uint i = node.offset; i < node.offset + leaf_count(node); i++) {
+      grow(box, m_sphere_data[m_leaf_index_data[i]].bounds());
+    }
+    return true;
+  });
+
+  upload_ranges(*m_spheres, m_sphere_data, moved);
+  upload_lights();
+  m_cpu_dirty = true;
+  if (m_node_format == NodeFormat::FULL && m_leaf_format == LeafFormat::INDEXED) {
+    upload_ranges(*m_kdtree, m_nodes, changed);
+  } else {
+    // quantized and wide nodes are derived from the whole tree and soa leaves hold copies
+    // of the moved spheres, so everything is encoded again
+    upload_nodes();
+  }
+  reset_buffer();
+
+  // refitted boxes only grow apart, rebuild once the tree got too much worse
+  float cost = sah_cost(m_nodes);
+  if (m_refit_threshold * m_build_cost < cost) {
+    std::cout << "refit cost " << cost << " exceeds " << m_refit_threshold << " x " << m_build_cost << ", rebuilding" << std::endl;
+    m_spheres_dirty = true;
+  }
+}
+
+void Renderer::set_refit_threshold(float threshold)
+{
+  m_refit_threshold = threshold;
+}
+
+void Renderer::set_animation(std::function<void(Renderer&, float)> animation)
+{
+  m_animation = std::move(animation);
+  m_animation_time = 0.0f;
 }
 
 void Renderer::set_kdtree(const std::vector<Sphere>& objects)
 {
-  KdTree<Sphere, 1, 2> tree(objects);
-  auto nodes = tree.nodes();
-  auto primitives = tree.primitives();
-  m_spheres->bind();
-  m_spheres->buffer_data(std::span(primitives));
-  m_kdtree->bind();
-  m_kdtree->buffer_data(std::span(nodes));
   m_use_bvh = true;
+  set_spheres(objects);
+  update_tree();
 }
 
 void Renderer::set_kdtree(const std::vector<glm::vec4>& objects)
 {
-  auto triangles = to_triangles(objects);
-  KdTree<Triangle, 8, 1> tree(triangles);
-  auto nodes = tree.nodes();
-  auto primitives = tree.primitives();
-  m_vertices->bind();
-  m_vertices->buffer_data(std::span(primitives));
+  m_use_bvh = true;
+  set_vertices(objects);
+  update_tree();
+}
+
+void Renderer::set_tree_builder(TreeBuilder builder)
+{
+  m_tree_builder = builder;
+  m_spheres_dirty = !m_sphere_data.empty();
+  m_triangles_dirty = !m_triangle_data.empty();
+  m_instances_dirty = !m_instance_data.empty();
+}
+
+void Renderer::set_cache_directory(const std::string& directory)
+{
+  m_cache = BuildCache(directory);
+}
+
+// bumped whenever a builder changes the trees it produces for the same input
+static constexpr uint64_t TREE_CACHE_VERSION = 1;
+
+// the trees only depend on the shape of the primitives, spheres leave out their
+// material and padding
+static uint64_t shape_hash(const std::vector<Triangle>& triangles, uint64_t seed)
+{
+  return hash_span(std::span(triangles), seed);
+}
+
+static uint64_t shape_hash(const std::vector<Sphere>& spheres, uint64_t seed)
+{
+  std::vector<glm::vec4> shapes;
+  shapes.reserve(spheres.size());
+  for (const Sphere& sphere : spheres) {
+    shapes.emplace_back(sphere.center, sphere.radius);
+  }
+  return hash_span(std::span(shapes), seed);
+}
+
+template <class Params>
+static uint64_t tree_key(uint64_t shapes, TreeBuilder builder, Params params)
+{
+  if constexpr (requires { params.threads; }) {
+    params.threads = 0; // any thread count builds the same tree
+  }
+  uint64_t key = hash_bytes(&params, sizeof(params), shapes ^ TREE_CACHE_VERSION);
+  return hash_bytes(&builder, sizeof(builder), key);
+}
+
+// builds the tree over primitives and returns its nodes, leaves are tagged with type and
+// index indices which receives the position in primitives of every reference. with a cache
+// the result is looked up under a hash of the primitives and the builder settings first
+template <class Bounded>
+static std::vector<KdNode> build_tree(const std::vector<Bounded>& primitives, TreeBuilder builder, PrimitiveType type,
+  const std::string& name, std::vector<uint>& indices, const BuildCache* cache = nullptr)
+{
+  LBVHParams lbvh_params;
+  lbvh_params.treelet_size = 7;
+  SBVHParams sbvh_params;
+  BVHParams bvh_params;
+
+  uint64_t key = 0;
+  bool cached = false;
+
+  if constexpr (requires { shape_hash(primitives, 0); }) {
+    if (cache && cache->enabled()) {
+      uint64_t shapes = shape_hash(primitives, primitives.size());
+      if (builder == TreeBuilder::LBVH) key = tree_key(shapes, builder, lbvh_params);
+      else if (builder == TreeBuilder::SBVH) key = tree_key(shapes, builder, sbvh_params);
+      else key = tree_key(shapes, builder, bvh_params);
+      cached = true;
+    }
+  }
+
+  if (cached) {
+    // a truncated or stale file is rebuilt rather than sending the traversal out of its buffers
+    auto entry = cache->load(key, 2);
+    if (entry && std::ranges::all_of(entry->section<uint>(1), [&](uint i) { return i < primitives.size(); })) {
+      std::vector<KdNode> nodes = entry->copy<KdNode>(0);
+      if (valid_tree(nodes, entry->section<uint>(1).size(), type)) {
+        indices = entry->copy<uint>(1);
+        std::cout << name << " tree: " << indices.size() << " references from " << cache->path(key) << std::endl;
+        return nodes;
+      }
+    }
+  }
+
+  std::vector<KdNode> nodes;
+
+  if (builder == TreeBuilder::LBVH) {
+    LBVH<Bounded> tree(primitives, lbvh_params);
+    std::cout << name << " lbvh: " << tree.stats() << std::endl;
+    indices = tree.indices();
+    nodes = tree.nodes();
+  } else if (builder == TreeBuilder::SBVH) {
+    SBVH<Bounded> tree(primitives, sbvh_params);
+    std::cout << name << " sbvh: " << tree.stats() << std::endl;
+    indices = tree.indices();
+    nodes = tree.nodes();
+  } else {
+    BVH<Bounded> tree(primitives, bvh_params);
+    std::cout << name << " bvh: " << tree.stats() << std::endl;
+    indices = tree.indices();
+    nodes = tree.nodes();
+  }
+  tag_leaves(nodes, type);
+
+  if (cached && !cache->store(key, {as_section(nodes), as_section(indices)})) {
+    std::cerr << "could not write " << cache->path(key) << std::endl;
+  }
+  return nodes;
+}
+
+// appends the leaf indices of a tree, offset by base, and returns the nodes with their
+// leaf offsets moved to the appended range
+static std::vector<KdNode> chain_leaves(std::vector<uint>& indices, const std::vector<KdNode>& nodes,
+  const std::vector<uint>& tree_indices, uint base = 0)
+{
+  std::vector<KdNode> shifted;
+  (void)append(shifted, nodes, static_cast<uint>(indices.size()));
+
+  for (uint i : tree_indices) {
+    indices.push_back(base + i);
+  }
+  return shifted;
+}
+
+uint Renderer::add_geometry(const std::vector<glm::vec4>& vertices)
+{
+  Geometry geometry;
+  geometry.triangles = to_triangles(vertices);
+  geometry.nodes = build_tree(geometry.triangles, m_tree_builder, PRIMITIVE_TRIANGLE, "geometry", geometry.indices,
+    &m_cache);
+
+  m_geometries.push_back(std::move(geometry));
+  m_instances_dirty = true;
+  m_use_bvh = true;
+  return static_cast<uint>(m_geometries.size() - 1);
+}
+
+void Renderer::set_instances(const std::vector<Instance>& instances)
+{
+  m_instance_data = instances;
+  m_instances_dirty = true;
+  m_use_bvh = true;
+}
+
+// stands in for an instance while the top level tree is built
+struct InstanceBounds {
+  AABB box;
+  uint index;
+
+  AABB bounds() const { return box; }
+};
+
+// builds one tree per primitive type and joins them, so a single traversal
+// on the gpu finds spheres, triangles and instances. the geometry trees are
+// appended behind the top level, instances point at their roots.
+void Renderer::update_tree()
+{
+  if (!m_use_bvh || !(m_spheres_dirty || m_triangles_dirty || m_instances_dirty)) {
+    return;
+  }
+
+  // only the spheres go into the grid
+  bool grid = m_tree_builder == TreeBuilder::GRID;
+  TreeBuilder builder = grid ? TreeBuilder::SAH : m_tree_builder;
+
+  if (m_spheres_dirty && grid) {
+    build_grid();
+    m_sphere_nodes.clear();
+    m_sphere_indices.clear();
+    m_spheres_dirty = false;
+  } else if (m_spheres_dirty) {
+    m_sphere_nodes = build_tree(m_sphere_data, builder, PRIMITIVE_SPHERE, "sphere", m_sphere_indices,
+      m_spheres_moving ? nullptr : &m_cache);
+    m_grid_cells.clear();
+    m_grid_indices.clear();
+    m_spheres_dirty = false;
+  }
+
+  if (m_triangles_dirty) {
+    m_triangle_nodes = build_tree(m_triangle_data, builder, PRIMITIVE_TRIANGLE, "triangle", m_triangle_indices,
+      &m_cache);
+    m_triangles_dirty = false;
+  }
+
+  if (m_instances_dirty) {
+    std::vector<InstanceBounds> boxes;
+
+    for (uint i = 0; i < m_instance_data.size(); i++) {
+      const Instance& instance = m_instance_data[i];
+      if (instance.geometry < m_geometries.size() && !m_geometries[instance.geometry].nodes.empty()) {
+        const AABB& box = m_geometries[instance.geometry].nodes[0];
+        boxes.push_back({ transform_bounds(box, glm::inverse(instance.world_to_object)), i });
+      }
+    }
+
+    m_instance_nodes.clear();
+    m_instance_indices.clear();
+
+    if (!boxes.empty()) {
+      std::vector<uint> order;
+      m_instance_nodes = build_tree(boxes, builder, PRIMITIVE_INSTANCE, "instance", order);
+      for (uint i : order) {
+        m_instance_indices.push_back(boxes[i].index);
+      }
+    }
+
+    m_instances_dirty = false;
+  }
+
+  // every tree gets its range of the shared leaf index list, the indices point into the
+  // sphere, triangle and instance buffers which hold each primitive once
+  std::vector<uint> indices;
+  auto sphere_nodes = chain_leaves(indices, m_sphere_nodes, m_sphere_indices);
+  auto triangle_nodes = chain_leaves(indices, m_triangle_nodes, m_triangle_indices);
+  auto instance_nodes = chain_leaves(indices, m_instance_nodes, m_instance_indices);
+  auto nodes = merge(merge(sphere_nodes, triangle_nodes), instance_nodes);
+
+  // the scene triangles come first in the vertex buffer, followed by every geometry
+  std::vector<Triangle> triangles = m_triangle_data;
+  m_geometry_roots.assign(m_geometries.size(), INVALID);
+
+  if (!m_instance_nodes.empty()) {
+    for (uint g = 0; g < m_geometries.size(); g++) {
+      const Geometry& geometry = m_geometries[g];
+      if (geometry.nodes.empty()) continue;
+
+      uint base = static_cast<uint>(triangles.size());
+      m_geometry_roots[g] = append(nodes, chain_leaves(indices, geometry.nodes, geometry.indices, base));
+      triangles.insert(triangles.end(), geometry.triangles.begin(), geometry.triangles.end());
+    }
+  }
+
+  // the grid cells index the end of the list
+  std::vector<uint> cells = m_grid_cells;
+  uint grid_base = static_cast<uint>(indices.size());
+  for (uint& offset : cells) {
+    offset += grid_base;
+  }
+  indices.insert(indices.end(), m_grid_indices.begin(), m_grid_indices.end());
+
+  std::vector<uint> grid = m_grid_cells.empty() ? std::vector<uint>() : m_grid_header;
+  grid.insert(grid.end(), cells.begin(), cells.end());
+  m_grid_data = std::move(grid);
+  m_grid->bind();
+  m_grid->buffer_data(std::span(m_grid_data));
+
+  m_leaf_index_data = std::move(indices);
+  m_leaf_indices->bind();
+  m_leaf_indices->buffer_data(std::span(m_leaf_index_data));
+
+  m_triangles = std::move(triangles);
+  upload_triangles();
+
+  m_build_cost = sah_cost(nodes);
+  m_nodes = std::move(nodes);
+  upload_nodes();
+  reset_buffer();
+}
+
+// builds the sphere grid and its header, the layout of grid_buffer in raytracer.glsl:
+// min, cell size and resolution as three 16 byte rows, then the cell offsets
+void Renderer::build_grid()
+{
+  m_grid_cells.clear();
+  m_grid_indices.clear();
+  if (m_sphere_data.empty()) {
+    return;
+  }
+
+  Grid<Sphere> grid(m_sphere_data);
+  std::cout << "sphere grid: " << grid.stats() << std::endl;
+
+  glm::vec3 min = glm::vec3(grid.bounds().min), size = grid.cell_size();
+  glm::uvec3 resolution = grid.resolution();
+
+  m_grid_header = {
+    std::bit_cast<uint>(min.x), std::bit_cast<uint>(min.y), std::bit_cast<uint>(min.z), 0U,
+    std::bit_cast<uint>(size.x), std::bit_cast<uint>(size.y), std::bit_cast<uint>(size.z), 0U,
+    resolution.x, resolution.y, resolution.z, 0U,
+  };
+  m_grid_cells = grid.cells();
+  m_grid_indices = grid.indices();
+}
+
+// uploads m_nodes in the selected format, together with the instances whose roots
+// are node ids of that format. soa leaves are copied out of the leaf index list and the
+// primitive buffers here, their node ids are those of m_nodes
+void Renderer::upload_nodes()
+{
+  std::vector<uint> roots = { 0 };
+  roots.insert(roots.end(), m_geometry_roots.begin(), m_geometry_roots.end());
+
+  SoaLeaves leaves;
+  if (m_leaf_format == LeafFormat::SOA) {
+    std::vector<TriangleRecord> records(m_triangles.begin(), m_triangles.end());
+    leaves = SoaLeaves(m_nodes, m_leaf_index_data, m_sphere_data, records);
+  }
+  const std::vector<KdNode>& source = (m_leaf_format == LeafFormat::SOA) ? leaves.nodes() : m_nodes;
+
+  std::vector<KdNode> nodes;
+  std::vector<uint> words;
+  std::vector<WideNode<4>> wide;
+
+  if (m_node_format == NodeFormat::QUANTIZED_16) {
+    words = CompactNodes<16>::encode(source, roots);
+  } else if (m_node_format == NodeFormat::QUANTIZED_8) {
+    words = CompactNodes<8>::encode(source, roots);
+  } else if (m_node_format == NodeFormat::WIDE_4) {
+    wide = WideBVH<4>(source, roots).nodes();
+  } else {
+    nodes = source;
+  }
+
+  std::vector<Instance> instances = m_instance_data;
+  for (Instance& instance : instances) {
+    instance.root = (instance.geometry < m_geometry_roots.size()) ? roots[1 + instance.geometry] : INVALID;
+  }
+
+  m_instances->bind();
+  m_instances->buffer_data(std::span(instances));
   m_kdtree->bind();
   m_kdtree->buffer_data(std::span(nodes));
-  m_use_bvh = true;
+  m_compact_nodes->bind();
+  m_compact_nodes->buffer_data(std::span(words));
+  m_wide_nodes->bind();
+  m_wide_nodes->buffer_data(std::span(wide));
+  m_sphere_blocks->bind();
+  m_sphere_blocks->buffer_data(std::span(leaves.spheres()));
+  m_triangle_blocks->bind();
+  m_triangle_blocks->buffer_data(std::span(leaves.triangles()));
+  m_cpu_dirty = true;
+
+  set_stack_size(stack_size());
+}
+
+// entries the gpu traversal needs at most: a pending sibling per level of the tree (three
+// for wide nodes), the instance markers of a leaf and the deepest geometry below it
+uint Renderer::stack_size() const
+{
+  uint per_level = (m_node_format == NodeFormat::WIDE_4) ? 3 : 1;
+
+  // every leaf a node reaches pushes all its instances before any of them is popped, the
+  // wide nodes reach up to 4 leaves at once and the compact ones 2
+  uint leaf_lanes = 1;
+  if (m_node_format == NodeFormat::WIDE_4) {
+    leaf_lanes = 4;
+  } else if (m_node_format == NodeFormat::QUANTIZED_16 || m_node_format == NodeFormat::QUANTIZED_8) {
+    leaf_lanes = 2;
+  }
+
+  uint instances = 0;
+  for (const KdNode& node : m_instance_nodes) {
+    if (is_leaf(node)) instances = glm::max(instances, leaf_count(node));
+  }
+
+  uint geometry_depth = 0;
+  if (0 < instances) {
+    for (const Geometry& geometry : m_geometries) {
+      geometry_depth = glm::max(geometry_depth, tree_depth(geometry.nodes));
+    }
+  }
+
+  return per_level * (tree_depth(m_nodes) + geometry_depth + 2) + leaf_lanes * instances + 1;
+}
+
+void Renderer::set_stack_size(uint size)
+{
+  // rounded up, so small changes of the tree do not recompile the shader
+  size = (size + 7) / 8 * 8;
+  if (size == m_stack_size) {
+    return;
+  }
+
+  std::cout << "traversal stack: " << size << std::endl;
+  m_stack_size = size;
+  m_render_shader = std::make_unique<ShaderProgram>(traversal_source(size));
+  m_stack_overflow_reported = false;
+
+  // recompiled with the new size on their next use
+  for (auto& stage : m_wavefront_shaders) {
+    stage.reset();
+  }
+}
+
+void Renderer::set_node_format(NodeFormat format)
+{
+  m_node_format = format;
+
+  if (!m_nodes.empty()) {
+    upload_nodes();
+    reset_buffer();
+  }
+}
+
+// uploads m_triangles either as raw vertices or as precomputed records, the buffer
+// of the other format is left empty
+void Renderer::upload_triangles()
+{
+  std::vector<Triangle> raw;
+  std::vector<TriangleRecord> records;
+
+  if (m_triangle_format == TriangleFormat::PRECOMPUTED) {
+    records.reserve(m_triangles.size());
+    for (const Triangle& triangle : m_triangles) {
+      records.emplace_back(triangle);
+    }
+  } else {
+    raw = m_triangles;
+  }
+
+  m_vertices->bind();
+  m_vertices->buffer_data(std::span(raw));
+  m_triangle_records->bind();
+  m_triangle_records->buffer_data(std::span(records));
+  m_cpu_dirty = true;
+}
+
+void Renderer::set_triangle_format(TriangleFormat format)
+{
+  m_triangle_format = format;
+  upload_triangles();
+  reset_buffer();
+}
+
+void Renderer::set_sampler(SamplerType sampler)
+{
+  m_sampler = sampler;
+  reset_buffer();
+}
+
+void Renderer::set_path_scheduling(PathScheduling scheduling)
+{
+  m_path_scheduling = scheduling;
+  reset_buffer();
+}
+
+void Renderer::set_leaf_format(LeafFormat format)
+{
+  m_leaf_format = format;
+
+  if (!m_nodes.empty()) {
+    upload_nodes();
+    reset_buffer();
+  }
 }
 
 void Renderer::save_to_file() const
@@ -252,8 +1266,26 @@ glm::mat4 Renderer::transform(const glm::vec3& translate, const glm::vec3& scale
   return t * r * s;
 }
 
-std::vector<glm::vec4> Renderer::load_obj(const std::string &path)
+// bumped whenever load_obj changes the vertices it produces for the same file
+static constexpr uint64_t OBJ_CACHE_VERSION = 1;
+
+std::vector<glm::vec4> Renderer::load_obj(const std::string &path, const std::string& cache_directory)
 {
+  // hashing the file is far cheaper than parsing it, a changed file gets a new key
+  BuildCache cache(cache_directory);
+  uint64_t key = 0;
+
+  if (cache.enabled()) {
+    MappedFile file(path);
+    key = hash_span(file.bytes(), 0x6f626a00 + OBJ_CACHE_VERSION); // "obj"
+
+    if (auto entry = cache.load(key, 1); entry && !file.bytes().empty()) {
+      std::vector<glm::vec4> vertices = entry->copy<glm::vec4>(0);
+      printf("# of triangles = %d, from %s\n", (int) vertices.size() / 3, cache.path(key).c_str());
+      return vertices;
+    }
+  }
+
   std::string warning, error;
   tinyobj::attrib_t attributes;
   std::vector<tinyobj::shape_t> shapes;
@@ -300,6 +1332,10 @@ std::vector<glm::vec4> Renderer::load_obj(const std::string &path)
   }
 
   printf("# of triangles = %d\n",(int) vertices.size() / 3);
+
+  if (cache.enabled() && !cache.store(key, {as_section(vertices)})) {
+    std::cerr << "could not write " << cache.path(key) << std::endl;
+  }
   return vertices;
 }
 
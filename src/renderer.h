@@ -1,100 +1,18 @@
 #include "window.h"
 #include "gfx/gfx.h"
 #include "kdtree.h"
+#include "scene.h"
+#include "cache.h"
+#include "cpu_tracer.h"
+#include "soa.h"
 
+#include <array>
+#include <functional>
 #include <memory>
 #include <vector>
 
 using namespace gfx::gl;
 
-using uint = unsigned int;
-
-#if defined(__GNUC__) || defined(__clang__)
-#  define ALIGN_START(x)
-#  define ALIGN_END(x) __attribute__ ((aligned(x)))
-#elif defined(_MSC_VER)
-#  define ALIGN_START(x) __declspec(align(x))
-#  define ALIGN_END(x)
-#else
-#  error "Unknown compiler; can't define ALIGN"
-#endif
-
-struct Triangle
-{
-  glm::vec4 v[3];
-
-  AABB bounds() const
-  {
-    return {glm::min(v[0], glm::min(v[1], v[2])), glm::max(v[0], glm::max(v[1], v[2]))};
-  }
-};
-
-static_assert(sizeof(Triangle) == 3 * sizeof(glm::vec4));
-
-inline std::vector<Triangle> to_triangles(const std::vector<glm::vec4> vertices)
-{
-  std::vector<Triangle> triangles;
-
-  for (uint i = 0; i < vertices.size() / 3; i++)
-  {
-    Triangle t;
-    t.v[0] = vertices[i * 3 + 0];
-    t.v[1] = vertices[i * 3 + 1];
-    t.v[2] = vertices[i * 3 + 2];
-    triangles.push_back(t);
-  }
-
-  return triangles;
-}
-
-ALIGN_START(16) 
-struct Sphere {
-  glm::vec3 center; 
-  float radius;
-  int material = 0;
-  Sphere(const glm::vec3& center_, float radius_, int mat = 0)
-    : center(center_), radius(radius_), material(mat) {}
-
-  AABB bounds() const {
-    return { glm::vec4(center - radius, 0.0f), glm::vec4(center + radius, 0.0f) };
-  }
-  
-} ALIGN_END(16);
-
-inline std::ostream &operator<<(std::ostream &os, const Sphere &obj)
-{
-  os << "Sphere { c = " << obj.center << ", r = " << obj.radius << " }";
-  return os;
-}
-
-enum MaterialType: uint {
-  DIFFUSE       = 0,
-  SPECULAR      = 1,
-  TRANSMISSIVE  = 2,
-};
-
-// vec4 only for alignment purposes
-ALIGN_START(16) 
-struct Material {
-  glm::vec4 albedo;
-  glm::vec3 emission;
-  MaterialType type;
-
-  Material(const glm::vec3& albedo_, const glm::vec3& emission_ = glm::vec3(0.0f), 
-    float smoothness = 0.0f, const MaterialType& type_ = DIFFUSE) 
-    : albedo(albedo_, smoothness), emission(emission_), type(type_) {}
-} ALIGN_END(16);
-
-
-ALIGN_START(16) struct Mesh {
-  uint start; // start offset
-  uint size; // triangle count
-  int material;
-
-  Mesh(uint start_, uint size_, int mat = 0) 
-    : start(start_), size(size_), material(mat) {}
-};
-
 inline glm::vec3 vector_from_spherical(float pitch, float yaw)
 {
     return {
@@ -104,24 +22,36 @@ inline glm::vec3 vector_from_spherical(float pitch, float yaw)
      };
 }
 
-struct Camera {
-  glm::vec3 position;
+enum class TreeBuilder {
+  SAH,  // binned surface area heuristic, best trees
+  LBVH, // morton code linear bvh, fastest builds for very large scenes
+  SBVH, // spatial splits, clips large overlapping primitives like walls and floors
+  GRID, // uniform grid over the spheres, linear builds for evenly spread spheres.
+        // triangles and instances still get a sah tree
+};
 
-  float fov = 45.0f;
-  
-  float focal_length  = 10.0f;
-  float aperture      = 0.001f;
-  
-  float pitch = M_PI / 2;
-  float yaw   = M_PI / 2;
+// layout of the tree on the gpu, quantized nodes take about half the memory,
+// wide nodes test four children at once and halve the nodes visited per ray
+enum class NodeFormat {
+  FULL,
+  QUANTIZED_16,
+  QUANTIZED_8,
+  WIDE_4,
+};
 
-  glm::vec3 forward = {0.0f, 0.0f, 1.0f};
-  glm::vec3 up      = {0.0f, 1.0f, 0.0f};
-  glm::vec3 right   = {-1.0f, 0.0f, 0.0f};
+// layout of the triangles on the gpu, precomputed records take twice the memory of the
+// raw vertices but leave only dot products per test and are watertight
+enum class TriangleFormat {
+  RAW,
+  PRECOMPUTED,
+};
 
-  Camera(const glm::vec3& position_, float fov_) 
-    : position(position_), fov(fov_)
-  {}
+// how the gpu schedules the paths: the megakernel traces a whole path per pixel in one
+// invocation, the wavefront path tracer runs every bounce as an intersection pass and one
+// shading pass per material type over queues of the paths that are still alive
+enum class PathScheduling {
+  MEGAKERNEL,
+  WAVEFRONT,
 };
 
 class Renderer : public Window {
@@ -132,18 +62,47 @@ public:
   void keyboard_state(const Uint8* state) override;
 
   void set_spheres(const std::vector<Sphere>& spheres);
+
+  // moves the spheres of the last set_spheres call, same count and order. the tree is
+  // refitted instead of rebuilt until its cost exceeds refit_threshold times the built cost
+  void update_spheres(const std::vector<Sphere>& spheres);
+  void set_refit_threshold(float threshold);
+
+  // called every frame before rendering, with the time since the start
+  void set_animation(std::function<void(Renderer&, float)> animation);
   void set_materials(const std::vector<Material>& material);
   void set_envmap(std::unique_ptr<CubemapTexture> envmap);
+
+  // loads the faces for the gpu and keeps a copy the cpu tracer samples
+  void set_envmap(const std::array<std::string, 6>& faces);
   void set_vertices(const std::vector<glm::vec4>& vertices);
   void set_meshes(const std::vector<Mesh>& meshes);
   void set_kdtree(const std::vector<Sphere>& objects);
   void set_kdtree(const std::vector<glm::vec4>& objects);
 
-
-
-  void set_nodes(const std::vector<KdNode>& nodes);
-
-  static std::vector<glm::vec4> load_obj(const std::string& path);
+  // upload an externally built tree over the current sphere buffer, its leaves index
+  // indices, the sphere of every reference. without indices they index the spheres directly
+  void set_nodes(const std::vector<KdNode>& nodes, const std::vector<uint>& indices = {});
+  void set_tree_builder(TreeBuilder builder);
+
+  // built trees are stored in directory and loaded from there while their input and
+  // builder stay the same, an empty directory disables the cache
+  void set_cache_directory(const std::string& directory);
+  void set_node_format(NodeFormat format);
+  void set_triangle_format(TriangleFormat format);
+
+  // soa leaves copy the spheres and triangles of every leaf into blocks that are tested in
+  // one pass, on the gpu and the cpu
+  void set_leaf_format(LeafFormat format);
+  void set_path_scheduling(PathScheduling scheduling);
+  void set_sampler(SamplerType sampler);
+
+  // builds the tree of a mesh once in object space, instances refer to it by the returned id
+  uint add_geometry(const std::vector<glm::vec4>& vertices);
+  void set_instances(const std::vector<Instance>& instances);
+
+  // the vertices are cached under a hash of the file in cache_directory, unless it is empty
+  static std::vector<glm::vec4> load_obj(const std::string& path, const std::string& cache_directory = "cache");
   static glm::mat4 transform(const glm::vec3& translate, const glm::vec3& scale, const glm::quat& rotate = glm::quat(glm::vec3(0.0f)));
 
 
@@ -155,6 +114,7 @@ private:
   std::unique_ptr<VertexBuffer> m_screen_quad_vbo = nullptr;
   
   std::unique_ptr<Texture> m_texture = nullptr;
+  std::unique_ptr<Texture> m_moments = nullptr; // per pixel frame count and luminance moments
 
   std::unique_ptr<CubemapTexture> m_envmap = nullptr;
 
@@ -163,8 +123,49 @@ private:
   std::unique_ptr<ShaderStorageBuffer> m_vertices = nullptr;
   std::unique_ptr<ShaderStorageBuffer> m_meshes = nullptr;
   std::unique_ptr<ShaderStorageBuffer> m_kdtree = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_instances = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_compact_nodes = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_wide_nodes = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_triangle_records = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_leaf_indices = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_grid = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_sphere_blocks = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_triangle_blocks = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_lights = nullptr; // the emissive spheres, rebuilt with spheres and materials
+  std::unique_ptr<ShaderStorageBuffer> m_environment = nullptr; // alias table of the envmap texels
+
+  // the wavefront stages generate, extend, shade and queues, compiled on first use, with the
+  // state of one path per pixel and the queues of path ids between the passes
+  std::array<std::unique_ptr<ShaderProgram>, 4> m_wavefront_shaders;
+  std::unique_ptr<ShaderStorageBuffer> m_paths = nullptr;
+  std::unique_ptr<ShaderStorageBuffer> m_queues = nullptr;
+  uint m_path_count = 0;
+  PathScheduling m_path_scheduling = PathScheduling::MEGAKERNEL;
+
+  // gpu time and rays of one frame at a time, the next frame is measured once the
+  // result of the last one is in. bounces and the shadow rays of light sampling are
+  // counted apart, path length is bounces per sample
+  std::unique_ptr<ShaderStorageBuffer> m_ray_count = nullptr;
+  GLuint m_ray_query = 0;
+  bool m_ray_query_pending = false;
+  double m_rays_per_second = 0.0;
+  double m_shadow_rays_per_second = 0.0;
+  float m_path_length = 0.0f;
+
+  // adaptive sampling: the tiles stage lists the tiles that have not converged and the
+  // megakernel is dispatched over them
+  std::unique_ptr<ShaderProgram> m_tiles_shader;
+  std::unique_ptr<ShaderStorageBuffer> m_tiles = nullptr;
+  bool m_adaptive = false;
+  float m_adaptive_threshold = 0.02f;
+  int m_adaptive_min_frames = 16;
+  float m_active_tiles = 1.0f; // share of the tiles traced by the last measured frame
+
+  SamplerType m_sampler = SamplerType::SOBOL;
 
   int m_bounces = 5;
+  bool m_roulette = true;
+  int m_roulette_depth = 5; // bounces before paths can end by russian roulette
   unsigned int m_samples = 1;
 
   Camera m_camera;
@@ -174,9 +175,87 @@ private:
   bool m_use_envmap = true;
   bool m_use_dof = true;
   bool m_use_bvh = false;
+  bool m_use_nee = true;
+
+  // host copies, the tree is rebuilt from these whenever they change
+  std::vector<Sphere> m_sphere_data;
+  std::vector<Triangle> m_triangle_data;
+  std::vector<KdNode> m_sphere_nodes;
+  std::vector<KdNode> m_triangle_nodes;
+  std::vector<uint> m_sphere_indices;   // index into m_sphere_data of every leaf reference
+  std::vector<uint> m_triangle_indices; // index into m_triangle_data of every leaf reference
+  std::vector<Material> m_material_data;
+  std::vector<Mesh> m_mesh_data;
+  std::vector<Sphere> m_light_data;
+
+  // the sphere grid of TreeBuilder::GRID, uploaded as a header followed by the cell offsets
+  // which index the grid range at the end of m_leaf_index_data
+  std::vector<uint> m_grid_header;
+  std::vector<uint> m_grid_cells;
+  std::vector<uint> m_grid_indices;
+  std::vector<uint> m_grid_data; // the uploaded grid_buffer
+
+  // bottom level trees, one per unique mesh
+  struct Geometry {
+    std::vector<KdNode> nodes;
+    std::vector<Triangle> triangles;
+    std::vector<uint> indices;
+  };
+
+  // top level tree over the instances, leaves hold a single instance
+  std::vector<Geometry> m_geometries;
+  std::vector<Instance> m_instance_data;
+  std::vector<uint> m_instance_indices; // index into m_instance_data of every leaf reference
+  std::vector<KdNode> m_instance_nodes;
+  bool m_spheres_dirty = false;
+  bool m_triangles_dirty = false;
+  bool m_instances_dirty = false;
+  bool m_spheres_moving = false; // animated spheres are rebuilt too often to be worth caching
+  TreeBuilder m_tree_builder = TreeBuilder::SAH;
+  BuildCache m_cache{"cache"};
+
+  // the uploaded tree, kept for refitting. leaf offsets index m_leaf_index_data, which
+  // holds the position of every reference in its primitive buffer
+  std::vector<KdNode> m_nodes;
+  std::vector<uint> m_leaf_index_data;
+  std::vector<uint> m_geometry_roots; // node id of every geometry tree in m_nodes
+  NodeFormat m_node_format = NodeFormat::FULL;
+  uint m_stack_size = 32; // STACK_SIZE the render shader was compiled with
+  bool m_stack_overflow_reported = false;
+  std::vector<Triangle> m_triangles; // the uploaded triangles, in the order leaves index them
+  TriangleFormat m_triangle_format = TriangleFormat::PRECOMPUTED;
+  LeafFormat m_leaf_format = LeafFormat::SOA;
+  float m_build_cost = 0.0f;
+  float m_refit_threshold = 1.5f;
+
+  // renders on the cpu instead of the render shader, from copies of the uploaded buffers
+  // that are refreshed before the next cpu frame whenever an upload changed them
+  std::unique_ptr<CpuTracer> m_cpu;
+  Cubemap m_envmap_data;
+  bool m_use_cpu = false;
+  bool m_cpu_dirty = true;
+
+  std::function<void(Renderer&, float)> m_animation;
+  float m_animation_time = 0.0f;
 
   void reset_buffer();
   void save_to_file() const;
+  void update_tree();
+  void build_grid();
+  void upload_nodes();
+  void upload_triangles();
+  void upload_lights();
+  void upload_environment();
+  uint stack_size() const;
+  void set_stack_size(uint size);
+  TraceSettings trace_settings() const;
+  void set_uniforms(const ShaderProgram& program, const TraceSettings& settings, bool count_rays) const;
+  void prepare_wavefront();
+  void render_wavefront();
+  void read_ray_count();
+  void render_adaptive(const TraceSettings& settings);
+  CpuScene cpu_scene() const;
+  void render_cpu(const TraceSettings& settings);
 
 
 #if 0
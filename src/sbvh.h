@@ -0,0 +1,458 @@
+#pragma once
+
+#include "kdtree.h"
+
+#include <cmath>
+
+struct SBVHParams
+{
+  uint bins = 16;                  // object split candidates per axis are bins - 1
+  uint spatial_bins = 32;          // spatial split candidates per axis are spatial_bins - 1
+  uint max_leaf_size = 8;          // larger ranges are always split
+  float traversal_cost = 1.0f;     // cost of visiting an interior node
+  float intersection_cost = 1.0f;  // cost of testing one primitive
+  float overlap_threshold = 1e-5f; // spatial splits are tried once the children overlap by this much of the root area
+  float max_duplication = 0.5f;    // extra references allowed, as a fraction of the primitives
+  uint min_spatial_count = 64;     // smaller nodes only get object splits, chopping them costs more than it saves
+};
+
+// Bounding volume hierarchy with spatial splits (Stich et al. 2009, "Spatial Splits in
+// Bounding Volume Hierarchies"). Where the children of the best object split overlap,
+// split planes that cut through primitives are tried as well: the primitive is referenced
+// from both children, each with the bounds of its clipped part, so large primitives no
+// longer inflate every box above them. Primitives with a clipped(axis, lo, hi) member get
+// exact clipped bounds, others are clipped as boxes.
+// Leaves index indices(), the input index of every reference, a primitive appears once
+// per leaf that overlaps it. Duplication stops at max_duplication extra references.
+template <class Bounded>
+class SBVH
+{
+public:
+  static constexpr uint MAX_BINS = 64;
+
+  SBVH(const std::vector<Bounded> &primitives, const SBVHParams &params = {})
+    : m_input(&primitives), m_params(params)
+  {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    m_params.bins = glm::clamp(m_params.bins, 2U, MAX_BINS);
+    m_params.spatial_bins = glm::clamp(m_params.spatial_bins, 2U, MAX_BINS);
+    m_params.max_leaf_size = glm::max(m_params.max_leaf_size, 1U);
+
+    uint count = static_cast<uint>(primitives.size());
+
+    std::vector<Reference> references(count);
+    AABB bounds = empty_aabb();
+
+    for (uint i = 0; i < count; i++)
+    {
+      references[i] = {primitives[i].bounds(), i};
+      grow(bounds, references[i].box);
+    }
+
+    m_root_area = surface_area(bounds);
+    m_references = count;
+    m_budget = count + static_cast<uint>(m_params.max_duplication * count);
+
+    if (0 < count)
+    {
+      m_nodes.reserve(2 * count);
+      m_indices.reserve(count);
+      (void)construct(references);
+    }
+
+    m_input = nullptr;
+
+    auto end = std::chrono::high_resolution_clock::now();
+
+    m_stats.build_time = std::chrono::duration<double, std::milli>(end - start).count();
+    m_stats.sah_cost = sah_cost(m_nodes, m_params.traversal_cost, m_params.intersection_cost);
+    m_stats.primitives = count;
+    m_stats.references = static_cast<uint>(m_indices.size());
+    m_stats.nodes = static_cast<uint>(m_nodes.size());
+    m_stats.leaves = static_cast<uint>(std::count_if(m_nodes.begin(), m_nodes.end(), is_leaf));
+    m_stats.depth = tree_depth(m_nodes);
+  }
+
+  const std::vector<KdNode> &nodes() const { return m_nodes; }
+  const std::vector<uint> &indices() const { return m_indices; }
+  const BuildStats &stats() const { return m_stats; }
+
+private:
+  // a primitive, or the part of it inside a node
+  struct Reference
+  {
+    AABB box;
+    uint index;
+  };
+
+  struct Bin
+  {
+    AABB bounds = empty_aabb();
+    uint count = 0; // object bins
+    uint entries = 0, exits = 0; // spatial bins, references starting and ending in the bin
+  };
+
+  struct Split
+  {
+    int axis = -1;
+    bool spatial = false;
+    float position = 0.0f; // spatial plane, or the centroid at the lower end of the object bins
+    float scale = 0.0f;    // object bins per unit
+    uint bin = 0;          // first object bin on the right
+    float cost = std::numeric_limits<float>::max();
+    AABB left = empty_aabb(), right = empty_aabb();
+  };
+
+  const std::vector<Bounded> *m_input = nullptr;
+  SBVHParams m_params;
+  BuildStats m_stats;
+  float m_root_area = 0.0f;
+  uint m_references = 0; // references alive, leaves plus pending
+  uint m_budget = 0;     // no spatial splits beyond this many references
+  std::vector<KdNode> m_nodes;
+  std::vector<uint> m_indices;
+
+  static AABB overlap(const AABB &a, const AABB &b)
+  {
+    return {glm::max(a.min, b.min), glm::min(a.max, b.max)};
+  }
+
+  static bool is_empty(const AABB &a)
+  {
+    return a.max.x < a.min.x || a.max.y < a.min.y || a.max.z < a.min.z;
+  }
+
+  AABB clip(const Reference &ref, int axis, float lo, float hi) const
+  {
+    AABB box = ref.box;
+    box.min[axis] = glm::max(box.min[axis], lo);
+    box.max[axis] = glm::min(box.max[axis], hi);
+
+    if constexpr (requires(const Bounded &p) { p.clipped(0, 0.0f, 0.0f); })
+      box = overlap(box, (*m_input)[ref.index].clipped(axis, lo, hi));
+
+    return box;
+  }
+
+  uint object_bin(const Reference &ref, int axis, float origin, float scale) const
+  {
+    return glm::min(static_cast<uint>((centroid(ref.box)[axis] - origin) * scale), m_params.bins - 1);
+  }
+
+  float cost(float left_area, uint left_count, float right_area, uint right_count, float inv_area) const
+  {
+    return m_params.traversal_cost + m_params.intersection_cost * inv_area *
+      (left_area * left_count + right_area * right_count);
+  }
+
+  // binned sah over the centroids, like BVH
+  Split find_object_split(const std::vector<Reference> &refs, const AABB &bounds) const
+  {
+    Split best;
+
+    AABB centroid_bounds = empty_aabb();
+    for (const Reference &ref : refs)
+      grow(centroid_bounds, centroid(ref.box));
+
+    float area = surface_area(bounds);
+    float inv_area = 0.0f < area ? 1.0f / area : 0.0f;
+    const uint bins = m_params.bins;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float extent = centroid_bounds.max[axis] - centroid_bounds.min[axis];
+      if (extent <= 0.0f)
+        continue;
+
+      float scale = static_cast<float>(bins) / extent;
+      Bin bin[MAX_BINS];
+
+      for (const Reference &ref : refs)
+      {
+        uint k = object_bin(ref, axis, centroid_bounds.min[axis], scale);
+        bin[k].count++;
+        grow(bin[k].bounds, ref.box);
+      }
+
+      AABB right_box[MAX_BINS];
+      uint right_count[MAX_BINS];
+      AABB acc = empty_aabb();
+      uint n = 0;
+
+      for (uint k = bins - 1; k > 0; k--)
+      {
+        grow(acc, bin[k].bounds);
+        n += bin[k].count;
+        right_box[k] = acc;
+        right_count[k] = n;
+      }
+
+      acc = empty_aabb();
+      n = 0;
+
+      for (uint k = 0; k < bins - 1; k++)
+      {
+        grow(acc, bin[k].bounds);
+        n += bin[k].count;
+
+        if (n == 0 || right_count[k + 1] == 0)
+          continue;
+
+        float c = cost(surface_area(acc), n, surface_area(right_box[k + 1]), right_count[k + 1], inv_area);
+        if (c < best.cost)
+        {
+          best.axis = axis;
+          best.spatial = false;
+          best.position = centroid_bounds.min[axis];
+          best.scale = scale;
+          best.bin = k + 1;
+          best.cost = c;
+          best.left = acc;
+          best.right = right_box[k + 1];
+        }
+      }
+    }
+
+    return best;
+  }
+
+  // every reference is chopped into the bins it spans, a plane between two bins sends the
+  // parts on either side to the child on that side
+  Split find_spatial_split(const std::vector<Reference> &refs, const AABB &bounds) const
+  {
+    Split best;
+
+    float area = surface_area(bounds);
+    float inv_area = 0.0f < area ? 1.0f / area : 0.0f;
+    const uint bins = m_params.spatial_bins;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float origin = bounds.min[axis];
+      float extent = bounds.max[axis] - origin;
+      if (extent <= 0.0f)
+        continue;
+
+      float width = extent / bins;
+      auto plane = [&](uint k) { return (k == bins) ? bounds.max[axis] : origin + k * width; };
+      auto bin_of = [&](float x) { return glm::min(static_cast<uint>(glm::max(x - origin, 0.0f) / width), bins - 1); };
+
+      Bin bin[MAX_BINS];
+
+      for (const Reference &ref : refs)
+      {
+        uint first = bin_of(ref.box.min[axis]);
+        uint last = bin_of(ref.box.max[axis]);
+
+        if (first == last)
+        {
+          grow(bin[first].bounds, ref.box);
+        }
+        else
+        {
+          for (uint k = first; k <= last; k++)
+            grow(bin[k].bounds, clip(ref, axis, plane(k), plane(k + 1)));
+        }
+
+        bin[first].entries++;
+        bin[last].exits++;
+      }
+
+      AABB right_box[MAX_BINS];
+      uint right_count[MAX_BINS];
+      AABB acc = empty_aabb();
+      uint n = 0;
+
+      for (uint k = bins - 1; k > 0; k--)
+      {
+        grow(acc, bin[k].bounds);
+        n += bin[k].exits;
+        right_box[k] = acc;
+        right_count[k] = n;
+      }
+
+      acc = empty_aabb();
+      n = 0;
+
+      for (uint k = 0; k < bins - 1; k++)
+      {
+        grow(acc, bin[k].bounds);
+        n += bin[k].entries;
+
+        if (n == 0 || right_count[k + 1] == 0)
+          continue;
+
+        float c = cost(surface_area(acc), n, surface_area(right_box[k + 1]), right_count[k + 1], inv_area);
+        if (c < best.cost)
+        {
+          best.axis = axis;
+          best.spatial = true;
+          best.position = plane(k + 1);
+          best.cost = c;
+          best.left = acc;
+          best.right = right_box[k + 1];
+        }
+      }
+    }
+
+    return best;
+  }
+
+  void partition_object(std::vector<Reference> &refs, const Split &split, std::vector<Reference> &left, std::vector<Reference> &right) const
+  {
+    for (const Reference &ref : refs)
+    {
+      if (object_bin(ref, split.axis, split.position, split.scale) < split.bin)
+        left.push_back(ref);
+      else
+        right.push_back(ref);
+    }
+  }
+
+  // references crossing the plane are split, or moved to one side whole where that is
+  // cheaper ("reference unsplitting")
+  void partition_spatial(std::vector<Reference> &refs, const Split &split, std::vector<Reference> &left, std::vector<Reference> &right)
+  {
+    int axis = split.axis;
+    float x = split.position;
+
+    AABB left_box = empty_aabb(), right_box = empty_aabb();
+    std::vector<Reference> straddling;
+
+    for (const Reference &ref : refs)
+    {
+      if (ref.box.max[axis] <= x)
+      {
+        left.push_back(ref);
+        grow(left_box, ref.box);
+      }
+      else if (x <= ref.box.min[axis])
+      {
+        right.push_back(ref);
+        grow(right_box, ref.box);
+      }
+      else
+      {
+        straddling.push_back(ref);
+      }
+    }
+
+    uint left_count = static_cast<uint>(left.size() + straddling.size());
+    uint right_count = static_cast<uint>(right.size() + straddling.size());
+
+    for (const Reference &ref : straddling)
+    {
+      Reference l = {clip(ref, axis, ref.box.min[axis], x), ref.index};
+      Reference r = {clip(ref, axis, x, ref.box.max[axis]), ref.index};
+
+      AABB split_left = left_box, split_right = right_box;
+      grow(split_left, l.box);
+      grow(split_right, r.box);
+
+      AABB whole_left = left_box, whole_right = right_box;
+      grow(whole_left, ref.box);
+      grow(whole_right, ref.box);
+
+      float split_cost = surface_area(split_left) * left_count + surface_area(split_right) * right_count;
+      float left_cost = surface_area(whole_left) * left_count + surface_area(right_box) * (right_count - 1);
+      float right_cost = surface_area(left_box) * (left_count - 1) + surface_area(whole_right) * right_count;
+
+      if (is_empty(r.box) || (!is_empty(l.box) && left_cost <= split_cost && left_cost <= right_cost))
+      {
+        left.push_back(ref);
+        left_box = whole_left;
+        right_count--;
+      }
+      else if (is_empty(l.box) || right_cost <= split_cost)
+      {
+        right.push_back(ref);
+        right_box = whole_right;
+        left_count--;
+      }
+      else
+      {
+        left.push_back(l);
+        right.push_back(r);
+        left_box = split_left;
+        right_box = split_right;
+        m_references++;
+      }
+    }
+  }
+
+  uint construct(std::vector<Reference> &refs)
+  {
+    uint count = static_cast<uint>(refs.size());
+
+    AABB bounds = empty_aabb();
+    for (const Reference &ref : refs)
+      grow(bounds, ref.box);
+
+    uint node_id = static_cast<uint>(m_nodes.size());
+
+    KdNode node;
+    node.min = bounds.min;
+    node.max = bounds.max;
+    m_nodes.push_back(node);
+
+    Split split = find_object_split(refs, bounds);
+
+    // spatial splits only pay off where the object split leaves overlapping children
+    if (m_params.min_spatial_count <= count && m_references < m_budget &&
+        (split.axis < 0 || m_params.overlap_threshold * m_root_area < surface_area(overlap(split.left, split.right))))
+    {
+      Split spatial = find_spatial_split(refs, bounds);
+      if (spatial.cost < split.cost)
+        split = spatial;
+    }
+
+    float leaf_cost = m_params.intersection_cost * count;
+
+    if (count == 1 || (count <= m_params.max_leaf_size && leaf_cost <= split.cost))
+    {
+      m_nodes[node_id].offset = static_cast<uint>(m_indices.size());
+      m_nodes[node_id].count = count;
+
+      for (const Reference &ref : refs)
+        m_indices.push_back(ref.index);
+
+      return node_id;
+    }
+
+    std::vector<Reference> left, right;
+
+    if (split.spatial)
+      partition_spatial(refs, split, left, right);
+    else if (0 <= split.axis)
+      partition_object(refs, split, left, right);
+
+    if (left.empty() || right.empty())
+    {
+      // no usable plane (e.g. coincident centroids), fall back to a median split
+      left.clear();
+      right.clear();
+
+      glm::vec3 extent = glm::vec3(bounds.max - bounds.min);
+      int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+
+      auto mid = refs.begin() + count / 2;
+      std::nth_element(refs.begin(), mid, refs.end(), [&](const Reference &a, const Reference &b) {
+        return centroid(a.box)[axis] < centroid(b.box)[axis];
+      });
+
+      left.assign(refs.begin(), mid);
+      right.assign(mid, refs.end());
+    }
+
+    // the references live on in the children only
+    std::vector<Reference>().swap(refs);
+
+    uint l = construct(left);
+    uint r = construct(right);
+
+    m_nodes[node_id].left = l;
+    m_nodes[node_id].right = r;
+    return node_id;
+  }
+};
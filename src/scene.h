@@ -0,0 +1,218 @@
+#pragma once
+
+#include "kdtree.h"
+
+#include <cmath>
+#include <vector>
+#include <ostream>
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define ALIGN_START(x)
+#  define ALIGN_END(x) __attribute__ ((aligned(x)))
+#elif defined(_MSC_VER)
+#  define ALIGN_START(x) __declspec(align(x))
+#  define ALIGN_END(x)
+#else
+#  error "Unknown compiler; can't define ALIGN"
+#endif
+
+struct Triangle
+{
+  glm::vec4 v[3];
+
+  AABB bounds() const
+  {
+    return {glm::min(v[0], glm::min(v[1], v[2])), glm::max(v[0], glm::max(v[1], v[2]))};
+  }
+
+  // bounds of the part between the planes lo and hi on axis, for spatial splits
+  AABB clipped(int axis, float lo, float hi) const
+  {
+    AABB box = empty_aabb();
+
+    for (int k = 0; k < 3; k++)
+    {
+      glm::vec3 a(v[k]), b(v[(k + 1) % 3]);
+
+      if (lo <= a[axis] && a[axis] <= hi)
+        grow(box, a);
+
+      for (float plane : {lo, hi})
+      {
+        if ((a[axis] < plane && plane < b[axis]) || (b[axis] < plane && plane < a[axis]))
+        {
+          glm::vec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+          p[axis] = plane;
+          grow(box, p);
+        }
+      }
+    }
+
+    return box;
+  }
+};
+
+static_assert(sizeof(Triangle) == 3 * sizeof(glm::vec4));
+
+inline std::vector<Triangle> to_triangles(const std::vector<glm::vec4>& vertices)
+{
+  std::vector<Triangle> triangles;
+  triangles.reserve(vertices.size() / 3);
+
+  for (uint i = 0; i < vertices.size() / 3; i++)
+  {
+    Triangle t;
+    t.v[0] = vertices[i * 3 + 0];
+    t.v[1] = vertices[i * 3 + 1];
+    t.v[2] = vertices[i * 3 + 2];
+    triangles.push_back(t);
+  }
+
+  return triangles;
+}
+
+// Triangle in the form the shader intersects it: the Pluecker coordinates of its edges
+// and its plane. The ray passes edge a -> b on the inner side if
+//   dot(edge, cross(direction, origin)) + dot(moment, direction) >= 0
+// and neighbours store a shared edge with exactly negated coordinates, so a ray through
+// the edge is inside one of them and never slips through the gap (watertight). What is
+// left per test are eight dot products and a division, the normal is stored normalized.
+ALIGN_START(16) struct TriangleRecord {
+  glm::vec4 edge[3];   // b - a, w holds the normal xyz
+  glm::vec4 moment[3]; // cross(b, a), w holds the plane distance, the material and 0
+
+  explicit TriangleRecord(const Triangle& triangle)
+  {
+    glm::vec3 v[3] = {glm::vec3(triangle.v[0]), glm::vec3(triangle.v[1]), glm::vec3(triangle.v[2])};
+
+    glm::vec3 normal = glm::cross(v[1] - v[0], v[2] - v[0]);
+    float length = glm::length(normal);
+    normal = (0.0f < length) ? normal / length : glm::vec3(0.0f);
+
+    for (int k = 0; k < 3; k++) {
+      const glm::vec3& a = v[k];
+      const glm::vec3& b = v[(k + 1) % 3];
+      edge[k] = glm::vec4(b - a, normal[k]);
+      moment[k] = glm::vec4(glm::cross(b, a), 0.0f);
+    }
+
+    moment[0].w = glm::dot(normal, v[0]);
+    moment[1].w = triangle.v[0].w;
+  }
+
+  glm::vec3 normal() const { return {edge[0].w, edge[1].w, edge[2].w}; }
+} ALIGN_END(16);
+
+static_assert(sizeof(TriangleRecord) == 6 * sizeof(glm::vec4));
+
+ALIGN_START(16) 
+struct Sphere {
+  glm::vec3 center; 
+  float radius;
+  int material = 0;
+  Sphere(const glm::vec3& center_, float radius_, int mat = 0)
+    : center(center_), radius(radius_), material(mat) {}
+
+  AABB bounds() const {
+    return { glm::vec4(center - radius, 0.0f), glm::vec4(center + radius, 0.0f) };
+  }
+
+  // bounds of the slice between the planes lo and hi on axis, for spatial splits
+  AABB clipped(int axis, float lo, float hi) const {
+    float nearest = glm::clamp(center[axis], lo, hi) - center[axis];
+    if (radius < glm::abs(nearest)) {
+      return empty_aabb();
+    }
+
+    // the widest circle of the slice is the one closest to the center
+    glm::vec3 extent = glm::vec3(std::sqrt(radius * radius - nearest * nearest));
+    AABB box = { glm::vec4(center - extent, 0.0f), glm::vec4(center + extent, 0.0f) };
+    box.min[axis] = glm::max(lo, center[axis] - radius);
+    box.max[axis] = glm::min(hi, center[axis] + radius);
+    return box;
+  }
+  
+} ALIGN_END(16);
+
+inline std::ostream &operator<<(std::ostream &os, const Sphere &obj)
+{
+  os << "Sphere { c = " << obj.center << ", r = " << obj.radius << " }";
+  return os;
+}
+
+enum MaterialType: uint {
+  DIFFUSE       = 0,
+  SPECULAR      = 1,
+  TRANSMISSIVE  = 2,
+};
+
+// vec4 only for alignment purposes
+ALIGN_START(16) 
+struct Material {
+  glm::vec4 albedo;
+  glm::vec3 emission;
+  MaterialType type;
+
+  Material(const glm::vec3& albedo_, const glm::vec3& emission_ = glm::vec3(0.0f), 
+    float smoothness = 0.0f, const MaterialType& type_ = DIFFUSE) 
+    : albedo(albedo_, smoothness), emission(emission_), type(type_) {}
+} ALIGN_END(16);
+
+// the spheres whose material emits light, the lights next event estimation samples
+inline std::vector<Sphere> emissive_spheres(const std::vector<Sphere>& spheres, const std::vector<Material>& materials)
+{
+  std::vector<Sphere> lights;
+  for (const Sphere& sphere : spheres) {
+    if (sphere.material < 0 || materials.size() <= static_cast<size_t>(sphere.material))
+      continue;
+    const glm::vec3& emission = materials[sphere.material].emission;
+    if (emission.x > 0.0f || emission.y > 0.0f || emission.z > 0.0f)
+      lights.push_back(sphere);
+  }
+  return lights;
+}
+
+
+ALIGN_START(16) struct Mesh {
+  uint start; // start offset
+  uint size; // triangle count
+  int material;
+
+  Mesh(uint start_, uint size_, int mat = 0) 
+    : start(start_), size(size_), material(mat) {}
+} ALIGN_END(16);
+
+// placement of a shared geometry, rays are moved into object space at the instance
+// so the geometry and its tree are stored once no matter how often it is placed
+ALIGN_START(16) struct Instance {
+  glm::mat4 world_to_object;
+  uint geometry;        // id returned by Renderer::add_geometry
+  int material;         // replaces the material of every triangle, -1 keeps them
+  uint root = INVALID;  // root of the geometry tree in the node buffer, set on upload
+  uint pad = 0;
+
+  Instance(uint geometry_, const glm::mat4& object_to_world, int mat = -1)
+    : world_to_object(glm::inverse(object_to_world)), geometry(geometry_), material(mat) {}
+} ALIGN_END(16);
+
+static_assert(sizeof(Instance) == 80);
+
+struct Camera {
+  glm::vec3 position;
+
+  float fov = 45.0f;
+  
+  float focal_length  = 10.0f;
+  float aperture      = 0.001f;
+  
+  float pitch = M_PI / 2;
+  float yaw   = M_PI / 2;
+
+  glm::vec3 forward = {0.0f, 0.0f, 1.0f};
+  glm::vec3 up      = {0.0f, 1.0f, 0.0f};
+  glm::vec3 right   = {-1.0f, 0.0f, 0.0f};
+
+  Camera(const glm::vec3& position_, float fov_) 
+    : position(position_), fov(fov_)
+  {}
+};
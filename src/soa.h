@@ -0,0 +1,273 @@
+#pragma once
+
+#include "kdtree.h"
+#include "scene.h"
+
+#if defined(__SSE__) || defined(_M_X64)
+#  include <immintrin.h>
+#endif
+
+// primitives per block, a leaf of n primitives takes (n + LEAF_WIDTH - 1) / LEAF_WIDTH blocks
+constexpr uint LEAF_WIDTH = 8;
+
+// distance the block kernels report for misses, INF of the shader
+constexpr float BLOCK_MISS = 1e5f;
+
+// how the sphere and triangle leaves refer to their primitives, instance leaves always
+// index leaf_indices
+enum class LeafFormat
+{
+  INDEXED, // offset is the first leaf_indices entry of the leaf
+  SOA,     // offset is the first block of the leaf, the blocks hold copies of the primitives
+};
+
+// Spheres of a leaf as structure of arrays, so one pass tests all of them. Lanes past the
+// end of a leaf are zero with id INVALID. Matches the std430 SphereBlock of raytracer.glsl.
+struct alignas(32) SphereBlock
+{
+  float center_x[LEAF_WIDTH], center_y[LEAF_WIDTH], center_z[LEAF_WIDTH];
+  float radius[LEAF_WIDTH];
+  int material[LEAF_WIDTH];
+  uint id[LEAF_WIDTH]; // index into the sphere buffer
+};
+
+static_assert(sizeof(SphereBlock) == 6 * LEAF_WIDTH * sizeof(float));
+
+// TriangleRecords of a leaf as structure of arrays, each pluecker coordinate and plane
+// component in its own row. Matches the std430 TriangleBlock of raytracer.glsl.
+struct alignas(32) TriangleBlock
+{
+  float edge[3][3][LEAF_WIDTH];   // [edge][axis][lane], b - a
+  float moment[3][3][LEAF_WIDTH]; // cross(b, a)
+  float normal[3][LEAF_WIDTH];
+  float plane[LEAF_WIDTH];        // dot(normal, a)
+  int material[LEAF_WIDTH];
+  uint id[LEAF_WIDTH];            // index into the triangle buffer
+};
+
+static_assert(sizeof(TriangleBlock) == 24 * LEAF_WIDTH * sizeof(float));
+
+// Copies the primitives of every sphere and triangle leaf into blocks, in the order the
+// leaf references them, and rewrites the leaf offsets to the first block of the leaf.
+// Leaf counts stay the number of primitives, so the last block of a leaf may be partial.
+class SoaLeaves
+{
+public:
+  SoaLeaves() = default;
+
+  SoaLeaves(const std::vector<KdNode> &nodes, const std::vector<uint> &leaf_indices, const std::vector<Sphere> &spheres,
+    const std::vector<TriangleRecord> &records)
+    : m_nodes(nodes)
+  {
+    for (KdNode &node : m_nodes)
+    {
+      if (!is_leaf(node) || leaf_type(node) == PRIMITIVE_INSTANCE)
+        continue;
+
+      uint begin = node.offset, end = node.offset + leaf_count(node);
+      m_used += end - begin;
+
+      if (leaf_type(node) == PRIMITIVE_TRIANGLE)
+      {
+        node.offset = static_cast<uint>(m_triangles.size());
+        for (uint i = begin; i < end; i++)
+          add(m_triangles, i - begin, records[leaf_indices[i]], leaf_indices[i]);
+      }
+      else
+      {
+        node.offset = static_cast<uint>(m_spheres.size());
+        for (uint i = begin; i < end; i++)
+          add(m_spheres, i - begin, spheres[leaf_indices[i]], leaf_indices[i]);
+      }
+    }
+  }
+
+  const std::vector<KdNode> &nodes() const { return m_nodes; }
+  const std::vector<SphereBlock> &spheres() const { return m_spheres; }
+  const std::vector<TriangleBlock> &triangles() const { return m_triangles; }
+
+  // used lanes over all lanes of the blocks
+  float occupancy() const
+  {
+    size_t lanes = (m_spheres.size() + m_triangles.size()) * LEAF_WIDTH;
+    return (lanes == 0) ? 0.0f : static_cast<float>(m_used) / lanes;
+  }
+
+private:
+  std::vector<KdNode> m_nodes;
+  std::vector<SphereBlock> m_spheres;
+  std::vector<TriangleBlock> m_triangles;
+  size_t m_used = 0;
+
+  template <class Block>
+  static Block &block_for(std::vector<Block> &blocks, uint position)
+  {
+    // every leaf starts a new block
+    if (position % LEAF_WIDTH == 0)
+    {
+      Block &block = blocks.emplace_back();
+      for (uint &id : block.id)
+        id = INVALID;
+    }
+    return blocks.back();
+  }
+
+  static void add(std::vector<SphereBlock> &blocks, uint position, const Sphere &sphere, uint id)
+  {
+    SphereBlock &block = block_for(blocks, position);
+    uint lane = position % LEAF_WIDTH;
+    block.center_x[lane] = sphere.center.x;
+    block.center_y[lane] = sphere.center.y;
+    block.center_z[lane] = sphere.center.z;
+    block.radius[lane] = sphere.radius;
+    block.material[lane] = sphere.material;
+    block.id[lane] = id;
+  }
+
+  static void add(std::vector<TriangleBlock> &blocks, uint position, const TriangleRecord &record, uint id)
+  {
+    TriangleBlock &block = block_for(blocks, position);
+    uint lane = position % LEAF_WIDTH;
+
+    for (int k = 0; k < 3; k++)
+    {
+      for (int axis = 0; axis < 3; axis++)
+      {
+        block.edge[k][axis][lane] = record.edge[k][axis];
+        block.moment[k][axis][lane] = record.moment[k][axis];
+      }
+      block.normal[k][lane] = record.edge[k].w;
+    }
+
+    block.plane[lane] = record.moment[0].w;
+    block.material[lane] = static_cast<int>(record.moment[1].w);
+    block.id[lane] = id;
+  }
+};
+
+// sphere_intersect of the shader for every lane of the block, BLOCK_MISS where the ray
+// misses. the operations are those of the scalar test in the same order, so the distances
+// are the same to the bit
+inline void intersect_block(const SphereBlock &block, const Ray &ray, float *t)
+{
+#if defined(__AVX__)
+  __m256 zero = _mm256_setzero_ps(), eps = _mm256_set1_ps(0.001f), miss = _mm256_set1_ps(BLOCK_MISS);
+
+  __m256 op[3] = {
+    _mm256_sub_ps(_mm256_loadu_ps(block.center_x), _mm256_set1_ps(ray.origin.x)),
+    _mm256_sub_ps(_mm256_loadu_ps(block.center_y), _mm256_set1_ps(ray.origin.y)),
+    _mm256_sub_ps(_mm256_loadu_ps(block.center_z), _mm256_set1_ps(ray.origin.z)),
+  };
+  __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(op[0], _mm256_set1_ps(ray.direction.x)),
+    _mm256_mul_ps(op[1], _mm256_set1_ps(ray.direction.y))), _mm256_mul_ps(op[2], _mm256_set1_ps(ray.direction.z)));
+  __m256 length = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(op[0], op[0]), _mm256_mul_ps(op[1], op[1])),
+    _mm256_mul_ps(op[2], op[2]));
+  __m256 radius = _mm256_loadu_ps(block.radius);
+  __m256 det = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(b, b), length), _mm256_mul_ps(radius, radius));
+
+  __m256 real = _mm256_cmp_ps(det, zero, _CMP_GE_OQ);
+  det = _mm256_sqrt_ps(_mm256_max_ps(det, zero));
+  __m256 t1 = _mm256_sub_ps(b, det), t2 = _mm256_add_ps(b, det);
+
+  __m256 result = _mm256_blendv_ps(miss, t2, _mm256_cmp_ps(t2, eps, _CMP_GT_OQ));
+  result = _mm256_blendv_ps(result, t1, _mm256_cmp_ps(t1, eps, _CMP_GT_OQ));
+  _mm256_storeu_ps(t, _mm256_blendv_ps(miss, result, real));
+#elif defined(__SSE__) || defined(_M_X64)
+  auto select = [](__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); };
+  __m128 zero = _mm_setzero_ps(), eps = _mm_set1_ps(0.001f), miss = _mm_set1_ps(BLOCK_MISS);
+
+  for (uint half = 0; half < LEAF_WIDTH; half += 4)
+  {
+    __m128 op[3] = {
+      _mm_sub_ps(_mm_loadu_ps(block.center_x + half), _mm_set1_ps(ray.origin.x)),
+      _mm_sub_ps(_mm_loadu_ps(block.center_y + half), _mm_set1_ps(ray.origin.y)),
+      _mm_sub_ps(_mm_loadu_ps(block.center_z + half), _mm_set1_ps(ray.origin.z)),
+    };
+    __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(op[0], _mm_set1_ps(ray.direction.x)),
+      _mm_mul_ps(op[1], _mm_set1_ps(ray.direction.y))), _mm_mul_ps(op[2], _mm_set1_ps(ray.direction.z)));
+    __m128 length = _mm_add_ps(_mm_add_ps(_mm_mul_ps(op[0], op[0]), _mm_mul_ps(op[1], op[1])), _mm_mul_ps(op[2], op[2]));
+    __m128 radius = _mm_loadu_ps(block.radius + half);
+    __m128 det = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b, b), length), _mm_mul_ps(radius, radius));
+
+    __m128 real = _mm_cmpge_ps(det, zero);
+    det = _mm_sqrt_ps(_mm_max_ps(det, zero));
+    __m128 t1 = _mm_sub_ps(b, det), t2 = _mm_add_ps(b, det);
+
+    __m128 result = select(_mm_cmpgt_ps(t2, eps), t2, miss);
+    result = select(_mm_cmpgt_ps(t1, eps), t1, result);
+    _mm_storeu_ps(t + half, select(real, result, miss));
+  }
+#else
+  for (uint lane = 0; lane < LEAF_WIDTH; lane++)
+  {
+    glm::vec3 op = glm::vec3(block.center_x[lane], block.center_y[lane], block.center_z[lane]) - ray.origin;
+    float b = glm::dot(op, ray.direction);
+    float det = b * b - glm::dot(op, op) + block.radius[lane] * block.radius[lane];
+    float root = std::sqrt(glm::max(det, 0.0f));
+
+    t[lane] = BLOCK_MISS;
+    if (0.0f <= det)
+      t[lane] = (0.001f < b - root) ? b - root : (0.001f < b + root) ? b + root : BLOCK_MISS;
+  }
+#endif
+}
+
+// triangle_record_intersect of the shader for every lane of the block, moment is
+// cross(ray.direction, ray.origin). rays exactly on an edge count as inside
+inline void intersect_block(const TriangleBlock &block, const Ray &ray, const glm::vec3 &moment, float *t)
+{
+#if defined(__AVX__)
+  __m256 m[3] = {_mm256_set1_ps(moment.x), _mm256_set1_ps(moment.y), _mm256_set1_ps(moment.z)};
+  __m256 d[3] = {_mm256_set1_ps(ray.direction.x), _mm256_set1_ps(ray.direction.y), _mm256_set1_ps(ray.direction.z)};
+  __m256 o[3] = {_mm256_set1_ps(ray.origin.x), _mm256_set1_ps(ray.origin.y), _mm256_set1_ps(ray.origin.z)};
+
+  auto dot = [](const float (*rows)[LEAF_WIDTH], const __m256 *v) {
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(rows[0]), v[0]),
+      _mm256_mul_ps(_mm256_loadu_ps(rows[1]), v[1])), _mm256_mul_ps(_mm256_loadu_ps(rows[2]), v[2]));
+  };
+
+  __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+  for (int k = 0; k < 3; k++)
+  {
+    __m256 side = _mm256_add_ps(dot(block.edge[k], m), dot(block.moment[k], d));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(side, _mm256_setzero_ps(), _CMP_NLT_UQ));
+  }
+
+  __m256 distance = _mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(block.plane), dot(block.normal, o)), dot(block.normal, d));
+  _mm256_storeu_ps(t, _mm256_blendv_ps(_mm256_set1_ps(BLOCK_MISS), distance, inside));
+#elif defined(__SSE__) || defined(_M_X64)
+  __m128 m[3] = {_mm_set1_ps(moment.x), _mm_set1_ps(moment.y), _mm_set1_ps(moment.z)};
+  __m128 d[3] = {_mm_set1_ps(ray.direction.x), _mm_set1_ps(ray.direction.y), _mm_set1_ps(ray.direction.z)};
+  __m128 o[3] = {_mm_set1_ps(ray.origin.x), _mm_set1_ps(ray.origin.y), _mm_set1_ps(ray.origin.z)};
+
+  for (uint half = 0; half < LEAF_WIDTH; half += 4)
+  {
+    auto dot = [half](const float (*rows)[LEAF_WIDTH], const __m128 *v) {
+      return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(rows[0] + half), v[0]),
+        _mm_mul_ps(_mm_loadu_ps(rows[1] + half), v[1])), _mm_mul_ps(_mm_loadu_ps(rows[2] + half), v[2]));
+    };
+
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int k = 0; k < 3; k++)
+    {
+      __m128 side = _mm_add_ps(dot(block.edge[k], m), dot(block.moment[k], d));
+      inside = _mm_and_ps(inside, _mm_cmpnlt_ps(side, _mm_setzero_ps()));
+    }
+
+    __m128 distance = _mm_div_ps(_mm_sub_ps(_mm_loadu_ps(block.plane + half), dot(block.normal, o)), dot(block.normal, d));
+    _mm_storeu_ps(t + half, _mm_or_ps(_mm_and_ps(inside, distance), _mm_andnot_ps(inside, _mm_set1_ps(BLOCK_MISS))));
+  }
+#else
+  for (uint lane = 0; lane < LEAF_WIDTH; lane++)
+  {
+    auto row = [lane](const float (*rows)[LEAF_WIDTH]) { return glm::vec3(rows[0][lane], rows[1][lane], rows[2][lane]); };
+
+    bool inside = true;
+    for (int k = 0; k < 3; k++)
+      inside = inside && !(glm::dot(row(block.edge[k]), moment) + glm::dot(row(block.moment[k]), ray.direction) < 0.0f);
+
+    glm::vec3 normal = row(block.normal);
+    t[lane] = inside ? (block.plane[lane] - glm::dot(normal, ray.origin)) / glm::dot(normal, ray.direction) : BLOCK_MISS;
+  }
+#endif
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "kdtree.h"
+
+#include <cfloat>
+
+#if defined(__SSE__) || defined(_M_X64)
+#  include <immintrin.h>
+#endif
+
+// Node of a WIDTH-ary tree with the child boxes stored as structure of arrays, so one
+// slab test covers every child. child is a node id for interior children (count 0), a
+// leaf offset otherwise, and INVALID for empty lanes. count keeps the primitive type in
+// its upper bits like KdNode::count. With WIDTH 4 the layout matches the std430 WideNode
+// of raytracer.glsl.
+template <uint WIDTH>
+struct alignas(4 * WIDTH) WideNode
+{
+  float min_x[WIDTH], min_y[WIDTH], min_z[WIDTH];
+  float max_x[WIDTH], max_y[WIDTH], max_z[WIDTH];
+  uint child[WIDTH];
+  uint count[WIDTH];
+};
+
+static_assert(sizeof(WideNode<4>) == 128);
+
+// Collapses a binary tree into WIDTH-ary nodes. Every node takes the two children of its
+// binary counterpart and keeps opening the interior child with the largest surface area
+// until all lanes are used, so the shallow levels get rid of the small boxes first.
+// roots, ids into nodes, are rewritten to the matching wide node ids.
+template <uint WIDTH>
+class WideBVH
+{
+public:
+  static_assert(2 <= WIDTH && WIDTH <= 8);
+
+  WideBVH(const std::vector<KdNode> &nodes, std::vector<uint> &roots)
+  {
+    m_nodes.reserve(nodes.size() / (WIDTH - 1) + 1);
+
+    for (uint &root : roots)
+    {
+      if (root < nodes.size())
+        root = emit(nodes, root);
+    }
+  }
+
+  const std::vector<WideNode<WIDTH>> &nodes() const { return m_nodes; }
+
+  // average number of used lanes per node
+  float occupancy() const
+  {
+    uint used = 0;
+    for (const auto &node : m_nodes)
+      for (uint c = 0; c < WIDTH; c++)
+        used += (node.child[c] != INVALID) ? 1 : 0;
+    return m_nodes.empty() ? 0.0f : static_cast<float>(used) / m_nodes.size();
+  }
+
+private:
+  std::vector<WideNode<WIDTH>> m_nodes;
+
+  uint emit(const std::vector<KdNode> &nodes, uint id)
+  {
+    uint lanes[WIDTH];
+    uint used = 0;
+
+    if (is_leaf(nodes[id]))
+    {
+      // a tree that is a single leaf
+      lanes[used++] = id;
+    }
+    else
+    {
+      if (nodes[id].left != INVALID) lanes[used++] = nodes[id].left;
+      if (nodes[id].right != INVALID) lanes[used++] = nodes[id].right;
+    }
+
+    while (used < WIDTH)
+    {
+      int open = -1;
+      float area = -1.0f;
+
+      for (uint c = 0; c < used; c++)
+      {
+        if (!is_leaf(nodes[lanes[c]]) && area < surface_area(nodes[lanes[c]]))
+        {
+          open = static_cast<int>(c);
+          area = surface_area(nodes[lanes[c]]);
+        }
+      }
+
+      if (open < 0)
+        break;
+
+      const KdNode &node = nodes[lanes[open]];
+      lanes[open] = (node.left != INVALID) ? node.left : node.right;
+      if (node.left != INVALID && node.right != INVALID)
+        lanes[used++] = node.right;
+    }
+
+    uint wide_id = static_cast<uint>(m_nodes.size());
+    m_nodes.emplace_back();
+
+    for (uint c = 0; c < WIDTH; c++)
+    {
+      uint child = INVALID, count = 0;
+      AABB box = {glm::vec4(FLT_MAX), glm::vec4(-FLT_MAX)};
+
+      if (c < used)
+      {
+        const KdNode &node = nodes[lanes[c]];
+
+        if (!is_leaf(node))
+        {
+          child = emit(nodes, lanes[c]);
+          box = node;
+        }
+        else if (0 < leaf_count(node))
+        {
+          child = node.offset;
+          count = node.count;
+          box = node;
+        }
+      }
+
+      // emit() may have grown m_nodes, so the node is looked up again
+      WideNode<WIDTH> &out = m_nodes[wide_id];
+      out.min_x[c] = box.min.x; out.min_y[c] = box.min.y; out.min_z[c] = box.min.z;
+      out.max_x[c] = box.max.x; out.max_y[c] = box.max.y; out.max_z[c] = box.max.z;
+      out.child[c] = child;
+      out.count[c] = count;
+    }
+
+    return wide_id;
+  }
+};
+
+// slab test of all children at once, returns a bit per child whose box the ray enters
+// before tmax and writes its entry distance to tnear
+template <uint WIDTH>
+inline uint intersect_children(const WideNode<WIDTH> &node, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+  float tmax, float *tnear)
+{
+#if defined(__AVX__)
+  if constexpr (WIDTH == 8)
+  {
+    auto slab = [&](const float *lo, const float *hi, int axis, __m256 &t0, __m256 &t1) {
+      __m256 o = _mm256_set1_ps(origin[axis]), inv = _mm256_set1_ps(inv_dir[axis]);
+      __m256 a = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(lo), o), inv);
+      __m256 b = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(hi), o), inv);
+      t0 = _mm256_max_ps(t0, _mm256_min_ps(a, b));
+      t1 = _mm256_min_ps(t1, _mm256_max_ps(a, b));
+    };
+
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tmax);
+    slab(node.min_x, node.max_x, 0, t0, t1);
+    slab(node.min_y, node.max_y, 1, t0, t1);
+    slab(node.min_z, node.max_z, 2, t0, t1);
+
+    _mm256_storeu_ps(tnear, t0);
+    return static_cast<uint>(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+  }
+#endif
+#if defined(__SSE__) || defined(_M_X64)
+  if constexpr (WIDTH == 4)
+  {
+    auto slab = [&](const float *lo, const float *hi, int axis, __m128 &t0, __m128 &t1) {
+      __m128 o = _mm_set1_ps(origin[axis]), inv = _mm_set1_ps(inv_dir[axis]);
+      __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(lo), o), inv);
+      __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(hi), o), inv);
+      t0 = _mm_max_ps(t0, _mm_min_ps(a, b));
+      t1 = _mm_min_ps(t1, _mm_max_ps(a, b));
+    };
+
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tmax);
+    slab(node.min_x, node.max_x, 0, t0, t1);
+    slab(node.min_y, node.max_y, 1, t0, t1);
+    slab(node.min_z, node.max_z, 2, t0, t1);
+
+    _mm_storeu_ps(tnear, t0);
+    return static_cast<uint>(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+  }
+#endif
+
+  uint mask = 0;
+
+  for (uint c = 0; c < WIDTH; c++)
+  {
+    float t0 = 0.0f, t1 = tmax;
+    const float lo[3] = {node.min_x[c], node.min_y[c], node.min_z[c]};
+    const float hi[3] = {node.max_x[c], node.max_y[c], node.max_z[c]};
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      float a = (lo[axis] - origin[axis]) * inv_dir[axis];
+      float b = (hi[axis] - origin[axis]) * inv_dir[axis];
+      t0 = glm::max(t0, glm::min(a, b));
+      t1 = glm::min(t1, glm::max(a, b));
+    }
+
+    tnear[c] = t0;
+    mask |= (t0 <= t1) ? (1U << c) : 0U;
+  }
+
+  return mask;
+}
+
+// Closest hit traversal, children are visited near to far and culled against the current
+// hit distance t. leaf(offset, count, type, t) intersects the primitives of a leaf and
+// lowers t on a hit. Returns the number of nodes visited.
+template <uint WIDTH, class Leaf>
+uint traverse_closest(const std::vector<WideNode<WIDTH>> &nodes, const Ray &ray, float &t, Leaf &&leaf)
+{
+  if (nodes.empty())
+    return 0;
+
+  glm::vec3 inv_dir = 1.0f / ray.direction;
+
+  struct Entry
+  {
+    uint id;
+    float tnear;
+  };
+
+  // up to WIDTH - 1 pending children per level, trees deeper than the inline entries
+  // spill to the heap
+  TraversalStack<Entry, 64 * WIDTH> stack;
+  stack.push({0, 0.0f});
+
+  uint visits = 0;
+
+  while (!stack.empty())
+  {
+    Entry entry = stack.pop();
+    if (t < entry.tnear)
+      continue;
+
+    const WideNode<WIDTH> &node = nodes[entry.id];
+    visits++;
+
+    alignas(32) float tnear[WIDTH];
+    uint mask = intersect_children(node, ray.origin, inv_dir, t, tnear);
+
+    Entry near[WIDTH];
+    int hits = 0;
+
+    for (uint c = 0; c < WIDTH; c++)
+    {
+      if (!(mask & (1U << c)) || node.child[c] == INVALID)
+        continue;
+
+      if (node.count[c] != 0)
+      {
+        leaf(node.child[c], node.count[c] & PRIMITIVE_COUNT_MASK,
+          static_cast<PrimitiveType>(node.count[c] >> PRIMITIVE_TYPE_SHIFT), t);
+        continue;
+      }
+
+      // insertion sort, farthest first so the nearest child ends up on top of the stack
+      int j = hits++;
+      while (0 < j && near[j - 1].tnear < tnear[c])
+      {
+        near[j] = near[j - 1];
+        j--;
+      }
+      near[j] = {node.child[c], tnear[c]};
+    }
+
+    for (int i = 0; i < hits; i++)
+      stack.push(near[i]);
+  }
+
+  return visits;
+}